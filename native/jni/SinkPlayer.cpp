@@ -21,14 +21,14 @@ status_t SinkPlayer::start(const char *host, int32_t port) {
     mNetSession = new ANetworkSession;
     mSink = new WifiDisplaySink(mNetSession, mSurfaceTexture);
 
-	//磬ʼܵļmPipe
+	//建立网络，初始化管道，设置文件描述符mPipe
     mNetSession->start();
     mLooper->setName("sink_player");
     mLooper->registerHandler(mSink);
 
     //LOGD("will start sink by %s:%d", host, port);
 
-	//罨úhostport
+	//在网络建立好后，设置host和port
     mSink->start(host, port);
 
 
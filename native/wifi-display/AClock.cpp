@@ -0,0 +1,213 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "AClock"
+#include <utils/Log.h>
+
+#include "AClock.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace android {
+
+struct MonotonicClock : public AClock {
+    MonotonicClock() {}
+
+    virtual int64_t nowUs() {
+        return ALooper::GetNowUs();
+    }
+
+    virtual void post(const sp<AMessage> &msg, int64_t delayUs) {
+        msg->post(delayUs);
+    }
+
+    virtual bool waitUntil(int64_t deadlineUs, int wakeupFd);
+
+    virtual bool isSystemClock() const {
+        return true;
+    }
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(MonotonicClock);
+};
+
+// Returns true iff "fd" was readable and has been drained.
+static bool DrainEventFd(int fd, int timeoutMs) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int res;
+    do {
+        res = poll(&pfd, 1, timeoutMs);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        ALOGE("poll failed (%s)", strerror(errno));
+        return false;
+    }
+
+    if (!(pfd.revents & POLLIN)) {
+        return false;
+    }
+
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+
+    return true;
+}
+
+bool MonotonicClock::waitUntil(int64_t deadlineUs, int wakeupFd) {
+    for (;;) {
+        int64_t delayUs = deadlineUs - ALooper::GetNowUs();
+        if (delayUs <= 0ll) {
+            return true;
+        }
+
+        // Round up, waking up early would only have us go back to sleep.
+        if (DrainEventFd(wakeupFd, (delayUs + 999ll) / 1000ll)) {
+            return false;
+        }
+    }
+}
+
+static Mutex gClockLock;
+static sp<AClock> gSystemClock;
+static sp<AClock> gDefaultClock;
+
+// static
+sp<AClock> AClock::GetSystemClock() {
+    Mutex::Autolock autoLock(gClockLock);
+
+    if (gSystemClock == NULL) {
+        gSystemClock = new MonotonicClock;
+    }
+
+    return gSystemClock;
+}
+
+// static
+sp<AClock> AClock::GetDefault() {
+    {
+        Mutex::Autolock autoLock(gClockLock);
+
+        if (gDefaultClock != NULL) {
+            return gDefaultClock;
+        }
+    }
+
+    return GetSystemClock();
+}
+
+// static
+void AClock::SetDefault(const sp<AClock> &clock) {
+    Mutex::Autolock autoLock(gClockLock);
+    gDefaultClock = clock;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+AVirtualClock::AVirtualClock(int64_t startTimeUs)
+    : mNowUs(startTimeUs) {
+}
+
+AVirtualClock::~AVirtualClock() {
+}
+
+int64_t AVirtualClock::nowUs() {
+    Mutex::Autolock autoLock(mLock);
+    return mNowUs;
+}
+
+void AVirtualClock::post(const sp<AMessage> &msg, int64_t delayUs) {
+    if (delayUs <= 0ll) {
+        msg->post();
+        return;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    Event event;
+    event.mDueTimeUs = mNowUs + delayUs;
+    event.mMessage = msg;
+
+    List<Event>::iterator it = mEvents.end();
+    while (it != mEvents.begin()) {
+        --it;
+
+        if ((*it).mDueTimeUs <= event.mDueTimeUs) {
+            ++it;
+            break;
+        }
+    }
+
+    mEvents.insert(it, event);
+}
+
+bool AVirtualClock::waitUntil(int64_t deadlineUs, int wakeupFd) {
+    Mutex::Autolock autoLock(mLock);
+
+    while (mNowUs < deadlineUs) {
+        if (DrainEventFd(wakeupFd, 0 /* timeoutMs */)) {
+            return false;
+        }
+
+        mCondition.waitRelative(mLock, kWakeupPollIntervalUs * 1000ll);
+    }
+
+    return true;
+}
+
+bool AVirtualClock::isSystemClock() const {
+    return false;
+}
+
+void AVirtualClock::advance(int64_t deltaUs) {
+    CHECK_GE(deltaUs, 0ll);
+
+    Mutex::Autolock autoLock(mLock);
+
+    int64_t targetTimeUs = mNowUs + deltaUs;
+
+    while (!mEvents.empty()
+            && (*mEvents.begin()).mDueTimeUs <= targetTimeUs) {
+        Event event = *mEvents.begin();
+        mEvents.erase(mEvents.begin());
+
+        if (event.mDueTimeUs > mNowUs) {
+            mNowUs = event.mDueTimeUs;
+            mCondition.broadcast();
+        }
+
+        // A handler may well post to us again right away.
+        mLock.unlock();
+        event.mMessage->post();
+        mLock.lock();
+    }
+
+    mNowUs = targetTimeUs;
+    mCondition.broadcast();
+}
+
+int64_t AVirtualClock::nextDueTimeUs() {
+    Mutex::Autolock autoLock(mLock);
+
+    if (mEvents.empty()) {
+        return -1ll;
+    }
+
+    return (*mEvents.begin()).mDueTimeUs;
+}
+
+size_t AVirtualClock::numHeldMessages() {
+    Mutex::Autolock autoLock(mLock);
+    return mEvents.size();
+}
+
+}  // namespace android
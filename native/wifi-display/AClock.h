@@ -0,0 +1,99 @@
+#ifndef A_CLOCK_H_
+
+#define A_CLOCK_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/List.h>
+#include <utils/RefBase.h>
+#include <utils/threads.h>
+
+#include <stdint.h>
+
+namespace android {
+
+struct AMessage;
+
+// Where timing-driven code gets the time and schedules its timers from,
+// so it can be run on simulated time. Components pick up the default
+// clock when they're created.
+struct AClock : public RefBase {
+    AClock() {}
+
+    virtual int64_t nowUs() = 0;
+
+    // Posts "msg" once "delayUs" have passed on this clock.
+    virtual void post(const sp<AMessage> &msg, int64_t delayUs) = 0;
+
+    // Blocks until "deadlineUs" or until "wakeupFd", an eventfd, becomes
+    // readable. Returns false in the latter case, after draining it.
+    virtual bool waitUntil(int64_t deadlineUs, int wakeupFd) = 0;
+
+    // True iff this clock is ALooper::GetNowUs(), i.e. CLOCK_MONOTONIC
+    // based timers can stand in for it.
+    virtual bool isSystemClock() const = 0;
+
+    static sp<AClock> GetSystemClock();
+
+    // The system clock unless replaced, which must happen before any of
+    // the components that are to use the replacement are created.
+    static sp<AClock> GetDefault();
+    static void SetDefault(const sp<AClock> &clock);
+
+protected:
+    virtual ~AClock() {}
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(AClock);
+};
+
+// Time only moves when advance() is called, messages posted with a delay
+// are held until then. Lets hours of streaming run in however long it
+// takes the components to do the work.
+struct AVirtualClock : public AClock {
+    AVirtualClock(int64_t startTimeUs = 0ll);
+
+    virtual int64_t nowUs();
+    virtual void post(const sp<AMessage> &msg, int64_t delayUs);
+
+    // The eventfd is only checked every kWakeupPollIntervalUs of real
+    // time, advance() wakes us up right away.
+    virtual bool waitUntil(int64_t deadlineUs, int wakeupFd);
+
+    virtual bool isSystemClock() const;
+
+    // Moves time forward by "deltaUs", stopping at the due time of each
+    // held message on the way to post it. Messages due at the same time
+    // are posted in the order they were posted to the clock in.
+    void advance(int64_t deltaUs);
+
+    // When the next held message is due, -1 if there are none.
+    int64_t nextDueTimeUs();
+
+    size_t numHeldMessages();
+
+protected:
+    virtual ~AVirtualClock();
+
+private:
+    enum {
+        kWakeupPollIntervalUs = 1000,
+    };
+
+    struct Event {
+        int64_t mDueTimeUs;
+        sp<AMessage> mMessage;
+    };
+
+    Mutex mLock;
+    Condition mCondition;
+    int64_t mNowUs;
+
+    // Sorted by due time, in order of posting among equals.
+    List<Event> mEvents;
+
+    DISALLOW_EVIL_CONSTRUCTORS(AVirtualClock);
+};
+
+}  // namespace android
+
+#endif  // A_CLOCK_H_
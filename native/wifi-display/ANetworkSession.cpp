@@ -4,6 +4,8 @@
 #include <utils/Log.h>
 
 #include "ANetworkSession.h"
+#include "AClock.h"
+#include "NetworkImpairment.h"
 #include "ParsedMessage.h"
 
 #include <arpa/inet.h>
@@ -11,11 +13,17 @@
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/foundation/AString.h>
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/Utils.h>
 
@@ -23,22 +31,222 @@ namespace android {
 
 static const size_t kMaxUDPSize = 1500;
 
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL     40
+#endif
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE  33
+#endif
+
+// How often held datagrams are looked at while time is simulated, the
+// network thread can't tell when the clock will move.
+static const int64_t kVirtualClockPollIntervalUs = 1000ll;
+
+// Don't grow a receive buffer more often than this, the kernel reports
+// the overflow of a single burst on every datagram that follows it.
+static const int64_t kMinSocketBufferGrowthIntervalUs = 500000ll;
+
+// Fills in "addr" if "host" is a dotted-quad address, that is if it can be
+// used without consulting the resolver.
+static bool ParseNumericAddress(
+        const char *host, unsigned port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+
+    return inet_aton(host, &addr->sin_addr) != 0;
+}
+
 struct ANetworkSession::NetworkThread : public Thread {
-    NetworkThread(ANetworkSession *session);
+    NetworkThread(ANetworkSession *session, size_t index);
+
+    status_t init();
+
+    size_t index() const;
+    bool isCurrentThread() const;
+
+    void interrupt();
+    void postCommand(Command *cmd);
+    Command *takeCommands();
+
+    // Owned by this thread, the subset of ANetworkSession::mSessions
+    // sharded onto it.
+    KeyedVector<int32_t, sp<Session> > mActiveSessions;
+    int32_t mActiveSessionsGeneration;
+
+    // eventfd that pulls this thread out of select().
+    int mWakeupFd;
 
 protected:
     virtual ~NetworkThread();
 
 private:
     ANetworkSession *mSession;
+    size_t mIndex;
+
+    // Set once the thread is running.
+    android_thread_id_t mThreadID;
 
+    // Commands posted by client threads, a lock-free LIFO that this
+    // thread empties in one go.
+    Command *volatile mCommandHead;
+
+    virtual status_t readyToRun();
     virtual bool threadLoop();
 
     DISALLOW_EVIL_CONSTRUCTORS(NetworkThread);
 };
 
+// Lets a client thread wait for the network thread to carry out a command.
+struct CommandCompletion : public RefBase {
+    CommandCompletion()
+        : mDone(false),
+          mResult(OK) {
+    }
+
+    void signal(status_t result) {
+        Mutex::Autolock autoLock(mLock);
+        mDone = true;
+        mResult = result;
+        mCondition.signal();
+    }
+
+    status_t wait() {
+        Mutex::Autolock autoLock(mLock);
+        while (!mDone) {
+            mCondition.wait(mLock);
+        }
+        return mResult;
+    }
+
+protected:
+    virtual ~CommandCompletion() {}
+
+private:
+    Mutex mLock;
+    Condition mCondition;
+    bool mDone;
+    status_t mResult;
+
+    DISALLOW_EVIL_CONSTRUCTORS(CommandCompletion);
+};
+
+struct ANetworkSession::Command {
+    enum Type {
+        kTypeSendRequest,
+        kTypeTuneSocketBuffers,
+        kTypeAddressResolved,
+        kTypeSetDatagramHandler,
+        kTypeSetImpairment,
+        kTypeGetImpairmentStats,
+        kTypeAwaitAddress,
+        kTypeConnect,
+        kTypeDisconnect,
+        kTypeSetMulticastSendOptions,
+        kTypeJoinMulticastGroup,
+        kTypeDestroySession,
+    };
+
+    Command(Type type, int32_t sessionID)
+        : mNext(NULL),
+          mType(type),
+          mSessionID(sessionID),
+          mBufferSize(0),
+          mErr(OK),
+          mImpairment(NULL),
+          mNumDropped(NULL),
+          mNumDuplicated(NULL),
+          mNumBytesHeld(NULL),
+          mTTL(0),
+          mLoopback(false),
+          mResult(-ENOENT) {
+        memset(&mAddr, 0, sizeof(mAddr));
+        memset(&mInterfaceAddr, 0, sizeof(mInterfaceAddr));
+        memset(&mGroupAddr, 0, sizeof(mGroupAddr));
+    }
+
+    // Whether it was carried out or dropped, whoever waits for the
+    // command learns about it once it's gone.
+    ~Command() {
+        delete mImpairment;
+        mImpairment = NULL;
+
+        if (mCompletion != NULL) {
+            mCompletion->signal(mResult);
+        }
+    }
+
+    Command *mNext;
+    Type mType;
+    int32_t mSessionID;
+
+    sp<ABuffer> mData;      // kTypeSendRequest
+    size_t mBufferSize;     // kTypeTuneSocketBuffers
+
+    // kTypeAddressResolved, kTypeConnect
+    status_t mErr;
+    struct sockaddr_in mAddr;
+
+    sp<DatagramHandler> mDatagramHandler;  // kTypeSetDatagramHandler
+
+    // kTypeSetImpairment, handed over to the session.
+    NetworkImpairment *mImpairment;
+
+    // kTypeGetImpairmentStats, the caller's, it waits for the command.
+    uint32_t *mNumDropped;
+    uint32_t *mNumDuplicated;
+    size_t *mNumBytesHeld;
+
+    // kTypeSetMulticastSendOptions, kTypeJoinMulticastGroup
+    struct in_addr mInterfaceAddr;
+    struct in_addr mGroupAddr;
+    int32_t mTTL;
+    bool mLoopback;
+
+    // Only set on commands run through runCommand(), -ENOENT unless the
+    // session was there to carry it out.
+    status_t mResult;
+    sp<CommandCompletion> mCompletion;
+
+private:
+    DISALLOW_EVIL_CONSTRUCTORS(Command);
+};
+
+// Runs hostname lookups off the network threads, one at a time. Results
+// are handed to the session's network thread as commands.
+struct ANetworkSession::ResolverThread : public Thread {
+    ResolverThread(ANetworkSession *session);
+
+    void resolve(int32_t sessionID, const char *host, unsigned port);
+
+    // Lets a thread asked to exit notice while it waits for requests.
+    void wakeUp();
+
+protected:
+    virtual ~ResolverThread();
+
+private:
+    struct Request {
+        int32_t mSessionID;
+        AString mHost;
+        unsigned mPort;
+    };
+
+    ANetworkSession *mSession;
+
+    Mutex mLock;
+    Condition mCondition;
+    List<Request> mRequests;
+
+    virtual bool threadLoop();
+
+    DISALLOW_EVIL_CONSTRUCTORS(ResolverThread);
+};
+
 struct ANetworkSession::Session : public RefBase {
     enum State {
+        RESOLVING,
         CONNECTING,
         CONNECTED,
         LISTENING_RTSP,
@@ -49,12 +257,16 @@ struct ANetworkSession::Session : public RefBase {
     Session(int32_t sessionID,
             State state,
             int s,
-            const sp<AMessage> &notify);
+            const sp<AMessage> &notify,
+            const sp<AClock> &clock);
 
     int32_t sessionID() const;
     int socket() const;
     sp<AMessage> getNotificationMessage() const;
 
+    // Fixed at creation, may be asked from any thread.
+    bool isDatagram() const;
+
     bool isRTSPServer() const;
     bool isTCPDatagramServer() const;
 
@@ -64,77 +276,273 @@ struct ANetworkSession::Session : public RefBase {
     status_t readMore();
     status_t writeMore();
 
-    status_t sendRequest(const void *data, ssize_t size);
+    status_t sendRequest(const sp<ABuffer> &data);
 
     void setIsRTSPConnection(bool yesno);
 
+    // The remote address is being looked up, the session is connected
+    // (stream) or gets its default destination (datagram) once it's known.
+    // Nothing is sent until then.
+    void setAwaitingAddress();
+    void onAddressResolved(status_t err, const struct sockaddr_in &addr);
+
+    void setDatagramHandler(const sp<DatagramHandler> &handler);
+
+    // Datagram sessions only, INVALID_OPERATION otherwise.
+    status_t connectDatagram(const struct sockaddr_in &addr);
+    status_t disconnectDatagram();
+
+    status_t setMulticastSendOptions(
+            const struct in_addr &interfaceAddr, int32_t ttl, bool loopback);
+
+    status_t joinMulticastGroup(
+            const struct in_addr &groupAddr,
+            const struct in_addr &interfaceAddr);
+
+    // Takes ownership, replaces whatever impaired the same direction.
+    void setImpairment(NetworkImpairment *impairment);
+
+    // Passes on the impaired datagrams due by "nowUs", returns when the
+    // next one will be or -1 if there are none.
+    int64_t releaseImpairedDatagrams(int64_t nowUs);
+
+    void getImpairmentStats(
+            uint32_t *numDropped, uint32_t *numDuplicated,
+            size_t *numBytesHeld) const;
+
+    status_t setSocketBufferSizes(size_t rcvBufSize, size_t sndBufSize);
+    uint32_t kernelDropCount() const;
+    void getSendQueueStats(size_t *numBytesQueued, uint32_t *numDropped) const;
+
 protected:
     virtual ~Session();
 
 private:
     int32_t mSessionID;
     State mState;
+    bool mIsDatagram;
     bool mIsRTSPConnection;
     int mSocket;
     sp<AMessage> mNotify;
+    sp<AClock> mClock;
     bool mSawReceiveFailure, mSawSendFailure;
 
     // for TCP / stream data
     AString mOutBuffer;
 
     // for UDP / datagrams
+    // Only the network thread changes the counters, client threads read
+    // them through getSendQueueStats(). mOutDatagramsSize is bounded by
+    // kMaxOutDatagramsSize, mOutDroppableSize of it could be evicted.
     List<sp<ABuffer> > mOutDatagrams;
+    volatile int32_t mOutDatagramsSize;
+    volatile int32_t mNumOutDatagramsDropped;
+    size_t mOutDroppableSize;
+
+    // Datagrams sent while not connected to a peer since the last one that
+    // made it out.
+    uint32_t mNumUnaddressedDrops;
 
     AString mInBuffer;
 
+    // How far the search for the end of the RTSP message at the start of
+    // mInBuffer got, so each read only scans what it appended.
+    ParsedMessage::Scanner mInScanner;
+
+    // Receive queue overflow accounting (SO_RXQ_OVFL), datagrams only.
+    // mRcvBufSize is what the kernel granted, not what we asked for, and
+    // mRcvBufAtLimit is set once it wouldn't grant more. mKernelDropCount
+    // is read from client threads.
+    size_t mRcvBufSize;
+    bool mRcvBufAtLimit;
+    uint32_t mRxqOvflCount;
+    volatile int32_t mKernelDropCount;
+    int64_t mLastRcvBufGrowthUs;
+
+    bool mAwaitingAddress;
+    int64_t mConnectStartTimeUs;
+
+    // If set, incoming datagrams are handed to it instead of being posted.
+    sp<DatagramHandler> mDatagramHandler;
+
+    // Simulated links datagrams go through before being delivered or
+    // sent, and the kernel drops to report along with the next delivery.
+    NetworkImpairment *mInImpairment;
+    NetworkImpairment *mOutImpairment;
+    uint32_t mNumHeldKernelDrops;
+
+    void deliverDatagram(
+            const sp<ABuffer> &buf,
+            int64_t arrivalTimeUs,
+            const struct sockaddr_in &remoteAddr,
+            uint32_t numKernelDrops);
+
+    void queueDatagram(const sp<ABuffer> &data);
+    List<sp<ABuffer> >::iterator removeDatagram(
+            List<sp<ABuffer> >::iterator it);
+
     void notifyError(bool send, status_t err, const char *detail);
     void notify(NotificationReason reason);
+    void notifyConnected();
+
+    uint32_t onKernelDrops(uint32_t rxqOvflCount);
+    status_t setReceiveBufferSize(size_t size);
 
     DISALLOW_EVIL_CONSTRUCTORS(Session);
 };
 ////////////////////////////////////////////////////////////////////////////////
 
-ANetworkSession::NetworkThread::NetworkThread(ANetworkSession *session)
-    : mSession(session) {
+ANetworkSession::NetworkThread::NetworkThread(
+        ANetworkSession *session, size_t index)
+    : mActiveSessionsGeneration(-1),
+      mWakeupFd(-1),
+      mSession(session),
+      mIndex(index),
+      mThreadID(0),
+      mCommandHead(NULL) {
 }
 
 ANetworkSession::NetworkThread::~NetworkThread() {
+    // Whatever we didn't get to is dropped.
+    Command *cmd = takeCommands();
+    while (cmd != NULL) {
+        Command *next = cmd->mNext;
+        delete cmd;
+        cmd = next;
+    }
+
+    if (mWakeupFd >= 0) {
+        close(mWakeupFd);
+        mWakeupFd = -1;
+    }
+}
+
+status_t ANetworkSession::NetworkThread::init() {
+    mWakeupFd = eventfd(0, 0);
+
+    return (mWakeupFd < 0) ? -errno : OK;
+}
+
+size_t ANetworkSession::NetworkThread::index() const {
+    return mIndex;
+}
+
+bool ANetworkSession::NetworkThread::isCurrentThread() const {
+    return mThreadID == androidGetThreadId();
+}
+
+status_t ANetworkSession::NetworkThread::readyToRun() {
+    mThreadID = androidGetThreadId();
+
+    return OK;
+}
+
+// 向eventfd中写入数据，把刚刚创建的socket加入到监听的readFd中
+void ANetworkSession::NetworkThread::interrupt() {
+    static const uint64_t one = 1;
+
+    ssize_t n;
+    do {
+        n = write(mWakeupFd, &one, sizeof(one));
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        ALOGW("Error writing to eventfd (%s)", strerror(errno));
+    }
+}
+
+void ANetworkSession::NetworkThread::postCommand(Command *cmd) {
+    Command *head;
+    do {
+        head = mCommandHead;
+        cmd->mNext = head;
+    } while (!__sync_bool_compare_and_swap(&mCommandHead, head, cmd));
+
+    if (head == NULL) {
+        // Only the first command posted since the network thread last
+        // emptied the queue needs to wake it up, it'll pick up the
+        // others along with it.
+        interrupt();
+    }
+}
+
+// Returns the pending commands in the order they were posted in.
+ANetworkSession::Command *ANetworkSession::NetworkThread::takeCommands() {
+    Command *cmd = __sync_lock_test_and_set(&mCommandHead, (Command *)NULL);
+
+    Command *ordered = NULL;
+    while (cmd != NULL) {
+        Command *next = cmd->mNext;
+        cmd->mNext = ordered;
+        ordered = cmd;
+        cmd = next;
+    }
+
+    return ordered;
 }
 
 bool ANetworkSession::NetworkThread::threadLoop() {
-    mSession->threadLoop();
+    mSession->threadLoop(this);
 
     return true;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-//ỰTCP/IPIPַͶ˿ں
+//建立会话，设置TCP/IP的IP地址和端口号
 ANetworkSession::Session::Session(
         int32_t sessionID,
         State state,
         int s,
-        const sp<AMessage> &notify)
+        const sp<AMessage> &notify,
+        const sp<AClock> &clock)
     : mSessionID(sessionID),
       mState(state),
+      mIsDatagram(state == DATAGRAM),
       mIsRTSPConnection(false),
       mSocket(s),
       mNotify(notify),
+      mClock(clock),
       mSawReceiveFailure(false),
-      mSawSendFailure(false) {
+      mSawSendFailure(false),
+      mOutDatagramsSize(0),
+      mNumOutDatagramsDropped(0),
+      mOutDroppableSize(0),
+      mNumUnaddressedDrops(0),
+      mRcvBufSize(kDefaultSocketBufferSize),
+      mRcvBufAtLimit(false),
+      mRxqOvflCount(0),
+      mKernelDropCount(0),
+      mLastRcvBufGrowthUs(-1ll),
+      mAwaitingAddress(false),
+      mConnectStartTimeUs(clock->nowUs()),
+      mInImpairment(NULL),
+      mOutImpairment(NULL),
+      mNumHeldKernelDrops(0) {
+    if (mState == DATAGRAM) {
+        // What the kernel made of kDefaultSocketBufferSize, see
+        // setReceiveBufferSize().
+        int value;
+        socklen_t valueLen = sizeof(value);
+        if (getsockopt(
+                    mSocket, SOL_SOCKET, SO_RCVBUF, &value, &valueLen) == 0) {
+            mRcvBufSize = value / 2;
+        }
+    }
+
     if (mState == CONNECTED) {
         struct sockaddr_in localAddr;
         socklen_t localAddrLen = sizeof(localAddr);
 
         int res = getsockname(
-                mSocket, (struct sockaddr *)&localAddr, &localAddrLen);//clientSocketñַ  
+                mSocket, (struct sockaddr *)&localAddr, &localAddrLen);//根据clientSocket获得本地网络地址  
         CHECK_GE(res, 0);
 
         struct sockaddr_in remoteAddr;
         socklen_t remoteAddrLen = sizeof(remoteAddr);
 
         res = getpeername(
-                mSocket, (struct sockaddr *)&remoteAddr, &remoteAddrLen);//clientSocketӵRtsp˵Ŀͻַ  
+                mSocket, (struct sockaddr *)&remoteAddr, &remoteAddrLen);//根据clientSocket获得连接到Rtsp服务端的客户端网络地址  
         CHECK_GE(res, 0);
 
         in_addr_t addr = ntohl(localAddr.sin_addr.s_addr);
@@ -153,9 +561,9 @@ ANetworkSession::Session::Session(
                 (addr >> 8) & 0xff,
                 addr & 0xff);
 
-        sp<AMessage> msg = mNotify->dup();  //AMessage֪ͨ 
+        sp<AMessage> msg = mNotify->dup();  //利用AMessage进行通知 
         msg->setInt32("sessionID", mSessionID);
-        msg->setInt32("reason", kWhatClientConnected);//֪ͨSourceϢ
+        msg->setInt32("reason", kWhatClientConnected);//通知Source端相关信息
         msg->setString("server-ip", localAddrString.c_str());
         msg->setInt32("server-port", ntohs(localAddr.sin_port));
         msg->setString("client-ip", remoteAddrString.c_str());
@@ -167,6 +575,31 @@ ANetworkSession::Session::Session(
 ANetworkSession::Session::~Session() {
     ALOGV("Session %d gone", mSessionID);
 
+    NetworkImpairment *impairments[2] = { mInImpairment, mOutImpairment };
+    for (size_t i = 0; i < 2; ++i) {
+        if (impairments[i] == NULL) {
+            continue;
+        }
+
+        NetworkImpairment::Stats stats;
+        impairments[i]->getStats(&stats);
+
+        ALOGI("session %d: %s impairment saw %u datagrams, lost %u, "
+              "overflowed %u, duplicated %u, held at most %d bytes",
+              mSessionID,
+              impairments[i]->isOutgoing() ? "outgoing" : "incoming",
+              stats.mNumQueued,
+              stats.mNumLost,
+              stats.mNumOverflowed,
+              stats.mNumDuplicated,
+              stats.mMaxBytesHeld);
+
+        delete impairments[i];
+    }
+
+    mInImpairment = NULL;
+    mOutImpairment = NULL;
+
     close(mSocket);
     mSocket = -1;
 }
@@ -179,10 +612,329 @@ int ANetworkSession::Session::socket() const {
     return mSocket;
 }
 
+bool ANetworkSession::Session::isDatagram() const {
+    return mIsDatagram;
+}
+
 void ANetworkSession::Session::setIsRTSPConnection(bool yesno) {
     mIsRTSPConnection = yesno;
 }
 
+void ANetworkSession::Session::setAwaitingAddress() {
+    mAwaitingAddress = true;
+    mConnectStartTimeUs = mClock->nowUs();
+
+    if (mState == CONNECTING) {
+        mState = RESOLVING;
+    }
+}
+
+void ANetworkSession::Session::onAddressResolved(
+        status_t err, const struct sockaddr_in &addr) {
+    if (!mAwaitingAddress) {
+        // Only connectUDPSession() resolves on an established session.
+        CHECK_EQ(mState, DATAGRAM);
+    }
+
+    mAwaitingAddress = false;
+
+    if (err != OK) {
+        notifyError(true /* send */, err, "Unable to resolve host.");
+        mSawSendFailure = true;
+        return;
+    }
+
+    int res = connect(mSocket, (const struct sockaddr *)&addr, sizeof(addr));
+
+    if (mState == RESOLVING) {
+        if (res < 0 && errno != EINPROGRESS) {
+            notifyError(true /* send */, -errno, "Connection failed");
+            mSawSendFailure = true;
+            return;
+        }
+
+        // Completion is signalled once the socket becomes writable.
+        mState = CONNECTING;
+        return;
+    }
+
+    if (res < 0) {
+        notifyError(true /* send */, -errno, "Connection failed");
+        mSawSendFailure = true;
+        return;
+    }
+
+    notifyConnected();
+}
+
+void ANetworkSession::Session::setDatagramHandler(
+        const sp<DatagramHandler> &handler) {
+    CHECK(mState == DATAGRAM || mState == RESOLVING);
+    mDatagramHandler = handler;
+}
+
+status_t ANetworkSession::Session::connectDatagram(
+        const struct sockaddr_in &addr) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    int res = connect(mSocket, (const struct sockaddr *)&addr, sizeof(addr));
+
+    return (res < 0) ? -errno : OK;
+}
+
+status_t ANetworkSession::Session::disconnectDatagram() {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    struct sockaddr_in unspecAddr;
+    memset(&unspecAddr, 0, sizeof(unspecAddr));
+    unspecAddr.sin_family = AF_UNSPEC;
+
+    int res = connect(
+            mSocket, (const struct sockaddr *)&unspecAddr, sizeof(unspecAddr));
+
+    return (res < 0) ? -errno : OK;
+}
+
+status_t ANetworkSession::Session::setMulticastSendOptions(
+        const struct in_addr &interfaceAddr, int32_t ttl, bool loopback) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    if (setsockopt(
+                mSocket, IPPROTO_IP, IP_MULTICAST_IF,
+                &interfaceAddr, sizeof(interfaceAddr)) < 0) {
+        return -errno;
+    }
+
+    unsigned char ttlValue = ttl;
+    if (setsockopt(
+                mSocket, IPPROTO_IP, IP_MULTICAST_TTL,
+                &ttlValue, sizeof(ttlValue)) < 0) {
+        return -errno;
+    }
+
+    unsigned char loopValue = loopback ? 1 : 0;
+    if (setsockopt(
+                mSocket, IPPROTO_IP, IP_MULTICAST_LOOP,
+                &loopValue, sizeof(loopValue)) < 0) {
+        return -errno;
+    }
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::joinMulticastGroup(
+        const struct in_addr &groupAddr,
+        const struct in_addr &interfaceAddr) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = groupAddr;
+    mreq.imr_interface = interfaceAddr;
+
+    int res = setsockopt(
+            mSocket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+
+    return (res < 0) ? -errno : OK;
+}
+
+void ANetworkSession::Session::setImpairment(NetworkImpairment *impairment) {
+    // ANetworkSession::setImpairment() turns away any other kind.
+    CHECK(mIsDatagram);
+
+    NetworkImpairment **slot =
+        impairment->isOutgoing() ? &mOutImpairment : &mInImpairment;
+
+    // Whatever the previous one still held is lost along with it.
+    delete *slot;
+    *slot = impairment;
+}
+
+int64_t ANetworkSession::Session::releaseImpairedDatagrams(int64_t nowUs) {
+    int64_t nextDueTimeUs = -1ll;
+
+    if (mInImpairment != NULL) {
+        sp<ABuffer> buf;
+        struct sockaddr_in remoteAddr;
+        while ((buf = mInImpairment->dequeue(nowUs, &remoteAddr)) != NULL) {
+            uint32_t numKernelDrops = mNumHeldKernelDrops;
+            mNumHeldKernelDrops = 0;
+
+            deliverDatagram(buf, nowUs, remoteAddr, numKernelDrops);
+        }
+
+        nextDueTimeUs = mInImpairment->nextDueTimeUs();
+    }
+
+    if (mOutImpairment != NULL) {
+        sp<ABuffer> buf;
+        struct sockaddr_in remoteAddr;
+        while ((buf = mOutImpairment->dequeue(nowUs, &remoteAddr)) != NULL) {
+            queueDatagram(buf);
+        }
+
+        int64_t dueTimeUs = mOutImpairment->nextDueTimeUs();
+        if (dueTimeUs >= 0ll
+                && (nextDueTimeUs < 0ll || dueTimeUs < nextDueTimeUs)) {
+            nextDueTimeUs = dueTimeUs;
+        }
+    }
+
+    return nextDueTimeUs;
+}
+
+void ANetworkSession::Session::getImpairmentStats(
+        uint32_t *numDropped, uint32_t *numDuplicated,
+        size_t *numBytesHeld) const {
+    *numDropped = 0;
+    *numDuplicated = 0;
+    *numBytesHeld = 0;
+
+    const NetworkImpairment *impairments[2] = {
+        mInImpairment, mOutImpairment
+    };
+
+    for (size_t i = 0; i < 2; ++i) {
+        if (impairments[i] == NULL) {
+            continue;
+        }
+
+        NetworkImpairment::Stats stats;
+        impairments[i]->getStats(&stats);
+
+        *numDropped += stats.mNumLost + stats.mNumOverflowed;
+        *numDuplicated += stats.mNumDuplicated;
+        *numBytesHeld += stats.mNumBytesHeld;
+    }
+}
+
+status_t ANetworkSession::Session::setSocketBufferSizes(
+        size_t rcvBufSize, size_t sndBufSize) {
+    if (mLastRcvBufGrowthUs >= 0ll && rcvBufSize < mRcvBufSize) {
+        // Never undo growth we had to resort to because of overflows.
+        rcvBufSize = mRcvBufSize;
+    }
+
+    status_t err = setReceiveBufferSize(rcvBufSize);
+    if (err != OK) {
+        return err;
+    }
+
+    mRcvBufAtLimit = mRcvBufSize < rcvBufSize;
+
+    if (mRcvBufAtLimit) {
+        ALOGW("session %d: kernel limited receive buffer to %d of %d bytes",
+              mSessionID, mRcvBufSize, rcvBufSize);
+    }
+
+    int size = sndBufSize;
+    if (setsockopt(mSocket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0) {
+        return -errno;
+    }
+
+    return OK;
+}
+
+uint32_t ANetworkSession::Session::kernelDropCount() const {
+    return android_atomic_acquire_load(&mKernelDropCount);
+}
+
+void ANetworkSession::Session::getSendQueueStats(
+        size_t *numBytesQueued, uint32_t *numDropped) const {
+    *numBytesQueued = android_atomic_acquire_load(&mOutDatagramsSize);
+    *numDropped = android_atomic_acquire_load(&mNumOutDatagramsDropped);
+}
+
+// Returns the number of datagrams dropped since the previous report.
+uint32_t ANetworkSession::Session::onKernelDrops(uint32_t rxqOvflCount) {
+    // The counter is cumulative for the lifetime of the socket.
+    uint32_t numDropped = rxqOvflCount - mRxqOvflCount;
+    mRxqOvflCount = rxqOvflCount;
+
+    if (numDropped == 0) {
+        return 0;
+    }
+
+    uint32_t totalDropped =
+        android_atomic_add(numDropped, &mKernelDropCount) + numDropped;
+
+    ALOGW("session %d: kernel dropped %u datagrams (%u total), "
+          "receive buffer is %d bytes",
+          mSessionID, numDropped, totalDropped, mRcvBufSize);
+
+    int64_t nowUs = mClock->nowUs();
+    if (mRcvBufAtLimit
+            || mRcvBufSize >= kMaxSocketBufferSize
+            || (mLastRcvBufGrowthUs >= 0ll
+                && nowUs < mLastRcvBufGrowthUs + kMinSocketBufferGrowthIntervalUs)) {
+        return numDropped;
+    }
+
+    size_t newSize = mRcvBufSize * 2;
+    if (newSize > kMaxSocketBufferSize) {
+        newSize = kMaxSocketBufferSize;
+    }
+
+    size_t oldSize = mRcvBufSize;
+
+    status_t err = setReceiveBufferSize(newSize);
+    if (err != OK) {
+        ALOGW("unable to grow receive buffer (%s)", strerror(-err));
+        return numDropped;
+    }
+
+    mLastRcvBufGrowthUs = nowUs;
+
+    if (mRcvBufSize > oldSize) {
+        ALOGI("session %d: grew receive buffer to %d bytes",
+              mSessionID, mRcvBufSize);
+    }
+
+    if (mRcvBufSize < newSize) {
+        // Asking again won't get us any more.
+        ALOGW("session %d: kernel limits receive buffer to %d bytes",
+              mSessionID, mRcvBufSize);
+
+        mRcvBufAtLimit = true;
+    }
+
+    return numDropped;
+}
+
+// SO_RCVBUF is silently clamped to net.core.rmem_max, SO_RCVBUFFORCE
+// gets past that if we're privileged enough. Either way mRcvBufSize ends
+// up with what the kernel actually granted.
+status_t ANetworkSession::Session::setReceiveBufferSize(size_t size) {
+    int value = size;
+    if (setsockopt(
+                mSocket, SOL_SOCKET, SO_RCVBUFFORCE,
+                &value, sizeof(value)) < 0
+            && setsockopt(
+                mSocket, SOL_SOCKET, SO_RCVBUF,
+                &value, sizeof(value)) < 0) {
+        return -errno;
+    }
+
+    socklen_t valueLen = sizeof(value);
+    if (getsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &value, &valueLen) < 0) {
+        return -errno;
+    }
+
+    // The kernel reports twice the size, it reserves as much again for
+    // its own bookkeeping.
+    mRcvBufSize = value / 2;
+
+    return OK;
+}
+
 sp<AMessage> ANetworkSession::Session::getNotificationMessage() const {
     return mNotify;
 }
@@ -196,17 +948,18 @@ bool ANetworkSession::Session::isTCPDatagramServer() const {
 }
 
 bool ANetworkSession::Session::wantsToRead() {
-    return !mSawReceiveFailure && mState != CONNECTING;
+    return !mSawReceiveFailure && mState != CONNECTING && mState != RESOLVING;
 }
 
 bool ANetworkSession::Session::wantsToWrite() {
     return !mSawSendFailure
         && (mState == CONNECTING
             || (mState == CONNECTED && !mOutBuffer.empty())
-            || (mState == DATAGRAM && !mOutDatagrams.empty()));
+            || (mState == DATAGRAM
+                && !mAwaitingAddress && !mOutDatagrams.empty()));
 }
 
-//ȡӽ
+//读取连接建立的内容
 status_t ANetworkSession::Session::readMore() {
     if (mState == DATAGRAM) {
         status_t err;
@@ -214,15 +967,42 @@ status_t ANetworkSession::Session::readMore() {
             sp<ABuffer> buf = new ABuffer(kMaxUDPSize); //kMaxUDPSize = 1500
 
             struct sockaddr_in remoteAddr;
-            socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+            struct iovec iov;
+            iov.iov_base = buf->data();
+            iov.iov_len = buf->capacity();
+
+            uint8_t control[CMSG_SPACE(sizeof(uint32_t))];
+
+            struct msghdr hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &remoteAddr;
+            hdr.msg_namelen = sizeof(remoteAddr);
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = sizeof(control);
 
             ssize_t n;
             do {
-                n = recvfrom(
-                        mSocket, buf->data(), buf->capacity(), 0,
-                        (struct sockaddr *)&remoteAddr, &remoteAddrLen);
+                n = recvmsg(mSocket, &hdr, 0);
             } while (n < 0 && errno == EINTR);
 
+            uint32_t numKernelDrops = 0;
+            if (n > 0) {
+                for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+                        cmsg != NULL; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+                    if (cmsg->cmsg_level == SOL_SOCKET
+                            && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                        uint32_t rxqOvflCount;
+                        memcpy(&rxqOvflCount, CMSG_DATA(cmsg),
+                               sizeof(rxqOvflCount));
+
+                        numKernelDrops = onKernelDrops(rxqOvflCount);
+                    }
+                }
+            }
+
             err = OK;
             if (n < 0) {
                 err = -errno;
@@ -231,27 +1011,15 @@ status_t ANetworkSession::Session::readMore() {
             } else {
                 buf->setRange(0, n);
 
-                int64_t nowUs = ALooper::GetNowUs();
-                buf->meta()->setInt64("arrivalTimeUs", nowUs);
+                int64_t nowUs = mClock->nowUs();
 
-                sp<AMessage> notify = mNotify->dup();
-                notify->setInt32("sessionID", mSessionID);
-                notify->setInt32("reason", kWhatDatagram);
-
-                uint32_t ip = ntohl(remoteAddr.sin_addr.s_addr);
-                notify->setString(
-                        "fromAddr",
-                        StringPrintf(
-                            "%u.%u.%u.%u",
-                            ip >> 24,
-                            (ip >> 16) & 0xff,
-                            (ip >> 8) & 0xff,
-                            ip & 0xff).c_str());
-
-                notify->setInt32("fromPort", ntohs(remoteAddr.sin_port));
+                if (mInImpairment != NULL) {
+                    mNumHeldKernelDrops += numKernelDrops;
+                    mInImpairment->queue(buf, remoteAddr, nowUs);
+                    continue;
+                }
 
-                notify->setBuffer("data", buf);
-                notify->post();
+                deliverDatagram(buf, nowUs, remoteAddr, numKernelDrops);
             }
         } while (err == OK);
 
@@ -316,7 +1084,7 @@ status_t ANetworkSession::Session::readMore() {
             size_t length;
 
             if (mInBuffer.size() > 0 && mInBuffer.c_str()[0] == '$') {
-				//յΪPlaybackSession::kWhatBinaryDataͷϢΪ'$'Żж 
+				//接收到类型为PlaybackSession::kWhatBinaryData且头部请求信息为'$'才会进入此判断体 
                 if (mInBuffer.size() < 4) {
                     break;
                 }
@@ -335,7 +1103,7 @@ status_t ANetworkSession::Session::readMore() {
                 sp<ABuffer> data = new ABuffer(length);
                 memcpy(data->data(), mInBuffer.c_str() + 4, length);
 
-                int64_t nowUs = ALooper::GetNowUs();
+                int64_t nowUs = mClock->nowUs();
                 data->meta()->setInt64("arrivalTimeUs", nowUs);
 
                 notify->setBuffer("data", data);
@@ -345,9 +1113,18 @@ status_t ANetworkSession::Session::readMore() {
                 continue;
             }
 
+            ssize_t messageLength =
+                mInScanner.scan(mInBuffer.c_str(), mInBuffer.size());
+
+            if (messageLength < 0) {
+                break;
+            }
+
+            mInScanner.reset();
+
             sp<ParsedMessage> msg =
                 ParsedMessage::Parse(
-                        mInBuffer.c_str(), mInBuffer.size(), err != OK, &length);//RTSPϢ  
+                        mInBuffer.c_str(), messageLength, err != OK, &length);//解析处理RTSP消息  
 
             if (msg == NULL) {
                 break;
@@ -355,7 +1132,7 @@ status_t ANetworkSession::Session::readMore() {
 
             sp<AMessage> notify = mNotify->dup();
             notify->setInt32("sessionID", mSessionID);
-            notify->setInt32("reason", kWhatData); //Sink˷ΪkWhatDataϢ
+            notify->setInt32("reason", kWhatData); //向Sink端发送类型为kWhatData的消息请求
             notify->setObject("data", msg);
             notify->post();
 
@@ -389,7 +1166,45 @@ status_t ANetworkSession::Session::readMore() {
     return err;
 }
 
-//ӵĶ˿д
+void ANetworkSession::Session::deliverDatagram(
+        const sp<ABuffer> &buf,
+        int64_t arrivalTimeUs,
+        const struct sockaddr_in &remoteAddr,
+        uint32_t numKernelDrops) {
+    if (mDatagramHandler != NULL) {
+        mDatagramHandler->onDatagram(
+                mSessionID, buf, arrivalTimeUs, remoteAddr, numKernelDrops);
+        return;
+    }
+
+    buf->meta()->setInt64("arrivalTimeUs", arrivalTimeUs);
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("sessionID", mSessionID);
+    notify->setInt32("reason", kWhatDatagram);
+
+    uint32_t ip = ntohl(remoteAddr.sin_addr.s_addr);
+    notify->setString(
+            "fromAddr",
+            StringPrintf(
+                "%u.%u.%u.%u",
+                ip >> 24,
+                (ip >> 16) & 0xff,
+                (ip >> 8) & 0xff,
+                ip & 0xff).c_str());
+
+    notify->setInt32("fromPort", ntohs(remoteAddr.sin_port));
+
+    if (numKernelDrops > 0) {
+        // Datagrams lost before this one ever made it to us.
+        notify->setInt32("kernelDrops", numKernelDrops);
+    }
+
+    notify->setBuffer("data", buf);
+    notify->post();
+}
+
+//向连接的端口写入内容
 status_t ANetworkSession::Session::writeMore() {
     if (mState == DATAGRAM) {
         CHECK(!mOutDatagrams.empty());
@@ -400,7 +1215,7 @@ status_t ANetworkSession::Session::writeMore() {
 
             uint8_t *data = datagram->data();
             if (data[0] == 0x80 && (data[1] & 0x7f) == 33) {
-                int64_t nowUs = ALooper::GetNowUs();
+                int64_t nowUs = mClock->nowUs();
 
                 uint32_t prevRtpTime = U32_AT(&data[4]);
 
@@ -424,7 +1239,23 @@ status_t ANetworkSession::Session::writeMore() {
             err = OK;
 
             if (n > 0) {
-                mOutDatagrams.erase(mOutDatagrams.begin());
+                if (mNumUnaddressedDrops > 0) {
+                    ALOGI("session %d dropped %u datagrams while it had no "
+                          "peer.", mSessionID, mNumUnaddressedDrops);
+
+                    mNumUnaddressedDrops = 0;
+                }
+
+                removeDatagram(mOutDatagrams.begin());
+            } else if (n < 0 && errno == EDESTADDRREQ) {
+                // Disconnected, see disconnectUDPSession(). Nothing the
+                // session can't recover from once it's connected again.
+                if (mNumUnaddressedDrops++ == 0) {
+                    ALOGW("session %d has no peer, dropping outgoing "
+                          "datagrams.", mSessionID);
+                }
+
+                removeDatagram(mOutDatagrams.begin());
             } else if (n < 0) {
                 err = -errno;
             } else if (n == 0) {
@@ -461,7 +1292,7 @@ status_t ANetworkSession::Session::writeMore() {
         }
 
         mState = CONNECTED;
-        notify(kWhatConnected);
+        notifyConnected();
 
         return OK;
     }
@@ -471,7 +1302,7 @@ status_t ANetworkSession::Session::writeMore() {
 
     ssize_t n;
     do {
-        n = send(mSocket, mOutBuffer.c_str(), mOutBuffer.size(), 0);//ͻ˷OPTIONS  
+        n = send(mSocket, mOutBuffer.c_str(), mOutBuffer.size(), 0);//客户端向服务端发送OPTIONS请求  
     } while (n < 0 && errno == EINTR);
 
     ALOGD("111  send %ld %u:\n%s\n", n, mOutBuffer.size(), mOutBuffer.c_str());
@@ -499,21 +1330,26 @@ status_t ANetworkSession::Session::writeMore() {
     return err;
 }
 
-status_t ANetworkSession::Session::sendRequest(const void *data, ssize_t size) {
+status_t ANetworkSession::Session::sendRequest(const sp<ABuffer> &data) {
     CHECK(mState == CONNECTED || mState == DATAGRAM);
 
     if (mState == DATAGRAM) {
-        CHECK_GE(size, 0);
+        if (mOutImpairment != NULL) {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
 
-        sp<ABuffer> datagram = new ABuffer(size);
-        memcpy(datagram->data(), data, size);
+            mOutImpairment->queue(data, addr, mClock->nowUs());
+            return OK;
+        }
 
-        mOutDatagrams.push_back(datagram);
+        queueDatagram(data);
         return OK;
     }
 
+    size_t size = data->size();
+
     if (mState == CONNECTED && !mIsRTSPConnection) {
-        CHECK_LE(size, 65535);
+        CHECK_LE(size, 65535u);
 
         uint8_t prefix[2];
         prefix[0] = size >> 8;
@@ -522,13 +1358,75 @@ status_t ANetworkSession::Session::sendRequest(const void *data, ssize_t size) {
         mOutBuffer.append((const char *)prefix, sizeof(prefix));
     }
 
-    mOutBuffer.append(
-            (const char *)data,
-            (size >= 0) ? size : strlen((const char *)data));
+    mOutBuffer.append((const char *)data->data(), size);
 
     return OK;
 }
 
+static bool IsDroppable(const sp<ABuffer> &datagram) {
+    int32_t droppable;
+    return datagram->meta()->findInt32("droppable", &droppable)
+        && droppable;
+}
+
+void ANetworkSession::Session::queueDatagram(const sp<ABuffer> &data) {
+    bool droppable = IsDroppable(data);
+
+    size_t size = (size_t)mOutDatagramsSize + data->size();
+
+    if (size > kMaxOutDatagramsSize && !droppable
+            && size - mOutDroppableSize <= kMaxOutDatagramsSize) {
+        // Make room at the expense of data nothing else depends on,
+        // oldest first.
+        List<sp<ABuffer> >::iterator it = mOutDatagrams.begin();
+        while (size > kMaxOutDatagramsSize) {
+            CHECK(it != mOutDatagrams.end());
+
+            if (!IsDroppable(*it)) {
+                ++it;
+                continue;
+            }
+
+            size -= (*it)->size();
+            it = removeDatagram(it);
+
+            if (android_atomic_inc(&mNumOutDatagramsDropped) == 0) {
+                ALOGW("session %d: send queue full, dropping datagrams",
+                      mSessionID);
+            }
+        }
+    }
+
+    if (size > kMaxOutDatagramsSize) {
+        // The link can't keep up, rather than queueing up more and
+        // more latency we shed the new datagram.
+        if (android_atomic_inc(&mNumOutDatagramsDropped) == 0) {
+            ALOGW("session %d: send queue full, dropping datagrams",
+                  mSessionID);
+        }
+        return;
+    }
+
+    // The buffer was copied when the request was posted and is ours.
+    mOutDatagrams.push_back(data);
+    android_atomic_add(data->size(), &mOutDatagramsSize);
+
+    if (droppable) {
+        mOutDroppableSize += data->size();
+    }
+}
+
+List<sp<ABuffer> >::iterator ANetworkSession::Session::removeDatagram(
+        List<sp<ABuffer> >::iterator it) {
+    if (IsDroppable(*it)) {
+        mOutDroppableSize -= (*it)->size();
+    }
+
+    android_atomic_add(-(int32_t)(*it)->size(), &mOutDatagramsSize);
+
+    return mOutDatagrams.erase(it);
+}
+
 void ANetworkSession::Session::notifyError(
         bool send, status_t err, const char *detail) {
     sp<AMessage> msg = mNotify->dup();
@@ -547,11 +1445,108 @@ void ANetworkSession::Session::notify(NotificationReason reason) {
     msg->post();
 }
 
+void ANetworkSession::Session::notifyConnected() {
+    int64_t connectLatencyUs = mClock->nowUs() - mConnectStartTimeUs;
+
+    ALOGI("session %d connected after %lld us",
+          mSessionID, connectLatencyUs);
+
+    sp<AMessage> msg = mNotify->dup();
+    msg->setInt32("sessionID", mSessionID);
+    msg->setInt32("reason", kWhatConnected);
+    msg->setInt64("connectLatencyUs", connectLatencyUs);
+    msg->post();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ANetworkSession::ResolverThread::ResolverThread(ANetworkSession *session)
+    : mSession(session) {
+}
+
+ANetworkSession::ResolverThread::~ResolverThread() {
+}
+
+void ANetworkSession::ResolverThread::resolve(
+        int32_t sessionID, const char *host, unsigned port) {
+    Request request;
+    request.mSessionID = sessionID;
+    request.mHost = host;
+    request.mPort = port;
+
+    Mutex::Autolock autoLock(mLock);
+    mRequests.push_back(request);
+    mCondition.signal();
+}
+
+void ANetworkSession::ResolverThread::wakeUp() {
+    Mutex::Autolock autoLock(mLock);
+    mCondition.signal();
+}
+
+bool ANetworkSession::ResolverThread::threadLoop() {
+    Request request;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        for (;;) {
+            if (exitPending()) {
+                return false;
+            }
+
+            if (!mRequests.empty()) {
+                break;
+            }
+
+            mCondition.wait(mLock);
+        }
+
+        request = *mRequests.begin();
+        mRequests.erase(mRequests.begin());
+    }
+
+    int64_t startTimeUs = ALooper::GetNowUs();
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+
+    struct addrinfo *result;
+    int res = getaddrinfo(request.mHost.c_str(), NULL, &hints, &result);
+
+    Command *cmd =
+        new Command(Command::kTypeAddressResolved, request.mSessionID);
+
+    if (res != 0 || result == NULL) {
+        ALOGE("unable to resolve '%s' (%s)",
+              request.mHost.c_str(), gai_strerror(res));
+
+        cmd->mErr = -EHOSTUNREACH;
+    } else {
+        cmd->mAddr = *(const struct sockaddr_in *)result->ai_addr;
+        cmd->mAddr.sin_port = htons(request.mPort);
+
+        freeaddrinfo(result);
+
+        ALOGI("resolved '%s' in %lld us",
+              request.mHost.c_str(), ALooper::GetNowUs() - startTimeUs);
+    }
+
+    mSession->postCommand(cmd);
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-ANetworkSession::ANetworkSession()
-    : mNextSessionID(1) {
-    mPipeFd[0] = mPipeFd[1] = -1;
+ANetworkSession::ANetworkSession(size_t numThreads)
+    : mNumThreads(numThreads),
+      mClock(AClock::GetDefault()),
+      mNextSessionID(1),
+      mSessionsGeneration(0) {
+    CHECK_GE(mNumThreads, 1u);
+    CHECK_LE(mNumThreads, (size_t)kMaxNumThreads);
 }
 
 ANetworkSession::~ANetworkSession() {
@@ -559,52 +1554,78 @@ ANetworkSession::~ANetworkSession() {
 }
 
 status_t ANetworkSession::start() {
-    if (mThread != NULL) {
-        return INVALID_OPERATION;
-    }
-	
-	//ANetworkSessionϵselectѭҪʱʹselect
-    int res = pipe(mPipeFd);  //дܵthreadLoopִ 
-    if (res != 0) {
-        mPipeFd[0] = mPipeFd[1] = -1;
-        return -errno;
+    {
+        Mutex::Autolock autoLock(mThreadsLock);
+
+        if (!mThreads.isEmpty()) {
+            return INVALID_OPERATION;
+        }
     }
 
-	//һNetworkThreadNetworkThreadҲǼ̳ThreadʵthreadLoop
-	//threadLoopֻǼ򵥵ĵANetworkSessionthreadLoop
-    mThread = new NetworkThread(this);  //ANetworkSessionڲṹ߳
+    for (size_t i = 0; i < mNumThreads; ++i) {
+        //创建一个NetworkThread，NetworkThread也是继承于Thread，并实现threadLoop方法，
+        //在threadLoop方法中只是简单的调用ANetworkSession的threadLoop方法
+        sp<NetworkThread> thread = new NetworkThread(this, i);
 
-	//ANDROID_PRIORITY_AUDIOȼANetworkSession߳ 
-	//NetworkThread߳threadLoopһAnetworkSession::threadLoop()  
-    status_t err = mThread->run("ANetworkSession", ANDROID_PRIORITY_AUDIO);
+        //让ANetworkSession不断的做select循环，当有事务要处理时，就从select中跳出来处理
+        status_t err = thread->init();  //建立eventfd，控制threadLoop的执行
 
-    if (err != OK) {
-        mThread.clear();
+        if (err == OK) {
+            AString name = StringPrintf("ANetworkSession%d", i);
 
-        close(mPipeFd[0]);
-        close(mPipeFd[1]);
-        mPipeFd[0] = mPipeFd[1] = -1;
+            //以ANDROID_PRIORITY_AUDIO优先级启动ANetworkSession，开启该线程
+            //将会调用NetworkThread线程中threadLoop，进一步会调用AnetworkSession::threadLoop()
+            err = thread->run(name.c_str(), ANDROID_PRIORITY_AUDIO);
+        }
 
-        return err;
+        if (err != OK) {
+            stop();
+            return err;
+        }
+
+        Mutex::Autolock autoLock(mThreadsLock);
+        mThreads.push(thread);
     }
 
     return OK;
 }
 
 status_t ANetworkSession::stop() {
-    if (mThread == NULL) {
+    // Commands posted from here on are dropped, those that made it to a
+    // thread before are dropped along with it.
+    Vector<sp<NetworkThread> > threads;
+
+    {
+        Mutex::Autolock autoLock(mThreadsLock);
+        threads = mThreads;
+        mThreads.clear();
+    }
+
+    if (threads.isEmpty()) {
         return INVALID_OPERATION;
     }
 
-    mThread->requestExit();
-    interrupt();
-    mThread->requestExitAndWait();
+    sp<ResolverThread> resolver;
+    {
+        Mutex::Autolock autoLock(mLock);
+        resolver = mResolver;
+        mResolver.clear();
+    }
 
-    mThread.clear();
+    if (resolver != NULL) {
+        resolver->requestExit();
+        resolver->wakeUp();
+        resolver->requestExitAndWait();
+    }
 
-    close(mPipeFd[0]);
-    close(mPipeFd[1]);
-    mPipeFd[0] = mPipeFd[1] = -1;
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->requestExit();
+        threads[i]->interrupt();
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i]->requestExitAndWait();
+    }
 
     return OK;
 }
@@ -686,6 +1707,32 @@ status_t ANetworkSession::createTCPDatagramSession(
 }
 
 status_t ANetworkSession::destroySession(int32_t sessionID) {
+    status_t err = removeSession(sessionID);
+
+    if (err != OK) {
+        return err;
+    }
+
+    // The socket is closed as soon as the owning thread lets go of the
+    // session. Unless that's us, wait for it so that the port may be
+    // bound again right away.
+    sp<NetworkThread> thread = getThread(sessionID);
+
+    if (thread == NULL) {
+        return OK;
+    }
+
+    if (thread->isCurrentThread()) {
+        thread->interrupt();
+        return OK;
+    }
+
+    thread.clear();
+
+    return runCommand(new Command(Command::kTypeDestroySession, sessionID));
+}
+
+status_t ANetworkSession::removeSession(int32_t sessionID) {
     Mutex::Autolock autoLock(mLock);
 
     ssize_t index = mSessions.indexOfKey(sessionID);
@@ -695,8 +1742,7 @@ status_t ANetworkSession::destroySession(int32_t sessionID) {
     }
 
     mSessions.removeItemsAt(index);
-
-    interrupt();
+    android_atomic_inc(&mSessionsGeneration);
 
     return OK;
 }
@@ -717,23 +1763,22 @@ status_t ANetworkSession::MakeSocketNonBlocking(int s) {
 }
 
 status_t ANetworkSession::createClientOrServer(
-        Mode mode,  //öͣʾkModeCreateUDPSession,TCPDaRTSPServerģʽ
+        Mode mode,  //枚举类型，标示kModeCreateUDPSession,TCPDa，RTSPServer等模式
         const struct in_addr *localAddr,
         unsigned port,
         const char *remoteHost,
         unsigned remotePort,
         const sp<AMessage> &notify,
         int32_t *sessionID) {
-    Mutex::Autolock autoLock(mLock);
-
     *sessionID = 0;
     status_t err = OK;
     int s, res;
     sp<Session> session;
+    bool awaitingAddress = false;
 
     s = socket(
             AF_INET,
-            (mode == kModeCreateUDPSession) ? SOCK_DGRAM : SOCK_STREAM,  ////Ϊ׽ֵsocket
+            (mode == kModeCreateUDPSession) ? SOCK_DGRAM : SOCK_STREAM,  ////建立类型为流套接字的socket
             0);
 
     if (s < 0) {
@@ -744,8 +1789,8 @@ status_t ANetworkSession::createClientOrServer(
     if (mode == kModeCreateRTSPServer
             || mode == kModeCreateTCPDatagramSessionPassive) {
         const int yes = 1;
-		///socketһʹеĵַ 
-		// ׽ΪSOL_SOCKET ͨ׽ֲѡ yesbindеĵַSO_REUSEADDRָ
+		///允许socket和一个已在使用中的地址捆绑 
+		// 控制套接字行为，SOL_SOCKET 通用套接字层次选项， yes非零重用bind中的地址（SO_REUSEADDR指定）
         res = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 
         if (res < 0) {
@@ -755,9 +1800,9 @@ status_t ANetworkSession::createClientOrServer(
     }
 
     if (mode == kModeCreateUDPSession) {
-        int size = 256 * 1024;
+        int size = kDefaultSocketBufferSize;
 
-		//ֽܻڳ
+		//接受缓冲区的字节长度
         res = setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
 
         if (res < 0) {
@@ -765,16 +1810,23 @@ status_t ANetworkSession::createClientOrServer(
             goto bail2;
         }
 		
-		//ͻֽڳ
+		//发送缓冲区的字节长度
         res = setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 
         if (res < 0) {
             err = -errno;
             goto bail2;
         }
+
+        // Have the kernel tell us about datagrams it had to drop because
+        // the receive queue was full, older kernels don't support this.
+        const int yes = 1;
+        if (setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &yes, sizeof(yes)) < 0) {
+            ALOGW("SO_RXQ_OVFL not supported (%s)", strerror(errno));
+        }
     }
 
-	//socketΪʽ
+	//设置socket为非阻塞方式
     err = MakeSocketNonBlocking(s);
 
     if (err != OK) {
@@ -787,14 +1839,9 @@ status_t ANetworkSession::createClientOrServer(
 
     if (mode == kModeCreateRTSPClient
             || mode == kModeCreateTCPDatagramSessionActive) {
-        struct hostent *ent= gethostbyname(remoteHost);
-        if (ent == NULL) {
-            err = -h_errno;
-            goto bail2;
-        }
-
-        addr.sin_addr.s_addr = *(in_addr_t *)ent->h_addr;
-        addr.sin_port = htons(remotePort);
+        // Names are looked up on the resolver thread and connected once
+        // the session exists.
+        awaitingAddress = !ParseNumericAddress(remoteHost, remotePort, &addr);
     } else if (localAddr != NULL) {
         addr.sin_addr = *localAddr;
         addr.sin_port = htons(port);
@@ -803,7 +1850,10 @@ status_t ANetworkSession::createClientOrServer(
         addr.sin_port = htons(port);
     }
 
-    if (mode == kModeCreateRTSPClient
+    if (awaitingAddress) {
+        ALOGI("socket %d waits for '%s' to be resolved", s, remoteHost);
+        res = 0;
+    } else if (mode == kModeCreateRTSPClient
             || mode == kModeCreateTCPDatagramSessionActive) {
         in_addr_t x = ntohl(addr.sin_addr.s_addr);
         ALOGI("connecting socket %d to %d.%d.%d.%d:%d",
@@ -822,36 +1872,30 @@ status_t ANetworkSession::createClientOrServer(
         }
     } else {
 		
-		//socketsockaddrṹָ󶨣sockaddrӦiface
+		//socket与sockaddr结构体指针绑定，sockaddr对应与iface
         res = bind(s, (const struct sockaddr *)&addr, sizeof(addr));
 
         if (res == 0) {
             if (mode == kModeCreateRTSPServer
                     || mode == kModeCreateTCPDatagramSessionPassive) {
 
-				//Ϊ˿ʼrtsp
+				//作为服务端开始监听rtsp连接请求
                 res = listen(s, 4);
             } else {
                 CHECK_EQ(mode, kModeCreateUDPSession);
 
                 if (remoteHost != NULL) {
                     struct sockaddr_in remoteAddr;
-                    memset(remoteAddr.sin_zero, 0, sizeof(remoteAddr.sin_zero));
-                    remoteAddr.sin_family = AF_INET;
-                    remoteAddr.sin_port = htons(remotePort);
-
-                    struct hostent *ent= gethostbyname(remoteHost);
-                    if (ent == NULL) {
-                        err = -h_errno;
-                        goto bail2;
-                    }
-
-                    remoteAddr.sin_addr.s_addr = *(in_addr_t *)ent->h_addr;
 
-                    res = connect(
-                            s,
-                            (const struct sockaddr *)&remoteAddr,
-                            sizeof(remoteAddr));
+                    if (ParseNumericAddress(
+                                remoteHost, remotePort, &remoteAddr)) {
+                        res = connect(
+                                s,
+                                (const struct sockaddr *)&remoteAddr,
+                                sizeof(remoteAddr));
+                    } else {
+                        awaitingAddress = true;
+                    }
                 }
             }
         }
@@ -877,7 +1921,7 @@ status_t ANetworkSession::createClientOrServer(
             break;
 
         case kModeCreateRTSPServer:
-            state = Session::LISTENING_RTSP; //Session״̬Ϊ LISTENING_RTSP
+            state = Session::LISTENING_RTSP; //设置Session状态为 LISTENING_RTSP
             break;
 
         default:
@@ -886,13 +1930,16 @@ status_t ANetworkSession::createClientOrServer(
             break;
     }
 
-	//һsession,sessionID+1 
-	// notifyһkWhatRTSPNotifyAMessag
+	//创建一个session对象,sessionID+1 
+	// notify是一个kWhatRTSPNotify的AMessag
 	session = new Session(
-            mNextSessionID++,  
+            allocateSessionID(
+                mode == kModeCreateRTSPClient
+                    || mode == kModeCreateRTSPServer),
             state,
             s,
-            notify);
+            notify,
+            mClock);
 
     if (mode == kModeCreateTCPDatagramSessionActive) {
         session->setIsRTSPConnection(false);
@@ -900,13 +1947,34 @@ status_t ANetworkSession::createClientOrServer(
         session->setIsRTSPConnection(true);
     }
 
-	//sessionỰmSessionsṹб
-    mSessions.add(session->sessionID(), session);
+    if (awaitingAddress) {
+        session->setAwaitingAddress();
+    }
+
+	//将该session会话加入mSessions结构中保存
+    {
+        Mutex::Autolock autoLock(mLock);
+        addSessionLocked(session);
+    }
+
+	// ANetworkSession的NetworkThread线程跳出select语句，并重新计算readFd和writeFd用于select监听的文件句柄
+    interrupt(session->sessionID());//ANetworkSession::interrupt(),向eventfd写数据
+
+    if (awaitingAddress) {
+        resolveAsync(session->sessionID(), remoteHost, remotePort);
+    }
 
-	// ANetworkSessionNetworkThread߳select䣬¼readFdwriteFdselectļ
-    interrupt();//ANetworkSession::interrupt(),ܵдд 
+    if (mode == kModeCreateUDPSession) {
+        // Lets tests and benchmarks run every datagram session of a
+        // process through a simulated link.
+        char val[PROPERTY_VALUE_MAX];
+        if (property_get("media.wfd.impairment", val, NULL)
+                && setImpairment(session->sessionID(), val) != OK) {
+            ALOGW("ignoring malformed media.wfd.impairment '%s'", val);
+        }
+    }
 
-    *sessionID = session->sessionID();//ָǰsessionID
+    *sessionID = session->sessionID();//由指针带出当前sessionID
 
     goto bail;
 
@@ -920,6 +1988,156 @@ bail:
 
 status_t ANetworkSession::connectUDPSession(
         int32_t sessionID, const char *remoteHost, unsigned remotePort) {
+    struct sockaddr_in remoteAddr;
+    if (!ParseNumericAddress(remoteHost, remotePort, &remoteAddr)) {
+        {
+            Mutex::Autolock autoLock(mLock);
+
+            ssize_t index = mSessions.indexOfKey(sessionID);
+
+            if (index < 0) {
+                return -ENOENT;
+            }
+
+            if (!mSessions.valueAt(index)->isDatagram()) {
+                return INVALID_OPERATION;
+            }
+        }
+
+        // Whatever is sent from now on must not reach the previous peer,
+        // it's held until the session has been connected to the new one.
+        status_t err = runCommand(
+                new Command(Command::kTypeAwaitAddress, sessionID));
+
+        if (err != OK) {
+            return err;
+        }
+
+        // The session's network thread connects it and notifies
+        // kWhatConnected once the name has been resolved.
+        resolveAsync(sessionID, remoteHost, remotePort);
+        return OK;
+    }
+
+    Command *cmd = new Command(Command::kTypeConnect, sessionID);
+    cmd->mAddr = remoteAddr;
+
+    return runCommand(cmd);
+}
+
+status_t ANetworkSession::disconnectUDPSession(int32_t sessionID) {
+    return runCommand(new Command(Command::kTypeDisconnect, sessionID));
+}
+
+status_t ANetworkSession::setMulticastSendOptions(
+        int32_t sessionID,
+        const struct in_addr &interfaceAddr,
+        int32_t ttl,
+        bool loopback) {
+    Command *cmd =
+        new Command(Command::kTypeSetMulticastSendOptions, sessionID);
+
+    cmd->mInterfaceAddr = interfaceAddr;
+    cmd->mTTL = ttl;
+    cmd->mLoopback = loopback;
+
+    return runCommand(cmd);
+}
+
+status_t ANetworkSession::joinMulticastGroup(
+        int32_t sessionID,
+        const char *groupAddr,
+        const struct in_addr &interfaceAddr) {
+    struct in_addr addr;
+    if (!inet_aton(groupAddr, &addr) || !IN_MULTICAST(ntohl(addr.s_addr))) {
+        return -EINVAL;
+    }
+
+    Command *cmd = new Command(Command::kTypeJoinMulticastGroup, sessionID);
+    cmd->mGroupAddr = addr;
+    cmd->mInterfaceAddr = interfaceAddr;
+
+    return runCommand(cmd);
+}
+
+// static
+bool ANetworkSession::IsMulticastAddress(const char *host) {
+    struct in_addr addr;
+    return inet_aton(host, &addr) != 0 && IN_MULTICAST(ntohl(addr.s_addr));
+}
+
+void ANetworkSession::resolveAsync(
+        int32_t sessionID, const char *host, unsigned port) {
+    sp<ResolverThread> resolver;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        if (mResolver == NULL) {
+            mResolver = new ResolverThread(this);
+
+            status_t err = mResolver->run(
+                    "ANetworkSessionResolver", ANDROID_PRIORITY_NORMAL);
+
+            CHECK_EQ(err, (status_t)OK);
+        }
+
+        resolver = mResolver;
+    }
+
+    resolver->resolve(sessionID, host, port);
+}
+
+status_t ANetworkSession::sendRequest(
+        int32_t sessionID, const void *data, ssize_t size, bool droppable) {
+    if (size < 0) {
+        size = strlen((const char *)data);
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    if (mSessions.indexOfKey(sessionID) < 0) {
+        return -ENOENT;
+    }
+
+    Command *cmd = new Command(Command::kTypeSendRequest, sessionID);
+    cmd->mData = new ABuffer(size);
+    memcpy(cmd->mData->data(), data, size);
+
+    if (droppable) {
+        cmd->mData->meta()->setInt32("droppable", true);
+    }
+
+    postCommand(cmd);
+
+    return OK;
+}
+
+// static
+size_t ANetworkSession::ComputeSocketBufferSize(
+        int32_t bitrate, int64_t targetLatencyUs) {
+    if (bitrate <= 0 || targetLatencyUs <= 0ll) {
+        return kDefaultSocketBufferSize;
+    }
+
+    int64_t size = (int64_t)bitrate * targetLatencyUs / 8000000ll;
+
+    // The kernel charges each datagram its full skb overhead against the
+    // buffer, roughly doubling the cost of a 1.3k RTP packet, and IDR
+    // frames arrive as bursts well above the average bitrate.
+    size *= 4;
+
+    if (size < kMinSocketBufferSize) {
+        size = kMinSocketBufferSize;
+    } else if (size > kMaxSocketBufferSize) {
+        size = kMaxSocketBufferSize;
+    }
+
+    return size;
+}
+
+status_t ANetworkSession::tuneSocketBuffers(
+        int32_t sessionID, int32_t bitrate, int64_t targetLatencyUs) {
     Mutex::Autolock autoLock(mLock);
 
     ssize_t index = mSessions.indexOfKey(sessionID);
@@ -928,36 +2146,97 @@ status_t ANetworkSession::connectUDPSession(
         return -ENOENT;
     }
 
-    const sp<Session> session = mSessions.valueAt(index);
-    int s = session->socket();
+    size_t size = ComputeSocketBufferSize(bitrate, targetLatencyUs);
 
-    struct sockaddr_in remoteAddr;
-    memset(remoteAddr.sin_zero, 0, sizeof(remoteAddr.sin_zero));
-    remoteAddr.sin_family = AF_INET;
-    remoteAddr.sin_port = htons(remotePort);
+    ALOGI("session %d: using %d byte socket buffers for %d bps, %lld us",
+          sessionID, size, bitrate, targetLatencyUs);
 
-    status_t err = OK;
-    struct hostent *ent = gethostbyname(remoteHost);
-    if (ent == NULL) {
-        err = -h_errno;
-    } else {
-        remoteAddr.sin_addr.s_addr = *(in_addr_t *)ent->h_addr;
+    // The session's buffer bookkeeping belongs to the network thread.
+    Command *cmd = new Command(Command::kTypeTuneSocketBuffers, sessionID);
+    cmd->mBufferSize = size;
 
-        int res = connect(
-                s,
-                (const struct sockaddr *)&remoteAddr,
-                sizeof(remoteAddr));
+    postCommand(cmd);
 
-        if (res < 0) {
-            err = -errno;
+    return OK;
+}
+
+status_t ANetworkSession::setDatagramHandler(
+        int32_t sessionID, const sp<DatagramHandler> &handler) {
+    Command *cmd = new Command(Command::kTypeSetDatagramHandler, sessionID);
+    cmd->mDatagramHandler = handler;
+
+    postCommand(cmd);
+
+    return OK;
+}
+
+status_t ANetworkSession::setImpairment(
+        int32_t sessionID, const char *spec) {
+    NetworkImpairment::Profile profile;
+    status_t err = NetworkImpairment::ParseProfile(spec, &profile);
+
+    if (err != OK) {
+        return err;
+    }
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        ssize_t index = mSessions.indexOfKey(sessionID);
+
+        if (index < 0) {
+            return -ENOENT;
+        }
+
+        // Only datagrams can go missing without breaking the stream.
+        if (!mSessions.valueAt(index)->isDatagram()) {
+            return INVALID_OPERATION;
         }
     }
 
-    return err;
+    ALOGI("session %d: impairing %s datagrams with '%s'",
+          sessionID, profile.mOutgoing ? "outgoing" : "incoming", spec);
+
+    Command *cmd = new Command(Command::kTypeSetImpairment, sessionID);
+    cmd->mImpairment = new NetworkImpairment(profile, sessionID);
+
+    postCommand(cmd);
+
+    return OK;
 }
 
-status_t ANetworkSession::sendRequest(
-        int32_t sessionID, const void *data, ssize_t size) {
+status_t ANetworkSession::getImpairmentStats(
+        int32_t sessionID,
+        uint32_t *numDropped,
+        uint32_t *numDuplicated,
+        size_t *numBytesHeld) {
+    // The impairments belong to the network thread, which may replace
+    // them any time.
+    Command *cmd = new Command(Command::kTypeGetImpairmentStats, sessionID);
+    cmd->mNumDropped = numDropped;
+    cmd->mNumDuplicated = numDuplicated;
+    cmd->mNumBytesHeld = numBytesHeld;
+
+    return runCommand(cmd);
+}
+
+status_t ANetworkSession::getKernelDropCount(
+        int32_t sessionID, uint32_t *numDrops) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    *numDrops = mSessions.valueAt(index)->kernelDropCount();
+
+    return OK;
+}
+
+status_t ANetworkSession::getSendQueueStats(
+        int32_t sessionID, size_t *numBytesQueued, uint32_t *numDropped) {
     Mutex::Autolock autoLock(mLock);
 
     ssize_t index = mSessions.indexOfKey(sessionID);
@@ -966,58 +2245,281 @@ status_t ANetworkSession::sendRequest(
         return -ENOENT;
     }
 
-    const sp<Session> session = mSessions.valueAt(index);
+    mSessions.valueAt(index)->getSendQueueStats(numBytesQueued, numDropped);
+
+    return OK;
+}
+
+// Control sessions (RTSP) all live on the first network thread, any
+// other session goes to one of the remaining threads in turn. The owning
+// thread can be told from the session ID alone.
+int32_t ANetworkSession::allocateSessionID(bool isControl) {
+    int32_t seqNo = android_atomic_inc(&mNextSessionID);
 
-    status_t err = session->sendRequest(data, size);
+    if (mNumThreads == 1) {
+        return seqNo;
+    }
 
-    interrupt();
+    size_t threadIndex = isControl ? 0 : 1 + seqNo % (mNumThreads - 1);
 
-    return err;
+    return seqNo * mNumThreads + threadIndex;
 }
 
-// pipeдһϢѸոմsocket뵽readFd
-void ANetworkSession::interrupt() {
-    static const char dummy = 0;
+size_t ANetworkSession::threadIndexOf(int32_t sessionID) const {
+    return (size_t)sessionID % mNumThreads;
+}
 
-    ssize_t n;
-    do {
-        n = write(mPipeFd[1], &dummy, 1);
-    } while (n < 0 && errno == EINTR);
+sp<ANetworkSession::NetworkThread> ANetworkSession::getThread(
+        int32_t sessionID) {
+    Mutex::Autolock autoLock(mThreadsLock);
 
-    if (n < 0) {
-        ALOGW("Error writing to pipe (%s)", strerror(errno));
+    if (mThreads.isEmpty()) {
+        return NULL;
+    }
+
+    return mThreads[threadIndexOf(sessionID)];
+}
+
+void ANetworkSession::interrupt(int32_t sessionID) {
+    sp<NetworkThread> thread = getThread(sessionID);
+
+    if (thread != NULL) {
+        thread->interrupt();
+    }
+}
+
+// Carries out "cmd" on the network thread owning its session, the only
+// one to touch the socket, and returns the result. On that very thread,
+// from a DatagramHandler say, or before start() it's carried out right
+// away instead.
+status_t ANetworkSession::runCommand(Command *cmd) {
+    sp<NetworkThread> thread = getThread(cmd->mSessionID);
+
+    if (thread == NULL || thread->isCurrentThread()) {
+        sp<Session> session;
+
+        {
+            Mutex::Autolock autoLock(mLock);
+
+            ssize_t index = mSessions.indexOfKey(cmd->mSessionID);
+
+            if (index >= 0) {
+                session = mSessions.valueAt(index);
+            }
+        }
+
+        if (session != NULL) {
+            executeCommand(session, cmd);
+        }
+
+        status_t result = cmd->mResult;
+        delete cmd;
+
+        return result;
+    }
+
+    sp<CommandCompletion> completion = new CommandCompletion;
+    cmd->mCompletion = completion;
+
+    thread->postCommand(cmd);
+
+    // Should the thread be going away, its destructor drops the command,
+    // we mustn't be the ones keeping it around.
+    thread.clear();
+
+    return completion->wait();
+}
+
+void ANetworkSession::postCommand(Command *cmd) {
+    sp<NetworkThread> thread = getThread(cmd->mSessionID);
+
+    if (thread == NULL) {
+        ALOGW("dropping command for session %d, not started",
+              cmd->mSessionID);
+
+        delete cmd;
+        return;
+    }
+
+    thread->postCommand(cmd);
+}
+
+void ANetworkSession::processCommands(NetworkThread *thread) {
+    Command *ordered = thread->takeCommands();
+
+    if (ordered == NULL) {
+        return;
+    }
+
+    // A command may refer to a session created right before it was posted.
+    syncSessions(thread);
+
+    while (ordered != NULL) {
+        Command *cmd = ordered;
+        ordered = cmd->mNext;
+
+        ssize_t index = thread->mActiveSessions.indexOfKey(cmd->mSessionID);
+
+        if (cmd->mType == Command::kTypeDestroySession) {
+            // Gone from mActiveSessions since the syncSessions() above,
+            // that released the socket.
+            CHECK_LT(index, 0);
+            cmd->mResult = OK;
+        } else if (index < 0) {
+            ALOGV("dropping command for session %d, it no longer exists",
+                  cmd->mSessionID);
+        } else {
+            executeCommand(thread->mActiveSessions.valueAt(index), cmd);
+        }
+
+        delete cmd;
+    }
+}
+
+void ANetworkSession::executeCommand(
+        const sp<Session> &session, Command *cmd) {
+    switch (cmd->mType) {
+        case Command::kTypeSendRequest:
+            session->sendRequest(cmd->mData);
+            break;
+
+        case Command::kTypeTuneSocketBuffers:
+        {
+            status_t err = session->setSocketBufferSizes(
+                    cmd->mBufferSize, cmd->mBufferSize);
+
+            if (err != OK) {
+                ALOGW("session %d: unable to resize socket buffers (%s)",
+                      cmd->mSessionID, strerror(-err));
+            }
+            break;
+        }
+
+        case Command::kTypeAddressResolved:
+            session->onAddressResolved(cmd->mErr, cmd->mAddr);
+            break;
+
+        case Command::kTypeSetDatagramHandler:
+            session->setDatagramHandler(cmd->mDatagramHandler);
+            break;
+
+        case Command::kTypeSetImpairment:
+            session->setImpairment(cmd->mImpairment);
+            cmd->mImpairment = NULL;
+            break;
+
+        case Command::kTypeGetImpairmentStats:
+            session->getImpairmentStats(
+                    cmd->mNumDropped, cmd->mNumDuplicated, cmd->mNumBytesHeld);
+            cmd->mResult = OK;
+            break;
+
+        case Command::kTypeAwaitAddress:
+            session->setAwaitingAddress();
+            cmd->mResult = OK;
+            break;
+
+        case Command::kTypeConnect:
+            cmd->mResult = session->connectDatagram(cmd->mAddr);
+            break;
+
+        case Command::kTypeDisconnect:
+            cmd->mResult = session->disconnectDatagram();
+            break;
+
+        case Command::kTypeSetMulticastSendOptions:
+            cmd->mResult = session->setMulticastSendOptions(
+                    cmd->mInterfaceAddr, cmd->mTTL, cmd->mLoopback);
+            break;
+
+        case Command::kTypeJoinMulticastGroup:
+            cmd->mResult = session->joinMulticastGroup(
+                    cmd->mGroupAddr, cmd->mInterfaceAddr);
+            break;
+
+        default:
+            TRESPASS();
+    }
+}
+
+void ANetworkSession::syncSessions(NetworkThread *thread) {
+    if (android_atomic_acquire_load(&mSessionsGeneration)
+            == thread->mActiveSessionsGeneration) {
+        return;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    if (mNumThreads == 1) {
+        thread->mActiveSessions = mSessions;
+    } else {
+        thread->mActiveSessions.clear();
+
+        for (size_t i = 0; i < mSessions.size(); ++i) {
+            int32_t sessionID = mSessions.keyAt(i);
+
+            if (threadIndexOf(sessionID) == thread->index()) {
+                thread->mActiveSessions.add(sessionID, mSessions.valueAt(i));
+            }
+        }
     }
+
+    thread->mActiveSessionsGeneration = mSessionsGeneration;
 }
 
-void ANetworkSession::threadLoop() {
+void ANetworkSession::addSessionLocked(const sp<Session> &session) {
+    mSessions.add(session->sessionID(), session);
+    android_atomic_inc(&mSessionsGeneration);
+}
+
+void ANetworkSession::threadLoop(NetworkThread *thread) {
+    processCommands(thread);
+    syncSessions(thread);
+
+    const KeyedVector<int32_t, sp<Session> > &sessions =
+        thread->mActiveSessions;
+
     fd_set rs, ws;
     FD_ZERO(&rs);
     FD_ZERO(&ws);
 
-    FD_SET(mPipeFd[0], &rs);
-    int maxFd = mPipeFd[0];
+    FD_SET(thread->mWakeupFd, &rs);
+    int maxFd = thread->mWakeupFd;
 
-    {
-        Mutex::Autolock autoLock(mLock);
+    // Impaired datagrams that are due go out before we look at who
+    // wants to write, the next one due bounds how long we may sleep.
+    int64_t nextDueTimeUs = -1ll;
+    int64_t nowUs = mClock->nowUs();
 
-		// KeyedVector<int32_t, sp<Session> > mSessions
-        for (size_t i = 0; i < mSessions.size(); ++i) {
-            const sp<Session> &session = mSessions.valueAt(i);
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        int64_t dueTimeUs =
+            sessions.valueAt(i)->releaseImpairedDatagrams(nowUs);
 
-            int s = session->socket();  //ȡvectorṹбsocket
+        if (dueTimeUs >= 0ll
+                && (nextDueTimeUs < 0ll || dueTimeUs < nextDueTimeUs)) {
+            nextDueTimeUs = dueTimeUs;
+        }
+    }
+
+    {
+		// KeyedVector<int32_t, sp<Session> > mActiveSessions
+        for (size_t i = 0; i < sessions.size(); ++i) {
+            const sp<Session> &session = sessions.valueAt(i);
+
+            int s = session->socket();  //遍历并获取vector结构中保存的socket
 
             if (s < 0) {
                 continue;
             }
 
-            if (session->wantsToRead()) {  //жϵǰsession״̬ǷҪ
+            if (session->wantsToRead()) {  //判断当前session状态是否需要读
                 FD_SET(s, &rs);
                 if (s > maxFd) {
                     maxFd = s;
                 }
             }
 
-            if (session->wantsToWrite()) {  //жϵǰsession״̬ǷҪд
+            if (session->wantsToWrite()) {  //判断当前session状态是否需要写
                 FD_SET(s, &ws);
                 if (s > maxFd) {
                     maxFd = s;
@@ -1026,7 +2528,24 @@ void ANetworkSession::threadLoop() {
         }
     }
 
-    int res = select(maxFd + 1, &rs, &ws, NULL, NULL /* tv */);  //鿴Ƿsocketɶд
+    struct timeval tv;
+    struct timeval *timeout = NULL;
+
+    if (nextDueTimeUs >= 0ll) {
+        int64_t delayUs = nextDueTimeUs - nowUs;
+        if (delayUs < 0ll) {
+            delayUs = 0ll;
+        } else if (!mClock->isSystemClock()
+                && delayUs > kVirtualClockPollIntervalUs) {
+            delayUs = kVirtualClockPollIntervalUs;
+        }
+
+        tv.tv_sec = delayUs / 1000000ll;
+        tv.tv_usec = delayUs % 1000000ll;
+        timeout = &tv;
+    }
+
+    int res = select(maxFd + 1, &rs, &ws, NULL, timeout);  //阻塞查看是否有socket可读写
 
     if (res == 0) {
         return;
@@ -1041,27 +2560,25 @@ void ANetworkSession::threadLoop() {
         return;
     }
 
-    if (FD_ISSET(mPipeFd[0], &rs)) {
-        char c;
+    if (FD_ISSET(thread->mWakeupFd, &rs)) {
+        uint64_t count;
         ssize_t n;
         do {
-            n = read(mPipeFd[0], &c, 1);//ֻеֵܵʱѭ interrupt  
+            n = read(thread->mWakeupFd, &count, sizeof(count));//只有当eventfd中有数值时才跳出循环，即类中有其他函数调用了 interrupt函数
         } while (n < 0 && errno == EINTR);
 
         if (n < 0) {
-            ALOGW("Error reading from pipe (%s)", strerror(errno));
+            ALOGW("Error reading from eventfd (%s)", strerror(errno));
         }
 
         --res;
     }
 
     {
-        Mutex::Autolock autoLock(mLock);
-
         List<sp<Session> > sessionsToAdd;
 
-        for (size_t i = mSessions.size(); res > 0 && i-- > 0;) {   //res>0жǷsocketԴɽжд
-            const sp<Session> &session = mSessions.valueAt(i);
+        for (size_t i = sessions.size(); res > 0 && i-- > 0;) {   //res>0判断是否有socket资源可进行读或写
+            const sp<Session> &session = sessions.valueAt(i);
 
             int s = session->socket();
 
@@ -1075,11 +2592,11 @@ void ANetworkSession::threadLoop() {
 
             if (FD_ISSET(s, &rs)) {
                 if (session->isRTSPServer() || session->isTCPDatagramServer()) {
-					//ǰ״̬Session״̬ΪLISTENING_RTSPLISTENING_TCP_DGRAMSִв
+					//如果当前状态Session状态为LISTENING_RTSP或LISTENING_TCP_DGRAMS执行下列操作
                     struct sockaddr_in remoteAddr;
                     socklen_t remoteAddrLen = sizeof(remoteAddr);
 
-					//Ӵlisten״̬׽sĿͻȡǰһͻµsocketͨ  
+					//从处于listen状态的流套接字s的客户连接请求队列中取出排在最前的一个客户请求建立新的socket通道  
                     int clientSocket = accept(
                             s, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
 
@@ -1108,24 +2625,26 @@ void ANetworkSession::threadLoop() {
                             sp<Session> clientSession =
                                 // using socket sd as sessionID
                                 new Session(
-                                        mNextSessionID++,
+                                        allocateSessionID(
+                                            session->isRTSPServer()),
                                         Session::CONNECTED,
                                         clientSocket,
-										//RTSPӵıصַͻַԼ˿ڵϢͨAMessage͵Source
-                                        session->getNotificationMessage());
+										//把所建立RTSP连接的本地地址、客户地址以及端口等信息通过AMessage发送到Source端
+                                        session->getNotificationMessage(),
+                                        mClock);
 
                             clientSession->setIsRTSPConnection(
-                                    session->isRTSPServer());//mIsRTSPConnectionΪfalse  
+                                    session->isRTSPServer());//mIsRTSPConnection变量设为false  
 
-                            sessionsToAdd.push_back(clientSession);//Session뵽 sessionsToAddβ
+                            sessionsToAdd.push_back(clientSession);//将该Session加入到 sessionsToAdd队列尾部
                         }
                     } else {
                         ALOGE("accept returned error %d (%s)",
                               errno, strerror(errno));
                     }
                 } else {
-					//ڽUDPӻRTSPѽ״ҸsocketɶӦsocketϢ
-					//ͬʱͨAMessageʽSourceSinkݽ֪ͨӦ  
+					//在建立UDP连接或者RTSP连接已建立的状况且该socket可读，接收相应socket传来的信息，
+					//同时通过AMessage的形式与Source或Sink端做数据交换并且通知其做相应处理  
                     status_t err = session->readMore();
                     if (err != OK) {
                         ALOGE("readMore on socket %d failed w/ error %d (%s)",
@@ -1135,7 +2654,7 @@ void ANetworkSession::threadLoop() {
             }
 
             if (FD_ISSET(s, &ws)) {
-				//дSession,Ҹsocketǿд£UDPRTSPӵһ˷SouceSinkӦлõ
+				//对有写需求的Session,并且该socket是可写的情况下，向UDP或RTSP连接的另一端发送由Souce或Sink端相应请求中获得的数据
                 status_t err = session->writeMore();
                 if (err != OK) {
                     ALOGE("writeMore on socket %d failed w/ error %d (%s)",
@@ -1144,14 +2663,22 @@ void ANetworkSession::threadLoop() {
             }
         }
 
-        while (!sessionsToAdd.empty()) {
-            sp<Session> session = *sessionsToAdd.begin();
-            sessionsToAdd.erase(sessionsToAdd.begin());
+        if (!sessionsToAdd.empty()) {
+            Mutex::Autolock autoLock(mLock);
 
-			//˳Sessionvectorṹб  
-            mSessions.add(session->sessionID(), session);
+            while (!sessionsToAdd.empty()) {
+                sp<Session> session = *sessionsToAdd.begin();
+                sessionsToAdd.erase(sessionsToAdd.begin());
 
-            ALOGI("added clientSession %d", session->sessionID());
+                //按队列顺序把相关Session加入vector结构中保存
+                addSessionLocked(session);
+
+                ALOGI("added clientSession %d", session->sessionID());
+
+                if (threadIndexOf(session->sessionID()) != thread->index()) {
+                    interrupt(session->sessionID());
+                }
+            }
         }
     }
 }
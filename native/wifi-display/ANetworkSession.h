@@ -5,21 +5,28 @@
 
 #include <media/stagefright/foundation/ABase.h>
 #include <utils/KeyedVector.h>
-#include <utils/RefBase.h> //spwpʵһͨüķƶڵĻ
+#include <utils/RefBase.h> //结合sp和wp，实现了一套通过引用计数的方法来控制对象生命周期的机制
 #include <utils/Thread.h>
+#include <utils/Vector.h>
 
 #include <netinet/in.h>
 
 namespace android {
 
+struct ABuffer;
+struct AClock;
 struct AMessage;
 
 // Helper class to manage a number of live sockets (datagram and stream-based)
-// on a single thread. Clients are notified about activity through AMessages.
+// on one or more threads. Clients are notified about activity through
+// AMessages.
 struct ANetworkSession : public RefBase { 
 
-	//ReBase spwpʵһͨüķƶڵĻ
-    ANetworkSession();
+	//ReBase 结合sp和wp，实现了一套通过引用计数的方法来控制对象生命周期的机制
+
+    // With more than one thread, RTSP sessions are handled on the first
+    // one and all other sessions are spread across the remaining ones.
+    ANetworkSession(size_t numThreads = 1);
 
     status_t start();
     status_t stop();
@@ -42,9 +49,42 @@ struct ANetworkSession : public RefBase {
             const sp<AMessage> &notify,
             int32_t *sessionID);
 
+    // The session's network thread alone touches its socket, so the
+    // following wait for it to have carried them out. They must not be
+    // called while holding a lock a DatagramHandler takes.
+
+    // Hostnames other than dotted-quad addresses are resolved on a
+    // separate thread, the session is connected once that completes and
+    // reports kWhatConnected. Datagrams sent meanwhile are held until
+    // then. Failure to resolve is reported as kWhatError.
     status_t connectUDPSession(
             int32_t sessionID, const char *remoteHost, unsigned remotePort);
 
+    // Dissolves the association made by connectUDPSession, the session
+    // then receives datagrams from any peer again. Datagrams sent before it
+    // is connected anew are dropped, the session remains usable.
+    status_t disconnectUDPSession(int32_t sessionID);
+
+    // Multicast on datagram sessions. A sending session is connected to
+    // the group, this picks the interface its datagrams leave through, how
+    // many hops they may travel and whether members on this host see them
+    // too. A receiving session must be bound to the group's port before
+    // joining, INADDR_ANY lets the kernel pick the interface. Closing the
+    // session leaves the group.
+    status_t setMulticastSendOptions(
+            int32_t sessionID,
+            const struct in_addr &interfaceAddr,
+            int32_t ttl,
+            bool loopback);
+
+    status_t joinMulticastGroup(
+            int32_t sessionID,
+            const char *groupAddr,
+            const struct in_addr &interfaceAddr);
+
+    // True iff "host" is a dotted-quad address in 224.0.0.0/4.
+    static bool IsMulticastAddress(const char *host);
+
     // passive
     status_t createTCPDatagramSession(
             const struct in_addr &addr, unsigned port,
@@ -58,16 +98,100 @@ struct ANetworkSession : public RefBase {
             const sp<AMessage> &notify,
             int32_t *sessionID);
 
+    // The socket is closed by the time this returns, unless called from a
+    // DatagramHandler on the session's own network thread.
     status_t destroySession(int32_t sessionID);
 
+    // Queues the data for transmission by the network thread, never blocks
+    // on socket activity. Should a datagram session's send queue fill up,
+    // "droppable" datagrams are discarded to make room for the others.
     status_t sendRequest(
-            int32_t sessionID, const void *data, ssize_t size = -1);
+            int32_t sessionID, const void *data, ssize_t size = -1,
+            bool droppable = false);
+
+    // Sizes the kernel send and receive buffers of a datagram session so
+    // they can absorb "targetLatencyUs" worth of traffic at "bitrate"
+    // bits/sec. Should the kernel still report receive queue overflows,
+    // the receive buffer keeps growing up to kMaxSocketBufferSize or as
+    // far as the kernel allows, whichever is less.
+    status_t tuneSocketBuffers(
+            int32_t sessionID, int32_t bitrate, int64_t targetLatencyUs);
+
+    // Receives a datagram session's incoming datagrams right on its network
+    // thread instead of through kWhatDatagram notifications. Must never
+    // block, "data" belongs to the handler.
+    struct DatagramHandler : public RefBase {
+        DatagramHandler() {}
+
+        virtual void onDatagram(
+                int32_t sessionID,
+                const sp<ABuffer> &data,
+                int64_t arrivalTimeUs,
+                const struct sockaddr_in &fromAddr,
+                uint32_t numKernelDrops) = 0;
+
+    protected:
+        virtual ~DatagramHandler() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(DatagramHandler);
+    };
+
+    // Takes effect asynchronously, a NULL handler restores notifications.
+    status_t setDatagramHandler(
+            int32_t sessionID, const sp<DatagramHandler> &handler);
+
+    // Runs a datagram session's incoming or outgoing datagrams through a
+    // simulated link, see NetworkImpairment::ParseProfile for "spec".
+    // Sessions are seeded with their ID as well, so the same sequence of
+    // sessions and datagrams is impaired identically on every run.
+    // Takes effect asynchronously, replacing the previous impairment of
+    // the same direction. Datagram sessions only, INVALID_OPERATION
+    // otherwise.
+    status_t setImpairment(int32_t sessionID, const char *spec);
+
+    // Datagrams the simulated links lost or discarded on overflow and
+    // those they duplicated, and the bytes still in flight on them. Waits
+    // for the session's network thread like connectUDPSession.
+    status_t getImpairmentStats(
+            int32_t sessionID,
+            uint32_t *numDropped,
+            uint32_t *numDuplicated,
+            size_t *numBytesHeld);
+
+    // Total number of datagrams the kernel discarded on this session's
+    // socket because its receive queue was full.
+    status_t getKernelDropCount(int32_t sessionID, uint32_t *numDrops);
+
+    // Bytes a datagram session has queued up waiting for its socket to
+    // become writable, and the number of datagrams discarded because that
+    // would have exceeded kMaxOutDatagramsSize, droppable ones first.
+    status_t getSendQueueStats(
+            int32_t sessionID, size_t *numBytesQueued, uint32_t *numDropped);
+
+    static size_t ComputeSocketBufferSize(
+            int32_t bitrate, int64_t targetLatencyUs);
+
+    enum {
+        kDefaultSocketBufferSize    = 256 * 1024,
+        kMinSocketBufferSize        = 64 * 1024,
+        kMaxSocketBufferSize        = 4 * 1024 * 1024,
+        kMaxOutDatagramsSize        = 2 * 1024 * 1024,
+    };
+
+    enum {
+        kMaxNumThreads              = 8,
+    };
 
     enum NotificationReason {
         kWhatError,
+        // Carries "connectLatencyUs". Datagram sessions only report this
+        // if their remote host had to be resolved.
         kWhatConnected,
         kWhatClientConnected,
         kWhatData,
+        // Carries an optional "kernelDrops" field, the number of datagrams
+        // the kernel discarded on this socket since the previous one.
         kWhatDatagram,
         kWhatBinaryData,
     };
@@ -78,15 +202,31 @@ protected:
 private:
     struct NetworkThread;
     struct Session;
+    struct Command;
+    struct ResolverThread;
 
     Mutex mLock;
-    sp<Thread> mThread;
 
-    int32_t mNextSessionID;
+    size_t mNumThreads;
+
+    // Picked up on creation, stamps arrivals and paces impaired datagrams.
+    sp<AClock> mClock;
 
-    int mPipeFd[2];
+    // Guards mThreads. May be taken while holding mLock, never the other
+    // way round.
+    Mutex mThreadsLock;
+    Vector<sp<NetworkThread> > mThreads;
 
+    volatile int32_t mNextSessionID;
+
+    // Started on demand, guarded by mLock.
+    sp<ResolverThread> mResolver;
+
+    // Guarded by mLock, mSessionsGeneration changes along with mSessions.
+    // Each network thread keeps its own copy of the sessions it owns and
+    // performs all I/O on those without holding mLock.
     KeyedVector<int32_t, sp<Session> > mSessions;
+    volatile int32_t mSessionsGeneration;
 
     enum Mode {
         kModeCreateUDPSession,
@@ -104,8 +244,25 @@ private:
             const sp<AMessage> &notify,
             int32_t *sessionID);
 
-    void threadLoop();
-    void interrupt();
+    void threadLoop(NetworkThread *thread);
+    void interrupt(int32_t sessionID);
+
+    int32_t allocateSessionID(bool isControl);
+    size_t threadIndexOf(int32_t sessionID) const;
+
+    // The thread owning "sessionID", NULL unless started.
+    sp<NetworkThread> getThread(int32_t sessionID);
+
+    status_t removeSession(int32_t sessionID);
+
+    void postCommand(Command *cmd);
+    status_t runCommand(Command *cmd);
+    void processCommands(NetworkThread *thread);
+    void executeCommand(const sp<Session> &session, Command *cmd);
+    void syncSessions(NetworkThread *thread);
+    void addSessionLocked(const sp<Session> &session);
+
+    void resolveAsync(int32_t sessionID, const char *host, unsigned port);
 
     static status_t MakeSocketNonBlocking(int s);
 
@@ -3,21 +3,27 @@ LOCAL_PATH:= $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
+        AClock.cpp                      \
         ANetworkSession.cpp             \
+        AudioFormats.cpp                \
+        NetworkImpairment.cpp           \
         Parameters.cpp                  \
         ParsedMessage.cpp               \
         sink/LinearRegression.cpp       \
+        sink/PathMerger.cpp             \
         sink/RTPSink.cpp                \
         sink/TunnelRenderer.cpp         \
         sink/WifiDisplaySink.cpp        \
         source/Converter.cpp            \
         source/MediaPuller.cpp          \
+        source/PCMKernels.cpp           \
         source/PlaybackSession.cpp      \
         source/RepeaterSource.cpp       \
         source/Sender.cpp               \
         source/TSPacketizer.cpp         \
         source/WifiDisplaySource.cpp    \
         TimeSeries.cpp                  \
+        VideoFormats.cpp                \
 
 LOCAL_C_INCLUDES:= \
         $(TOP)/frameworks/av/media/libstagefright \
@@ -83,3 +89,93 @@ LOCAL_MODULE:= udptest
 LOCAL_MODULE_TAGS := debug
 
 # include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        nsbench.cpp                 \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= nsbench
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        rtpbench.cpp                \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= rtpbench
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        pcmbench.cpp                \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= pcmbench
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        rtspbench.cpp               \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= rtspbench
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        soakbench.cpp               \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= soakbench
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
@@ -0,0 +1,114 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "AudioFormats"
+#include <utils/Log.h>
+
+#include "AudioFormats.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace android {
+
+static const char *kCodecNames[] = { "LPCM", "AAC", "AC3" };
+
+AudioFormats::AudioFormats() {
+    disableAll();
+}
+
+void AudioFormats::disableAll() {
+    for (size_t i = 0; i < kNumCodecTypes; ++i) {
+        mModes[i] = 0;
+        mLatency[i] = 0;
+    }
+}
+
+void AudioFormats::setModes(CodecType codec, uint32_t modes, uint8_t latency) {
+    CHECK_LT(codec, kNumCodecTypes);
+
+    mModes[codec] = modes;
+    mLatency[codec] = latency;
+}
+
+uint32_t AudioFormats::getModes(CodecType codec) const {
+    CHECK_LT(codec, kNumCodecTypes);
+
+    return mModes[codec];
+}
+
+// sink_audio_list := ("LPCM"|"AAC"|"AC3" HEXDIGIT*8 HEXDIGIT*2)
+//                       (", " sink_audio_list)*
+bool AudioFormats::parseFormatSpec(const char *spec) {
+    disableAll();
+
+    if (!strcmp(spec, "none")) {
+        return true;
+    }
+
+    const char *s = spec;
+    for (;;) {
+        while (isspace(*s)) {
+            ++s;
+        }
+
+        ssize_t codec = -1;
+        size_t nameLen = 0;
+        for (size_t i = 0; i < kNumCodecTypes; ++i) {
+            nameLen = strlen(kCodecNames[i]);
+
+            if (!strncmp(s, kCodecNames[i], nameLen) && s[nameLen] == ' ') {
+                codec = i;
+                break;
+            }
+        }
+
+        unsigned modes, latency;
+        if (codec < 0
+                || sscanf(&s[nameLen + 1], "%08x %02x", &modes, &latency) != 2) {
+            ALOGE("malformed wfd_audio_codecs: '%s'", spec);
+
+            disableAll();
+            return false;
+        }
+
+        mModes[codec] = modes;
+        mLatency[codec] = latency;
+
+        const char *commaPos = strchr(s, ',');
+        if (commaPos == NULL) {
+            break;
+        }
+
+        s = commaPos + 1;
+    }
+
+    return true;
+}
+
+AString AudioFormats::getFormatSpec() const {
+    AString spec;
+
+    for (size_t i = 0; i < kNumCodecTypes; ++i) {
+        if (mModes[i] == 0) {
+            continue;
+        }
+
+        if (!spec.empty()) {
+            spec.append(", ");
+        }
+
+        spec.append(
+                StringPrintf(
+                    "%s %08x %02x", kCodecNames[i], mModes[i], mLatency[i]));
+    }
+
+    if (spec.empty()) {
+        spec = "none";
+    }
+
+    return spec;
+}
+
+}  // namespace android
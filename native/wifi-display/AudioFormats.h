@@ -0,0 +1,53 @@
+#ifndef AUDIO_FORMATS_H_
+
+#define AUDIO_FORMATS_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <media/stagefright/foundation/AString.h>
+
+#include <stdint.h>
+
+namespace android {
+
+// Models the "wfd_audio_codecs" parameter, the sampling rate/channel
+// combinations supported for each codec as a bitmap (WFD 6.1.2).
+struct AudioFormats {
+    AudioFormats();
+
+    enum CodecType {
+        CODEC_LPCM,
+        CODEC_AAC,
+        CODEC_AC3,
+        kNumCodecTypes,
+    };
+
+    enum {
+        // LPCM
+        kModeLPCM44100Stereo    = 1,
+        kModeLPCM48000Stereo    = 2,
+
+        // AAC and AC3, all at 48kHz
+        kModeStereo             = 1,
+        kMode4Channels          = 2,
+        kMode6Channels          = 4,
+        kMode8Channels          = 8,
+    };
+
+    void disableAll();
+
+    void setModes(CodecType codec, uint32_t modes, uint8_t latency = 0);
+    uint32_t getModes(CodecType codec) const;
+
+    bool parseFormatSpec(const char *spec);
+    AString getFormatSpec() const;
+
+private:
+    uint32_t mModes[kNumCodecTypes];
+    uint8_t mLatency[kNumCodecTypes];
+
+    DISALLOW_EVIL_CONSTRUCTORS(AudioFormats);
+};
+
+}  // namespace android
+
+#endif  // AUDIO_FORMATS_H_
@@ -0,0 +1,301 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "NetworkImpairment"
+#include <utils/Log.h>
+
+#include "NetworkImpairment.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AString.h>
+#include <media/stagefright/MediaErrors.h>
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace android {
+
+static const size_t kDefaultQueueLimit = 256 * 1024;
+
+// Exponential jitter is cut off at this multiple of its mean.
+static const double kMaxJitterFactor = 10.0;
+
+NetworkImpairment::Profile::Profile()
+    : mOutgoing(false),
+      mSeed(1),
+      mGoodToBad(0.0),
+      mBadToGood(1.0),
+      mGoodLoss(0.0),
+      mBadLoss(1.0),
+      mDuplicate(0.0),
+      mDelayUs(0ll),
+      mJitterUs(0ll),
+      mJitterDist(kJitterUniform),
+      mRateBps(0),
+      mQueueLimit(kDefaultQueueLimit) {
+}
+
+static bool ParsePercentage(const char *s, double *x) {
+    char *end;
+    double val = strtod(s, &end);
+
+    if (end == s || *end != '\0' || val < 0.0 || val > 100.0) {
+        return false;
+    }
+
+    *x = val / 100.0;
+    return true;
+}
+
+static bool ParseUnsigned(const char *s, unsigned long *x) {
+    char *end;
+    unsigned long val = strtoul(s, &end, 10);
+
+    if (end == s || *end != '\0') {
+        return false;
+    }
+
+    *x = val;
+    return true;
+}
+
+// static
+status_t NetworkImpairment::ParseProfile(const char *spec, Profile *profile) {
+    *profile = Profile();
+
+    AString s = spec;
+    size_t start = 0;
+    while (start < s.size()) {
+        ssize_t commaPos = s.find(",", start);
+        size_t end = (commaPos < 0) ? s.size() : commaPos;
+
+        AString pair(s, start, end - start);
+        start = end + 1;
+
+        pair.trim();
+        if (pair.empty()) {
+            continue;
+        }
+
+        ssize_t equalsPos = pair.find("=");
+        if (equalsPos < 0) {
+            ALOGE("malformed impairment '%s'", pair.c_str());
+            return ERROR_MALFORMED;
+        }
+
+        AString key(pair, 0, equalsPos);
+        AString value(pair, equalsPos + 1, pair.size() - equalsPos - 1);
+        key.trim();
+        value.trim();
+
+        const char *val = value.c_str();
+        unsigned long x = 0;
+
+        bool ok;
+        if (key == "dir") {
+            ok = (value == "in" || value == "out");
+            profile->mOutgoing = (value == "out");
+        } else if (key == "seed") {
+            ok = ParseUnsigned(val, &x);
+            profile->mSeed = x;
+        } else if (key == "loss") {
+            ok = ParsePercentage(val, &profile->mGoodLoss);
+        } else if (key == "p") {
+            ok = ParsePercentage(val, &profile->mGoodToBad);
+        } else if (key == "r") {
+            ok = ParsePercentage(val, &profile->mBadToGood);
+        } else if (key == "burst-loss") {
+            ok = ParsePercentage(val, &profile->mBadLoss);
+        } else if (key == "dup") {
+            ok = ParsePercentage(val, &profile->mDuplicate);
+        } else if (key == "delay") {
+            ok = ParseUnsigned(val, &x);
+            profile->mDelayUs = x * 1000ll;
+        } else if (key == "jitter") {
+            ok = ParseUnsigned(val, &x);
+            profile->mJitterUs = x * 1000ll;
+        } else if (key == "dist") {
+            ok = (value == "uniform" || value == "exp");
+            profile->mJitterDist =
+                (value == "exp") ? kJitterExponential : kJitterUniform;
+        } else if (key == "rate") {
+            ok = ParseUnsigned(val, &x) && x <= 0x7fffffff / 1000;
+            profile->mRateBps = x * 1000;
+        } else if (key == "queue") {
+            ok = ParseUnsigned(val, &x);
+            profile->mQueueLimit = x;
+        } else {
+            ALOGE("unknown impairment '%s'", key.c_str());
+            return ERROR_UNSUPPORTED;
+        }
+
+        if (!ok) {
+            ALOGE("invalid value for impairment '%s'", pair.c_str());
+            return ERROR_MALFORMED;
+        }
+    }
+
+    return OK;
+}
+
+NetworkImpairment::NetworkImpairment(const Profile &profile, uint32_t stream)
+    : mProfile(profile),
+      mRandomState(((uint64_t)profile.mSeed << 32) | stream),
+      mBadState(false),
+      mLinkBusyUntilUs(-1ll) {
+    memset(&mStats, 0, sizeof(mStats));
+
+    // Get away from seeds that only differ in a few bits.
+    for (size_t i = 0; i < 4; ++i) {
+        random();
+    }
+}
+
+NetworkImpairment::~NetworkImpairment() {
+}
+
+bool NetworkImpairment::isOutgoing() const {
+    return mProfile.mOutgoing;
+}
+
+// Uniform in [0, 1), taken from the upper bits of a 64-bit LCG.
+double NetworkImpairment::random() {
+    mRandomState =
+        mRandomState * 6364136223846793005ull + 1442695040888963407ull;
+
+    return (mRandomState >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int64_t NetworkImpairment::randomJitterUs() {
+    double u = random();
+
+    if (mProfile.mJitterDist == kJitterUniform) {
+        // Spread over [0, 2 * mean).
+        return (int64_t)(u * 2.0 * mProfile.mJitterUs);
+    }
+
+    double jitterUs = -mProfile.mJitterUs * log(1.0 - u);
+    if (jitterUs > kMaxJitterFactor * mProfile.mJitterUs) {
+        jitterUs = kMaxJitterFactor * mProfile.mJitterUs;
+    }
+
+    return (int64_t)jitterUs;
+}
+
+void NetworkImpairment::queue(
+        const sp<ABuffer> &buffer,
+        const struct sockaddr_in &addr,
+        int64_t nowUs) {
+    ++mStats.mNumQueued;
+
+    // Always the same draws, see above.
+    double transition = random();
+    double loss = random();
+    double duplicate = random();
+    int64_t jitterUs[2];
+    jitterUs[0] = randomJitterUs();
+    jitterUs[1] = randomJitterUs();
+
+    if (mBadState) {
+        mBadState = !(transition < mProfile.mBadToGood);
+    } else {
+        mBadState = transition < mProfile.mGoodToBad;
+    }
+
+    if (loss < (mBadState ? mProfile.mBadLoss : mProfile.mGoodLoss)) {
+        ++mStats.mNumLost;
+        return;
+    }
+
+    size_t numCopies = (duplicate < mProfile.mDuplicate) ? 2 : 1;
+
+    for (size_t i = 0; i < numCopies; ++i) {
+        int64_t departureTimeUs = nowUs;
+
+        if (mProfile.mRateBps > 0) {
+            int64_t startTimeUs =
+                (mLinkBusyUntilUs > nowUs) ? mLinkBusyUntilUs : nowUs;
+
+            size_t backlog =
+                (startTimeUs - nowUs) * mProfile.mRateBps / 8000000ll;
+
+            if (backlog + buffer->size() > mProfile.mQueueLimit) {
+                ++mStats.mNumOverflowed;
+                continue;
+            }
+
+            departureTimeUs = startTimeUs
+                + buffer->size() * 8000000ll / mProfile.mRateBps;
+
+            mLinkBusyUntilUs = departureTimeUs;
+        }
+
+        sp<ABuffer> copy = buffer;
+        if (i > 0) {
+            copy = new ABuffer(buffer->size());
+            memcpy(copy->data(), buffer->data(), buffer->size());
+
+            ++mStats.mNumDuplicated;
+        }
+
+        hold(copy, addr, departureTimeUs + mProfile.mDelayUs + jitterUs[i]);
+    }
+}
+
+void NetworkImpairment::hold(
+        const sp<ABuffer> &buffer,
+        const struct sockaddr_in &addr,
+        int64_t dueTimeUs) {
+    Entry entry;
+    entry.mDueTimeUs = dueTimeUs;
+    entry.mBuffer = buffer;
+    entry.mAddr = addr;
+
+    List<Entry>::iterator it = mEntries.end();
+    while (it != mEntries.begin()) {
+        --it;
+
+        if ((*it).mDueTimeUs <= dueTimeUs) {
+            ++it;
+            break;
+        }
+    }
+
+    mEntries.insert(it, entry);
+
+    mStats.mNumBytesHeld += buffer->size();
+    if (mStats.mNumBytesHeld > mStats.mMaxBytesHeld) {
+        mStats.mMaxBytesHeld = mStats.mNumBytesHeld;
+    }
+}
+
+sp<ABuffer> NetworkImpairment::dequeue(
+        int64_t nowUs, struct sockaddr_in *addr) {
+    if (mEntries.empty() || (*mEntries.begin()).mDueTimeUs > nowUs) {
+        return NULL;
+    }
+
+    const Entry &entry = *mEntries.begin();
+
+    sp<ABuffer> buffer = entry.mBuffer;
+    *addr = entry.mAddr;
+
+    mStats.mNumBytesHeld -= buffer->size();
+    mEntries.erase(mEntries.begin());
+
+    return buffer;
+}
+
+int64_t NetworkImpairment::nextDueTimeUs() const {
+    if (mEntries.empty()) {
+        return -1ll;
+    }
+
+    return (*mEntries.begin()).mDueTimeUs;
+}
+
+void NetworkImpairment::getStats(Stats *stats) const {
+    *stats = mStats;
+}
+
+}  // namespace android
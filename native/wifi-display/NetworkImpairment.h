@@ -0,0 +1,134 @@
+#ifndef NETWORK_IMPAIRMENT_H_
+
+#define NETWORK_IMPAIRMENT_H_
+
+#include <sys/types.h>
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/Errors.h>
+#include <utils/List.h>
+#include <utils/RefBase.h>
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Simulates a lossy, slow and jittery link in front of a datagram
+// session, for tests and benchmarks. All randomness comes from a
+// generator seeded from the profile, and each datagram draws the same
+// number of values whatever happens to it, so a given sequence of
+// datagrams meets the same fate on every run and changing one parameter
+// leaves the other decisions alone. The current time is passed in rather
+// than read. Not thread-safe.
+struct NetworkImpairment {
+    enum JitterDistribution {
+        kJitterUniform,
+        kJitterExponential,
+    };
+
+    struct Profile {
+        Profile();
+
+        // Impair what the session sends rather than what it receives.
+        bool mOutgoing;
+
+        uint32_t mSeed;
+
+        // Gilbert-Elliott loss, probabilities are per datagram. The link
+        // goes bad with mGoodToBad and recovers with mBadToGood, each
+        // state loses datagrams with its own probability.
+        double mGoodToBad;
+        double mBadToGood;
+        double mGoodLoss;
+        double mBadLoss;
+
+        double mDuplicate;
+
+        // Every datagram is held for mDelayUs plus a random amount
+        // following mJitterDist, whose mean is mJitterUs. Enough jitter
+        // reorders datagrams.
+        int64_t mDelayUs;
+        int64_t mJitterUs;
+        JitterDistribution mJitterDist;
+
+        // Bits/sec the link drains at, 0 for no limit. Datagrams that
+        // would grow its backlog beyond mQueueLimit bytes are dropped.
+        int32_t mRateBps;
+        size_t mQueueLimit;
+    };
+
+    // "spec" is a comma-separated list of key=value pairs, any of
+    //   dir=in|out   seed=N   loss=%   p=%   r=%   burst-loss=%   dup=%
+    //   delay=ms   jitter=ms   dist=uniform|exp   rate=kbps   queue=bytes
+    // where "loss" is the loss in the good state, "p" and "r" the chances
+    // of entering and leaving the bad one and "burst-loss" the loss in it.
+    static status_t ParseProfile(const char *spec, Profile *profile);
+
+    // "stream" tells apart impairments sharing a profile, its generator
+    // is seeded from both.
+    NetworkImpairment(const Profile &profile, uint32_t stream);
+    ~NetworkImpairment();
+
+    bool isOutgoing() const;
+
+    // "buffer" enters the link at "nowUs", "addr" travels along with it.
+    void queue(
+            const sp<ABuffer> &buffer,
+            const struct sockaddr_in &addr,
+            int64_t nowUs);
+
+    // Returns the next datagram that has made it across by "nowUs", if any.
+    sp<ABuffer> dequeue(int64_t nowUs, struct sockaddr_in *addr);
+
+    // When the next datagram comes out, -1 if none are in flight.
+    int64_t nextDueTimeUs() const;
+
+    struct Stats {
+        uint32_t mNumQueued;
+        uint32_t mNumLost;
+        uint32_t mNumOverflowed;
+        uint32_t mNumDuplicated;
+
+        // Bytes in flight, now and at most.
+        size_t mNumBytesHeld;
+        size_t mMaxBytesHeld;
+    };
+
+    void getStats(Stats *stats) const;
+
+private:
+    struct Entry {
+        int64_t mDueTimeUs;
+        sp<ABuffer> mBuffer;
+        struct sockaddr_in mAddr;
+    };
+
+    Profile mProfile;
+    uint64_t mRandomState;
+
+    bool mBadState;
+
+    // When the link will have drained everything queued so far.
+    int64_t mLinkBusyUntilUs;
+
+    // Sorted by due time, in order of arrival among equals.
+    List<Entry> mEntries;
+
+    Stats mStats;
+
+    double random();
+    int64_t randomJitterUs();
+
+    void hold(
+            const sp<ABuffer> &buffer,
+            const struct sockaddr_in &addr,
+            int64_t dueTimeUs);
+
+    DISALLOW_EVIL_CONSTRUCTORS(NetworkImpairment);
+};
+
+}  // namespace android
+
+#endif  // NETWORK_IMPAIRMENT_H_
@@ -3,11 +3,184 @@
 #include "ParsedMessage.h"
 
 #include <ctype.h>
+#include <string.h>
+#include <strings.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 
 namespace android {
 
+static const char *kWellKnownHeaderNames[] = {
+    "cseq",
+    "session",
+    "content-length",
+    "transport",
+};
+
+static bool IsLineEnd(const char *data, size_t size, size_t offset) {
+    return offset + 1 < size && data[offset] == '\r' && data[offset + 1] == '\n';
+}
+
+static bool MatchesKey(const char *key, size_t keyLength, const char *name) {
+    return !strncasecmp(key, name, keyLength) && name[keyLength] == '\0';
+}
+
+static void Trim(const char *data, size_t *offset, size_t *length) {
+    while (*length > 0 && isspace(data[*offset])) {
+        ++*offset;
+        --*length;
+    }
+
+    while (*length > 0 && isspace(data[*offset + *length - 1])) {
+        --*length;
+    }
+}
+
+// Splits the header line at "data" into its trimmed key and raw value,
+// returns false if there is no colon.
+static bool SplitHeaderLine(
+        const char *data, size_t lineOffset, size_t lineLength,
+        size_t *keyOffset, size_t *keyLength,
+        size_t *valueOffset, size_t *valueLength) {
+    const char *colonPos =
+        (const char *)memchr(&data[lineOffset], ':', lineLength);
+
+    if (colonPos == NULL) {
+        return false;
+    }
+
+    *keyOffset = lineOffset;
+    *keyLength = colonPos - &data[lineOffset];
+    Trim(data, keyOffset, keyLength);
+
+    *valueOffset = colonPos - data + 1;
+    *valueLength = lineOffset + lineLength - *valueOffset;
+
+    return true;
+}
+
+// A missing or malformed content-length means there is no content.
+static size_t ParseContentLength(const char *value, size_t length) {
+    char tmp[16];
+    if (length == 0 || length >= sizeof(tmp)) {
+        return 0;
+    }
+
+    memcpy(tmp, value, length);
+    tmp[length] = '\0';
+
+    char *end;
+    long contentLength = strtol(tmp, &end, 10);
+
+    if (*end != '\0' || contentLength < 0) {
+        return 0;
+    }
+
+    return contentLength;
+}
+
+static size_t ParseContentLength(const AString &value) {
+    size_t offset = 0;
+    size_t length = value.size();
+    Trim(value.c_str(), &offset, &length);
+
+    return ParseContentLength(&value.c_str()[offset], length);
+}
+
+// The value of the last content-length header among the header lines
+// from "offset" up to the empty line at "end", folded ones included.
+// Scanner::scan() and parse() both go by it, so they always agree on
+// where a message ends.
+static size_t FindContentLength(
+        const char *data, size_t offset, size_t end) {
+    size_t contentLength = 0;
+
+    // Whether the most recent header is a content-length, continuation
+    // lines extend its value just like parse() has them extend any other.
+    bool inContentLength = false;
+    AString value;
+
+    while (offset < end) {
+        size_t lineEndOffset = offset;
+        while (!IsLineEnd(data, end + 2, lineEndOffset)) {
+            ++lineEndOffset;
+        }
+
+        size_t lineLength = lineEndOffset - offset;
+
+        size_t keyOffset, keyLength, valueOffset, valueLength;
+        if (data[offset] == ' ' || data[offset] == '\t') {
+            if (inContentLength) {
+                value.append(&data[offset], lineLength);
+            }
+        } else if (SplitHeaderLine(
+                    data, offset, lineLength,
+                    &keyOffset, &keyLength, &valueOffset, &valueLength)) {
+            if (inContentLength) {
+                contentLength = ParseContentLength(value);
+            }
+
+            inContentLength = MatchesKey(
+                    &data[keyOffset], keyLength, "content-length");
+
+            if (inContentLength) {
+                value.setTo(&data[valueOffset], valueLength);
+            }
+        }
+
+        offset = lineEndOffset + 2;
+    }
+
+    if (inContentLength) {
+        contentLength = ParseContentLength(value);
+    }
+
+    return contentLength;
+}
+
+ParsedMessage::Scanner::Scanner() {
+    reset();
+}
+
+void ParsedMessage::Scanner::reset() {
+    mOffset = 0;
+    mHeaderLength = 0;
+    mContentLength = 0;
+}
+
+ssize_t ParsedMessage::Scanner::scan(const char *data, size_t size) {
+    if (mHeaderLength == 0) {
+        // Everything before mOffset is known not to start the empty line
+        // terminating the headers.
+        size_t offset = mOffset;
+        while (offset + 4 <= size && memcmp(&data[offset], "\r\n\r\n", 4)) {
+            ++offset;
+        }
+
+        if (offset + 4 > size) {
+            mOffset = offset;
+            return -1;
+        }
+
+        mHeaderLength = offset + 4;
+
+        // Skip the request/status line.
+        size_t lineOffset = 0;
+        while (!IsLineEnd(data, size, lineOffset)) {
+            ++lineOffset;
+        }
+
+        mContentLength =
+            FindContentLength(data, lineOffset + 2, mHeaderLength - 2);
+    }
+
+    size_t totalLength = mHeaderLength + mContentLength;
+
+    return size < totalLength ? -1 : (ssize_t)totalLength;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 // static
 sp<ParsedMessage> ParsedMessage::Parse(
         const char *data, size_t size, bool noMoreData, size_t *length) {
@@ -23,17 +196,58 @@ sp<ParsedMessage> ParsedMessage::Parse(
     return msg;
 }
 
-ParsedMessage::ParsedMessage() {
+ParsedMessage::ParsedMessage()
+    : mRequestLineLength(0),
+      mContentOffset(0) {
+    for (size_t i = 0; i < kNumWellKnownHeaders; ++i) {
+        mWellKnownHeaders[i] = -1;
+    }
 }
 
 ParsedMessage::~ParsedMessage() {
 }
 
+// static
+ssize_t ParsedMessage::WellKnownHeaderIndex(
+        const char *key, size_t keyLength) {
+    for (size_t i = 0; i < kNumWellKnownHeaders; ++i) {
+        if (MatchesKey(key, keyLength, kWellKnownHeaderNames[i])) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+ssize_t ParsedMessage::findHeader(const char *name) const {
+    size_t nameLength = strlen(name);
+
+    ssize_t wellKnownIndex = WellKnownHeaderIndex(name, nameLength);
+    if (wellKnownIndex >= 0) {
+        return mWellKnownHeaders[wellKnownIndex];
+    }
+
+    // Later headers replace earlier ones of the same name.
+    for (size_t i = mHeaders.size(); i-- > 0;) {
+        const Header &header = mHeaders.itemAt(i);
+
+        if (header.mKeyLength == nameLength
+                && !strncasecmp(
+                    &mData.c_str()[header.mKeyOffset], name, nameLength)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
 bool ParsedMessage::findString(const char *name, AString *value) const {
-    AString key = name;
-    key.tolower();
+    if (!strcmp(name, "_")) {
+        value->setTo(mData.c_str(), mRequestLineLength);
+        return true;
+    }
 
-    ssize_t index = mDict.indexOfKey(key);
+    ssize_t index = findHeader(name);
 
     if (index < 0) {
         value->clear();
@@ -41,7 +255,9 @@ bool ParsedMessage::findString(const char *name, AString *value) const {
         return false;
     }
 
-    *value = mDict.valueAt(index);
+    const Header &header = mHeaders.itemAt(index);
+    value->setTo(&mData.c_str()[header.mValueOffset], header.mValueLength);
+
     return true;
 }
 
@@ -64,7 +280,7 @@ bool ParsedMessage::findInt32(const char *name, int32_t *value) const {
 }
 
 const char *ParsedMessage::getContent() const {
-    return mContent.c_str();
+    return &mData.c_str()[mContentOffset];
 }
 
 ssize_t ParsedMessage::parse(const char *data, size_t size, bool noMoreData) {
@@ -72,10 +288,15 @@ ssize_t ParsedMessage::parse(const char *data, size_t size, bool noMoreData) {
         return -1;
     }
 
-    ssize_t lastDictIndex = -1;
+    // Folded header values are the only ones that cannot simply point into
+    // the message, they're reassembled here and appended to mData later.
+    AString folded;
+    Vector<size_t> foldedHeaders;
+
+    ssize_t lastHeaderIndex = -1;
 
     size_t offset = 0;
-    while (offset < size) {
+    for (;;) {
         size_t lineEndOffset = offset;
         while (lineEndOffset + 1 < size
                 && (data[lineEndOffset] != '\r'
@@ -87,61 +308,64 @@ ssize_t ParsedMessage::parse(const char *data, size_t size, bool noMoreData) {
             return -1;
         }
 
-        AString line(&data[offset], lineEndOffset - offset);
+        size_t lineLength = lineEndOffset - offset;
 
         if (offset == 0) {
             // Special handling for the request/status line.
 
-            mDict.add(AString("_"), line);
+            mRequestLineLength = lineLength;
             offset = lineEndOffset + 2;
 
             continue;
         }
 
-        if (lineEndOffset == offset) {
+        if (lineLength == 0) {
             offset += 2;
             break;
         }
 
-        if (line.c_str()[0] == ' ' || line.c_str()[0] == '\t') {
+        if (data[offset] == ' ' || data[offset] == '\t') {
             // Support for folded header values.
 
-            if (lastDictIndex >= 0) {
+            if (lastHeaderIndex >= 0) {
                 // Otherwise it's malformed since the first header line
                 // cannot continue anything...
 
-                AString &value = mDict.editValueAt(lastDictIndex);
-                value.append(line);
+                Header &header = mHeaders.editItemAt(lastHeaderIndex);
+
+                if (foldedHeaders.isEmpty()
+                        || foldedHeaders.top() != (size_t)lastHeaderIndex) {
+                    size_t foldedOffset = folded.size();
+                    folded.append(
+                            &data[header.mValueOffset], header.mValueLength);
+
+                    header.mValueOffset = foldedOffset;
+                    foldedHeaders.push(lastHeaderIndex);
+                }
+
+                folded.append(&data[offset], lineLength);
+                header.mValueLength += lineLength;
             }
 
             offset = lineEndOffset + 2;
             continue;
         }
 
-        ssize_t colonPos = line.find(":");
-        if (colonPos >= 0) {
-            AString key(line, 0, colonPos);
-            key.trim();
-            key.tolower();
-
-            line.erase(0, colonPos + 1);
-
-            lastDictIndex = mDict.add(key, line);
+        Header header;
+        if (SplitHeaderLine(
+                    data, offset, lineLength,
+                    &header.mKeyOffset, &header.mKeyLength,
+                    &header.mValueOffset, &header.mValueLength)) {
+            lastHeaderIndex = mHeaders.add(header);
         }
 
         offset = lineEndOffset + 2;
     }
 
-    for (size_t i = 0; i < mDict.size(); ++i) {
-        mDict.editValueAt(i).trim();
-    }
-
     // Found the end of headers.
 
-    int32_t contentLength;
-    if (!findInt32("content-length", &contentLength) || contentLength < 0) {
-        contentLength = 0;
-    }
+    size_t contentLength =
+        FindContentLength(data, mRequestLineLength + 2, offset - 2);
 
     size_t totalLength = offset + contentLength;
 
@@ -149,7 +373,34 @@ ssize_t ParsedMessage::parse(const char *data, size_t size, bool noMoreData) {
         return -1;
     }
 
-    mContent.setTo(&data[offset], contentLength);
+    // The only copy made of the message.
+    mData.setTo(data, totalLength);
+    mContentOffset = offset;
+
+    if (!foldedHeaders.isEmpty()) {
+        // Keeps the content NUL-terminated.
+        mData.append("", 1);
+
+        size_t foldedBase = mData.size();
+        mData.append(folded);
+
+        for (size_t i = 0; i < foldedHeaders.size(); ++i) {
+            mHeaders.editItemAt(foldedHeaders.itemAt(i)).mValueOffset +=
+                foldedBase;
+        }
+    }
+
+    for (size_t i = 0; i < mHeaders.size(); ++i) {
+        Header &header = mHeaders.editItemAt(i);
+        Trim(mData.c_str(), &header.mValueOffset, &header.mValueLength);
+
+        ssize_t wellKnownIndex = WellKnownHeaderIndex(
+                &mData.c_str()[header.mKeyOffset], header.mKeyLength);
+
+        if (wellKnownIndex >= 0) {
+            mWellKnownHeaders[wellKnownIndex] = i;
+        }
+    }
 
     return totalLength;
 }
@@ -191,27 +442,21 @@ bool ParsedMessage::getStatusCode(int32_t *statusCode) const {
 }
 
 AString ParsedMessage::debugString() const {
-    AString line;
-    CHECK(findString("_", &line));
+    AString line(mData.c_str(), mRequestLineLength);
 
     line.append("\n");
 
-    for (size_t i = 0; i < mDict.size(); ++i) {
-        const AString &key = mDict.keyAt(i);
-        const AString &value = mDict.valueAt(i);
-
-        if (key == AString("_")) {
-            continue;
-        }
+    for (size_t i = 0; i < mHeaders.size(); ++i) {
+        const Header &header = mHeaders.itemAt(i);
 
-        line.append(key);
+        line.append(&mData.c_str()[header.mKeyOffset], header.mKeyLength);
         line.append(": ");
-        line.append(value);
+        line.append(&mData.c_str()[header.mValueOffset], header.mValueLength);
         line.append("\n");
     }
 
     line.append("\n");
-    line.append(mContent);
+    line.append(getContent());
 
     return line;
 }
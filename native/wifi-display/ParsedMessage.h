@@ -1,14 +1,32 @@
-
 #include <media/stagefright/foundation/ABase.h>
 #include <media/stagefright/foundation/AString.h>
-#include <utils/KeyedVector.h>
 #include <utils/RefBase.h>
+#include <utils/Vector.h>
 
 namespace android {
 
 // Encapsulates an "HTTP/RTSP style" response, i.e. a status line,
 // key/value pairs making up the headers and an optional body/content.
 struct ParsedMessage : public RefBase {
+    // Locates the end of the message at the start of a receive buffer
+    // that is being filled by successive reads. Only the bytes appended
+    // since the previous call are looked at, reset() must be called once
+    // the message has been consumed.
+    struct Scanner {
+        Scanner();
+
+        void reset();
+
+        // Returns the total length of the message starting at "data" once
+        // all of it has arrived, -1 otherwise.
+        ssize_t scan(const char *data, size_t size);
+
+    private:
+        size_t mOffset;
+        size_t mHeaderLength;
+        size_t mContentLength;
+    };
+
     static sp<ParsedMessage> Parse(
             const char *data, size_t size, bool noMoreData, size_t *length);
 
@@ -32,14 +50,44 @@ protected:
     virtual ~ParsedMessage();
 
 private:
-    KeyedVector<AString, AString> mDict;
-    AString mContent;
+    // Key and value of a header line, as offsets into mData.
+    struct Header {
+        size_t mKeyOffset;
+        size_t mKeyLength;
+        size_t mValueOffset;
+        size_t mValueLength;
+    };
+
+    // Headers every RTSP exchange looks up, their index into mHeaders is
+    // recorded while parsing.
+    enum WellKnownHeader {
+        kHeaderCSeq,
+        kHeaderSession,
+        kHeaderContentLength,
+        kHeaderTransport,
+        kNumWellKnownHeaders,
+    };
+
+    // The message as received, header values are trimmed and unfolded
+    // in place.
+    AString mData;
+
+    size_t mRequestLineLength;
+    Vector<Header> mHeaders;
+    ssize_t mWellKnownHeaders[kNumWellKnownHeaders];
+
+    size_t mContentOffset;
 
     ParsedMessage();
 
     ssize_t parse(const char *data, size_t size, bool noMoreData);
 
+    ssize_t findHeader(const char *name) const;
+
+    static ssize_t WellKnownHeaderIndex(const char *key, size_t keyLength);
+
     DISALLOW_EVIL_CONSTRUCTORS(ParsedMessage);
 };
 
 }  // namespace android
+
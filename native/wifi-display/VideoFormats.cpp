@@ -0,0 +1,499 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "VideoFormats"
+#include <utils/Log.h>
+
+#include "VideoFormats.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace android {
+
+struct ResolutionConfig {
+    size_t mWidth;
+    size_t mHeight;
+    size_t mFramesPerSecond;    // fields per second if interlaced
+    bool mInterlaced;
+};
+
+static const ResolutionConfig kCEAResolutions[] = {
+    {  640,  480, 60, false },
+    {  720,  480, 60, false },
+    {  720,  480, 60, true  },
+    {  720,  576, 50, false },
+    {  720,  576, 50, true  },
+    { 1280,  720, 30, false },
+    { 1280,  720, 60, false },
+    { 1920, 1080, 30, false },
+    { 1920, 1080, 60, false },
+    { 1920, 1080, 60, true  },
+    { 1280,  720, 25, false },
+    { 1280,  720, 50, false },
+    { 1920, 1080, 25, false },
+    { 1920, 1080, 50, false },
+    { 1920, 1080, 50, true  },
+    { 1280,  720, 24, false },
+    { 1920, 1080, 24, false },
+};
+
+static const ResolutionConfig kVESAResolutions[] = {
+    {  800,  600, 30, false },
+    {  800,  600, 60, false },
+    { 1024,  768, 30, false },
+    { 1024,  768, 60, false },
+    { 1152,  864, 30, false },
+    { 1152,  864, 60, false },
+    { 1280,  768, 30, false },
+    { 1280,  768, 60, false },
+    { 1280,  800, 30, false },
+    { 1280,  800, 60, false },
+    { 1360,  768, 30, false },
+    { 1360,  768, 60, false },
+    { 1366,  768, 30, false },
+    { 1366,  768, 60, false },
+    { 1280, 1024, 30, false },
+    { 1280, 1024, 60, false },
+    { 1400, 1050, 30, false },
+    { 1400, 1050, 60, false },
+    { 1440,  900, 30, false },
+    { 1440,  900, 60, false },
+    { 1600,  900, 30, false },
+    { 1600,  900, 60, false },
+    { 1600, 1200, 30, false },
+    { 1600, 1200, 60, false },
+    { 1680, 1024, 30, false },
+    { 1680, 1024, 60, false },
+    { 1680, 1050, 30, false },
+    { 1680, 1050, 60, false },
+    { 1920, 1200, 30, false },
+    { 1920, 1200, 60, false },
+};
+
+static const ResolutionConfig kHHResolutions[] = {
+    {  800,  480, 30, false },
+    {  800,  480, 60, false },
+    {  854,  480, 30, false },
+    {  854,  480, 60, false },
+    {  864,  480, 30, false },
+    {  864,  480, 60, false },
+    {  640,  360, 30, false },
+    {  640,  360, 60, false },
+    {  960,  540, 30, false },
+    {  960,  540, 60, false },
+    {  848,  480, 30, false },
+    {  848,  480, 60, false },
+};
+
+static const struct {
+    const ResolutionConfig *mConfigs;
+    size_t mNumConfigs;
+} kResolutionTables[VideoFormats::kNumResolutionTypes] = {
+    { kCEAResolutions,
+      sizeof(kCEAResolutions) / sizeof(kCEAResolutions[0]) },
+    { kVESAResolutions,
+      sizeof(kVESAResolutions) / sizeof(kVESAResolutions[0]) },
+    { kHHResolutions,
+      sizeof(kHHResolutions) / sizeof(kHHResolutions[0]) },
+};
+
+// H.264 Table A-1, macroblocks per second and per frame.
+static const struct {
+    uint32_t mMaxMBPS;
+    uint32_t mMaxFS;
+} kLevelLimits[VideoFormats::kNumLevelTypes] = {
+    { 108000, 3600 },   // 3.1
+    { 216000, 5120 },   // 3.2
+    { 245760, 8192 },   // 4
+    { 245760, 8192 },   // 4.1
+    { 522240, 8704 },   // 4.2
+};
+
+static const ResolutionConfig *GetResolutionConfig(
+        VideoFormats::ResolutionType type, size_t index) {
+    CHECK_LT(type, VideoFormats::kNumResolutionTypes);
+
+    if (index >= kResolutionTables[type].mNumConfigs) {
+        return NULL;
+    }
+
+    return &kResolutionTables[type].mConfigs[index];
+}
+
+static uint32_t GetMacroblocksPerFrame(const ResolutionConfig &config) {
+    return ((config.mWidth + 15) / 16) * ((config.mHeight + 15) / 16);
+}
+
+static uint64_t GetPixelsPerSec(const ResolutionConfig &config) {
+    size_t framesPerSecond = config.mFramesPerSecond;
+    if (config.mInterlaced) {
+        framesPerSecond /= 2;
+    }
+
+    return (uint64_t)config.mWidth * config.mHeight * framesPerSecond;
+}
+
+VideoFormats::VideoFormats() {
+    disableAll();
+}
+
+void VideoFormats::disableAll() {
+    mNativeType = RESOLUTION_CEA;
+    mNativeIndex = 0;
+
+    mCodecs.clear();
+}
+
+void VideoFormats::setNativeResolution(ResolutionType type, size_t index) {
+    CHECK(GetResolutionConfig(type, index) != NULL);
+
+    mNativeType = type;
+    mNativeIndex = index;
+}
+
+void VideoFormats::getNativeResolution(
+        ResolutionType *type, size_t *index) const {
+    *type = mNativeType;
+    *index = mNativeIndex;
+}
+
+void VideoFormats::addCodec(
+        ProfileType profile, LevelType level,
+        uint32_t maxMacroblocksPerSec) {
+    CHECK_LT(profile, kNumProfileTypes);
+    CHECK_LT(level, kNumLevelTypes);
+
+    H264Codec codec;
+    memset(&codec, 0, sizeof(codec));
+
+    codec.mProfile = profile;
+    codec.mLevel = level;
+
+    for (size_t type = 0; type < kNumResolutionTypes; ++type) {
+        for (size_t i = 0; i < kResolutionTables[type].mNumConfigs; ++i) {
+            const ResolutionConfig &config = kResolutionTables[type].mConfigs[i];
+
+            if (config.mInterlaced) {
+                continue;
+            }
+
+            LevelType requiredLevel;
+            if (!GetRequiredLevel((ResolutionType)type, i, &requiredLevel)
+                    || requiredLevel > level) {
+                continue;
+            }
+
+            if (maxMacroblocksPerSec > 0
+                    && GetMacroblocksPerSec((ResolutionType)type, i)
+                            > maxMacroblocksPerSec) {
+                continue;
+            }
+
+            codec.mResolutions[type] |= 1ul << i;
+        }
+    }
+
+    // 640x480p60
+    codec.mResolutions[RESOLUTION_CEA] |= 1;
+
+    mCodecs.push(codec);
+}
+
+size_t VideoFormats::countCodecs() const {
+    return mCodecs.size();
+}
+
+const VideoFormats::H264Codec &VideoFormats::codecAt(size_t index) const {
+    return mCodecs.itemAt(index);
+}
+
+bool VideoFormats::isResolutionEnabled(
+        ResolutionType type, size_t index) const {
+    CHECK_LT(type, kNumResolutionTypes);
+
+    for (size_t i = 0; i < mCodecs.size(); ++i) {
+        if (mCodecs.itemAt(i).mResolutions[type] & (1ul << index)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static ssize_t GetBitIndex(unsigned bitmap, size_t numBits) {
+    for (size_t i = 0; i < numBits; ++i) {
+        if (bitmap == (1u << i)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// wfd_video_formats := native preferred-display-mode-supported
+//                      H.264-codec (", " H.264-codec)*
+// H.264-codec := profile level CEA-mask VESA-mask HH-mask latency
+//                min-slice-size slice-enc-params frame-rate-control
+//                max-hres max-vres
+bool VideoFormats::parseFormatSpec(const char *spec) {
+    disableAll();
+
+    unsigned native, preferredDisplayMode;
+    int n;
+    if (sscanf(spec, "%02x %02x %n", &native, &preferredDisplayMode, &n) != 2) {
+        ALOGE("malformed wfd_video_formats: '%s'", spec);
+        return false;
+    }
+
+    ResolutionType nativeType = (ResolutionType)(native & 7);
+    size_t nativeIndex = native >> 3;
+
+    if (nativeType >= kNumResolutionTypes
+            || GetResolutionConfig(nativeType, nativeIndex) == NULL) {
+        ALOGW("invalid native resolution %02x in wfd_video_formats", native);
+
+        nativeType = RESOLUTION_CEA;
+        nativeIndex = 0;
+    }
+
+    const char *s = spec + n;
+    for (;;) {
+        unsigned profile, level, cea, vesa, hh, latency;
+        unsigned minSliceSize, sliceEncParams, frameRateControl;
+        if (sscanf(s, "%02x %02x %08x %08x %08x %02x %04x %04x %02x%n",
+                   &profile, &level, &cea, &vesa, &hh, &latency,
+                   &minSliceSize, &sliceEncParams, &frameRateControl,
+                   &n) != 9) {
+            ALOGE("malformed wfd_video_formats: '%s'", spec);
+
+            disableAll();
+            return false;
+        }
+
+        ssize_t profileIndex = GetBitIndex(profile, kNumProfileTypes);
+        ssize_t levelIndex = GetBitIndex(level, kNumLevelTypes);
+
+        // max-hres and max-vres follow, "none" unless the sink's display
+        // is smaller than what the masks claim, ignored here.
+
+        if (profileIndex < 0 || levelIndex < 0) {
+            ALOGW("ignoring H.264 codec with profile %02x level %02x",
+                  profile, level);
+        } else {
+            H264Codec codec;
+            codec.mProfile = (ProfileType)profileIndex;
+            codec.mLevel = (LevelType)levelIndex;
+            codec.mResolutions[RESOLUTION_CEA] = cea;
+            codec.mResolutions[RESOLUTION_VESA] = vesa;
+            codec.mResolutions[RESOLUTION_HH] = hh;
+            codec.mLatency = latency;
+            codec.mMinSliceSize = minSliceSize;
+            codec.mSliceEncParams = sliceEncParams;
+            codec.mFrameRateControl = frameRateControl;
+
+            mCodecs.push(codec);
+        }
+
+        const char *commaPos = strchr(s + n, ',');
+        if (commaPos == NULL) {
+            break;
+        }
+
+        s = commaPos + 1;
+        while (isspace(*s)) {
+            ++s;
+        }
+    }
+
+    mNativeType = nativeType;
+    mNativeIndex = nativeIndex;
+
+    return true;
+}
+
+AString VideoFormats::getFormatSpec() const {
+    AString spec = StringPrintf(
+            "%02x 00", (unsigned)((mNativeIndex << 3) | mNativeType));
+
+    for (size_t i = 0; i < mCodecs.size(); ++i) {
+        const H264Codec &codec = mCodecs.itemAt(i);
+
+        spec.append(
+                StringPrintf(
+                    "%s %02x %02x %08x %08x %08x %02x %04x %04x %02x none none",
+                    i > 0 ? "," : "",
+                    1u << codec.mProfile,
+                    1u << codec.mLevel,
+                    codec.mResolutions[RESOLUTION_CEA],
+                    codec.mResolutions[RESOLUTION_VESA],
+                    codec.mResolutions[RESOLUTION_HH],
+                    codec.mLatency,
+                    codec.mMinSliceSize,
+                    codec.mSliceEncParams,
+                    codec.mFrameRateControl));
+    }
+
+    return spec;
+}
+
+// static
+AString VideoFormats::GetFormatSpecFor(
+        ResolutionType type, size_t index,
+        ProfileType profile, LevelType level) {
+    CHECK(GetResolutionConfig(type, index) != NULL);
+
+    uint32_t resolutions[kNumResolutionTypes] = { 0, 0, 0 };
+    resolutions[type] = 1ul << index;
+
+    return StringPrintf(
+            "%02x 00 %02x %02x %08x %08x %08x 00 0000 0000 00 none none",
+            (unsigned)((index << 3) | type),
+            1u << profile,
+            1u << level,
+            resolutions[RESOLUTION_CEA],
+            resolutions[RESOLUTION_VESA],
+            resolutions[RESOLUTION_HH]);
+}
+
+// static
+bool VideoFormats::GetConfiguration(
+        ResolutionType type, size_t index,
+        size_t *width, size_t *height, size_t *framesPerSecond,
+        bool *interlaced) {
+    const ResolutionConfig *config = GetResolutionConfig(type, index);
+
+    if (config == NULL) {
+        return false;
+    }
+
+    *width = config->mWidth;
+    *height = config->mHeight;
+    *framesPerSecond = config->mFramesPerSecond;
+    *interlaced = config->mInterlaced;
+
+    return true;
+}
+
+// static
+uint32_t VideoFormats::GetMacroblocksPerSec(ResolutionType type, size_t index) {
+    const ResolutionConfig *config = GetResolutionConfig(type, index);
+    CHECK(config != NULL);
+
+    size_t framesPerSecond = config->mFramesPerSecond;
+    if (config->mInterlaced) {
+        framesPerSecond /= 2;
+    }
+
+    return GetMacroblocksPerFrame(*config) * framesPerSecond;
+}
+
+// static
+bool VideoFormats::GetRequiredLevel(
+        ResolutionType type, size_t index, LevelType *level) {
+    const ResolutionConfig *config = GetResolutionConfig(type, index);
+    CHECK(config != NULL);
+
+    uint32_t mbsPerFrame = GetMacroblocksPerFrame(*config);
+    uint32_t mbsPerSec = GetMacroblocksPerSec(type, index);
+
+    for (size_t i = 0; i < kNumLevelTypes; ++i) {
+        if (mbsPerFrame <= kLevelLimits[i].mMaxFS
+                && mbsPerSec <= kLevelLimits[i].mMaxMBPS) {
+            *level = (LevelType)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// static
+bool VideoFormats::PickBestFormat(
+        const VideoFormats &sinkSupported,
+        const VideoFormats &sourceSupported,
+        uint64_t maxPixelsPerSec,
+        ResolutionType *chosenType,
+        size_t *chosenIndex,
+        ProfileType *chosenProfile,
+        LevelType *chosenLevel) {
+    bool found = false;
+    uint64_t bestPixelsPerSec = 0;
+
+    for (size_t i = 0; i < sinkSupported.mCodecs.size(); ++i) {
+        const H264Codec &sinkCodec = sinkSupported.mCodecs.itemAt(i);
+
+        for (size_t j = 0; j < sourceSupported.mCodecs.size(); ++j) {
+            const H264Codec &sourceCodec = sourceSupported.mCodecs.itemAt(j);
+
+            if (sinkCodec.mProfile != sourceCodec.mProfile) {
+                continue;
+            }
+
+            LevelType level = sinkCodec.mLevel < sourceCodec.mLevel
+                ? sinkCodec.mLevel : sourceCodec.mLevel;
+
+            for (size_t type = 0; type < kNumResolutionTypes; ++type) {
+                uint32_t common = sinkCodec.mResolutions[type]
+                    & sourceCodec.mResolutions[type];
+
+                for (size_t index = 0;
+                        index < kResolutionTables[type].mNumConfigs; ++index) {
+                    if (!(common & (1ul << index))) {
+                        continue;
+                    }
+
+                    const ResolutionConfig &config =
+                        kResolutionTables[type].mConfigs[index];
+
+                    LevelType requiredLevel;
+                    if (config.mInterlaced
+                            || !GetRequiredLevel(
+                                (ResolutionType)type, index, &requiredLevel)
+                            || requiredLevel > level) {
+                        continue;
+                    }
+
+                    uint64_t pixelsPerSec = GetPixelsPerSec(config);
+
+                    if (maxPixelsPerSec > 0 && pixelsPerSec > maxPixelsPerSec
+                            && !(type == RESOLUTION_CEA && index == 0)) {
+                        continue;
+                    }
+
+                    if (found
+                            && (pixelsPerSec < bestPixelsPerSec
+                                || (pixelsPerSec == bestPixelsPerSec
+                                    && sinkCodec.mProfile <= *chosenProfile))) {
+                        continue;
+                    }
+
+                    found = true;
+                    bestPixelsPerSec = pixelsPerSec;
+
+                    *chosenType = (ResolutionType)type;
+                    *chosenIndex = index;
+                    *chosenProfile = sinkCodec.mProfile;
+                    *chosenLevel = requiredLevel;
+                }
+            }
+        }
+    }
+
+    if (found) {
+        size_t width, height, framesPerSecond;
+        bool interlaced;
+        CHECK(GetConfiguration(
+                    *chosenType, *chosenIndex,
+                    &width, &height, &framesPerSecond, &interlaced));
+
+        ALOGI("picked %d x %d p%d (type %d, index %d), profile %d, level %d",
+              width, height, framesPerSecond,
+              *chosenType, *chosenIndex, *chosenProfile, *chosenLevel);
+    }
+
+    return found;
+}
+
+}  // namespace android
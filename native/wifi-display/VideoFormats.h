@@ -0,0 +1,113 @@
+#ifndef VIDEO_FORMATS_H_
+
+#define VIDEO_FORMATS_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <media/stagefright/foundation/AString.h>
+#include <utils/Vector.h>
+
+#include <stdint.h>
+
+namespace android {
+
+// Models the "wfd_video_formats" parameter, i.e. the native resolution and
+// one H.264 codec entry per supported profile listing the CEA, VESA and
+// handheld resolutions/refresh rates supported at its level (WFD 6.1.3).
+struct VideoFormats {
+    VideoFormats();
+
+    enum ResolutionType {
+        RESOLUTION_CEA,
+        RESOLUTION_VESA,
+        RESOLUTION_HH,
+        kNumResolutionTypes,
+    };
+
+    // Bit positions in the profile bitmap.
+    enum ProfileType {
+        PROFILE_CBP,    // Constrained Baseline
+        PROFILE_CHP,    // Constrained High
+        kNumProfileTypes,
+    };
+
+    // Bit positions in the level bitmap.
+    enum LevelType {
+        LEVEL_31,
+        LEVEL_32,
+        LEVEL_40,
+        LEVEL_41,
+        LEVEL_42,
+        kNumLevelTypes,
+    };
+
+    struct H264Codec {
+        ProfileType mProfile;
+        LevelType mLevel;
+        uint32_t mResolutions[kNumResolutionTypes];
+        uint8_t mLatency;
+        uint16_t mMinSliceSize;
+        uint16_t mSliceEncParams;
+        uint8_t mFrameRateControl;
+    };
+
+    void disableAll();
+
+    void setNativeResolution(ResolutionType type, size_t index);
+    void getNativeResolution(ResolutionType *type, size_t *index) const;
+
+    // Adds a codec entry enabling every progressive resolution "level"
+    // can carry that needs at most "maxMacroblocksPerSec" (0 for no limit)
+    // to decode. 640x480p60 is mandatory and always enabled.
+    void addCodec(
+            ProfileType profile, LevelType level,
+            uint32_t maxMacroblocksPerSec);
+
+    size_t countCodecs() const;
+    const H264Codec &codecAt(size_t index) const;
+
+    bool isResolutionEnabled(ResolutionType type, size_t index) const;
+
+    bool parseFormatSpec(const char *spec);
+    AString getFormatSpec() const;
+
+    // The single-mode spec a source sends in M4 once it picked a format.
+    static AString GetFormatSpecFor(
+            ResolutionType type, size_t index,
+            ProfileType profile, LevelType level);
+
+    static bool GetConfiguration(
+            ResolutionType type, size_t index,
+            size_t *width, size_t *height, size_t *framesPerSecond,
+            bool *interlaced);
+
+    static uint32_t GetMacroblocksPerSec(ResolutionType type, size_t index);
+
+    // The lowest level that can carry the resolution, false if none can.
+    static bool GetRequiredLevel(
+            ResolutionType type, size_t index, LevelType *level);
+
+    // Picks the progressive resolution with the highest pixel rate both
+    // sides support in a common profile, preferring CHP over CBP. A
+    // non-zero "maxPixelsPerSec" excludes resolutions the link cannot
+    // carry at an acceptable quality.
+    static bool PickBestFormat(
+            const VideoFormats &sinkSupported,
+            const VideoFormats &sourceSupported,
+            uint64_t maxPixelsPerSec,
+            ResolutionType *chosenType,
+            size_t *chosenIndex,
+            ProfileType *chosenProfile,
+            LevelType *chosenLevel);
+
+private:
+    ResolutionType mNativeType;
+    size_t mNativeIndex;
+
+    Vector<H264Codec> mCodecs;
+
+    DISALLOW_EVIL_CONSTRUCTORS(VideoFormats);
+};
+
+}  // namespace android
+
+#endif  // VIDEO_FORMATS_H_
@@ -0,0 +1,335 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "nsbench"
+#include <utils/Log.h>
+
+#include "ANetworkSession.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+namespace android {
+
+// Measures how much loopback UDP traffic ANetworkSession moves for a
+// given number of network threads. Every stream is a sender/receiver
+// session pair driven from its own looper, so that the network threads
+// rather than the clients are what limits throughput.
+struct StreamHandler : public AHandler {
+    StreamHandler(
+            const sp<ANetworkSession> &netSession,
+            int32_t bitrate, size_t packetSize);
+
+    status_t init(unsigned port);
+    void start(int64_t durationUs);
+
+    void getStats(
+            int64_t *numPacketsSent,
+            int64_t *numPacketsReceived,
+            int64_t *numBytesReceived) const;
+
+protected:
+    virtual ~StreamHandler();
+
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatSendBurst,
+        kWhatReceiverNotify,
+        kWhatSenderNotify,
+    };
+
+    // Packets are sent in bursts on this period.
+    static const int64_t kBurstIntervalUs = 1000ll;
+
+    sp<ANetworkSession> mNetSession;
+    int32_t mBitrate;
+    size_t mPacketSize;
+
+    int32_t mReceiverSessionID;
+    int32_t mSenderSessionID;
+
+    int64_t mStartTimeUs;
+    int64_t mStopTimeUs;
+    sp<ABuffer> mPacket;
+
+    mutable Mutex mLock;
+    int64_t mNumPacketsSent;
+    int64_t mNumPacketsReceived;
+    int64_t mNumBytesReceived;
+
+    void onSendBurst();
+
+    DISALLOW_EVIL_CONSTRUCTORS(StreamHandler);
+};
+
+StreamHandler::StreamHandler(
+        const sp<ANetworkSession> &netSession,
+        int32_t bitrate, size_t packetSize)
+    : mNetSession(netSession),
+      mBitrate(bitrate),
+      mPacketSize(packetSize),
+      mReceiverSessionID(0),
+      mSenderSessionID(0),
+      mStartTimeUs(-1ll),
+      mStopTimeUs(-1ll),
+      mNumPacketsSent(0ll),
+      mNumPacketsReceived(0ll),
+      mNumBytesReceived(0ll) {
+    mPacket = new ABuffer(mPacketSize);
+    memset(mPacket->data(), 0, mPacket->size());
+}
+
+StreamHandler::~StreamHandler() {
+    if (mSenderSessionID != 0) {
+        mNetSession->destroySession(mSenderSessionID);
+    }
+
+    if (mReceiverSessionID != 0) {
+        mNetSession->destroySession(mReceiverSessionID);
+    }
+}
+
+status_t StreamHandler::init(unsigned port) {
+    status_t err = mNetSession->createUDPSession(
+            port, new AMessage(kWhatReceiverNotify, id()),
+            &mReceiverSessionID);
+
+    if (err != OK) {
+        return err;
+    }
+
+    return mNetSession->createUDPSession(
+            0 /* localPort */, "127.0.0.1", port,
+            new AMessage(kWhatSenderNotify, id()),
+            &mSenderSessionID);
+}
+
+void StreamHandler::start(int64_t durationUs) {
+    mStartTimeUs = ALooper::GetNowUs();
+    mStopTimeUs = mStartTimeUs + durationUs;
+
+    (new AMessage(kWhatSendBurst, id()))->post();
+}
+
+void StreamHandler::getStats(
+        int64_t *numPacketsSent,
+        int64_t *numPacketsReceived,
+        int64_t *numBytesReceived) const {
+    Mutex::Autolock autoLock(mLock);
+
+    *numPacketsSent = mNumPacketsSent;
+    *numPacketsReceived = mNumPacketsReceived;
+    *numBytesReceived = mNumBytesReceived;
+}
+
+void StreamHandler::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatSendBurst:
+        {
+            onSendBurst();
+            break;
+        }
+
+        case kWhatReceiverNotify:
+        case kWhatSenderNotify:
+        {
+            int32_t reason;
+            CHECK(msg->findInt32("reason", &reason));
+
+            switch (reason) {
+                case ANetworkSession::kWhatError:
+                {
+                    int32_t err;
+                    CHECK(msg->findInt32("err", &err));
+
+                    AString detail;
+                    CHECK(msg->findString("detail", &detail));
+
+                    ALOGE("session error %d (%s)", err, detail.c_str());
+                    break;
+                }
+
+                case ANetworkSession::kWhatDatagram:
+                {
+                    sp<ABuffer> data;
+                    CHECK(msg->findBuffer("data", &data));
+
+                    Mutex::Autolock autoLock(mLock);
+                    ++mNumPacketsReceived;
+                    mNumBytesReceived += data->size();
+                    break;
+                }
+
+                default:
+                    TRESPASS();
+            }
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+void StreamHandler::onSendBurst() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (nowUs >= mStopTimeUs) {
+        return;
+    }
+
+    // Catch up to where the configured bitrate says we should be.
+    int64_t numPacketsDue =
+        ((nowUs - mStartTimeUs) * mBitrate) / (8000000ll * mPacketSize) + 1;
+
+    Mutex::Autolock autoLock(mLock);
+
+    while (mNumPacketsSent < numPacketsDue) {
+        mNetSession->sendRequest(
+                mSenderSessionID, mPacket->data(), mPacket->size());
+
+        ++mNumPacketsSent;
+    }
+
+    (new AMessage(kWhatSendBurst, id()))->post(kBurstIntervalUs);
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s\n"
+            "           -s streams    \tnumber of concurrent streams (4)\n"
+            "           -r mbps       \tbitrate of each stream (50)\n"
+            "           -d seconds    \tduration of each run (5)\n"
+            "           -t max threads\trun with 1..max network threads (4),\n"
+            "                         \tall but the first carry streams\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    int32_t numStreams = 4;
+    int32_t bitrateMbps = 50;
+    int32_t durationSecs = 5;
+    int32_t maxNumThreads = 4;
+
+    int res;
+    while ((res = getopt(argc, argv, "hs:r:d:t:")) >= 0) {
+        switch (res) {
+            case 's':
+                numStreams = atoi(optarg);
+                break;
+
+            case 'r':
+                bitrateMbps = atoi(optarg);
+                break;
+
+            case 'd':
+                durationSecs = atoi(optarg);
+                break;
+
+            case 't':
+                maxNumThreads = atoi(optarg);
+                break;
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (numStreams < 1 || bitrateMbps < 1 || durationSecs < 1
+            || maxNumThreads < 1
+            || maxNumThreads > ANetworkSession::kMaxNumThreads) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    // RTP carrying 7 TS packets, as sent by the source.
+    static const size_t kPacketSize = 12 + 7 * 188;
+
+    printf("threads\tdata threads\tstreams\toffered Mbit/s\t"
+           "received Mbit/s\tloss %%\n");
+
+    for (int32_t numThreads = 1; numThreads <= maxNumThreads; ++numThreads) {
+        // Of several threads, the first is kept for RTSP sessions and sits
+        // idle here, the streams share the remaining ones.
+        int32_t numDataThreads = (numThreads > 1) ? numThreads - 1 : 1;
+
+        sp<ANetworkSession> netSession = new ANetworkSession(numThreads);
+        CHECK_EQ(netSession->start(), (status_t)OK);
+
+        Vector<sp<ALooper> > loopers;
+        Vector<sp<StreamHandler> > handlers;
+
+        for (int32_t i = 0; i < numStreams; ++i) {
+            sp<ALooper> looper = new ALooper;
+            looper->setName("nsbench");
+            looper->start();
+
+            sp<StreamHandler> handler = new StreamHandler(
+                    netSession, bitrateMbps * 1000000, kPacketSize);
+
+            looper->registerHandler(handler);
+
+            // Don't trip over sockets of the previous run still lingering.
+            unsigned port = 40000 + numThreads * 100 + i;
+            CHECK_EQ(handler->init(port), (status_t)OK);
+
+            loopers.push(looper);
+            handlers.push(handler);
+        }
+
+        int64_t durationUs = durationSecs * 1000000ll;
+
+        for (size_t i = 0; i < handlers.size(); ++i) {
+            handlers[i]->start(durationUs);
+        }
+
+        // Let the last packets in flight arrive.
+        usleep(durationUs + 200000ll);
+
+        int64_t totalSent = 0ll;
+        int64_t totalReceived = 0ll;
+        int64_t totalBytesReceived = 0ll;
+
+        for (size_t i = 0; i < handlers.size(); ++i) {
+            int64_t numPacketsSent, numPacketsReceived, numBytesReceived;
+            handlers[i]->getStats(
+                    &numPacketsSent, &numPacketsReceived, &numBytesReceived);
+
+            totalSent += numPacketsSent;
+            totalReceived += numPacketsReceived;
+            totalBytesReceived += numBytesReceived;
+        }
+
+        for (size_t i = 0; i < loopers.size(); ++i) {
+            loopers[i]->unregisterHandler(handlers[i]->id());
+            loopers[i]->stop();
+        }
+
+        handlers.clear();
+        loopers.clear();
+
+        netSession->stop();
+        netSession.clear();
+
+        printf("%d\t%d\t\t%d\t%.2f\t\t%.2f\t\t%.2f\n",
+               numThreads,
+               numDataThreads,
+               numStreams,
+               (double)numStreams * bitrateMbps,
+               totalBytesReceived * 8.0 / durationUs,
+               totalSent > 0
+                    ? 100.0 * (totalSent - totalReceived) / totalSent : 0.0);
+    }
+
+    return 0;
+}
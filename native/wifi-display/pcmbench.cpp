@@ -0,0 +1,120 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "pcmbench"
+#include <utils/Log.h>
+
+#include "source/PCMKernels.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace android {
+
+// Mirrors Converter's LPCM path: 16-bit stereo at 48kHz, 6 AUs of 80
+// frames each (10ms of audio) per PES packet behind a 4 byte header.
+static const size_t kFrameSize = 2 * sizeof(int16_t);
+static const size_t kFramesPerPESPacket = 6 * 80;
+static const size_t kPESPayloadSize = kFrameSize * kFramesPerPESPacket;
+
+// Returns the average time in ns spent on one PES packet's worth of audio.
+static double benchmark(
+        const PCMKernels &kernels,
+        const uint8_t *input, size_t inputSize,
+        uint8_t *output, int32_t numIterations) {
+    int64_t startUs = ALooper::GetNowUs();
+
+    size_t numPackets = 0;
+    for (int32_t i = 0; i < numIterations; ++i) {
+        // Converter checks the raw input for silence first.
+        if (kernels.mIsSilence(input, inputSize)) {
+            continue;
+        }
+
+        for (size_t offset = 0; offset + kPESPayloadSize <= inputSize;
+                offset += kPESPayloadSize) {
+            output[0] = 0xa0;
+            output[1] = 6;
+            output[2] = 0;
+            output[3] = (2 << 3) | 1;
+
+            kernels.mSwapCopy16(
+                    &output[4], &input[offset], kPESPayloadSize / 2);
+
+            ++numPackets;
+        }
+    }
+
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+
+    return numPackets > 0 ? elapsedUs * 1000.0 / numPackets : 0.0;
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s\n"
+            "           -n iterations \tnumber of iterations (20000)\n"
+            "           -p packets    \tPES packets per input buffer (4)\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    int32_t numIterations = 20000;
+    int32_t packetsPerBuffer = 4;
+
+    int res;
+    while ((res = getopt(argc, argv, "hn:p:")) >= 0) {
+        switch (res) {
+            case 'n':
+                numIterations = atoi(optarg);
+                break;
+
+            case 'p':
+                packetsPerBuffer = atoi(optarg);
+                break;
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (numIterations < 1 || packetsPerBuffer < 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    size_t inputSize = packetsPerBuffer * kPESPayloadSize;
+    uint8_t *input = new uint8_t[inputSize];
+    uint8_t *output = new uint8_t[4 + kPESPayloadSize];
+
+    // Quiet but not silent, so the silence check has to look at all of it.
+    memset(input, 0, inputSize);
+    input[inputSize - 1] = 1;
+
+    const PCMKernels &scalar = GetScalarPCMKernels();
+    const PCMKernels &best = GetPCMKernels();
+
+    double scalarNs =
+        benchmark(scalar, input, inputSize, output, numIterations);
+
+    double bestNs =
+        benchmark(best, input, inputSize, output, numIterations);
+
+    printf("kernels\tns per 10ms of audio\n");
+    printf("%s\t%.1f\n", scalar.mName, scalarNs);
+    printf("%s\t%.1f\t(%.2fx)\n",
+           best.mName, bestNs, bestNs > 0.0 ? scalarNs / bestNs : 0.0);
+
+    delete[] output;
+    delete[] input;
+
+    return 0;
+}
@@ -0,0 +1,557 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "rtpbench"
+#include <utils/Log.h>
+
+#include "ANetworkSession.h"
+#include "NetworkImpairment.h"
+#include "sink/PathMerger.h"
+#include "sink/RTPSink.h"
+
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+namespace android {
+
+static const size_t kMaxNumPaths = 2;
+
+// Where the second path goes relative to the first one's port.
+static const unsigned kRedundantPortOffset = 100;
+
+// Stands in for the TunnelRenderer, keeps packets sorted by sequence
+// number and drains them whenever it is woken up. With more than one
+// path, duplicates are dropped first like RTPSink does.
+struct ReorderQueue : public AHandler {
+    ReorderQueue(size_t numPaths);
+
+    // Called on any thread, wakeups are coalesced.
+    void queueDirect(size_t path, const sp<ABuffer> &buffer);
+
+    int64_t numPacketsDrained() const;
+
+    void getPathStats(size_t path, PathMerger::PathStats *stats) const;
+
+    enum {
+        kWhatQueue,
+        kWhatWakeup,
+    };
+
+protected:
+    virtual ~ReorderQueue() {}
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    mutable Mutex mLock;
+    List<sp<ABuffer> > mPackets;
+    bool mWakeupPending;
+    int64_t mNumPacketsDrained;
+    size_t mNumPaths;
+    PathMerger mPathMerger;
+
+    void insertLocked(size_t path, const sp<ABuffer> &buffer);
+    void drain();
+
+    DISALLOW_EVIL_CONSTRUCTORS(ReorderQueue);
+};
+
+ReorderQueue::ReorderQueue(size_t numPaths)
+    : mWakeupPending(false),
+      mNumPacketsDrained(0ll),
+      mNumPaths(numPaths),
+      mPathMerger(numPaths) {
+}
+
+void ReorderQueue::queueDirect(size_t path, const sp<ABuffer> &buffer) {
+    Mutex::Autolock autoLock(mLock);
+    insertLocked(path, buffer);
+
+    if (!mWakeupPending) {
+        mWakeupPending = true;
+        (new AMessage(kWhatWakeup, id()))->post();
+    }
+}
+
+int64_t ReorderQueue::numPacketsDrained() const {
+    Mutex::Autolock autoLock(mLock);
+    return mNumPacketsDrained;
+}
+
+void ReorderQueue::getPathStats(
+        size_t path, PathMerger::PathStats *stats) const {
+    Mutex::Autolock autoLock(mLock);
+    mPathMerger.getPathStats(path, stats);
+}
+
+void ReorderQueue::insertLocked(size_t path, const sp<ABuffer> &buffer) {
+    int32_t seqNo = buffer->int32Data();
+
+    if (mNumPaths > 1 && !mPathMerger.addPacket(path, seqNo)) {
+        return;
+    }
+
+    List<sp<ABuffer> >::iterator it = mPackets.end();
+    while (it != mPackets.begin()) {
+        --it;
+
+        if ((int16_t)(seqNo - (*it)->int32Data()) > 0) {
+            mPackets.insert(++it, buffer);
+            return;
+        }
+    }
+
+    mPackets.insert(mPackets.begin(), buffer);
+}
+
+void ReorderQueue::drain() {
+    Mutex::Autolock autoLock(mLock);
+    mWakeupPending = false;
+
+    while (!mPackets.empty()) {
+        mPackets.erase(mPackets.begin());
+        ++mNumPacketsDrained;
+    }
+}
+
+void ReorderQueue::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatQueue:
+        {
+            size_t path;
+            CHECK(msg->findSize("path", &path));
+
+            sp<ABuffer> buffer;
+            CHECK(msg->findBuffer("buffer", &buffer));
+
+            {
+                Mutex::Autolock autoLock(mLock);
+                insertLocked(path, buffer);
+            }
+
+            drain();
+            break;
+        }
+
+        case kWhatWakeup:
+        {
+            drain();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// The default receive path, every packet is a kWhatDatagram notification
+// on our looper which then hops over to the renderer's looper.
+struct NotifyReceiver : public AHandler {
+    NotifyReceiver(const sp<ReorderQueue> &queue, size_t path)
+        : mQueue(queue),
+          mPath(path) {
+    }
+
+protected:
+    virtual ~NotifyReceiver() {}
+
+    virtual void onMessageReceived(const sp<AMessage> &msg) {
+        int32_t reason;
+        CHECK(msg->findInt32("reason", &reason));
+
+        if (reason != ANetworkSession::kWhatDatagram) {
+            return;
+        }
+
+        sp<ABuffer> data;
+        CHECK(msg->findBuffer("data", &data));
+
+        RTPSink::PacketInfo info;
+        if (RTPSink::ParsePacketHeader(
+                    data->data(), data->size(), &info) != OK) {
+            return;
+        }
+
+        sp<AMessage> meta = data->meta();
+        meta->setInt32("ssrc", info.mSSRC);
+        meta->setInt32("rtp-time", info.mRTPTime);
+        meta->setInt32("PT", info.mPayloadType);
+        meta->setInt32("M", info.mMarker);
+
+        data->setInt32Data(info.mSeqNo);
+        data->setRange(info.mPayloadOffset, info.mPayloadSize);
+
+        sp<AMessage> queueMsg = new AMessage(
+                ReorderQueue::kWhatQueue, mQueue->id());
+        queueMsg->setSize("path", mPath);
+        queueMsg->setBuffer("buffer", data);
+        queueMsg->post();
+    }
+
+private:
+    sp<ReorderQueue> mQueue;
+    size_t mPath;
+
+    DISALLOW_EVIL_CONSTRUCTORS(NotifyReceiver);
+};
+
+// The direct path, packets are parsed and queued on the network thread.
+struct DirectReceiver : public ANetworkSession::DatagramHandler {
+    DirectReceiver(const sp<ReorderQueue> &queue, size_t path)
+        : mQueue(queue),
+          mPath(path) {
+    }
+
+    virtual void onDatagram(
+            int32_t sessionID,
+            const sp<ABuffer> &data,
+            int64_t arrivalTimeUs,
+            const struct sockaddr_in &fromAddr,
+            uint32_t numKernelDrops) {
+        RTPSink::PacketInfo info;
+        if (RTPSink::ParsePacketHeader(
+                    data->data(), data->size(), &info) != OK) {
+            return;
+        }
+
+        data->setInt32Data(info.mSeqNo);
+        data->setRange(info.mPayloadOffset, info.mPayloadSize);
+
+        mQueue->queueDirect(mPath, data);
+    }
+
+private:
+    sp<ReorderQueue> mQueue;
+    size_t mPath;
+
+    DISALLOW_EVIL_CONSTRUCTORS(DirectReceiver);
+};
+
+}  // namespace android
+
+// Runs in a child process so its CPU time isn't charged to the receiver.
+// Sends to the multicast group if there is one, looped back to us. Every
+// packet goes out on each path, unless that path's simulated loss drops
+// it, independently of the others.
+static void sendPackets(
+        const char *groupAddr,
+        unsigned port, int32_t packetsPerSec, int64_t durationUs,
+        size_t numPaths, const int32_t *lossPercent) {
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK_GE(s, 0);
+
+    struct sockaddr_in addr;
+    memset(addr.sin_zero, 0, sizeof(addr.sin_zero));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (groupAddr != NULL) {
+        CHECK(inet_aton(groupAddr, &addr.sin_addr));
+
+        struct in_addr ifAddr;
+        ifAddr.s_addr = htonl(INADDR_LOOPBACK);
+        CHECK_EQ(setsockopt(
+                    s, IPPROTO_IP, IP_MULTICAST_IF,
+                    &ifAddr, sizeof(ifAddr)), 0);
+
+        unsigned char loop = 1;
+        CHECK_EQ(setsockopt(
+                    s, IPPROTO_IP, IP_MULTICAST_LOOP,
+                    &loop, sizeof(loop)), 0);
+    }
+
+    // RTP carrying 7 TS packets, as sent by the source.
+    uint8_t packet[12 + 7 * 188];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x80;
+    packet[1] = 33;  // MP2T
+    packet[8] = 0xde;
+    packet[9] = 0xad;
+    packet[10] = 0xbe;
+    packet[11] = 0xef;
+
+    // Reproducible from run to run.
+    unsigned seeds[android::kMaxNumPaths];
+    for (size_t i = 0; i < numPaths; ++i) {
+        seeds[i] = i + 1;
+    }
+
+    int64_t startTimeUs = android::ALooper::GetNowUs();
+    int64_t numPacketsSent = 0ll;
+
+    for (;;) {
+        int64_t elapsedUs = android::ALooper::GetNowUs() - startTimeUs;
+        if (elapsedUs >= durationUs) {
+            break;
+        }
+
+        int64_t numPacketsDue = elapsedUs * packetsPerSec / 1000000ll + 1;
+
+        while (numPacketsSent < numPacketsDue) {
+            uint16_t seqNo = numPacketsSent;
+            packet[2] = seqNo >> 8;
+            packet[3] = seqNo & 0xff;
+
+            for (size_t i = 0; i < numPaths; ++i) {
+                if ((int32_t)(rand_r(&seeds[i]) % 100) < lossPercent[i]) {
+                    continue;
+                }
+
+                addr.sin_port = htons(port + i * android::kRedundantPortOffset);
+
+                sendto(s, packet, sizeof(packet), 0,
+                       (const struct sockaddr *)&addr, sizeof(addr));
+            }
+
+            ++numPacketsSent;
+        }
+
+        usleep(1000);
+    }
+
+    close(s);
+}
+
+static int64_t getCPUTimeUs() {
+    struct rusage usage;
+    CHECK_EQ(getrusage(RUSAGE_SELF, &usage), 0);
+
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ll
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s\n"
+            "           -r packets/sec\tpacket rate (5000)\n"
+            "           -d seconds    \tduration of each run (5)\n"
+            "           -m group      \treceive from a multicast group on "
+            "the loopback interface\n"
+            "           -l loss%%[,loss%%]\tsimulated loss, a second value "
+            "adds a redundant path\n"
+            "           -i impairment \timpair what each path receives, "
+            "e.g. p=1,r=25,delay=5,jitter=2\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    int32_t packetsPerSec = 5000;
+    int32_t durationSecs = 5;
+    const char *groupAddr = NULL;
+    size_t numPaths = 1;
+    int32_t lossPercent[kMaxNumPaths] = { 0, 0 };
+    const char *impairment = NULL;
+
+    int res;
+    while ((res = getopt(argc, argv, "hr:d:m:l:i:")) >= 0) {
+        switch (res) {
+            case 'r':
+                packetsPerSec = atoi(optarg);
+                break;
+
+            case 'd':
+                durationSecs = atoi(optarg);
+                break;
+
+            case 'm':
+                groupAddr = optarg;
+                break;
+
+            case 'l':
+            {
+                int n = sscanf(
+                        optarg, "%d,%d", &lossPercent[0], &lossPercent[1]);
+
+                if (n < 1) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+
+                numPaths = n;
+                break;
+            }
+
+            case 'i':
+            {
+                NetworkImpairment::Profile profile;
+                if (NetworkImpairment::ParseProfile(optarg, &profile) != OK
+                        || profile.mOutgoing) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+
+                impairment = optarg;
+                break;
+            }
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (packetsPerSec < 1 || durationSecs < 1
+            || lossPercent[0] < 0 || lossPercent[0] > 100
+            || lossPercent[1] < 0 || lossPercent[1] > 100
+            || (groupAddr != NULL
+                && !ANetworkSession::IsMulticastAddress(groupAddr))) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    int64_t durationUs = durationSecs * 1000000ll;
+
+    printf("mode\tpackets\tloss %%\tCPU us/packet\n");
+
+    for (int direct = 0; direct <= 1; ++direct) {
+        sp<ANetworkSession> netSession = new ANetworkSession;
+        CHECK_EQ(netSession->start(), (status_t)OK);
+
+        sp<ALooper> receiverLooper = new ALooper;
+        receiverLooper->setName("rtpbench_receiver");
+        receiverLooper->start();
+
+        sp<ALooper> rendererLooper = new ALooper;
+        rendererLooper->setName("rtpbench_renderer");
+        rendererLooper->start();
+
+        sp<ReorderQueue> queue = new ReorderQueue(numPaths);
+        rendererLooper->registerHandler(queue);
+
+        // Don't trip over the socket of the previous run still lingering.
+        unsigned port = 41000 + direct;
+
+        sp<NotifyReceiver> receivers[kMaxNumPaths];
+        int32_t sessionIDs[kMaxNumPaths];
+
+        for (size_t i = 0; i < numPaths; ++i) {
+            receivers[i] = new NotifyReceiver(queue, i);
+            receiverLooper->registerHandler(receivers[i]);
+
+            int32_t sessionID;
+            CHECK_EQ(netSession->createUDPSession(
+                        port + i * kRedundantPortOffset,
+                        new AMessage(0, receivers[i]->id()),
+                        &sessionID),
+                     (status_t)OK);
+
+            if (groupAddr != NULL) {
+                struct in_addr ifAddr;
+                ifAddr.s_addr = htonl(INADDR_LOOPBACK);
+
+                CHECK_EQ(netSession->joinMulticastGroup(
+                            sessionID, groupAddr, ifAddr),
+                         (status_t)OK);
+            }
+
+            netSession->tuneSocketBuffers(
+                    sessionID, packetsPerSec * 8 * (12 + 7 * 188), 200000ll);
+
+            if (direct) {
+                netSession->setDatagramHandler(
+                        sessionID, new DirectReceiver(queue, i));
+            }
+
+            if (impairment != NULL) {
+                CHECK_EQ(netSession->setImpairment(sessionID, impairment),
+                         (status_t)OK);
+            }
+
+            sessionIDs[i] = sessionID;
+        }
+
+        // Give the command a chance to reach the network thread.
+        usleep(100000ll);
+
+        int64_t startCPUTimeUs = getCPUTimeUs();
+
+        pid_t pid = fork();
+        CHECK_GE(pid, 0);
+
+        if (pid == 0) {
+            sendPackets(
+                    groupAddr, port, packetsPerSec, durationUs,
+                    numPaths, lossPercent);
+            _exit(0);
+        }
+
+        int status;
+        CHECK_EQ(waitpid(pid, &status, 0), pid);
+
+        // Let the last packets in flight arrive.
+        usleep(200000ll);
+
+        int64_t cpuTimeUs = getCPUTimeUs() - startCPUTimeUs;
+        int64_t numPacketsSent = durationUs * packetsPerSec / 1000000ll;
+        int64_t numPackets = queue->numPacketsDrained();
+
+        PathMerger::PathStats stats[kMaxNumPaths];
+        uint32_t numImpairedDrops = 0;
+        uint32_t numImpairedDups = 0;
+        for (size_t i = 0; i < numPaths; ++i) {
+            queue->getPathStats(i, &stats[i]);
+
+            uint32_t numDropped, numDuplicated;
+            size_t numBytesHeld;
+            CHECK_EQ(netSession->getImpairmentStats(
+                        sessionIDs[i],
+                        &numDropped, &numDuplicated, &numBytesHeld),
+                     (status_t)OK);
+
+            numImpairedDrops += numDropped;
+            numImpairedDups += numDuplicated;
+
+            netSession->destroySession(sessionIDs[i]);
+            receiverLooper->unregisterHandler(receivers[i]->id());
+        }
+
+        receiverLooper->stop();
+
+        rendererLooper->unregisterHandler(queue->id());
+        rendererLooper->stop();
+
+        netSession->stop();
+        netSession.clear();
+
+        printf("%s\t%lld\t%.2f\t%.2f\n",
+               direct ? "direct" : "notify",
+               numPackets,
+               numPacketsSent > 0
+                    ? 100.0 * (numPacketsSent - numPackets) / numPacketsSent
+                    : 0.0,
+               numPackets > 0 ? (double)cpuTimeUs / numPackets : 0.0);
+
+        if (impairment != NULL) {
+            printf("  impaired\t%u dropped, %u duplicated\n",
+                   numImpairedDrops, numImpairedDups);
+        }
+
+        if (numPaths < 2) {
+            continue;
+        }
+
+        for (size_t i = 0; i < numPaths; ++i) {
+            printf("  path %d\t%u lost (%.2f%%), %u delivered first\n",
+                   i,
+                   stats[i].mNumLost,
+                   stats[i].mNumExpected > 0
+                        ? 100.0 * stats[i].mNumLost / stats[i].mNumExpected
+                        : 0.0,
+                   stats[i].mNumFirst);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,285 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "rtspbench"
+#include <utils/Log.h>
+
+#include "ParsedMessage.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AString.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace android {
+
+// A source/sink capability negotiation and session setup as recorded
+// between WifiDisplaySource and a sink, M1 through M7 plus a M16
+// keep-alive, requests and responses in wire order.
+static const char *kExchange[] = {
+    // M1
+    "OPTIONS * RTSP/1.0\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:10 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 1\r\n"
+    "Require: org.wfa.wfd1.0\r\n"
+    "\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:10 +0000\r\n"
+    "CSeq: 1\r\n"
+    "Public: org.wfa.wfd1.0, GET_PARAMETER, SET_PARAMETER\r\n"
+    "\r\n",
+
+    // M2
+    "OPTIONS * RTSP/1.0\r\n"
+    "CSeq: 1\r\n"
+    "Require: org.wfa.wfd1.0\r\n"
+    "\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:10 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 1\r\n"
+    "Public: org.wfa.wfd1.0, SETUP, TEARDOWN, PLAY, PAUSE, "
+        "GET_PARAMETER, SET_PARAMETER\r\n"
+    "\r\n",
+
+    // M3
+    "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:10 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 2\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 83\r\n"
+    "\r\n"
+    "wfd_video_formats\r\n"
+    "wfd_audio_codecs\r\n"
+    "wfd_client_rtp_ports\r\n"
+    "wfd_content_protection\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "CSeq: 2\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 206\r\n"
+    "\r\n"
+    "wfd_video_formats: 28 00 02 02 00000020 00000000 00000000 00 0000 "
+        "0000 00 none none\r\n"
+    "wfd_audio_codecs: LPCM 00000003 00, AAC 00000001 00\r\n"
+    "wfd_client_rtp_ports: RTP/AVP/UDP;unicast 19000 0 mode=play\r\n"
+    "wfd_content_protection: none\r\n",
+
+    // M4
+    "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:10 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 3\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 219\r\n"
+    "\r\n"
+    "wfd_video_formats: 00 00 02 10 00000020 00000000 00000000 00 0000 "
+        "0000 00 none none\r\n"
+    "wfd_audio_codecs: AAC 00000001 00\r\n"
+    "wfd_presentation_URL: rtsp://192.168.1.1/wfd1.0/streamid=0 none\r\n"
+    "wfd_client_rtp_ports: RTP/AVP/UDP;unicast 19000 0 mode=play\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "CSeq: 3\r\n"
+    "\r\n",
+
+    // M5
+    "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:10 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 4\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 27\r\n"
+    "\r\n"
+    "wfd_trigger_method: SETUP\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "CSeq: 4\r\n"
+    "\r\n",
+
+    // M6
+    "SETUP rtsp://192.168.1.1/wfd1.0/streamid=0 RTSP/1.0\r\n"
+    "CSeq: 2\r\n"
+    "Transport: RTP/AVP/UDP;unicast;client_port=19000-19001\r\n"
+    "\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:11 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 2\r\n"
+    "Session: 1804289383;timeout=30\r\n"
+    "Transport: RTP/AVP/UDP;unicast;client_port=19000-19001;"
+        "server_port=15550-15551\r\n"
+    "\r\n",
+
+    // M7
+    "PLAY rtsp://192.168.1.1/wfd1.0/streamid=0 RTSP/1.0\r\n"
+    "CSeq: 3\r\n"
+    "Session: 1804289383\r\n"
+    "\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:11 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 3\r\n"
+    "Session: 1804289383;timeout=30\r\n"
+    "Range: npt=now-\r\n"
+    "\r\n",
+
+    // M16
+    "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "Date: Tue, 06 Nov 2012 17:42:31 +0000\r\n"
+    "Server: stagefright/1.2 (Linux;Android 4.2)\r\n"
+    "CSeq: 5\r\n"
+    "Session: 1804289383\r\n"
+    "\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "CSeq: 5\r\n"
+    "\r\n",
+};
+
+static const size_t kNumMessages = sizeof(kExchange) / sizeof(kExchange[0]);
+
+// Looks up what the RTSP handlers look up in every message.
+static void consume(const sp<ParsedMessage> &msg) {
+    int32_t cseq;
+    CHECK(msg->findInt32("cseq", &cseq));
+
+    AString value;
+    msg->findString("session", &value);
+    msg->findString("transport", &value);
+}
+
+// Feeds the exchange in reads of "chunkSize" bytes the way
+// ANetworkSession::Session::readMore does, either reparsing the whole
+// receive buffer after each read or only once the scanner has seen all of
+// a message. Returns the average time in ns spent per message.
+static double benchmark(
+        const AString &stream, size_t chunkSize, bool resumable,
+        int32_t numIterations) {
+    int64_t startUs = ALooper::GetNowUs();
+
+    size_t numMessages = 0;
+    for (int32_t i = 0; i < numIterations; ++i) {
+        AString inBuffer;
+        ParsedMessage::Scanner scanner;
+
+        for (size_t offset = 0; offset < stream.size(); offset += chunkSize) {
+            size_t n = stream.size() - offset;
+            if (n > chunkSize) {
+                n = chunkSize;
+            }
+
+            inBuffer.append(stream.c_str() + offset, n);
+
+            for (;;) {
+                size_t size = inBuffer.size();
+
+                if (resumable) {
+                    ssize_t messageLength =
+                        scanner.scan(inBuffer.c_str(), inBuffer.size());
+
+                    if (messageLength < 0) {
+                        break;
+                    }
+
+                    scanner.reset();
+                    size = messageLength;
+                }
+
+                size_t length;
+                sp<ParsedMessage> msg =
+                    ParsedMessage::Parse(inBuffer.c_str(), size, false, &length);
+
+                if (msg == NULL) {
+                    break;
+                }
+
+                consume(msg);
+                ++numMessages;
+
+                inBuffer.erase(0, length);
+            }
+        }
+
+        CHECK_EQ(inBuffer.size(), 0u);
+    }
+
+    CHECK_EQ(numMessages, numIterations * kNumMessages);
+
+    int64_t elapsedUs = ALooper::GetNowUs() - startUs;
+
+    return elapsedUs * 1000.0 / numMessages;
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s\n"
+            "           -n iterations \tnumber of iterations (5000)\n"
+            "           -c bytes      \tsize of a single read, 0 sweeps (0)\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    int32_t numIterations = 5000;
+    int32_t chunkSize = 0;
+
+    int res;
+    while ((res = getopt(argc, argv, "hn:c:")) >= 0) {
+        switch (res) {
+            case 'n':
+                numIterations = atoi(optarg);
+                break;
+
+            case 'c':
+                chunkSize = atoi(optarg);
+                break;
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (numIterations < 1 || chunkSize < 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    AString stream;
+    for (size_t i = 0; i < kNumMessages; ++i) {
+        stream.append(kExchange[i]);
+    }
+
+    static const size_t kChunkSizes[] = { 1, 16, 64, 512 };
+
+    printf("read size\tns per message (reparse)\tns per message (resumable)\n");
+
+    for (size_t i = 0; i < sizeof(kChunkSizes) / sizeof(kChunkSizes[0]); ++i) {
+        size_t size = chunkSize > 0 ? chunkSize : kChunkSizes[i];
+
+        double reparseNs = benchmark(stream, size, false, numIterations);
+        double resumableNs = benchmark(stream, size, true, numIterations);
+
+        printf("%zu\t%.1f\t%.1f\t(%.2fx)\n",
+               size, reparseNs, resumableNs,
+               resumableNs > 0.0 ? reparseNs / resumableNs : 0.0);
+
+        if (chunkSize > 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PathMerger"
+#include <utils/Log.h>
+
+#include "PathMerger.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+
+#include <string.h>
+
+namespace android {
+
+PathMerger::PathMerger(size_t numPaths)
+    : mNumPaths(numPaths),
+      mPaths(new Path[numPaths]) {
+    reset();
+}
+
+PathMerger::~PathMerger() {
+    delete[] mPaths;
+    mPaths = NULL;
+}
+
+void PathMerger::reset() {
+    for (size_t i = 0; i < mNumPaths; ++i) {
+        Path *path = &mPaths[i];
+
+        path->mStarted = false;
+        path->mJumped = false;
+        path->mBaseSeq = 0;
+        path->mMaxSeq = 0;
+        path->mNumReceived = 0;
+        path->mNumFirst = 0;
+    }
+
+    mStarted = false;
+    mBaseSeq = 0;
+    mMaxSeq = 0;
+    mNumUnique = 0;
+    memset(mSeen, 0, sizeof(mSeen));
+    mNumUnconfirmedJump = 0;
+}
+
+bool PathMerger::isSeen(int32_t seq) const {
+    uint32_t bit = seq & (kWindowSize - 1);
+    return (mSeen[bit / 32] & (1u << (bit % 32))) != 0;
+}
+
+void PathMerger::setSeen(int32_t seq, bool seen) {
+    uint32_t bit = seq & (kWindowSize - 1);
+
+    if (seen) {
+        mSeen[bit / 32] |= 1u << (bit % 32);
+    } else {
+        mSeen[bit / 32] &= ~(1u << (bit % 32));
+    }
+}
+
+bool PathMerger::allPathsJumped() const {
+    for (size_t i = 0; i < mNumPaths; ++i) {
+        const Path &p = mPaths[i];
+
+        if (p.mStarted && !p.mJumped) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool PathMerger::addPacket(size_t path, uint16_t seqNo) {
+    CHECK_LT(path, mNumPaths);
+
+    if (!mStarted) {
+        mStarted = true;
+        mBaseSeq = seqNo;
+        mMaxSeq = seqNo;
+    }
+
+    Path *p = &mPaths[path];
+
+    // Extended relative to the path's own newest packet, one lagging far
+    // behind the others is merely late, it didn't start over.
+    int32_t refSeq = p->mStarted ? p->mMaxSeq : mMaxSeq;
+    int32_t seq = refSeq + (int16_t)(seqNo - (uint16_t)refSeq);
+
+    if (seq > refSeq + kMaxDropout || seq < refSeq - kMaxDropout) {
+        p->mJumped = true;
+        ++mNumUnconfirmedJump;
+
+        if (!allPathsJumped()
+                && mNumUnconfirmedJump <= kMaxUnconfirmedJump) {
+            return false;
+        }
+
+        ALOGI("sequence number jumped from %d to %d, starting over",
+              refSeq & 0xffff, seqNo);
+
+        reset();
+        return addPacket(path, seqNo);
+    }
+
+    // Whatever made this path look like it jumped was a stray packet.
+    p->mJumped = false;
+    mNumUnconfirmedJump = 0;
+
+    if (!p->mStarted) {
+        p->mStarted = true;
+        p->mBaseSeq = seq;
+        p->mMaxSeq = seq;
+    } else if (seq > p->mMaxSeq) {
+        p->mMaxSeq = seq;
+    } else if (seq < p->mBaseSeq) {
+        p->mBaseSeq = seq;
+    }
+
+    ++p->mNumReceived;
+
+    if (seq > mMaxSeq) {
+        // Forget about the sequence numbers sliding out of the window.
+        int32_t numNew = seq - mMaxSeq;
+        if (numNew >= kWindowSize) {
+            memset(mSeen, 0, sizeof(mSeen));
+        } else {
+            for (int32_t i = 1; i <= numNew; ++i) {
+                setSeen(mMaxSeq + i, false);
+            }
+        }
+
+        mMaxSeq = seq;
+    } else if (seq <= mMaxSeq - kWindowSize || isSeen(seq)) {
+        return false;
+    }
+
+    if (seq < mBaseSeq) {
+        mBaseSeq = seq;
+    }
+
+    setSeen(seq, true);
+
+    ++mNumUnique;
+    ++p->mNumFirst;
+
+    return true;
+}
+
+void PathMerger::getPathStats(size_t path, PathStats *stats) const {
+    CHECK_LT(path, mNumPaths);
+
+    const Path &p = mPaths[path];
+
+    if (!p.mStarted) {
+        stats->mNumExpected = 0;
+        stats->mNumLost = 0;
+        stats->mNumFirst = 0;
+        return;
+    }
+
+    stats->mNumExpected = p.mMaxSeq - p.mBaseSeq + 1;
+
+    stats->mNumLost =
+        (stats->mNumExpected > p.mNumReceived)
+            ? stats->mNumExpected - p.mNumReceived : 0;
+
+    stats->mNumFirst = p.mNumFirst;
+}
+
+void PathMerger::getMergedStats(PathStats *stats) const {
+    if (!mStarted) {
+        stats->mNumExpected = 0;
+        stats->mNumLost = 0;
+        stats->mNumFirst = 0;
+        return;
+    }
+
+    stats->mNumExpected = mMaxSeq - mBaseSeq + 1;
+
+    stats->mNumLost =
+        (stats->mNumExpected > mNumUnique)
+            ? stats->mNumExpected - mNumUnique : 0;
+
+    stats->mNumFirst = mNumUnique;
+}
+
+}  // namespace android
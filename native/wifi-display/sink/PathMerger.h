@@ -0,0 +1,89 @@
+#ifndef PATH_MERGER_H_
+
+#define PATH_MERGER_H_
+
+#include <sys/types.h>
+#include <media/stagefright/foundation/ABase.h>
+
+#include <stdint.h>
+
+namespace android {
+
+// Merges the copies of an RTP stream arriving over redundant paths (as in
+// SMPTE 2022-7), the first copy of each sequence number is passed on and
+// any later ones are discarded. Tracks how many packets each path lost.
+// Not thread-safe.
+struct PathMerger {
+    PathMerger(size_t numPaths);
+    ~PathMerger();
+
+    // Forgets about the stream, the next packet starts a new one.
+    void reset();
+
+    // Returns true iff this is the first copy of "seqNo" on any path,
+    // false for duplicates and for packets too late to tell.
+    bool addPacket(size_t path, uint16_t seqNo);
+
+    struct PathStats {
+        // Packets the path should have delivered since it saw its first
+        // one and those that didn't show up on it.
+        uint32_t mNumExpected;
+        uint32_t mNumLost;
+
+        // Packets the path delivered before any other did.
+        uint32_t mNumFirst;
+    };
+
+    void getPathStats(size_t path, PathStats *stats) const;
+
+    // Same, for the merged stream, i.e. mNumLost are the packets lost on
+    // every path.
+    void getMergedStats(PathStats *stats) const;
+
+private:
+    enum {
+        // Sequence numbers remembered for spotting duplicates.
+        kWindowSize = 1024,
+
+        // Anything further away from the newest packet on the same path
+        // means the source started over. Once every path says so we do
+        // too, or once the ones that don't have been silent for
+        // kMaxUnconfirmedJump packets.
+        kMaxDropout = 3000,
+        kMaxUnconfirmedJump = 64,
+    };
+
+    struct Path {
+        bool mStarted;
+        bool mJumped;
+        int32_t mBaseSeq;
+        int32_t mMaxSeq;
+        uint32_t mNumReceived;
+        uint32_t mNumFirst;
+    };
+
+    size_t mNumPaths;
+    Path *mPaths;
+
+    // Sequence numbers are extended to 32 bits relative to mMaxSeq.
+    bool mStarted;
+    int32_t mBaseSeq;
+    int32_t mMaxSeq;
+    uint32_t mNumUnique;
+    uint32_t mSeen[kWindowSize / 32];
+
+    // Packets dropped because their path jumped since one that didn't
+    // was last heard from.
+    uint32_t mNumUnconfirmedJump;
+
+    bool isSeen(int32_t seq) const;
+    void setSeen(int32_t seq, bool seen);
+
+    bool allPathsJumped() const;
+
+    DISALLOW_EVIL_CONSTRUCTORS(PathMerger);
+};
+
+}  // namespace android
+
+#endif  // PATH_MERGER_H_
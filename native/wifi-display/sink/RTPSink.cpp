@@ -5,22 +5,30 @@
 
 #include "RTPSink.h"
 
+#include "AClock.h"
 #include "ANetworkSession.h"
 #include "TunnelRenderer.h"
 
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/foundation/hexdump.h>
 #include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/Utils.h>
 
+#include <cutils/properties.h>
+
 namespace android {
 
 struct RTPSink::Source : public RefBase {
     Source(uint16_t seq, const sp<ABuffer> &buffer,
            const sp<AMessage> queueBufferMsg);
 
+    // Hands packets straight to the renderer from the calling thread.
+    Source(uint16_t seq, const sp<ABuffer> &buffer,
+           const sp<TunnelRenderer> &renderer);
+
     bool updateSeq(uint16_t seq, const sp<ABuffer> &buffer);
 
     void addReportBlock(uint32_t ssrc, const sp<ABuffer> &buf);
@@ -35,6 +43,7 @@ private:
     static const uint32_t kRTPSeqMod = 1u << 16;
 
     sp<AMessage> mQueueBufferMsg;
+    sp<TunnelRenderer> mRenderer;
 
     uint16_t mMaxSeq;
     uint32_t mCycles;
@@ -65,6 +74,18 @@ RTPSink::Source::Source(
     queuePacket(buffer);
 }
 
+RTPSink::Source::Source(
+        uint16_t seq, const sp<ABuffer> &buffer,
+        const sp<TunnelRenderer> &renderer)
+    : mRenderer(renderer),
+      mProbation(kMinSequential) {
+    initSeq(seq);
+    mMaxSeq = seq - 1;
+
+    buffer->setInt32Data(mCycles | seq);
+    queuePacket(buffer);
+}
+
 RTPSink::Source::~Source() {
 }
 
@@ -151,6 +172,11 @@ bool RTPSink::Source::updateSeq(uint16_t seq, const sp<ABuffer> &buffer) {
 }
 
 void RTPSink::Source::queuePacket(const sp<ABuffer> &buffer) {
+    if (mRenderer != NULL) {
+        mRenderer->queueBufferDirect(buffer);
+        return;
+    }
+
     sp<AMessage> msg = mQueueBufferMsg->dup();
     msg->setBuffer("buffer", buffer);
     msg->post();
@@ -221,22 +247,85 @@ void RTPSink::Source::addReportBlock(
 
 ////////////////////////////////////////////////////////////////////////////////
 
+struct RTPSink::DirectReceiver : public ANetworkSession::DatagramHandler {
+    DirectReceiver(const wp<RTPSink> &sink)
+        : mSink(sink) {
+    }
+
+    virtual void onDatagram(
+            int32_t sessionID,
+            const sp<ABuffer> &data,
+            int64_t arrivalTimeUs,
+            const struct sockaddr_in &fromAddr,
+            uint32_t numKernelDrops) {
+        sp<RTPSink> sink = mSink.promote();
+
+        if (sink != NULL) {
+            sink->onDirectPacket(sessionID, data, fromAddr, numKernelDrops);
+        }
+    }
+
+private:
+    wp<RTPSink> mSink;
+
+    DISALLOW_EVIL_CONSTRUCTORS(DirectReceiver);
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 RTPSink::RTPSink(
         const sp<ANetworkSession> &netSession,
-        const sp<ISurfaceTexture> &surfaceTex)
+        const sp<ISurfaceTexture> &surfaceTex,
+        const sp<AMessage> &notify)
     : mNetSession(netSession),
       mSurfaceTex(surfaceTex),
+      mNotify(notify),
+      mClock(AClock::GetDefault()),
+      mUseDirectPath(false),
+      mDirectSawFirstPacket(false),
       mRTPPort(0),
       mRTPSessionID(0),
       mRTCPSessionID(0),
+      mMulticastPort(0),
+      mMulticastSessionID(0),
+      mRedundantPort(0),
+      mRedundantSessionID(0),
+      mPathMerger(kNumPaths),
+      mLastPathStatsUs(-1ll),
       mFirstArrivalTimeUs(-1ll),
       mNumPacketsReceived(0ll),
       mRegression(1000),
       mMaxDelayMs(-1ll),
-      mIsConnectRemotePort(false) {
+      mNumBytesReceived(0ll),
+      mNumKernelDrops(0ll),
+      mLastBitrateCheckUs(-1ll),
+      mLastBitrateCheckBytes(0ll),
+      mSocketBufferBitrate(kDefaultBitrate),
+      mIsConnectRemotePort(false),
+      mSendingReports(false) {
 }
 
 RTPSink::~RTPSink() {
+    if (mUseDirectPath) {
+        mNetSession->setDatagramHandler(mRTPSessionID, NULL);
+
+        if (mRedundantSessionID != 0) {
+            mNetSession->setDatagramHandler(mRedundantSessionID, NULL);
+        }
+
+        if (mMulticastSessionID != 0) {
+            mNetSession->setDatagramHandler(mMulticastSessionID, NULL);
+        }
+    }
+
+    if (mMulticastSessionID != 0) {
+        mNetSession->destroySession(mMulticastSessionID);
+    }
+
+    if (mRedundantSessionID != 0) {
+        mNetSession->destroySession(mRedundantSessionID);
+    }
+
     if (mRTCPSessionID != 0) {
         mNetSession->destroySession(mRTCPSessionID);
     }
@@ -284,6 +373,50 @@ status_t RTPSink::init(bool useTCPInterleaving) {
         return UNKNOWN_ERROR;
     }
 
+    status_t err = mNetSession->tuneSocketBuffers(
+            mRTPSessionID, mSocketBufferBitrate, kSocketBufferLatencyUs);
+
+    if (err != OK) {
+        ALOGW("failed to size RTP socket buffers (%d)", err);
+    }
+
+    // Asks the source for a second copy of the stream on another socket,
+    // losing a packet then takes losing it on both.
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.redundant-rtp", val, NULL)
+            && (!strcasecmp("true", val) || !strcmp("1", val))) {
+        int32_t port = mRTPPort + kRedundantPortOffset;
+
+        int32_t sessionID;
+        err = mNetSession->createUDPSession(port, rtpNotify, &sessionID);
+
+        if (err != OK) {
+            ALOGW("failed to create redundant RTP socket on port %d", port);
+        } else {
+            mNetSession->tuneSocketBuffers(
+                    sessionID, mSocketBufferBitrate, kSocketBufferLatencyUs);
+
+            mRedundantPort = port;
+            mRedundantSessionID = sessionID;
+        }
+    }
+
+    if (property_get("media.wfd.sink.direct-rtp", val, NULL)
+            && (!strcasecmp("true", val) || !strcmp("1", val))) {
+        ALOGI("Handling RTP packets on the network thread.");
+
+        // Packets take a while to show up after this, they're still
+        // handled on our looper until then.
+        mUseDirectPath = true;
+        mNetSession->setDatagramHandler(
+                mRTPSessionID, new DirectReceiver(this));
+
+        if (mRedundantSessionID != 0) {
+            mNetSession->setDatagramHandler(
+                    mRedundantSessionID, new DirectReceiver(this));
+        }
+    }
+
     return OK;
 }
 
@@ -291,6 +424,61 @@ int32_t RTPSink::getRTPPort() const {
     return mRTPPort;
 }
 
+int32_t RTPSink::getRedundantRTPPort() const {
+    return mRedundantPort;
+}
+
+void RTPSink::setRendererOutputHandler(
+        const sp<TunnelRenderer::OutputHandler> &handler) {
+    Mutex::Autolock autoLock(mLock);
+    mRendererOutputHandler = handler;
+}
+
+void RTPSink::getRendererQueueStats(size_t *numPackets, int64_t *numBytes) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (mRenderer == NULL) {
+        *numPackets = 0;
+        *numBytes = 0ll;
+        return;
+    }
+
+    mRenderer->getQueueStats(numPackets, numBytes);
+}
+
+void RTPSink::prepareRenderer() {
+    Mutex::Autolock autoLock(mLock);
+
+    createRendererLocked();
+    mRenderer->prepare();
+}
+
+void RTPSink::restartStream(bool formatChanged) {
+    bool wasConnected;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        mSources.clear();
+        mDirectSawFirstPacket = false;
+        mPathMerger.reset();
+
+        wasConnected = mIsConnectRemotePort;
+        mIsConnectRemotePort = false;
+
+        if (mRenderer != NULL) {
+            mRenderer->restart(formatChanged);
+        }
+    }
+
+    // Not under mLock, the network thread may need it before it gets to
+    // carry these out.
+    if (wasConnected) {
+        mNetSession->disconnectUDPSession(mRTPSessionID);
+        mNetSession->disconnectUDPSession(mRTCPSessionID);
+    }
+}
+
 void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
     switch (msg->what()) {
         case kWhatRTPNotify:
@@ -335,24 +523,58 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
                     sp<ABuffer> data;
                     CHECK(msg->findBuffer("data", &data));
 
+                    int32_t kernelDrops;
+                    if (msg->findInt32("kernelDrops", &kernelDrops)) {
+                        Mutex::Autolock autoLock(mLock);
+                        mNumKernelDrops += kernelDrops;
+
+                        ALOGW("socket dropped %d datagrams (%lld total)",
+                              kernelDrops, mNumKernelDrops);
+                    }
+
+                    if (msg->what() == kWhatRTPNotify) {
+                        Mutex::Autolock autoLock(mLock);
+                        mNumBytesReceived += data->size();
+                    }
+
                     int32_t fromPort = 0;
                     AString fromAddr;
+                    bool redundant =
+                        mRedundantSessionID != 0
+                            && sessionID == mRedundantSessionID;
+
                     if (msg->findString("fromAddr", &fromAddr)
                             && msg->findInt32("fromPort", &fromPort)) {
-                        if (!mIsConnectRemotePort) {
+                        if (!mIsConnectRemotePort && mMulticastSessionID == 0
+                                && !redundant) {
                             connect(fromAddr.c_str(), fromPort, fromPort+1);
                         }
                     }
 
                     status_t err;
                     if (msg->what() == kWhatRTPNotify) {
-                        err = parseRTP(data);
+                        err = parseRTP(
+                                redundant ? kRedundantPath : kPrimaryPath,
+                                data);
                     } else {
                         err = parseRTCP(data);
                     }
                     break;
                 }
 
+                case ANetworkSession::kWhatConnected:
+                {
+                    // The source's hostname has been resolved.
+                    int64_t connectLatencyUs;
+                    CHECK(msg->findInt64(
+                                "connectLatencyUs", &connectLatencyUs));
+
+                    ALOGI("%s session connected after %lld us",
+                          msg->what() == kWhatRTPNotify ? "RTP" : "RTCP",
+                          connectLatencyUs);
+                    break;
+                }
+
                 default:
                     TRESPASS();
             }
@@ -365,9 +587,23 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
-        case kWhatPacketLost:
+        case kWhatRendererNotify:
         {
-            onPacketLost(msg);
+            onRendererNotify(msg);
+            break;
+        }
+
+        case kWhatConnectRemote:
+        {
+            AString fromAddr;
+            CHECK(msg->findString("fromAddr", &fromAddr));
+
+            int32_t fromPort;
+            CHECK(msg->findInt32("fromPort", &fromPort));
+
+            if (!mIsConnectRemotePort && mMulticastSessionID == 0) {
+                connect(fromAddr.c_str(), fromPort, fromPort + 1);
+            }
             break;
         }
 
@@ -381,7 +617,7 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
 
             status_t err;
             if (isRTP) {
-                err = parseRTP(buffer);
+                err = parseRTP(kPrimaryPath, buffer);
             } else {
                 err = parseRTCP(buffer);
             }
@@ -402,15 +638,14 @@ status_t RTPSink::injectPacket(bool isRTP, const sp<ABuffer> &buffer) {
     return OK;
 }
 
-status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
-    size_t size = buffer->size();
+// static
+status_t RTPSink::ParsePacketHeader(
+        const uint8_t *data, size_t size, PacketInfo *info) {
     if (size < 12) {
         // Too short to be a valid RTP header.
         return ERROR_MALFORMED;
     }
 
-    const uint8_t *data = buffer->data();
-
     if ((data[0] >> 6) != 2) {
         // Unsupported version.
         return ERROR_UNSUPPORTED;
@@ -461,9 +696,28 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
         payloadOffset += 4 + extensionLength;
     }
 
-    uint32_t srcId = U32_AT(&data[8]);
-    uint32_t rtpTime = U32_AT(&data[4]);
-    uint16_t seqNo = U16_AT(&data[2]);
+    info->mSSRC = U32_AT(&data[8]);
+    info->mRTPTime = U32_AT(&data[4]);
+    info->mSeqNo = U16_AT(&data[2]);
+    info->mPayloadType = data[1] & 0x7f;
+    info->mMarker = (data[1] >> 7) != 0;
+    info->mPayloadOffset = payloadOffset;
+    info->mPayloadSize = size - payloadOffset;
+
+    return OK;
+}
+
+status_t RTPSink::parseRTP(size_t path, const sp<ABuffer> &buffer) {
+    PacketInfo info;
+    status_t err = ParsePacketHeader(buffer->data(), buffer->size(), &info);
+
+    if (err != OK) {
+        return err;
+    }
+
+    uint32_t srcId = info.mSSRC;
+    uint32_t rtpTime = info.mRTPTime;
+    uint16_t seqNo = info.mSeqNo;
 
     int64_t arrivalTimeUs;
     CHECK(buffer->meta()->findInt64("arrivalTimeUs", &arrivalTimeUs));
@@ -499,31 +753,112 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
     sp<AMessage> meta = buffer->meta();
     meta->setInt32("ssrc", srcId);
     meta->setInt32("rtp-time", rtpTime);
-    meta->setInt32("PT", data[1] & 0x7f);
-    meta->setInt32("M", data[1] >> 7);
+    meta->setInt32("PT", info.mPayloadType);
+    meta->setInt32("M", info.mMarker);
 
-    buffer->setRange(payloadOffset, size - payloadOffset);
+    buffer->setRange(info.mPayloadOffset, info.mPayloadSize);
 
-    ssize_t index = mSources.indexOfKey(srcId);
-    if (index < 0) {
-        if (mRenderer == NULL) {
-            sp<AMessage> notifyLost = new AMessage(kWhatPacketLost, id());
-            notifyLost->setInt32("ssrc", srcId);
+    Mutex::Autolock autoLock(mLock);
+    queuePacketLocked(path, info, buffer);
+
+    return OK;
+}
+
+void RTPSink::createRendererLocked() {
+    if (mRenderer != NULL) {
+        return;
+    }
+
+    sp<AMessage> notify = new AMessage(kWhatRendererNotify, id());
+    mRenderer = new TunnelRenderer(notify, mSurfaceTex);
+
+    if (mRendererOutputHandler != NULL) {
+        mRenderer->setOutputHandler(mRendererOutputHandler);
+    }
+
+    looper()->registerHandler(mRenderer);
+}
+
+void RTPSink::queuePacketLocked(
+        size_t path, const PacketInfo &info, const sp<ABuffer> &buffer) {
+    if (mRedundantSessionID != 0 && !mPathMerger.addPacket(path, info.mSeqNo)) {
+        // The other path delivered it already.
+        return;
+    }
 
-            mRenderer = new TunnelRenderer(notifyLost, mSurfaceTex);
-            looper()->registerHandler(mRenderer);
+    ssize_t index = mSources.indexOfKey(info.mSSRC);
+    if (index < 0) {
+        if (mSources.isEmpty()) {
+            notifyMilestone(kWhatFirstPacket, mClock->nowUs());
         }
 
-        sp<AMessage> queueBufferMsg =
-            new AMessage(TunnelRenderer::kWhatQueueBuffer, mRenderer->id());
+        createRendererLocked();
+
+        sp<Source> source;
+        if (mUseDirectPath) {
+            source = new Source(info.mSeqNo, buffer, mRenderer);
+        } else {
+            sp<AMessage> queueBufferMsg =
+                new AMessage(TunnelRenderer::kWhatQueueBuffer, mRenderer->id());
+
+            source = new Source(info.mSeqNo, buffer, queueBufferMsg);
+        }
 
-        sp<Source> source = new Source(seqNo, buffer, queueBufferMsg);
-        mSources.add(srcId, source);
+        mSources.add(info.mSSRC, source);
     } else {
-        mSources.valueAt(index)->updateSeq(seqNo, buffer);
+        mSources.valueAt(index)->updateSeq(info.mSeqNo, buffer);
     }
+}
 
-    return OK;
+// Called on the network thread for every packet arriving on the RTP
+// session while the direct path is in use.
+void RTPSink::onDirectPacket(
+        int32_t sessionID,
+        const sp<ABuffer> &buffer,
+        const struct sockaddr_in &fromAddr,
+        uint32_t numKernelDrops) {
+    PacketInfo info;
+    if (ParsePacketHeader(buffer->data(), buffer->size(), &info) != OK) {
+        return;
+    }
+
+    // mRedundantSessionID doesn't change once we're called, see RTPSink.h.
+    bool redundant =
+        mRedundantSessionID != 0 && sessionID == mRedundantSessionID;
+
+    // The renderer may take it for the end of a video frame.
+    buffer->meta()->setInt32("M", info.mMarker);
+
+    size_t size = buffer->size();
+    buffer->setRange(info.mPayloadOffset, info.mPayloadSize);
+
+    Mutex::Autolock autoLock(mLock);
+
+    if (!mDirectSawFirstPacket && !redundant) {
+        // connect() belongs on our looper like everything else.
+        mDirectSawFirstPacket = true;
+
+        uint32_t ip = ntohl(fromAddr.sin_addr.s_addr);
+
+        sp<AMessage> msg = new AMessage(kWhatConnectRemote, id());
+        msg->setString(
+                "fromAddr",
+                StringPrintf(
+                    "%u.%u.%u.%u",
+                    ip >> 24,
+                    (ip >> 16) & 0xff,
+                    (ip >> 8) & 0xff,
+                    ip & 0xff).c_str());
+        msg->setInt32("fromPort", ntohs(fromAddr.sin_port));
+        msg->post();
+    }
+
+    ++mNumPacketsReceived;
+    mNumBytesReceived += size;
+    mNumKernelDrops += numKernelDrops;
+
+    queuePacketLocked(
+            redundant ? kRedundantPath : kPrimaryPath, info, buffer);
 }
 
 status_t RTPSink::parseRTCP(const sp<ABuffer> &buffer) {
@@ -665,13 +1000,74 @@ status_t RTPSink::connect(
             mRTCPSessionID, buf->data(), buf->size());
 #endif
 
-    scheduleSendRR();
+    if (!mSendingReports) {
+        mSendingReports = true;
+        scheduleSendRR();
+    }
+
+    return OK;
+}
+
+status_t RTPSink::joinMulticastGroup(const char *groupAddr, int32_t groupPort) {
+    if (mMulticastSessionID != 0) {
+        if (mMulticastGroup == groupAddr && mMulticastPort == groupPort) {
+            // Still a member after resuming the session.
+            return OK;
+        }
+
+        if (mUseDirectPath) {
+            mNetSession->setDatagramHandler(mMulticastSessionID, NULL);
+        }
+
+        mNetSession->destroySession(mMulticastSessionID);
+        mMulticastSessionID = 0;
+    }
+
+    ALOGI("joining multicast group %s:%d", groupAddr, groupPort);
+
+    sp<AMessage> rtpNotify = new AMessage(kWhatRTPNotify, id());
+
+    int32_t sessionID;
+    status_t err = mNetSession->createUDPSession(
+            groupPort, rtpNotify, &sessionID);
+
+    if (err != OK) {
+        ALOGE("failed to create multicast socket on port %d", groupPort);
+        return err;
+    }
+
+    struct in_addr anyAddr;
+    anyAddr.s_addr = htonl(INADDR_ANY);
+
+    err = mNetSession->joinMulticastGroup(sessionID, groupAddr, anyAddr);
+
+    if (err != OK) {
+        ALOGE("failed to join multicast group %s (%d)", groupAddr, err);
+
+        mNetSession->destroySession(sessionID);
+        return err;
+    }
+
+    err = mNetSession->tuneSocketBuffers(
+            sessionID, mSocketBufferBitrate, kSocketBufferLatencyUs);
+
+    if (err != OK) {
+        ALOGW("failed to size multicast socket buffers (%d)", err);
+    }
+
+    if (mUseDirectPath) {
+        mNetSession->setDatagramHandler(sessionID, new DirectReceiver(this));
+    }
+
+    mMulticastGroup = groupAddr;
+    mMulticastPort = groupPort;
+    mMulticastSessionID = sessionID;
 
     return OK;
 }
 
 void RTPSink::scheduleSendRR() {
-    (new AMessage(kWhatSendRR, id()))->post(2000000ll);
+    mClock->post(new AMessage(kWhatSendRR, id()), 2000000ll);
 }
 
 void RTPSink::addSDES(const sp<ABuffer> &buffer) {
@@ -723,6 +1119,12 @@ void RTPSink::addSDES(const sp<ABuffer> &buffer) {
 }
 
 void RTPSink::onSendRR() {
+    if (!mIsConnectRemotePort) {
+        // Between streams, nowhere to send it to.
+        scheduleSendRR();
+        return;
+    }
+
     sp<ABuffer> buf = new ABuffer(1500);
     buf->setRange(0, 0);
 
@@ -739,17 +1141,22 @@ void RTPSink::onSendRR() {
     buf->setRange(0, 8);
 
     size_t numReportBlocks = 0;
-    for (size_t i = 0; i < mSources.size(); ++i) {
-        uint32_t ssrc = mSources.keyAt(i);
-        sp<Source> source = mSources.valueAt(i);
 
-        if (numReportBlocks > 31 || buf->size() + 24 > buf->capacity()) {
-            // Cannot fit another report block.
-            break;
-        }
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        for (size_t i = 0; i < mSources.size(); ++i) {
+            uint32_t ssrc = mSources.keyAt(i);
+            sp<Source> source = mSources.valueAt(i);
+
+            if (numReportBlocks > 31 || buf->size() + 24 > buf->capacity()) {
+                // Cannot fit another report block.
+                break;
+            }
 
-        source->addReportBlock(ssrc, buf);
-        ++numReportBlocks;
+            source->addReportBlock(ssrc, buf);
+            ++numReportBlocks;
+        }
     }
 
     ptr[0] |= numReportBlocks;  // 5 bit
@@ -764,12 +1171,190 @@ void RTPSink::onSendRR() {
 
     mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
 
+    retuneSocketBuffers();
+
+    if (mRedundantSessionID != 0) {
+        logPathStats();
+    }
+
     scheduleSendRR();
 }
 
+void RTPSink::logPathStats() {
+    int64_t nowUs = mClock->nowUs();
+
+    if (mLastPathStatsUs >= 0ll
+            && nowUs < mLastPathStatsUs + kPathStatsIntervalUs) {
+        return;
+    }
+
+    mLastPathStatsUs = nowUs;
+
+    PathMerger::PathStats stats[kNumPaths];
+    PathMerger::PathStats merged;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        for (size_t i = 0; i < kNumPaths; ++i) {
+            mPathMerger.getPathStats(i, &stats[i]);
+        }
+
+        mPathMerger.getMergedStats(&merged);
+    }
+
+    for (size_t i = 0; i < kNumPaths; ++i) {
+        ALOGI("[path %d] %u packets lost (%.2f%%), delivered %.1f%% first",
+              i,
+              stats[i].mNumLost,
+              stats[i].mNumExpected > 0
+                ? 100.0 * stats[i].mNumLost / stats[i].mNumExpected : 0.0,
+              merged.mNumFirst > 0
+                ? 100.0 * stats[i].mNumFirst / merged.mNumFirst : 0.0);
+    }
+
+    ALOGI("[merged] %u packets lost on both paths (%.2f%%)",
+          merged.mNumLost,
+          merged.mNumExpected > 0
+            ? 100.0 * merged.mNumLost / merged.mNumExpected : 0.0);
+}
+
+// Resizes the RTP socket buffers whenever the measured bitrate strays
+// too far from the one they were last sized for.
+void RTPSink::retuneSocketBuffers() {
+    if (mRTPSessionID == 0) {
+        return;
+    }
+
+    int64_t nowUs = mClock->nowUs();
+
+    int64_t numBytesReceived;
+    {
+        Mutex::Autolock autoLock(mLock);
+        numBytesReceived = mNumBytesReceived;
+    }
+
+    if (mLastBitrateCheckUs < 0ll) {
+        mLastBitrateCheckUs = nowUs;
+        mLastBitrateCheckBytes = numBytesReceived;
+        return;
+    }
+
+    int64_t elapsedUs = nowUs - mLastBitrateCheckUs;
+    if (elapsedUs <= 0ll) {
+        return;
+    }
+
+    int32_t bitrate =
+        ((numBytesReceived - mLastBitrateCheckBytes) * 8000000ll) / elapsedUs;
+
+    mLastBitrateCheckUs = nowUs;
+    mLastBitrateCheckBytes = numBytesReceived;
+
+    if (bitrate == 0
+            || (bitrate < mSocketBufferBitrate * 5 / 4
+                && bitrate > mSocketBufferBitrate / 2)) {
+        return;
+    }
+
+    ALOGI("retuning RTP socket buffers for %.2f Mbit/sec",
+          bitrate / 1E6);
+
+    status_t err = mNetSession->tuneSocketBuffers(
+            mRTPSessionID, bitrate, kSocketBufferLatencyUs);
+
+    if (err == OK && mMulticastSessionID != 0) {
+        err = mNetSession->tuneSocketBuffers(
+                mMulticastSessionID, bitrate, kSocketBufferLatencyUs);
+    }
+
+    if (err == OK && mRedundantSessionID != 0) {
+        err = mNetSession->tuneSocketBuffers(
+                mRedundantSessionID, bitrate, kSocketBufferLatencyUs);
+    }
+
+    if (err == OK) {
+        mSocketBufferBitrate = bitrate;
+    }
+}
+
+void RTPSink::onRendererNotify(const sp<AMessage> &msg) {
+    int32_t what;
+    CHECK(msg->findInt32("what", &what));
+
+    switch (what) {
+        case TunnelRenderer::kWhatPacketLost:
+        {
+            onPacketLost(msg);
+            break;
+        }
+
+        case TunnelRenderer::kWhatVideoLoss:
+        {
+            // Too late for a retransmission, leave it to WifiDisplaySink.
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatVideoLoss);
+            notify->post();
+            break;
+        }
+
+        case TunnelRenderer::kWhatVideoRecovered:
+        {
+            int64_t recoveryTimeUs;
+            CHECK(msg->findInt64("recoveryTimeUs", &recoveryTimeUs));
+
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatVideoRecovered);
+            notify->setInt64("recoveryTimeUs", recoveryTimeUs);
+            notify->post();
+            break;
+        }
+
+        case TunnelRenderer::kWhatPlayerStarted:
+        {
+            int64_t timeUs;
+            CHECK(msg->findInt64("timeUs", &timeUs));
+
+            notifyMilestone(kWhatPlayerStarted, timeUs);
+            break;
+        }
+
+        case TunnelRenderer::kWhatFirstFrame:
+        {
+            int64_t timeUs;
+            CHECK(msg->findInt64("timeUs", &timeUs));
+
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatFirstFrame);
+            notify->setInt64("timeUs", timeUs);
+
+            int64_t blackoutUs;
+            if (msg->findInt64("blackoutUs", &blackoutUs)) {
+                notify->setInt64("blackoutUs", blackoutUs);
+            }
+
+            notify->post();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
 void RTPSink::onPacketLost(const sp<AMessage> &msg) {
+    // The renderer may predate the first packet and doesn't know the SSRC,
+    // there's only ever the one stream from the source.
     uint32_t srcId;
-    CHECK(msg->findInt32("ssrc", (int32_t *)&srcId));
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        if (mSources.isEmpty()) {
+            return;
+        }
+
+        srcId = mSources.keyAt(0);
+    }
 
     int32_t seqNo;
     CHECK(msg->findInt32("seqNo", &seqNo));
@@ -802,5 +1387,12 @@ void RTPSink::onPacketLost(const sp<AMessage> &msg) {
     mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
 }
 
+void RTPSink::notifyMilestone(int32_t what, int64_t timeUs) {
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", what);
+    notify->setInt64("timeUs", timeUs);
+    notify->post();
+}
+
 }  // namespace android
 
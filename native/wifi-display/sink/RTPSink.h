@@ -4,23 +4,43 @@
 #define RTP_SINK_H_
 
 #include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/AString.h>
+#include <utils/threads.h>
 
 #include "LinearRegression.h"
+#include "PathMerger.h"
+#include "TunnelRenderer.h"
 
 #include <gui/Surface.h>
 
+#include <netinet/in.h>
+
 namespace android {
 
 struct ABuffer;
+struct AClock;
 struct ANetworkSession;
-struct TunnelRenderer;
 
 // Creates a pair of sockets for RTP/RTCP traffic, instantiates a renderer
 // for incoming transport stream data and occasionally sends statistics over
 // the RTCP channel.
 struct RTPSink : public AHandler {
     RTPSink(const sp<ANetworkSession> &netSession,
-            const sp<ISurfaceTexture> &surfaceTex);
+            const sp<ISurfaceTexture> &surfaceTex,
+            const sp<AMessage> &notify);
+
+    enum {
+        // Video data went missing for good, the decoder needs an IDR frame.
+        kWhatVideoLoss,
+        // An IDR frame arrived after video loss, carries "recoveryTimeUs".
+        kWhatVideoRecovered,
+        // Startup milestones, each carries the "timeUs" it was reached at.
+        kWhatPlayerStarted,
+        kWhatFirstPacket,
+        // Once per stream, after a restartStream() also carries the
+        // "blackoutUs" since the previous stream's last frame.
+        kWhatFirstFrame,
+    };
 
     // If TCP interleaving is used, no UDP sockets are created, instead
     // incoming RTP/RTCP packets (arriving on the RTSP control connection)
@@ -30,10 +50,52 @@ struct RTPSink : public AHandler {
     status_t connect(
             const char *host, int32_t remoteRtpPort, int32_t remoteRtcpPort);
 
+    // Additionally receives RTP from the given multicast group, on a
+    // socket of its own bound to "groupPort". The source's RTCP port can't
+    // be told from the group's packets then, connect() needs to be called
+    // explicitly. Retransmissions still arrive on the unicast RTP socket.
+    status_t joinMulticastGroup(const char *groupAddr, int32_t groupPort);
+
     int32_t getRTPPort() const;
 
+    // The socket receiving a second copy of the stream over a redundant
+    // path (see media.wfd.sink.redundant-rtp), 0 if there is none.
+    int32_t getRedundantRTPPort() const;
+
+    // Instantiates the renderer and has it start up its player before
+    // any data arrives.
+    void prepareRenderer();
+
+    // After the control connection was re-established the source starts
+    // over with a new stream, possibly from a different port. Keeps the
+    // sockets and the renderer's player, forgets about the old stream.
+    void restartStream(bool formatChanged);
+
     status_t injectPacket(bool isRTP, const sp<ABuffer> &buffer);
 
+    // Hands the renderer's output to "handler" instead of a player, see
+    // TunnelRenderer::setOutputHandler. To be called before init().
+    void setRendererOutputHandler(
+            const sp<TunnelRenderer::OutputHandler> &handler);
+
+    // The renderer's reordering queue, zeros until it exists. May be
+    // called from any thread.
+    void getRendererQueueStats(size_t *numPackets, int64_t *numBytes);
+
+    struct PacketInfo {
+        uint32_t mSSRC;
+        uint32_t mRTPTime;
+        uint16_t mSeqNo;
+        uint8_t mPayloadType;
+        bool mMarker;
+        size_t mPayloadOffset;
+        size_t mPayloadSize;
+    };
+
+    // Validates the RTP header, strips CSRCs, extension and padding.
+    static status_t ParsePacketHeader(
+            const uint8_t *data, size_t size, PacketInfo *info);
+
 protected:
     virtual void onMessageReceived(const sp<AMessage> &msg);
     virtual ~RTPSink();
@@ -43,39 +105,106 @@ private:
         kWhatRTPNotify,
         kWhatRTCPNotify,
         kWhatSendRR,
-        kWhatPacketLost,
+        kWhatRendererNotify,
         kWhatInject,
+        kWhatConnectRemote,
     };
 
     struct Source;
     struct StreamSource;
+    struct DirectReceiver;
+
+    // The RTP socket should be able to hold this much of the incoming
+    // stream while the looper is busy elsewhere.
+    static const int64_t kSocketBufferLatencyUs = 200000ll;
+
+    // Assumed bitrate until we have measured the actual one.
+    static const int32_t kDefaultBitrate = 10000000;
+
+    // Where the redundant path's socket goes relative to mRTPPort.
+    static const int32_t kRedundantPortOffset = 100;
+
+    // How often per path loss is logged while there are two of them.
+    static const int64_t kPathStatsIntervalUs = 10000000ll;
+
+    enum {
+        kPrimaryPath,
+        kRedundantPath,
+        kNumPaths,
+    };
 
     sp<ANetworkSession> mNetSession;
     sp<ISurfaceTexture> mSurfaceTex;
+    sp<AMessage> mNotify;
+    sp<AClock> mClock;
+
+    // With the direct path enabled (media.wfd.sink.direct-rtp), RTP
+    // packets are parsed and queued right on the network thread, mLock
+    // then guards mDirectSawFirstPacket, the sources, the renderer's
+    // creation and the stats.
+    Mutex mLock;
+    bool mUseDirectPath;
+    bool mDirectSawFirstPacket;
+
     KeyedVector<uint32_t, sp<Source> > mSources;
 
     int32_t mRTPPort;
     int32_t mRTPSessionID;
     int32_t mRTCPSessionID;
 
+    AString mMulticastGroup;
+    int32_t mMulticastPort;
+    int32_t mMulticastSessionID;
+
+    // Set up by init() before any DatagramHandler is installed and never
+    // changed afterwards, the network thread reads it without mLock.
+    int32_t mRedundantPort;
+    int32_t mRedundantSessionID;
+
+    // Drops the copies already received on the other path, guarded by
+    // mLock.
+    PathMerger mPathMerger;
+    int64_t mLastPathStatsUs;
+
     int64_t mFirstArrivalTimeUs;
     int64_t mNumPacketsReceived;
     LinearRegression mRegression;
     int64_t mMaxDelayMs;
 
+    int64_t mNumBytesReceived;
+    int64_t mNumKernelDrops;
+    int64_t mLastBitrateCheckUs;
+    int64_t mLastBitrateCheckBytes;
+    int32_t mSocketBufferBitrate;
+
     sp<TunnelRenderer> mRenderer;
+    sp<TunnelRenderer::OutputHandler> mRendererOutputHandler;
 
     bool mIsConnectRemotePort;
-
-    status_t parseRTP(const sp<ABuffer> &buffer);
+    bool mSendingReports;
+
+    status_t parseRTP(size_t path, const sp<ABuffer> &buffer);
+    void createRendererLocked();
+    void queuePacketLocked(
+            size_t path, const PacketInfo &info, const sp<ABuffer> &buffer);
+
+    void onDirectPacket(
+            int32_t sessionID,
+            const sp<ABuffer> &buffer,
+            const struct sockaddr_in &fromAddr,
+            uint32_t numKernelDrops);
     status_t parseRTCP(const sp<ABuffer> &buffer);
     status_t parseBYE(const uint8_t *data, size_t size);
     status_t parseSR(const uint8_t *data, size_t size);
 
     void addSDES(const sp<ABuffer> &buffer);
     void onSendRR();
+    void logPathStats();
+    void onRendererNotify(const sp<AMessage> &msg);
     void onPacketLost(const sp<AMessage> &msg);
+    void notifyMilestone(int32_t what, int64_t timeUs);
     void scheduleSendRR();
+    void retuneSocketBuffers();
 
     DISALLOW_EVIL_CONSTRUCTORS(RTPSink);
 };
@@ -5,6 +5,7 @@
 
 #include "TunnelRenderer.h"
 
+#include "AClock.h"
 #include "ATSParser.h"
 
 #include <binder/IMemory.h>
@@ -15,6 +16,7 @@
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/Utils.h>
 #include <ui/DisplayInfo.h>
 
 namespace android {
@@ -102,13 +104,33 @@ void TunnelRenderer::StreamSource::doSomeWork() {
     Mutex::Autolock autoLock(mLock);
 
     while (!mIndicesAvailable.empty()) {
-        sp<ABuffer> srcBuffer = mOwner->dequeueBuffer();
+        uint32_t discontinuityMask;
+        sp<ABuffer> srcBuffer = mOwner->dequeueBuffer(&discontinuityMask);
         if (srcBuffer == NULL) {
             break;
         }
 
         ++mNumDeqeued;
 
+        if (mNumDeqeued > 1 && discontinuityMask != 0) {
+            ALOGI("stream restarted, re-anchoring time.");
+
+            // Unlike the renderer, the player always runs on real time.
+            sp<AMessage> extra = new AMessage;
+
+            extra->setInt32(
+                    IStreamListener::kKeyDiscontinuityMask,
+                    discontinuityMask);
+
+            extra->setInt64(
+                    IStreamListener::kKeyMediaTimeUs, ALooper::GetNowUs());
+
+            mListener->issueCommand(
+                    IStreamListener::DISCONTINUITY,
+                    false /* synchronous */,
+                    extra);
+        }
+
         if (mNumDeqeued == 1) {
             ALOGI("fixing real time now.");
 
@@ -143,14 +165,37 @@ void TunnelRenderer::StreamSource::doSomeWork() {
 ////////////////////////////////////////////////////////////////////////////////
 
 TunnelRenderer::TunnelRenderer(
-        const sp<AMessage> &notifyLost,
+        const sp<AMessage> &notify,
         const sp<ISurfaceTexture> &surfaceTex)
-    : mNotifyLost(notifyLost),
+    : mNotify(notify),
       mSurfaceTex(surfaceTex),
+      mClock(AClock::GetDefault()),
       mTotalBytesQueued(0ll),
       mLastDequeuedExtSeqNo(-1),
       mFirstFailedAttemptUs(-1ll),
-      mRequestedRetransmission(false) {
+      mRequestedRetransmission(false),
+      mWakeupPending(false),
+      mVideoPID(-1),
+      mVideoContinuityCounter(-1),
+      mVideoLossTimeUs(-1ll),
+      mHaveFrame(false),
+      mFrameIsIDR(false),
+      mFrameIsReference(false),
+      mFrameIsCorrupt(false),
+      mFrameBytesRemaining(-1),
+      mFrameLastDataUs(-1ll),
+      mFinishFramePending(false),
+      mFrameEndGuessed(false),
+      mDropUntilIDR(false),
+      mDropUntilIDRStartUs(-1ll),
+      mFirstFrameNotifyPending(true),
+      mLastFrameTimeUs(-1ll),
+      mDiscontinuityMask(0),
+      mNumFramesForwarded(0ll),
+      mNumFramesDroppedCorrupt(0ll),
+      mNumFramesDroppedDependent(0ll),
+      mNumFramesDroppedOverload(0ll),
+      mLastStatsUs(-1ll) {
 }
 
 TunnelRenderer::~TunnelRenderer() {
@@ -195,9 +240,424 @@ void TunnelRenderer::queueBuffer(const sp<ABuffer> &buffer) {
     }
 }
 
-sp<ABuffer> TunnelRenderer::dequeueBuffer() {
+void TunnelRenderer::setOutputHandler(const sp<OutputHandler> &handler) {
+    mOutputHandler = handler;
+}
+
+void TunnelRenderer::getQueueStats(
+        size_t *numPackets, int64_t *numBytes) const {
+    Mutex::Autolock autoLock(mLock);
+
+    *numPackets = mPackets.size();
+    *numBytes = mTotalBytesQueued;
+}
+
+void TunnelRenderer::queueBufferDirect(const sp<ABuffer> &buffer) {
+    queueBuffer(buffer);
+
+    Mutex::Autolock autoLock(mLock);
+
+    if (!mWakeupPending) {
+        mWakeupPending = true;
+        (new AMessage(kWhatBuffersQueued, id()))->post();
+    }
+}
+
+sp<ABuffer> TunnelRenderer::dequeueBuffer(uint32_t *discontinuityMask) {
+    Mutex::Autolock autoLock(mLock);
+
+    *discontinuityMask = 0;
+
+    while (mOutputPackets.empty()) {
+        sp<ABuffer> buffer = dequeueBufferLocked();
+
+        if (buffer == NULL) {
+            return NULL;
+        }
+
+        processTSPackets(buffer);
+    }
+
+    sp<ABuffer> buffer = *mOutputPackets.begin();
+    mOutputPackets.erase(mOutputPackets.begin());
+
+    *discontinuityMask = mDiscontinuityMask;
+    mDiscontinuityMask = 0;
+
+    return buffer;
+}
+
+void TunnelRenderer::restart(bool formatChanged) {
     Mutex::Autolock autoLock(mLock);
 
+    ALOGI("restarting%s", formatChanged ? " with a new format" : "");
+
+    mPackets.clear();
+    mTotalBytesQueued = 0ll;
+    mLastDequeuedExtSeqNo = -1;
+    mFirstFailedAttemptUs = -1ll;
+    mRequestedRetransmission = false;
+
+    mVideoPID = -1;
+    mVideoContinuityCounter = -1;
+    mVideoLossTimeUs = -1ll;
+
+    mOutputPackets.clear();
+    mFramePackets.clear();
+    mHaveFrame = false;
+    mFrameEndGuessed = false;
+    mDropUntilIDR = false;
+
+    mFirstFrameNotifyPending = true;
+
+    mDiscontinuityMask =
+        formatChanged
+            ? ATSParser::DISCONTINUITY_FORMATCHANGE
+            : ATSParser::DISCONTINUITY_TIME;
+}
+
+// static
+void TunnelRenderer::AppendTSPacket(
+        List<sp<ABuffer> > *packets, const uint8_t *packet) {
+    sp<ABuffer> buffer;
+    if (!packets->empty()) {
+        buffer = *--packets->end();
+    }
+
+    if (buffer == NULL || buffer->size() + 188 > buffer->capacity()) {
+        buffer = new ABuffer(kMaxTSPacketsPerBuffer * 188);
+        buffer->setRange(0, 0);
+
+        packets->push_back(buffer);
+    }
+
+    memcpy(buffer->data() + buffer->size(), packet, 188);
+    buffer->setRange(0, buffer->size() + 188);
+}
+
+// Everything but video goes straight to the player. Video packets are
+// collected until their frame is complete, which we know from the PES
+// packet's length. If it's unbounded, the frame ends with the RTP packet
+// carrying the marker bit, which our source sets, or with the start of
+// the next frame. Sources that don't set it cost us kMaxFrameIdleUs, the
+// frame is taken to be complete once no more data came for that long.
+// Packets we gave up on in dequeueBufferLocked() may or may not have
+// carried video, the continuity counters of the video PID tell us for
+// sure.
+void TunnelRenderer::processTSPackets(const sp<ABuffer> &buffer) {
+    const uint8_t *data = buffer->data();
+    size_t size = buffer->size();
+
+    int32_t marker;
+    if (!buffer->meta()->findInt32("M", &marker)) {
+        marker = false;
+    }
+
+    bool extendedFrame = false;
+
+    while (size >= 188 && data[0] == 0x47) {
+        bool payloadUnitStart = (data[1] & 0x40) != 0;
+        int32_t PID = ((data[1] & 0x1f) << 8) | data[2];
+        unsigned adaptationFieldControl = (data[3] >> 4) & 3;
+        int32_t continuityCounter = data[3] & 0x0f;
+
+        size_t offset = 4;
+        if (adaptationFieldControl & 2) {
+            offset += 1 + data[4];
+        }
+
+        const uint8_t *payload = NULL;
+        size_t payloadSize = 0;
+
+        if ((adaptationFieldControl & 1) && offset < 188) {
+            payload = &data[offset];
+            payloadSize = 188 - offset;
+
+            if (mVideoPID < 0
+                    && payloadUnitStart
+                    && payloadSize >= 4
+                    && !memcmp("\x00\x00\x01", payload, 3)
+                    && (payload[3] & 0xf0) == 0xe0) {
+                ALOGI("video is carried on PID 0x%04x", PID);
+                mVideoPID = PID;
+            }
+        }
+
+        if (PID != mVideoPID || payload == NULL) {
+            AppendTSPacket(&mOutputPackets, data);
+
+            data += 188;
+            size -= 188;
+            continue;
+        }
+
+        if (mVideoContinuityCounter >= 0
+                && continuityCounter != mVideoContinuityCounter
+                && continuityCounter
+                        != ((mVideoContinuityCounter + 1) & 0x0f)) {
+            ALOGI("lost video data on PID 0x%04x", PID);
+            onVideoLoss();
+        }
+
+        mVideoContinuityCounter = continuityCounter;
+
+        if (payloadUnitStart) {
+            if (mHaveFrame) {
+                finishFrame();
+            }
+
+            mHaveFrame = true;
+            mFrameIsCorrupt = false;
+            mFrameEndGuessed = false;
+
+            ParseFrameStart(
+                    payload, payloadSize, &mFrameIsIDR, &mFrameIsReference);
+
+            size_t PES_packet_length =
+                (payloadSize >= 6) ? U16_AT(&payload[4]) : 0;
+
+            mFrameBytesRemaining =
+                (PES_packet_length > 0) ? 6 + PES_packet_length : -1;
+        } else if (!mHaveFrame && mFrameEndGuessed) {
+            // We passed on the previous frame before it was complete.
+            ALOGI("video frame continued after we took it to be complete");
+            onVideoLoss();
+        }
+
+        if (mHaveFrame) {
+            AppendTSPacket(&mFramePackets, data);
+            extendedFrame = true;
+
+            if (mFrameBytesRemaining >= 0) {
+                mFrameBytesRemaining -= payloadSize;
+
+                if (mFrameBytesRemaining <= 0) {
+                    finishFrame();
+                }
+            }
+        }
+
+        // Otherwise this continues a frame whose start we lost.
+
+        data += 188;
+        size -= 188;
+    }
+
+    if (extendedFrame && mHaveFrame && mFrameBytesRemaining < 0) {
+        if (marker) {
+            finishFrame();
+            mFrameEndGuessed = true;
+        } else {
+            mFrameLastDataUs = mClock->nowUs();
+            scheduleFinishFrame(kMaxFrameIdleUs);
+        }
+    }
+}
+
+void TunnelRenderer::scheduleFinishFrame(int64_t delayUs) {
+    if (mFinishFramePending) {
+        return;
+    }
+
+    mFinishFramePending = true;
+    mClock->post(new AMessage(kWhatFinishFrame, id()), delayUs);
+}
+
+void TunnelRenderer::onFinishFrame() {
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        mFinishFramePending = false;
+
+        if (!mHaveFrame || mFrameBytesRemaining >= 0) {
+            return;
+        }
+
+        int64_t idleUs = mClock->nowUs() - mFrameLastDataUs;
+
+        if (idleUs < kMaxFrameIdleUs) {
+            scheduleFinishFrame(kMaxFrameIdleUs - idleUs);
+            return;
+        }
+
+        if (!mPackets.empty()) {
+            // Not idle, whatever comes next is waiting for a packet that
+            // is missing or for the player, the frame may go on after it.
+            scheduleFinishFrame(kMaxFrameIdleUs);
+            return;
+        }
+
+        finishFrame();
+        mFrameEndGuessed = true;
+    }
+
+    onBuffersQueued();
+}
+
+// Once video data went missing the decoder shows corruption until the
+// next IDR frame, so we report the loss and keep the damage away from it.
+void TunnelRenderer::onVideoLoss() {
+    // Covers a frame we passed on too early as well.
+    mFrameEndGuessed = false;
+
+    if (mVideoLossTimeUs < 0ll) {
+        mVideoLossTimeUs = mClock->nowUs();
+    }
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatVideoLoss);
+    notify->post();
+
+    if (mHaveFrame) {
+        mFrameIsCorrupt = true;
+    } else if (!mDropUntilIDR) {
+        // We can't tell what the lost frame was, assume the worst.
+        mDropUntilIDR = true;
+        mDropUntilIDRStartUs = mClock->nowUs();
+    }
+}
+
+void TunnelRenderer::finishFrame() {
+    CHECK(mHaveFrame);
+    mHaveFrame = false;
+
+    int64_t nowUs = mClock->nowUs();
+
+    bool forward = false;
+
+    if (mFrameIsCorrupt) {
+        ++mNumFramesDroppedCorrupt;
+
+        if (mFrameIsReference && !mDropUntilIDR) {
+            ALOGI("dropping frames until the next IDR frame");
+
+            mDropUntilIDR = true;
+            mDropUntilIDRStartUs = nowUs;
+        }
+    } else if (mFrameIsIDR) {
+        if (mDropUntilIDR) {
+            ALOGI("resuming at IDR frame");
+            mDropUntilIDR = false;
+        }
+
+        if (mVideoLossTimeUs >= 0ll) {
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatVideoRecovered);
+            notify->setInt64("recoveryTimeUs", nowUs - mVideoLossTimeUs);
+            notify->post();
+
+            mVideoLossTimeUs = -1ll;
+        }
+
+        forward = true;
+    } else if (mDropUntilIDR
+            && nowUs < mDropUntilIDRStartUs + kMaxDropUntilIDRUs) {
+        ++mNumFramesDroppedDependent;
+    } else if (!mFrameIsReference
+            && mTotalBytesQueued > kMaxBytesQueuedBeforeDropping) {
+        ++mNumFramesDroppedOverload;
+    } else {
+        if (mDropUntilIDR) {
+            ALOGW("no IDR frame after %lld ms, resuming anyway",
+                  (nowUs - mDropUntilIDRStartUs) / 1000ll);
+
+            mDropUntilIDR = false;
+        }
+
+        forward = true;
+    }
+
+    if (forward) {
+        ++mNumFramesForwarded;
+
+        if (mFirstFrameNotifyPending) {
+            mFirstFrameNotifyPending = false;
+
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatFirstFrame);
+            notify->setInt64("timeUs", nowUs);
+            if (mLastFrameTimeUs >= 0ll) {
+                notify->setInt64("blackoutUs", nowUs - mLastFrameTimeUs);
+            }
+            notify->post();
+        }
+
+        mLastFrameTimeUs = nowUs;
+
+        for (List<sp<ABuffer> >::iterator it = mFramePackets.begin();
+                it != mFramePackets.end(); ++it) {
+            mOutputPackets.push_back(*it);
+        }
+    }
+
+    mFramePackets.clear();
+
+    logFrameStats();
+}
+
+void TunnelRenderer::logFrameStats() {
+    int64_t nowUs = mClock->nowUs();
+
+    if (mLastStatsUs < 0ll) {
+        mLastStatsUs = nowUs;
+        return;
+    }
+
+    if (nowUs < mLastStatsUs + kStatsIntervalUs) {
+        return;
+    }
+
+    mLastStatsUs = nowUs;
+
+    ALOGI("%lld video frames forwarded, dropped %lld incomplete, "
+          "%lld depending on lost ones, %lld due to overload",
+          mNumFramesForwarded,
+          mNumFramesDroppedCorrupt,
+          mNumFramesDroppedDependent,
+          mNumFramesDroppedOverload);
+}
+
+// static
+void TunnelRenderer::ParseFrameStart(
+        const uint8_t *payload, size_t size,
+        bool *isIDR, bool *isReference) {
+    *isIDR = false;
+
+    // Unless we find out otherwise, other frames may depend on this one.
+    *isReference = true;
+
+    // Skip the PES header.
+    if (size < 9 || size < 9u + payload[8]) {
+        return;
+    }
+
+    size_t offset = 9 + payload[8];
+
+    // An IDR frame is preceded by its SPS, look for either. The first
+    // slice tells whether the frame is used for reference.
+    while (offset + 3 < size) {
+        if (payload[offset] == 0x00
+                && payload[offset + 1] == 0x00
+                && payload[offset + 2] == 0x01) {
+            unsigned nalType = payload[offset + 3] & 0x1f;
+
+            if (nalType == 5 || nalType == 7) {
+                *isIDR = true;
+            }
+
+            if (nalType >= 1 && nalType <= 5) {
+                *isReference = (payload[offset + 3] & 0x60) != 0;
+                return;
+            }
+
+            offset += 3;
+        } else {
+            ++offset;
+        }
+    }
+}
+
+sp<ABuffer> TunnelRenderer::dequeueBufferLocked() {
     sp<ABuffer> buffer;
     int32_t extSeqNo;
     while (!mPackets.empty()) {
@@ -219,11 +679,11 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
 
     if (mPackets.empty()) {
         if (mFirstFailedAttemptUs < 0ll) {
-            mFirstFailedAttemptUs = ALooper::GetNowUs();
+            mFirstFailedAttemptUs = mClock->nowUs();
             mRequestedRetransmission = false;
         } else {
             ALOGV("no packets available for %.2f secs",
-                    (ALooper::GetNowUs() - mFirstFailedAttemptUs) / 1E6);
+                    (mClock->nowUs() - mFirstFailedAttemptUs) / 1E6);
         }
 
         return NULL;
@@ -247,20 +707,21 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
     }
 
     if (mFirstFailedAttemptUs < 0ll) {
-        mFirstFailedAttemptUs = ALooper::GetNowUs();
+        mFirstFailedAttemptUs = mClock->nowUs();
 
         ALOGI("failed to get the correct packet the first time.");
         return NULL;
     }
 
-    if (mFirstFailedAttemptUs + 50000ll > ALooper::GetNowUs()) {
+    if (mFirstFailedAttemptUs + 50000ll > mClock->nowUs()) {
         // We're willing to wait a little while to get the right packet.
 
         if (!mRequestedRetransmission) {
             ALOGI("requesting retransmission of seqNo %d",
                   (mLastDequeuedExtSeqNo + 1) & 0xffff);
 
-            sp<AMessage> notify = mNotifyLost->dup();
+            sp<AMessage> notify = mNotify->dup();
+            notify->setInt32("what", kWhatPacketLost);
             notify->setInt32("seqNo", (mLastDequeuedExtSeqNo + 1) & 0xffff);
             notify->post();
 
@@ -295,24 +756,65 @@ void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
             CHECK(msg->findBuffer("buffer", &buffer));
 
             queueBuffer(buffer);
+            onBuffersQueued();
+            break;
+        }
 
-            if (mStreamSource == NULL) {
-                if (mTotalBytesQueued > 0ll) {
-                    initPlayer();
-                } else {
-                    ALOGI("Have %lld bytes queued...", mTotalBytesQueued);
-                }
-            } else {
-                mStreamSource->doSomeWork();
+        case kWhatBuffersQueued:
+        {
+            {
+                Mutex::Autolock autoLock(mLock);
+                mWakeupPending = false;
+            }
+
+            onBuffersQueued();
+            break;
+        }
+
+        case kWhatPrepare:
+        {
+            if (mStreamSource == NULL && mOutputHandler == NULL) {
+                initPlayer();
             }
             break;
         }
 
+        case kWhatFinishFrame:
+        {
+            onFinishFrame();
+            break;
+        }
+
         default:
             TRESPASS();
     }
 }
 
+void TunnelRenderer::prepare() {
+    (new AMessage(kWhatPrepare, id()))->post();
+}
+
+void TunnelRenderer::onBuffersQueued() {
+    if (mOutputHandler != NULL) {
+        uint32_t discontinuityMask;
+        sp<ABuffer> buffer;
+        while ((buffer = dequeueBuffer(&discontinuityMask)) != NULL) {
+            mOutputHandler->onOutput(buffer);
+        }
+        return;
+    }
+
+    if (mStreamSource == NULL) {
+        if (mTotalBytesQueued > 0ll) {
+            initPlayer();
+        } else {
+            ALOGI("Have %lld bytes queued...", mTotalBytesQueued);
+        }
+    } else {
+        mStreamSource->doSomeWork();
+    }
+}
+
 void TunnelRenderer::initPlayer() {
     if (mSurfaceTex == NULL) {
         mComposerClient = new SurfaceComposerClient;
@@ -370,20 +872,31 @@ void TunnelRenderer::initPlayer() {
             mSurfaceTex != NULL ? mSurfaceTex : mSurface->getSurfaceTexture());
 
     mPlayer->start();
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatPlayerStarted);
+    notify->setInt64("timeUs", mClock->nowUs());
+    notify->post();
 }
 
+// There is no player with an OutputHandler or if we go away before
+// kWhatPrepare got to create one.
 void TunnelRenderer::destroyPlayer() {
     mStreamSource.clear();
 
-    mPlayer->stop();
-    mPlayer.clear();
+    if (mPlayer != NULL) {
+        mPlayer->stop();
+        mPlayer.clear();
+    }
 
     if (mSurfaceTex == NULL) {
         mSurface.clear();
         mSurfaceControl.clear();
 
-        mComposerClient->dispose();
-        mComposerClient.clear();
+        if (mComposerClient != NULL) {
+            mComposerClient->dispose();
+            mComposerClient.clear();
+        }
     }
 }
 
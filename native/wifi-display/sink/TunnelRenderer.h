@@ -9,6 +9,7 @@
 namespace android {
 
 struct ABuffer;
+struct AClock;
 struct SurfaceComposerClient;
 struct SurfaceControl;
 struct Surface;
@@ -17,16 +18,76 @@ struct IStreamListener;
 
 // This class reassembles incoming RTP packets into the correct order
 // and sends the resulting transport stream to a mediaplayer instance
-// for playback.
+// for playback. Video is passed on in whole frames only, frames that
+// lost data and those depending on them are dropped.
 struct TunnelRenderer : public AHandler {
+    // "notify" is posted with "what" set to one of the notifications
+    // below.
     TunnelRenderer(
-            const sp<AMessage> &notifyLost,
+            const sp<AMessage> &notify,
             const sp<ISurfaceTexture> &surfaceTex);
 
-    sp<ABuffer> dequeueBuffer();
+    enum {
+        // Still missing after a while, carries the "seqNo" worth asking
+        // the source to retransmit.
+        kWhatPacketLost,
+        // Video data went missing for good, the decoder needs an IDR frame.
+        kWhatVideoLoss,
+        // An IDR frame arrived after video loss, carries "recoveryTimeUs".
+        kWhatVideoRecovered,
+        // Carry the "timeUs" they happened at.
+        kWhatPlayerStarted,
+        // Once per stream, after a restart() also carries the "blackoutUs"
+        // since the previous stream's last frame.
+        kWhatFirstFrame,
+    };
+
+    // "discontinuityMask" is set to the ATSParser discontinuity the player
+    // needs to be told about ahead of the returned data, if any.
+    sp<ABuffer> dequeueBuffer(uint32_t *discontinuityMask);
+
+    // May be called from any thread. Wakeups of our looper are coalesced,
+    // a burst of packets is handed to the player in one go.
+    void queueBufferDirect(const sp<ABuffer> &buffer);
+
+    // Creates the player right away instead of on the first data queued,
+    // its startup then overlaps the rest of the session setup.
+    void prepare();
+
+    // May be called from any thread. Discards everything queued from the
+    // current stream, the source starts over with a new one that goes to
+    // the same player after a time (or, if "formatChanged", a format)
+    // discontinuity.
+    void restart(bool formatChanged);
+
+    // Stands in for the player, e.g. in benchmarks. Called on the
+    // renderer's looper with the TS packets the player would have read,
+    // as soon as they're available.
+    struct OutputHandler : public RefBase {
+        OutputHandler() {}
+
+        virtual void onOutput(const sp<ABuffer> &buffer) = 0;
+
+    protected:
+        virtual ~OutputHandler() {}
+
+    private:
+        DISALLOW_EVIL_CONSTRUCTORS(OutputHandler);
+    };
+
+    // No player is created if there is a handler, must be set before any
+    // data is queued.
+    void setOutputHandler(const sp<OutputHandler> &handler);
+
+    // Packets (and their bytes) waiting to be put back in order. May be
+    // called from any thread.
+    void getQueueStats(size_t *numPackets, int64_t *numBytes) const;
 
     enum {
         kWhatQueueBuffer,
+        kWhatBuffersQueued,
+        kWhatPrepare,
+        kWhatFinishFrame,
     };
 
 protected:
@@ -37,10 +98,31 @@ private:
     struct PlayerClient;
     struct StreamSource;
 
+    // Up to this many TS packets are handed to the player at a time.
+    static const size_t kMaxTSPacketsPerBuffer = 7;
+
+    // With more than this queued up for reordering we can't keep up and
+    // start dropping non-reference frames.
+    static const int64_t kMaxBytesQueuedBeforeDropping = 256 * 1024;
+
+    // Longest we drop frames waiting for an IDR frame after losing a
+    // reference frame, the source's intra refresh repairs the picture
+    // eventually even if no IDR frame arrives.
+    static const int64_t kMaxDropUntilIDRUs = 2000000ll;
+
+    // A video frame in an unbounded PES packet whose data stopped coming
+    // for this long is taken to be complete, rather than waiting for the
+    // next one to start.
+    static const int64_t kMaxFrameIdleUs = 10000ll;
+
+    static const int64_t kStatsIntervalUs = 10000000ll;
+
     mutable Mutex mLock;
 
-    sp<AMessage> mNotifyLost;
+    sp<AMessage> mNotify;
     sp<ISurfaceTexture> mSurfaceTex;
+    sp<AClock> mClock;
+    sp<OutputHandler> mOutputHandler;
 
     List<sp<ABuffer> > mPackets;
     int64_t mTotalBytesQueued;
@@ -56,10 +138,67 @@ private:
     int64_t mFirstFailedAttemptUs;
     bool mRequestedRetransmission;
 
+    // Guarded by mLock.
+    bool mWakeupPending;
+
+    // Continuity tracking of the video elementary stream, guarded by mLock.
+    int32_t mVideoPID;
+    int32_t mVideoContinuityCounter;
+    int64_t mVideoLossTimeUs;
+
+    // TS packets ready for the player, guarded by mLock.
+    List<sp<ABuffer> > mOutputPackets;
+
+    // The video frame currently being assembled, guarded by mLock.
+    List<sp<ABuffer> > mFramePackets;
+    bool mHaveFrame;
+    bool mFrameIsIDR;
+    bool mFrameIsReference;
+    bool mFrameIsCorrupt;
+    // PES bytes still missing, negative if the PES packet is unbounded.
+    ssize_t mFrameBytesRemaining;
+    int64_t mFrameLastDataUs;
+    bool mFinishFramePending;
+
+    // The last frame was unbounded and we guessed where it ended, from
+    // the RTP marker bit or because no more data came.
+    bool mFrameEndGuessed;
+
+    bool mDropUntilIDR;
+    int64_t mDropUntilIDRStartUs;
+
+    // Reported once per stream, the first one with the time it took to
+    // get here since the previous stream's last frame. Guarded by mLock.
+    bool mFirstFrameNotifyPending;
+    int64_t mLastFrameTimeUs;
+    uint32_t mDiscontinuityMask;
+
+    int64_t mNumFramesForwarded;
+    int64_t mNumFramesDroppedCorrupt;
+    int64_t mNumFramesDroppedDependent;
+    int64_t mNumFramesDroppedOverload;
+    int64_t mLastStatsUs;
+
+    sp<ABuffer> dequeueBufferLocked();
+    void processTSPackets(const sp<ABuffer> &buffer);
+    void onVideoLoss();
+    void finishFrame();
+    void scheduleFinishFrame(int64_t delayUs);
+    void onFinishFrame();
+    void logFrameStats();
+
+    static void AppendTSPacket(
+            List<sp<ABuffer> > *packets, const uint8_t *packet);
+
+    static void ParseFrameStart(
+            const uint8_t *payload, size_t size,
+            bool *isIDR, bool *isReference);
+
     void initPlayer();
     void destroyPlayer();
 
     void queueBuffer(const sp<ABuffer> &buffer);
+    void onBuffersQueued();
 
     DISALLOW_EVIL_CONSTRUCTORS(TunnelRenderer);
 };
@@ -4,14 +4,22 @@
 #include <utils/Log.h>
 
 #include "WifiDisplaySink.h"
+#include "Parameters.h"
 #include "ParsedMessage.h"
 #include "RTPSink.h"
 
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaCodecList.h>
+#include <media/stagefright/MediaDefs.h>
 #include <media/stagefright/MediaErrors.h>
 
+#include <cutils/properties.h>
+
+#include <OMX_Video.h>
+
 namespace android {
 
 WifiDisplaySink::WifiDisplaySink(
@@ -20,13 +28,194 @@ WifiDisplaySink::WifiDisplaySink(
     : mState(UNDEFINED),
       mNetSession(netSession),
       mSurfaceTex(surfaceTex),
+      mRTSPPort(0),
       mSessionID(0),
-      mNextCSeq(1) {
+      mNextCSeq(1),
+      mLastIDRRequestUs(-1ll),
+      mNumIDRRequestsSent(0),
+      mNumIDRRequestsSuppressed(0),
+      mStartTimeUs(-1ll),
+      mResumeEnabled(false),
+      mResumeStartUs(-1ll),
+      mStreamFormatChanged(false) {
+    for (size_t i = 0; i < kNumHandshakePhases; ++i) {
+        mHandshakeTimesUs[i] = -1ll;
+    }
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.resume", val, NULL)
+            && (!strcasecmp("true", val) || !strcmp("1", val))) {
+        ALOGI("Resuming sessions after losing the control connection.");
+        mResumeEnabled = true;
+    }
+
+    initSupportedFormats();
 }
 
 WifiDisplaySink::~WifiDisplaySink() {
 }
 
+static VideoFormats::LevelType GetLevelType(uint32_t omxLevel) {
+    if (omxLevel >= OMX_VIDEO_AVCLevel42) {
+        return VideoFormats::LEVEL_42;
+    } else if (omxLevel >= OMX_VIDEO_AVCLevel41) {
+        return VideoFormats::LEVEL_41;
+    } else if (omxLevel >= OMX_VIDEO_AVCLevel4) {
+        return VideoFormats::LEVEL_40;
+    } else if (omxLevel >= OMX_VIDEO_AVCLevel32) {
+        return VideoFormats::LEVEL_32;
+    }
+
+    return VideoFormats::LEVEL_31;
+}
+
+// Advertises the profiles and levels the AVC decoder reports. Setting
+// media.wfd.sink.max-mbps to the macroblock rate the decoder was measured
+// to sustain on this device further limits the resolutions offered to
+// what it can actually keep up with.
+void WifiDisplaySink::initSupportedFormats() {
+    uint32_t maxMacroblocksPerSec = 0;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.max-mbps", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val) {
+            maxMacroblocksPerSec = x;
+        }
+    }
+
+    uint32_t maxBaselineLevel = 0;
+    uint32_t maxHighLevel = 0;
+
+    const MediaCodecList *codecs = MediaCodecList::getInstance();
+    ssize_t index = codecs->findCodecByType(
+            MEDIA_MIMETYPE_VIDEO_AVC, false /* encoder */);
+
+    Vector<MediaCodecList::ProfileLevel> profileLevels;
+    Vector<uint32_t> colorFormats;
+    if (index >= 0
+            && codecs->getCodecCapabilities(
+                index, MEDIA_MIMETYPE_VIDEO_AVC,
+                &profileLevels, &colorFormats) == OK) {
+        for (size_t i = 0; i < profileLevels.size(); ++i) {
+            const MediaCodecList::ProfileLevel &pl = profileLevels.itemAt(i);
+
+            if (pl.mProfile == OMX_VIDEO_AVCProfileBaseline
+                    && pl.mLevel > maxBaselineLevel) {
+                maxBaselineLevel = pl.mLevel;
+            } else if (pl.mProfile == OMX_VIDEO_AVCProfileHigh
+                    && pl.mLevel > maxHighLevel) {
+                maxHighLevel = pl.mLevel;
+            }
+        }
+    }
+
+    if (maxBaselineLevel == 0 && maxHighLevel == 0) {
+        ALOGW("AVC decoder reports no usable profile/level, "
+              "assuming constrained baseline at level 3.1");
+
+        maxBaselineLevel = OMX_VIDEO_AVCLevel31;
+    }
+
+    mSinkSupportedVideoFormats.disableAll();
+
+    if (maxBaselineLevel > 0) {
+        mSinkSupportedVideoFormats.addCodec(
+                VideoFormats::PROFILE_CBP,
+                GetLevelType(maxBaselineLevel),
+                maxMacroblocksPerSec);
+    }
+
+    if (maxHighLevel > 0) {
+        mSinkSupportedVideoFormats.addCodec(
+                VideoFormats::PROFILE_CHP,
+                GetLevelType(maxHighLevel),
+                maxMacroblocksPerSec);
+    }
+
+    VideoFormats::ResolutionType nativeType;
+    size_t nativeIndex;
+    VideoFormats::ProfileType profile;
+    VideoFormats::LevelType level;
+    if (VideoFormats::PickBestFormat(
+                mSinkSupportedVideoFormats,
+                mSinkSupportedVideoFormats,
+                0 /* maxPixelsPerSec */,
+                &nativeType, &nativeIndex, &profile, &level)) {
+        mSinkSupportedVideoFormats.setNativeResolution(nativeType, nativeIndex);
+    }
+
+    mSinkSupportedAudioFormats.disableAll();
+    mSinkSupportedAudioFormats.setModes(
+            AudioFormats::CODEC_LPCM,
+            AudioFormats::kModeLPCM44100Stereo
+                | AudioFormats::kModeLPCM48000Stereo);
+
+    ALOGI("supported video formats: %s",
+          mSinkSupportedVideoFormats.getFormatSpec().c_str());
+}
+
+static const char *kHandshakePhaseNames[] = {
+    "connected",
+    "M1",
+    "M3",
+    "M4",
+    "M5",
+    "SETUP sent",
+    "SETUP done",
+    "PLAY sent",
+    "PLAY done",
+    "player started",
+    "first packet",
+    "first frame",
+};
+
+// Only the first time a phase is reached counts, later keep-alives and
+// parameter updates look just like the handshake messages.
+void WifiDisplaySink::markHandshakePhase(HandshakePhase phase, int64_t timeUs) {
+    CHECK_LT(phase, kNumHandshakePhases);
+
+    if (mHandshakeTimesUs[phase] >= 0ll) {
+        return;
+    }
+
+    if (timeUs < 0ll) {
+        timeUs = ALooper::GetNowUs();
+    }
+
+    mHandshakeTimesUs[phase] = timeUs;
+
+    ALOGV("handshake phase '%s' reached after %lld us",
+          kHandshakePhaseNames[phase], timeUs - mStartTimeUs);
+}
+
+// Logs a single line per session for time to first frame measurements,
+// every phase reached is given in ms since start().
+void WifiDisplaySink::logHandshakeTimes() const {
+    AString breakdown;
+    for (size_t i = 0; i < kNumHandshakePhases; ++i) {
+        if (mHandshakeTimesUs[i] < 0ll) {
+            continue;
+        }
+
+        if (!breakdown.empty()) {
+            breakdown.append(", ");
+        }
+
+        breakdown.append(
+                StringPrintf(
+                    "%s +%lld",
+                    kHandshakePhaseNames[i],
+                    (mHandshakeTimesUs[i] - mStartTimeUs) / 1000ll));
+    }
+
+    ALOGI("time to first frame %lld ms (%s)",
+          (mHandshakeTimesUs[PHASE_FIRST_FRAME] - mStartTimeUs) / 1000ll,
+          breakdown.c_str());
+}
+
 void WifiDisplaySink::start(const char *sourceHost, int32_t sourcePort) {
     sp<AMessage> msg = new AMessage(kWhatStart, id());
     msg->setString("sourceHost", sourceHost);
@@ -104,16 +293,18 @@ bool WifiDisplaySink::ParseURL(
     return true;
 }
 
-//ԴˣsourceϢ
+//接受资源端（source）消息
 void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
     switch (msg->what()) {
-        case kWhatStart:       //ԿʼĽ׶
+        case kWhatStart:       //测试开始的阶段
         {
+            mStartTimeUs = ALooper::GetNowUs();
+
             int32_t sourcePort;
 
             if (msg->findString("setupURI", &mSetupURI)) {
                 AString path, user, pass;
-                CHECK(ParseURL(          //URLнHostPort
+                CHECK(ParseURL(          //从URL中解析出Host和Port
                             mSetupURI.c_str(),
                             &mRTSPHost, &sourcePort, &path, &user, &pass)
                         && user.empty() && pass.empty());
@@ -122,17 +313,19 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
                 CHECK(msg->findInt32("sourcePort", &sourcePort));
             }
 
-            sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());   //ϢЭ
+            mRTSPPort = sourcePort;
+
+            sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());   //消息协商
 
             status_t err = mNetSession->createRTSPClient(
-                    mRTSPHost.c_str(), sourcePort, notify, &mSessionID);//RTSPͻ
+                    mRTSPHost.c_str(), sourcePort, notify, &mSessionID);//建立RTSP客户端
             CHECK_EQ(err, (status_t)OK);
 
             mState = CONNECTING;
             break;
         }
 
-        case kWhatRTSPNotify:              //RTSPЭ
+        case kWhatRTSPNotify:              //RTSP能力协商
         {
             int32_t reason;
             CHECK(msg->findInt32("reason", &reason));
@@ -162,16 +355,31 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
                         mNetSession->destroySession(mSessionID);
                         mSessionID = 0;
 
-                        looper()->stop();
+                        if (!resumeSession()) {
+                            looper()->stop();
+                        }
                     }
                     break;
                 }
 
                 case ANetworkSession::kWhatConnected:
                 {
-                    ALOGI("We're now connected.");
+                    int64_t connectLatencyUs;
+                    CHECK(msg->findInt64(
+                                "connectLatencyUs", &connectLatencyUs));
+
+                    ALOGI("We're now connected (after %lld us).",
+                          connectLatencyUs);
                     mState = CONNECTED;
 
+                    markHandshakePhase(PHASE_CONNECTED);
+
+                    if (mResumeStartUs >= 0ll) {
+                        ALOGI("reconnected %lld ms after losing the "
+                              "control connection",
+                              (ALooper::GetNowUs() - mResumeStartUs) / 1000ll);
+                    }
+
                     if (!mSetupURI.empty()) {
                         status_t err =
                             sendDescribe(mSessionID, mSetupURI.c_str());
@@ -183,7 +391,7 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
 
                 case ANetworkSession::kWhatData:
                 {
-                    onReceiveClientData(msg);  //Ϣ  
+                    onReceiveClientData(msg);  //调用消息处理函数  
                     break;
                 }
 
@@ -213,6 +421,32 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatReconnect:
+        {
+            sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());
+
+            status_t err = mNetSession->createRTSPClient(
+                    mRTSPHost.c_str(), mRTSPPort, notify, &mSessionID);
+
+            if (err != OK) {
+                ALOGE("failed to reconnect to %s:%d (%d)",
+                      mRTSPHost.c_str(), mRTSPPort, err);
+
+                mSessionID = 0;
+
+                if (!resumeSession()) {
+                    looper()->stop();
+                }
+            }
+            break;
+        }
+
+        case kWhatRTPSinkNotify:
+        {
+            onRTPSinkNotify(msg);
+            break;
+        }
+
         default:
             TRESPASS();
     }
@@ -293,6 +527,8 @@ status_t WifiDisplaySink::onReceiveSetupResponse(
         return ERROR_UNSUPPORTED;
     }
 
+    markHandshakePhase(PHASE_SETUP_DONE);
+
     if (!msg->findString("session", &mPlaybackSessionID)) {
         return ERROR_MALFORMED;
     }
@@ -311,6 +547,14 @@ status_t WifiDisplaySink::onReceiveSetupResponse(
                 colonPos, mPlaybackSessionID.size() - colonPos);
     }
 
+    if (mResumeStartUs >= 0ll) {
+        // The source only starts streaming once it gets our PLAY. This
+        // drops the old stream's peer, so it has to happen before
+        // configureTransport() connects to the new one.
+        mRTPSink->restartStream(mStreamFormatChanged);
+        mStreamFormatChanged = false;
+    }
+
     status_t err = configureTransport(msg);
 
     if (err != OK) {
@@ -344,6 +588,13 @@ status_t WifiDisplaySink::configureTransport(const sp<ParsedMessage> &msg) {
         sourceHost = mRTSPHost;
     }
 
+    AString redundantPortStr;
+    if (mRTPSink->getRedundantRTPPort() > 0
+            && !ParsedMessage::GetAttribute(
+                transport.c_str(), "redundant_port", &redundantPortStr)) {
+        ALOGW("Source doesn't send a redundant copy of the stream.");
+    }
+
     int rtpPort, rtcpPort;
 
     AString serverPortStr;
@@ -379,6 +630,29 @@ status_t WifiDisplaySink::configureTransport(const sp<ParsedMessage> &msg) {
         return OK;
     }
 
+    if (transport.startsWith("RTP/AVP/UDP;multicast;")) {
+        AString groupAddr;
+        int32_t groupPort;
+        if (!ParsedMessage::GetAttribute(
+                    transport.c_str(), "destination", &groupAddr)
+                || !ParsedMessage::GetInt32Attribute(
+                    transport.c_str(), "port", &groupPort)
+                || groupPort <= 0 || groupPort > 65535) {
+            ALOGE("Invalid multicast transport '%s'.", transport.c_str());
+            return ERROR_MALFORMED;
+        }
+
+        status_t err =
+            mRTPSink->joinMulticastGroup(groupAddr.c_str(), groupPort);
+
+        if (err != OK) {
+            return err;
+        }
+
+        // Our RTCP peer can't be told from the group's packets.
+        return mRTPSink->connect(sourceHost.c_str(), rtpPort, rtcpPort);
+    }
+
     return OK;  // Now, we not care the "server_port" parameter.
     // return mRTPSink->connect(sourceHost.c_str(), rtpPort, rtcpPort);
 }
@@ -397,6 +671,8 @@ status_t WifiDisplaySink::onReceivePlayResponse(
 
     mState = PLAYING;
 
+    markHandshakePhase(PHASE_PLAY_DONE);
+
     return OK;
 }
 
@@ -404,13 +680,13 @@ void WifiDisplaySink::onReceiveClientData(const sp<AMessage> &msg) {
     ALOGD("WifiDisplaySink onReceiveClientData");
 
     int32_t sessionID;
-    CHECK(msg->findInt32("sessionID", &sessionID));//÷ϢsessionID
+    CHECK(msg->findInt32("sessionID", &sessionID));//获得发送消息的sessionID
 
     sp<RefBase> obj;
-    CHECK(msg->findObject("data", &obj));//÷Ϣobject
+    CHECK(msg->findObject("data", &obj));//获得发送信息的object对象
 
     sp<ParsedMessage> data =
-        static_cast<ParsedMessage *>(obj.get());//objectȡ
+        static_cast<ParsedMessage *>(obj.get());//根据object对象获取解析后的数据
 
     ALOGV("session %d received '%s'",
           sessionID, data->debugString().c_str());
@@ -420,19 +696,19 @@ void WifiDisplaySink::onReceiveClientData(const sp<AMessage> &msg) {
     data->getRequestField(0, &method);
 
     int32_t cseq;
-    if (!data->findInt32("cseq", &cseq)) {  //ȡsendʱϢ
+    if (!data->findInt32("cseq", &cseq)) {  //获取send时加入的消息序号
         sendErrorResponse(sessionID, "400 Bad Request", -1 /* cseq */);
         return;
     }
 
-    if (method.startsWith("RTSP/")) {  //Ϣ"RTSP/"ͷ
+    if (method.startsWith("RTSP/")) {  //如果消息以"RTSP/"开头
         // This is a response.
 
         ResponseID id;
         id.mSessionID = sessionID;
         id.mCSeq = cseq;
 
-		// ResponseIDȡעʱmResponseHandlersKeyedVector<ResponseID, HandleRTSPResponseFunc>ݽṹеλ
+		//根据 ResponseID获取注册时的mResponseHandlers在KeyedVector<ResponseID, HandleRTSPResponseFunc>这个数据结构中的位置
         ssize_t index = mResponseHandlers.indexOfKey(id);
 
         if (index < 0) {
@@ -440,16 +716,16 @@ void WifiDisplaySink::onReceiveClientData(const sp<AMessage> &msg) {
             return;
         }
 
-        HandleRTSPResponseFunc func = mResponseHandlers.valueAt(index); //λûȡעĻظ  
+        HandleRTSPResponseFunc func = mResponseHandlers.valueAt(index); //根据位置获取注册的回复函数  
         mResponseHandlers.removeItemsAt(index);
 
-        status_t err = (this->*func)(sessionID, data);//亯ָ  
-         //жϻظǷдϢ  
+        status_t err = (this->*func)(sessionID, data);//填充函数指针  
+         //判断回复中是否有错误信息  
         CHECK_EQ(err, (status_t)OK);
     } else {
         AString version;
         data->getRequestField(2, &version);
-        if (!(version == AString("RTSP/1.0"))) { //жRTSPЭ汾Ƿȷ
+        if (!(version == AString("RTSP/1.0"))) { //判断RTSP协议版本是否正确
             sendErrorResponse(sessionID, "505 RTSP Version not supported", cseq);
             return;
         }
@@ -471,12 +747,14 @@ void WifiDisplaySink::onOptionsRequest(
         int32_t cseq,
         const sp<ParsedMessage> &data) {
     ALOGD("WifiDisplaySink:: onOptionsRequest");
+    markHandshakePhase(PHASE_M1_RECEIVED);
+
     AString response = "RTSP/1.0 200 OK\r\n";
     AppendCommonResponse(&response, cseq);
     response.append("Public: org.wfa.wfd1.0, GET_PARAMETER, SET_PARAMETER\r\n");
     response.append("\r\n");
 
-	//֧GET_PARAMETER, SET_PARAMETERķANetworkSession
+	//支持GET_PARAMETER, SET_PARAMETER的方法发送至ANetworkSession
     status_t err = mNetSession->sendRequest(sessionID, response.c_str());
     CHECK_EQ(err, (status_t)OK);
 
@@ -490,28 +768,32 @@ void WifiDisplaySink::onGetParameterRequest(
         int32_t cseq,
         const sp<ParsedMessage> &data) {
     ALOGD("WifiDisplaySink:: onGetParameterRequest");
+    markHandshakePhase(PHASE_M3_RECEIVED);
 
-    {
-        // mRTPSink....
+    // Opening the RTP/RTCP sockets and starting up the player now takes
+    // both off the path from SETUP to the first frame, and we get to
+    // advertise the port actually bound.
+    if (prepareRTPSink() != OK) {
+        sendErrorResponse(sessionID, "500 Internal Server Error", cseq);
+        return;
     }
 
-    /* AString body =
-        "wfd_video_formats: xxx\r\n"
-        "wfd_audio_codecs: xxx\r\n"
-        "wfd_client_rtp_ports: RTP/AVP/UDP;unicast xxx 0 mode=play\r\n"; */
-
-    AString body =
-        "wfd_video_formats: 48 00 02 02 0001DEFF 157C7FFF 00000FFF 00 0000 0000 00 none none\r\n"
-        "wfd_audio_codecs: LPCM 00000003 00\r\n";
+    AString body = StringPrintf(
+        "wfd_video_formats: %s\r\n"
+        "wfd_audio_codecs: %s\r\n",
+        mSinkSupportedVideoFormats.getFormatSpec().c_str(),
+        mSinkSupportedAudioFormats.getFormatSpec().c_str());
 
     body.append("wfd_content_protection: none\r\n");
     body.append("wfd_coupled_sink: 00 none\r\n");
     body.append("wfd_uibc_capability: none\r\n");
     body.append("wfd_standby_resume_capability: none\r\n");
     body.append("wfd_lg_dlna_uuid: none\r\n");
-    //body.append("wfd_client_rtp_ports: RTP/AVP/UDP;unicast %d 0 mode=play\r\n",
-    //            mRTPSink->getRTPPort());
-    body.append("wfd_client_rtp_ports: RTP/AVP/UDP;unicast 15550 0 mode=play\r\n");
+    body.append(
+            StringPrintf(
+                "wfd_client_rtp_ports: RTP/AVP/UDP;unicast %d 0 mode=play\r\n",
+                mRTPSink->getRTPPort()));
+
     AString response = "RTSP/1.0 200 OK\r\n";
     AppendCommonResponse(&response, cseq);
     response.append("Content-Type: text/parameters\r\n");
@@ -550,10 +832,14 @@ status_t WifiDisplaySink::sendDescribe(int32_t sessionID, const char *uri) {
     return OK;
 }
 
-status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
-    ALOGD("WifiDisplaySink:: sendSetup");
+status_t WifiDisplaySink::prepareRTPSink() {
+    if (mRTPSink != NULL) {
+        return OK;
+    }
+
+    sp<AMessage> notify = new AMessage(kWhatRTPSinkNotify, id());
 
-    mRTPSink = new RTPSink(mNetSession, mSurfaceTex);
+    mRTPSink = new RTPSink(mNetSession, mSurfaceTex, notify);
     looper()->registerHandler(mRTPSink);
 
     status_t err = mRTPSink->init(sUseTCPInterleaving);
@@ -564,6 +850,57 @@ status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
         return err;
     }
 
+    mRTPSink->prepareRenderer();
+
+    return OK;
+}
+
+// Keeps the RTP sockets, the renderer and its player around and connects
+// to the same source again. It runs the capability exchange as usual, we
+// offer the same port and the new stream then picks up in the existing
+// player. Returns false if there's no session worth resuming (anymore).
+bool WifiDisplaySink::resumeSession() {
+    if (!mResumeEnabled || mRTPSink == NULL) {
+        return false;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mResumeStartUs < 0ll) {
+        if (mState != PLAYING && mState != PAUSED) {
+            return false;
+        }
+
+        ALOGI("trying to resume the session with %s:%d",
+              mRTSPHost.c_str(), mRTSPPort);
+
+        mResumeStartUs = nowUs;
+    } else if (nowUs >= mResumeStartUs + kMaxResumeDurationUs) {
+        ALOGE("giving up on resuming the session after %lld ms",
+              (nowUs - mResumeStartUs) / 1000ll);
+
+        return false;
+    }
+
+    mState = CONNECTING;
+    mResponseHandlers.clear();
+    mPlaybackSessionID.clear();
+
+    (new AMessage(kWhatReconnect, id()))->post(kReconnectIntervalUs);
+
+    return true;
+}
+
+status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
+    ALOGD("WifiDisplaySink:: sendSetup");
+
+    // Normally already done while answering M3.
+    status_t err = prepareRTPSink();
+
+    if (err != OK) {
+        return err;
+    }
+
     AString request = StringPrintf("SETUP %s RTSP/1.0\r\n", uri);
 
     AppendCommonResponse(&request, mNextCSeq);
@@ -575,8 +912,16 @@ status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
 
         request.append(
                 StringPrintf(
-                    "Transport: RTP/AVP/UDP;unicast;client_port=%d\r\n",
-                    rtpPort));
+                    "Transport: RTP/AVP/UDP;unicast;client_port=%d-%d",
+                    rtpPort, rtpPort + 1));
+
+        int32_t redundantPort = mRTPSink->getRedundantRTPPort();
+        if (redundantPort > 0) {
+            request.append(
+                    StringPrintf(";redundant_port=%d", redundantPort));
+        }
+
+        request.append("\r\n");
     }
 
     request.append("\r\n");
@@ -594,6 +939,8 @@ status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
 
     ++mNextCSeq;
 
+    markHandshakePhase(PHASE_SETUP_SENT);
+
     return OK;
 }
 
@@ -618,6 +965,128 @@ status_t WifiDisplaySink::sendPlay(int32_t sessionID, const char *uri) {
 
     ++mNextCSeq;
 
+    markHandshakePhase(PHASE_PLAY_SENT);
+
+    return OK;
+}
+
+void WifiDisplaySink::onRTPSinkNotify(const sp<AMessage> &msg) {
+    int32_t what;
+    CHECK(msg->findInt32("what", &what));
+
+    switch (what) {
+        case RTPSink::kWhatVideoLoss:
+        {
+            if (mState != PLAYING || mSessionID == 0) {
+                break;
+            }
+
+            int64_t nowUs = ALooper::GetNowUs();
+
+            if (mLastIDRRequestUs >= 0ll
+                    && nowUs < mLastIDRRequestUs + kMinIDRRequestIntervalUs) {
+                // The IDR frame we asked for is probably on its way.
+                ++mNumIDRRequestsSuppressed;
+                break;
+            }
+
+            if (sendIDRRequest(mSessionID) == OK) {
+                mLastIDRRequestUs = nowUs;
+                ++mNumIDRRequestsSent;
+            }
+            break;
+        }
+
+        case RTPSink::kWhatVideoRecovered:
+        {
+            int64_t recoveryTimeUs;
+            CHECK(msg->findInt64("recoveryTimeUs", &recoveryTimeUs));
+
+            ALOGI("video recovered %lld ms after the loss "
+                  "(%d IDR requests sent, %d suppressed so far)",
+                  recoveryTimeUs / 1000ll,
+                  mNumIDRRequestsSent,
+                  mNumIDRRequestsSuppressed);
+            break;
+        }
+
+        case RTPSink::kWhatPlayerStarted:
+        case RTPSink::kWhatFirstPacket:
+        case RTPSink::kWhatFirstFrame:
+        {
+            int64_t timeUs;
+            CHECK(msg->findInt64("timeUs", &timeUs));
+
+            if (what == RTPSink::kWhatPlayerStarted) {
+                markHandshakePhase(PHASE_PLAYER_STARTED, timeUs);
+            } else if (what == RTPSink::kWhatFirstPacket) {
+                markHandshakePhase(PHASE_FIRST_PACKET, timeUs);
+            } else if (mResumeStartUs < 0ll) {
+                markHandshakePhase(PHASE_FIRST_FRAME, timeUs);
+                logHandshakeTimes();
+            } else {
+                int64_t blackoutUs = -1ll;
+                msg->findInt64("blackoutUs", &blackoutUs);
+
+                ALOGI("session resumed, first frame %lld ms after losing the "
+                      "control connection, %lld ms without video",
+                      (timeUs - mResumeStartUs) / 1000ll,
+                      blackoutUs / 1000ll);
+
+                mResumeStartUs = -1ll;
+            }
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+status_t WifiDisplaySink::sendIDRRequest(int32_t sessionID) {
+    ALOGI("requesting an IDR frame");
+
+    AString content = "wfd_idr_request\r\n";
+
+    AString request = StringPrintf(
+            "SET_PARAMETER rtsp://%s/wfd1.0/streamid=0 RTSP/1.0\r\n",
+            mPresentation_URL.c_str());
+
+    AppendCommonResponse(&request, mNextCSeq);
+
+    request.append(StringPrintf("Session: %s\r\n", mPlaybackSessionID.c_str()));
+    request.append("Content-Type: text/parameters\r\n");
+    request.append(StringPrintf("Content-Length: %d\r\n", content.size()));
+    request.append("\r\n");
+    request.append(content);
+
+    status_t err =
+        mNetSession->sendRequest(sessionID, request.c_str(), request.size());
+
+    if (err != OK) {
+        return err;
+    }
+
+    registerResponseHandler(
+            sessionID, mNextCSeq, &WifiDisplaySink::onReceiveIDRRequestResponse);
+
+    ++mNextCSeq;
+
+    return OK;
+}
+
+status_t WifiDisplaySink::onReceiveIDRRequestResponse(
+        int32_t sessionID, const sp<ParsedMessage> &msg) {
+    int32_t statusCode;
+    if (!msg->getStatusCode(&statusCode)) {
+        return ERROR_MALFORMED;
+    }
+
+    if (statusCode != 200) {
+        // Not worth tearing down the session over.
+        ALOGW("source refused our IDR request (%d)", statusCode);
+    }
+
     return OK;
 }
 
@@ -629,28 +1098,49 @@ void WifiDisplaySink::onSetParameterRequest(
     ALOGD("WifiDisplaySink onSetParameterRequest");
     const char *content = data->getContent();
 
-    // if M4
-    onSetParameterRequest_CheckM4Parameter(content);
+    bool triggerSetup =
+        strstr(content, "wfd_trigger_method: SETUP\r\n") != NULL;
 
-    // if M5(setup) request.  then send M6
-    if (strstr(content, "wfd_trigger_method: SETUP\r\n") != NULL) {
-        // AString uri = StringPrintf("rtsp://%s/wfd1.0/streamid=0", mPresentation_URL.c_str());
-        AString uri = StringPrintf("rtsp://%s/wfd1.0/streamid=0", mPresentation_URL.c_str());
-        status_t err =
-            sendSetup(
-                    sessionID,
-                    uri.c_str());
+    markHandshakePhase(triggerSetup ? PHASE_M5_RECEIVED : PHASE_M4_RECEIVED);
 
-        CHECK_EQ(err, (status_t)OK);
+    // A resumed session only needs the player to reconfigure if the
+    // source's choice of formats changed.
+    sp<Parameters> params = Parameters::Parse(content, strlen(content));
+
+    AString videoFormat, audioFormat;
+    if (params != NULL
+            && params->findParameter("wfd_video_formats", &videoFormat)
+            && params->findParameter("wfd_audio_codecs", &audioFormat)) {
+        AString formats = StringPrintf(
+                "%s / %s", videoFormat.c_str(), audioFormat.c_str());
+
+        if (!mStreamFormats.empty() && !(formats == mStreamFormats)) {
+            ALOGI("source changed formats to %s", formats.c_str());
+            mStreamFormatChanged = true;
+        }
+
+        mStreamFormats = formats;
     }
 
-    // response this M*
+    // if M4
+    onSetParameterRequest_CheckM4Parameter(content);
+
+    // response this M*, ahead of M6 so that the source isn't kept waiting
+    // for it, both usually go out in the same write.
     AString response = "RTSP/1.0 200 OK\r\n";
     AppendCommonResponse(&response, cseq);
     response.append("\r\n");
 
     status_t err = mNetSession->sendRequest(sessionID, response.c_str());
     CHECK_EQ(err, (status_t)OK);
+
+    // if M5(setup) request.  then send M6
+    if (triggerSetup) {
+        AString uri = StringPrintf("rtsp://%s/wfd1.0/streamid=0", mPresentation_URL.c_str());
+        err = sendSetup(sessionID, uri.c_str());
+
+        CHECK_EQ(err, (status_t)OK);
+    }
 }
 
 void WifiDisplaySink::onSetParameterRequest_CheckM4Parameter(const char *content) {
@@ -4,6 +4,8 @@
 #define WIFI_DISPLAY_SINK_H_
 
 #include "ANetworkSession.h"
+#include "AudioFormats.h"
+#include "VideoFormats.h"
 
 #include <gui/Surface.h>
 #include <media/stagefright/foundation/AHandler.h>
@@ -41,6 +43,26 @@ private:
         kWhatStart,
         kWhatRTSPNotify,
         kWhatStop,
+        kWhatRTPSinkNotify,
+        kWhatReconnect,
+    };
+
+    // Milestones from starting the connection to the first video frame
+    // reaching the player, logged once that happens.
+    enum HandshakePhase {
+        PHASE_CONNECTED,
+        PHASE_M1_RECEIVED,
+        PHASE_M3_RECEIVED,
+        PHASE_M4_RECEIVED,
+        PHASE_M5_RECEIVED,
+        PHASE_SETUP_SENT,
+        PHASE_SETUP_DONE,
+        PHASE_PLAY_SENT,
+        PHASE_PLAY_DONE,
+        PHASE_PLAYER_STARTED,
+        PHASE_FIRST_PACKET,
+        PHASE_FIRST_FRAME,
+        kNumHandshakePhases,
     };
 
     struct ResponseID {
@@ -59,11 +81,21 @@ private:
 
     static const bool sUseTCPInterleaving = false;
 
+    // Don't ask the source for IDR frames more often than this.
+    static const int64_t kMinIDRRequestIntervalUs = 1000000ll;
+
+    // With media.wfd.sink.resume enabled, losing the control connection
+    // mid-session has us reconnect to the source every so often for this
+    // long before we give up.
+    static const int64_t kReconnectIntervalUs = 500000ll;
+    static const int64_t kMaxResumeDurationUs = 10000000ll;
+
     State mState;
     sp<ANetworkSession> mNetSession;
     sp<ISurfaceTexture> mSurfaceTex;
     AString mSetupURI;
     AString mRTSPHost;
+    int32_t mRTSPPort;
     int32_t mSessionID;
 
     AString mPresentation_URL;
@@ -76,10 +108,38 @@ private:
     AString mPlaybackSessionID;
     int32_t mPlaybackSessionTimeoutSecs;
 
+    int64_t mLastIDRRequestUs;
+    int32_t mNumIDRRequestsSent;
+    int32_t mNumIDRRequestsSuppressed;
+
+    int64_t mStartTimeUs;
+    int64_t mHandshakeTimesUs[kNumHandshakePhases];
+
+    bool mResumeEnabled;
+    // When the control connection was lost, -1 unless resuming.
+    int64_t mResumeStartUs;
+
+    // The video and audio format the source chose in M4.
+    AString mStreamFormats;
+    bool mStreamFormatChanged;
+
+    // Advertised in M3, derived from what the local decoder can sustain.
+    VideoFormats mSinkSupportedVideoFormats;
+    AudioFormats mSinkSupportedAudioFormats;
+
+    void initSupportedFormats();
+
+    void markHandshakePhase(HandshakePhase phase, int64_t timeUs = -1ll);
+    void logHandshakeTimes() const;
+
+    status_t prepareRTPSink();
+    bool resumeSession();
+
     status_t sendM2(int32_t sessionID);
     status_t sendDescribe(int32_t sessionID, const char *uri);
     status_t sendSetup(int32_t sessionID, const char *uri);
     status_t sendPlay(int32_t sessionID, const char *uri);
+    status_t sendIDRRequest(int32_t sessionID);
 
     status_t onReceiveM2Response(
             int32_t sessionID, const sp<ParsedMessage> &msg);
@@ -95,6 +155,11 @@ private:
     status_t onReceivePlayResponse(
             int32_t sessionID, const sp<ParsedMessage> &msg);
 
+    status_t onReceiveIDRRequestResponse(
+            int32_t sessionID, const sp<ParsedMessage> &msg);
+
+    void onRTPSinkNotify(const sp<AMessage> &msg);
+
     void registerResponseHandler(
             int32_t sessionID, int32_t cseq, HandleRTSPResponseFunc func);
 
@@ -0,0 +1,575 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "soakbench"
+#include <utils/Log.h>
+
+#include "AClock.h"
+#include "ANetworkSession.h"
+#include "sink/RTPSink.h"
+#include "sink/TunnelRenderer.h"
+#include "source/Sender.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <utils/Vector.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace android {
+
+static const int32_t kVideoPID = 0x1011;
+static const int32_t kFrameRate = 30;
+static const int32_t kIDRInterval = 30;  // frames
+
+// A frame's PES packet length has to fit into 16 bits.
+static const size_t kMaxTSPacketsPerFrame = (0xffff + 6) / 184;
+
+// Each video TS packet ends in the time it was generated at.
+static const size_t kTimestampSize = 8;
+
+// With simulated time a frame is given this much real time, at most
+// kMaxSettleIterations times, to get out of the sender before the clock
+// moves on.
+static const int64_t kSettleUs = 1000ll;
+static const size_t kMaxSettleIterations = 50;
+
+// The first part of the run is left out of the drift check, caches and
+// queues are still filling up.
+static const int32_t kWarmupPercent = 10;
+static const size_t kMinNumDriftSamples = 8;
+
+// A series drifts if its last quarter averages this much above its first,
+// both relatively and absolutely.
+static const double kMinDriftFactor = 1.1;
+
+// Counts the video losses the sink reports, logs a dying sender.
+struct NotifyCounter : public AHandler {
+    NotifyCounter();
+
+    int32_t numVideoLosses() const;
+
+    enum {
+        kWhatSenderNotify,
+        kWhatSinkNotify,
+    };
+
+protected:
+    virtual ~NotifyCounter() {}
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    mutable Mutex mLock;
+    int32_t mNumVideoLosses;
+
+    DISALLOW_EVIL_CONSTRUCTORS(NotifyCounter);
+};
+
+NotifyCounter::NotifyCounter()
+    : mNumVideoLosses(0) {
+}
+
+int32_t NotifyCounter::numVideoLosses() const {
+    Mutex::Autolock autoLock(mLock);
+    return mNumVideoLosses;
+}
+
+void NotifyCounter::onMessageReceived(const sp<AMessage> &msg) {
+    int32_t what;
+    CHECK(msg->findInt32("what", &what));
+
+    if (msg->what() == kWhatSinkNotify) {
+        if (what == RTPSink::kWhatVideoLoss) {
+            Mutex::Autolock autoLock(mLock);
+            ++mNumVideoLosses;
+        }
+    } else if (what == Sender::kWhatSessionDead) {
+        ALOGE("sender's session died");
+    }
+}
+
+// Takes the player's place, measures how long each video TS packet took
+// from being generated to leaving the renderer, frame assembly included.
+struct LatencyProbe : public TunnelRenderer::OutputHandler {
+    LatencyProbe(const sp<AClock> &clock);
+
+    virtual void onOutput(const sp<ABuffer> &buffer);
+
+    // Hands over the latencies collected since the last call.
+    void takeLatencies(Vector<int64_t> *latenciesUs);
+
+protected:
+    virtual ~LatencyProbe() {}
+
+private:
+    Mutex mLock;
+    sp<AClock> mClock;
+    Vector<int64_t> mLatenciesUs;
+
+    DISALLOW_EVIL_CONSTRUCTORS(LatencyProbe);
+};
+
+LatencyProbe::LatencyProbe(const sp<AClock> &clock)
+    : mClock(clock) {
+}
+
+void LatencyProbe::onOutput(const sp<ABuffer> &buffer) {
+    int64_t nowUs = mClock->nowUs();
+
+    Mutex::Autolock autoLock(mLock);
+
+    for (size_t offset = 0; offset + 188 <= buffer->size(); offset += 188) {
+        const uint8_t *packet = buffer->data() + offset;
+        int32_t PID = ((packet[1] & 0x1f) << 8) | packet[2];
+
+        if (packet[0] != 0x47 || PID != kVideoPID) {
+            continue;
+        }
+
+        int64_t timeUs = 0ll;
+        for (size_t i = 188 - kTimestampSize; i < 188; ++i) {
+            timeUs = (timeUs << 8) | packet[i];
+        }
+
+        mLatenciesUs.push(nowUs - timeUs);
+    }
+}
+
+void LatencyProbe::takeLatencies(Vector<int64_t> *latenciesUs) {
+    Mutex::Autolock autoLock(mLock);
+
+    *latenciesUs = mLatenciesUs;
+    mLatenciesUs.clear();
+}
+
+// A video frame of "numTSPackets" on kVideoPID whose PES packet length
+// is set, so the renderer can pass it on as soon as it's complete.
+static sp<ABuffer> MakeFrame(
+        size_t numTSPackets, int64_t timeUs, bool isIDR,
+        uint8_t *continuityCounter) {
+    sp<ABuffer> buffer = new ABuffer(numTSPackets * 188);
+    memset(buffer->data(), 0xff, buffer->size());
+
+    for (size_t i = 0; i < numTSPackets; ++i) {
+        uint8_t *packet = buffer->data() + i * 188;
+
+        packet[0] = 0x47;
+        packet[1] = ((i == 0) ? 0x40 : 0x00) | (kVideoPID >> 8);
+        packet[2] = kVideoPID & 0xff;
+        packet[3] = 0x10 | *continuityCounter;
+
+        *continuityCounter = (*continuityCounter + 1) & 0x0f;
+
+        for (size_t j = 0; j < kTimestampSize; ++j) {
+            packet[188 - 1 - j] = (timeUs >> (8 * j)) & 0xff;
+        }
+    }
+
+    uint8_t *pes = buffer->data() + 4;
+
+    size_t PES_packet_length = numTSPackets * 184 - 6;
+    uint64_t PTS = timeUs * 9ll / 100ll;
+
+    pes[0] = 0x00;
+    pes[1] = 0x00;
+    pes[2] = 0x01;
+    pes[3] = 0xe0;
+    pes[4] = PES_packet_length >> 8;
+    pes[5] = PES_packet_length & 0xff;
+    pes[6] = 0x80;
+    pes[7] = 0x80;  // PTS only
+    pes[8] = 0x05;
+    pes[9] = 0x21 | ((PTS >> 29) & 0x0e);
+    pes[10] = (PTS >> 22) & 0xff;
+    pes[11] = ((PTS >> 14) & 0xfe) | 1;
+    pes[12] = (PTS >> 7) & 0xff;
+    pes[13] = ((PTS << 1) & 0xfe) | 1;
+
+    // The start of the first slice, enough for the renderer to tell IDR
+    // from reference frames.
+    pes[14] = 0x00;
+    pes[15] = 0x00;
+    pes[16] = 0x00;
+    pes[17] = 0x01;
+    pes[18] = isIDR ? 0x65 : 0x41;
+
+    return buffer;
+}
+
+static int64_t GetRSSKb() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return -1ll;
+    }
+
+    unsigned long size, resident;
+    int n = fscanf(file, "%lu %lu", &size, &resident);
+    fclose(file);
+
+    if (n != 2) {
+        return -1ll;
+    }
+
+    return (int64_t)resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static int CompareInt64(const int64_t *a, const int64_t *b) {
+    return (*a < *b) ? -1 : (*a > *b) ? 1 : 0;
+}
+
+// "sorted" must not be empty.
+static int64_t Percentile(const Vector<int64_t> &sorted, int32_t percent) {
+    size_t index = (sorted.size() - 1) * percent / 100;
+    return sorted.itemAt(index);
+}
+
+enum {
+    kSeriesRSS,
+    kSeriesPending,
+    kSeriesUnsent,
+    kSeriesHistory,
+    kSeriesRendererPackets,
+    kSeriesRendererBytes,
+    kSeriesLatencyP50,
+    kSeriesLatencyP95,
+    kSeriesLatencyP99,
+    kSeriesLatencyMax,
+    kNumSeries
+};
+
+struct Series {
+    const char *mName;
+
+    // Growth below this is noise, however steady.
+    int64_t mMinGrowth;
+
+    // Negative for intervals that had nothing to measure.
+    Vector<int64_t> mValues;
+};
+
+// Past the warm-up, splits "series" into quarters and flags it if each
+// quarter averages higher than the one before and the last one ends up
+// well above the first.
+static bool IsDrifting(const Series &series, double *first, double *last) {
+    const Vector<int64_t> &values = series.mValues;
+
+    size_t start = values.size() * kWarmupPercent / 100;
+    size_t n = values.size() - start;
+
+    if (n < kMinNumDriftSamples) {
+        return false;
+    }
+
+    double means[4];
+    for (size_t i = 0; i < 4; ++i) {
+        int64_t sum = 0ll;
+        size_t count = 0;
+        for (size_t j = start + i * n / 4; j < start + (i + 1) * n / 4; ++j) {
+            if (values.itemAt(j) >= 0ll) {
+                sum += values.itemAt(j);
+                ++count;
+            }
+        }
+
+        if (count == 0) {
+            return false;
+        }
+
+        means[i] = (double)sum / count;
+
+        if (i > 0 && means[i] <= means[i - 1]) {
+            return false;
+        }
+    }
+
+    *first = means[0];
+    *last = means[3];
+
+    return means[3] > means[0] * kMinDriftFactor
+        && means[3] - means[0] >= series.mMinGrowth;
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s\n"
+            "           -d seconds    \tduration of the run (3600)\n"
+            "           -r kbps       \tvideo bitrate (5000)\n"
+            "           -p seconds    \tsampling interval (10)\n"
+            "           -s            \trun on simulated time, as fast as "
+            "the pipeline allows\n"
+            "           -o file       \twrite the samples to a file "
+            "instead of stdout\n"
+            "\n"
+            "The link can be impaired through media.wfd.impairment, "
+            "e.g. p=1,r=25,delay=5,jitter=2.\n"
+            "Exits with status 1 if any of the sampled values keeps "
+            "growing.\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    int32_t durationSecs = 3600;
+    int32_t bitrateKbps = 5000;
+    int32_t sampleIntervalSecs = 10;
+    bool simulate = false;
+    const char *outputPath = NULL;
+
+    int res;
+    while ((res = getopt(argc, argv, "hd:r:p:so:")) >= 0) {
+        switch (res) {
+            case 'd':
+                durationSecs = atoi(optarg);
+                break;
+
+            case 'r':
+                bitrateKbps = atoi(optarg);
+                break;
+
+            case 'p':
+                sampleIntervalSecs = atoi(optarg);
+                break;
+
+            case 's':
+                simulate = true;
+                break;
+
+            case 'o':
+                outputPath = optarg;
+                break;
+
+            case '?':
+            case 'h':
+            default:
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    size_t numTSPacketsPerFrame =
+        (size_t)bitrateKbps * 1000 / 8 / kFrameRate / 188;
+
+    if (durationSecs < 1 || sampleIntervalSecs < 1
+            || sampleIntervalSecs > durationSecs
+            || numTSPacketsPerFrame < 1
+            || numTSPacketsPerFrame > kMaxTSPacketsPerFrame) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    FILE *out = stdout;
+    if (outputPath != NULL) {
+        out = fopen(outputPath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "unable to open '%s'\n", outputPath);
+            exit(1);
+        }
+    }
+
+    // Everything created from here on picks up the simulated clock.
+    sp<AVirtualClock> virtualClock;
+    if (simulate) {
+        virtualClock = new AVirtualClock;
+        AClock::SetDefault(virtualClock);
+    }
+
+    sp<AClock> clock = AClock::GetDefault();
+
+    sp<ANetworkSession> netSession = new ANetworkSession;
+    CHECK_EQ(netSession->start(), (status_t)OK);
+
+    sp<ALooper> sourceLooper = new ALooper;
+    sourceLooper->setName("soakbench_source");
+    sourceLooper->start();
+
+    sp<ALooper> sinkLooper = new ALooper;
+    sinkLooper->setName("soakbench_sink");
+    sinkLooper->start();
+
+    sp<NotifyCounter> counter = new NotifyCounter;
+    sourceLooper->registerHandler(counter);
+
+    sp<RTPSink> sink = new RTPSink(
+            netSession,
+            NULL /* surfaceTex */,
+            new AMessage(NotifyCounter::kWhatSinkNotify, counter->id()));
+
+    sinkLooper->registerHandler(sink);
+
+    sp<LatencyProbe> probe = new LatencyProbe(clock);
+    sink->setRendererOutputHandler(probe);
+
+    CHECK_EQ(sink->init(false /* useTCPInterleaving */), (status_t)OK);
+
+    sp<Sender> sender = new Sender(
+            netSession,
+            new AMessage(NotifyCounter::kWhatSenderNotify, counter->id()));
+
+    sourceLooper->registerHandler(sender);
+
+    int32_t rtpPort = sink->getRTPPort();
+    CHECK_EQ(sender->init(
+                "127.0.0.1", rtpPort, rtpPort + 1, Sender::TRANSPORT_UDP),
+             (status_t)OK);
+
+    sender->setBitrate(bitrateKbps * 1000);
+    CHECK_EQ(sender->finishInit(), (status_t)OK);
+    sender->scheduleSendSR();
+
+    Series series[kNumSeries] = {
+        { "rss_kb",             1024 },
+        { "pending_bytes",      64 * 1024 },
+        { "unsent_bytes",       64 * 1024 },
+        { "history_packets",    64 },
+        { "renderer_packets",   64 },
+        { "renderer_bytes",     64 * 1024 },
+        { "latency_p50_us",     5000 },
+        { "latency_p95_us",     5000 },
+        { "latency_p99_us",     5000 },
+        { "latency_max_us",     5000 },
+    };
+
+    fprintf(out, "time_s");
+    for (size_t i = 0; i < kNumSeries; ++i) {
+        fprintf(out, "\t%s", series[i].mName);
+    }
+    fprintf(out, "\tvideo_losses\n");
+    fflush(out);
+
+    int64_t durationUs = durationSecs * 1000000ll;
+    int64_t sampleIntervalUs = sampleIntervalSecs * 1000000ll;
+
+    int64_t startUs = clock->nowUs();
+    int64_t nextSampleUs = startUs + sampleIntervalUs;
+
+    uint8_t continuityCounter = 0;
+    Vector<int64_t> latenciesUs;
+
+    for (int64_t frameIndex = 0;; ++frameIndex) {
+        int64_t frameTimeUs = startUs + frameIndex * 1000000ll / kFrameRate;
+
+        if (frameTimeUs - startUs > durationUs) {
+            break;
+        }
+
+        int64_t delayUs = frameTimeUs - clock->nowUs();
+        if (delayUs > 0ll) {
+            if (virtualClock != NULL) {
+                virtualClock->advance(delayUs);
+            } else {
+                usleep(delayUs);
+            }
+        }
+
+        while (frameTimeUs >= nextSampleUs) {
+            int64_t values[kNumSeries];
+
+            values[kSeriesRSS] = GetRSSKb();
+
+            size_t numBytesPending, numBytesUnsent, historyLength;
+            sender->getQueueSizes(
+                    &numBytesPending, &numBytesUnsent, &historyLength);
+
+            values[kSeriesPending] = numBytesPending;
+            values[kSeriesUnsent] = numBytesUnsent;
+            values[kSeriesHistory] = historyLength;
+
+            size_t numRendererPackets;
+            int64_t numRendererBytes;
+            sink->getRendererQueueStats(
+                    &numRendererPackets, &numRendererBytes);
+
+            values[kSeriesRendererPackets] = numRendererPackets;
+            values[kSeriesRendererBytes] = numRendererBytes;
+
+            probe->takeLatencies(&latenciesUs);
+            latenciesUs.sort(CompareInt64);
+
+            bool haveLatencies = !latenciesUs.isEmpty();
+            values[kSeriesLatencyP50] =
+                haveLatencies ? Percentile(latenciesUs, 50) : -1ll;
+            values[kSeriesLatencyP95] =
+                haveLatencies ? Percentile(latenciesUs, 95) : -1ll;
+            values[kSeriesLatencyP99] =
+                haveLatencies ? Percentile(latenciesUs, 99) : -1ll;
+            values[kSeriesLatencyMax] =
+                haveLatencies ? Percentile(latenciesUs, 100) : -1ll;
+
+            fprintf(out, "%lld", (nextSampleUs - startUs) / 1000000ll);
+            for (size_t i = 0; i < kNumSeries; ++i) {
+                series[i].mValues.push(values[i]);
+                fprintf(out, "\t%lld", values[i]);
+            }
+            fprintf(out, "\t%d\n", counter->numVideoLosses());
+            fflush(out);
+
+            nextSampleUs += sampleIntervalUs;
+        }
+
+        sender->queuePackets(
+                clock->nowUs(),
+                MakeFrame(
+                    numTSPacketsPerFrame,
+                    clock->nowUs(),
+                    (frameIndex % kIDRInterval) == 0,
+                    &continuityCounter));
+
+        if (virtualClock == NULL) {
+            continue;
+        }
+
+        // The clock stands still until we move it, let the frame reach the
+        // sink first. What the impairment holds back is released once time
+        // moves on, so simulated delays come in steps of a frame.
+        for (size_t i = 0; i < kMaxSettleIterations; ++i) {
+            usleep(kSettleUs);
+
+            size_t numBytesPending, numBytesUnsent, historyLength;
+            sender->getQueueSizes(
+                    &numBytesPending, &numBytesUnsent, &historyLength);
+
+            if (numBytesPending == 0 && numBytesUnsent == 0) {
+                break;
+            }
+        }
+    }
+
+    bool drifting = false;
+    for (size_t i = 0; i < kNumSeries; ++i) {
+        double first, last;
+        if (IsDrifting(series[i], &first, &last)) {
+            fprintf(stderr,
+                    "DRIFT %s: %.0f -> %.0f over the run\n",
+                    series[i].mName, first, last);
+
+            drifting = true;
+        }
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    sourceLooper->unregisterHandler(sender->id());
+    sinkLooper->unregisterHandler(sink->id());
+    sourceLooper->unregisterHandler(counter->id());
+
+    sourceLooper->stop();
+    sinkLooper->stop();
+
+    // Goes through ~RTPSink and ~TunnelRenderer, which never had a player
+    // to tear down, while the network session is still up.
+    sink.clear();
+
+    netSession->stop();
+
+    AClock::SetDefault(NULL);
+
+    return drifting ? 1 : 0;
+}
@@ -21,6 +21,7 @@
 #include "Converter.h"
 
 #include "MediaPuller.h"
+#include "PCMKernels.h"
 
 #include <cutils/properties.h>
 #include <gui/SurfaceTextureClient.h>
@@ -37,6 +38,24 @@
 
 namespace android {
 
+// Attached to the meta data of an access unit that references encoder
+// output memory, hands the buffer back to the encoder when destroyed.
+struct Converter::OutputBufferReleaser : public RefBase {
+    OutputBufferReleaser(const sp<AMessage> &msg)
+        : mMsg(msg) {
+    }
+
+protected:
+    virtual ~OutputBufferReleaser() {
+        mMsg->post();
+    }
+
+private:
+    sp<AMessage> mMsg;
+
+    DISALLOW_EVIL_CONSTRUCTORS(OutputBufferReleaser);
+};
+
 Converter::Converter(
         const sp<AMessage> &notify,
         const sp<ALooper> &codecLooper,
@@ -49,6 +68,12 @@ Converter::Converter(
       mIsVideo(false),
       mIsPCMAudio(usePCMAudio),
       mNeedToManuallyPrependSPSPPS(false),
+      mNumSlices(1),
+      mNumBorrowedOutputBuffers(0),
+      mNumOutputFrames(0),
+      mNumOutputFramesBorrowed(0),
+      mNumInputBytesCopied(0ll),
+      mNumOutputBytesCopied(0ll),
       mDoMoreWorkPending(false)
 #if ENABLE_SILENCE_DETECTION
       ,mFirstSilentFrameUs(-1ll)
@@ -64,6 +89,10 @@ Converter::Converter(
 
     CHECK(!usePCMAudio || !mIsVideo);
 
+    if (mIsVideo && mInputFormat->findInt32("num-slices", &mNumSlices)) {
+        ALOGI("slice mode, %d slices per frame", mNumSlices);
+    }
+
     mInitCheck = initEncoder();
 
     if (mInitCheck != OK) {
@@ -113,6 +142,11 @@ static int32_t getBitrate(const char *propName, int32_t defaultValue) {
     return defaultValue;
 }
 
+// static
+int32_t Converter::GetVideoBitrate() {
+    return getBitrate("media.wfd.video-bitrate", 5000000);
+}
+
 status_t Converter::initEncoder() {
     AString inputMIME;
     CHECK(mInputFormat->findString("mime", &inputMIME));
@@ -150,7 +184,7 @@ status_t Converter::initEncoder() {
     mOutputFormat->setString("mime", outputMIME.c_str());
 
     int32_t audioBitrate = getBitrate("media.wfd.audio-bitrate", 128000);
-    int32_t videoBitrate = getBitrate("media.wfd.video-bitrate", 5000000);
+    int32_t videoBitrate = GetVideoBitrate();
 
     ALOGI("using audio bitrate of %d bps, video bitrate of %d bps",
           audioBitrate, videoBitrate);
@@ -160,7 +194,11 @@ status_t Converter::initEncoder() {
     } else {
         mOutputFormat->setInt32("bitrate", videoBitrate);
         mOutputFormat->setInt32("bitrate-mode", OMX_Video_ControlRateConstant);
-        mOutputFormat->setInt32("frame-rate", 30);
+        int32_t frameRate;
+        if (!mInputFormat->findInt32("frame-rate", &frameRate)) {
+            frameRate = 30;
+        }
+        mOutputFormat->setInt32("frame-rate", frameRate);
         mOutputFormat->setInt32("i-frame-interval", 15);  // Iframes every 15 secs
 
         // Configure encoder to use intra macroblock refresh mode
@@ -247,16 +285,7 @@ void Converter::notifyError(status_t err) {
 
 // static
 bool Converter::IsSilence(const sp<ABuffer> &accessUnit) {
-    const uint8_t *ptr = accessUnit->data();
-    const uint8_t *end = ptr + accessUnit->size();
-    while (ptr < end) {
-        if (*ptr != 0) {
-            return false;
-        }
-        ++ptr;
-    }
-
-    return true;
+    return GetPCMKernels().mIsSilence(accessUnit->data(), accessUnit->size());
 }
 
 void Converter::onMessageReceived(const sp<AMessage> &msg) {
@@ -383,10 +412,37 @@ void Converter::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatReleaseOutputBuffer:
+        {
+            CHECK_GT(mNumBorrowedOutputBuffers, 0u);
+            --mNumBorrowedOutputBuffers;
+
+            if (mEncoder == NULL) {
+                break;
+            }
+
+            size_t bufferIndex;
+            CHECK(msg->findSize("bufferIndex", &bufferIndex));
+
+            mEncoder->releaseOutputBuffer(bufferIndex);
+
+            // The encoder may have been waiting for this one.
+            scheduleDoMoreWork();
+            break;
+        }
+
         case kWhatShutdown:
         {
             ALOGI("shutting down encoder");
 
+            if (mNumBorrowedOutputBuffers > 0) {
+                // Whoever still holds on to these must not touch them
+                // anymore, PlaybackSession drops its queues before
+                // shutting us down.
+                ALOGW("%d output buffers still lent out",
+                      mNumBorrowedOutputBuffers);
+            }
+
             if (mEncoder != NULL) {
                 mEncoder->release();
                 mEncoder.clear();
@@ -430,18 +486,14 @@ void Converter::scheduleDoMoreWork() {
 status_t Converter::feedRawAudioInputBuffers() {
     // Split incoming PCM audio into buffers of 6 AUs of 80 audio frames each
     // and add a 4 byte header according to the wifi display specs.
+    // Samples are converted to network byte order as they are copied.
+
+    const PCMKernels &kernels = GetPCMKernels();
 
     while (!mInputBufferQueue.empty()) {
         sp<ABuffer> buffer = *mInputBufferQueue.begin();
         mInputBufferQueue.erase(mInputBufferQueue.begin());
 
-        int16_t *ptr = (int16_t *)buffer->data();
-        int16_t *stop = (int16_t *)(buffer->data() + buffer->size());
-        while (ptr < stop) {
-            *ptr = htons(*ptr);
-            ++ptr;
-        }
-
         static const size_t kFrameSize = 2 * sizeof(int16_t);  // stereo
         static const size_t kFramesPerAU = 80;
         static const size_t kNumAUsPerPESPacket = 6;
@@ -456,9 +508,10 @@ status_t Converter::feedRawAudioInputBuffers() {
                 copy = bytesMissingForFullAU;
             }
 
-            memcpy(mPartialAudioAU->data() + mPartialAudioAU->size(),
-                   buffer->data(),
-                   copy);
+            kernels.mSwapCopy16(
+                    mPartialAudioAU->data() + mPartialAudioAU->size(),
+                    buffer->data(),
+                    copy / sizeof(int16_t));
 
             mPartialAudioAU->setRange(0, mPartialAudioAU->size() + copy);
 
@@ -505,7 +558,7 @@ status_t Converter::feedRawAudioInputBuffers() {
                 copy = partialAudioAU->size() - 4;
             }
 
-            memcpy(&ptr[4], buffer->data(), copy);
+            kernels.mSwapCopy16(&ptr[4], buffer->data(), copy / sizeof(int16_t));
 
             partialAudioAU->setRange(0, 4 + copy);
             buffer->setRange(buffer->offset() + copy, buffer->size() - copy);
@@ -555,10 +608,14 @@ status_t Converter::feedEncoderInputBuffers() {
         if (buffer != NULL) {
             CHECK(buffer->meta()->findInt64("timeUs", &timeUs));
 
+            // For video this is just the metadata referencing the
+            // graphic buffer (store-metadata-in-buffers), not the frame.
             memcpy(mEncoderInputBuffers.itemAt(bufferIndex)->data(),
                    buffer->data(),
                    buffer->size());
 
+            mNumInputBytesCopied += buffer->size();
+
             void *mediaBuffer;
             if (buffer->meta()->findPointer("mediaBuffer", &mediaBuffer)
                     && mediaBuffer != NULL) {
@@ -615,32 +672,46 @@ status_t Converter::doMoreWork() {
             break;
         }
 
+        bool borrowed = false;
+
         if (flags & MediaCodec::BUFFER_FLAG_EOS) {
             sp<AMessage> notify = mNotify->dup();
             notify->setInt32("what", kWhatEOS);
             notify->post();
-        } else {
+        } else if (flags & MediaCodec::BUFFER_FLAG_CODECCONFIG) {
+            // We hold on to this one for good.
             sp<ABuffer> buffer = new ABuffer(size);
             buffer->meta()->setInt64("timeUs", timeUs);
 
-            ALOGV("[%s] time %lld us (%.2f secs)",
-                  mIsVideo ? "video" : "audio", timeUs, timeUs / 1E6);
-
             memcpy(buffer->data(),
                    mEncoderOutputBuffers.itemAt(bufferIndex)->base() + offset,
                    size);
 
-            if (flags & MediaCodec::BUFFER_FLAG_CODECCONFIG) {
-                mOutputFormat->setBuffer("csd-0", buffer);
+            mOutputFormat->setBuffer("csd-0", buffer);
+        } else {
+            ALOGV("[%s] time %lld us (%.2f secs)",
+                  mIsVideo ? "video" : "audio", timeUs, timeUs / 1E6);
+
+            sp<ABuffer> buffer =
+                wrapOutputBuffer(bufferIndex, offset, size, &borrowed);
+
+            buffer->meta()->setInt64("timeUs", timeUs);
+
+            if (mIsVideo && mNumSlices > 1) {
+                notifySlices(buffer);
             } else {
                 sp<AMessage> notify = mNotify->dup();
                 notify->setInt32("what", kWhatAccessUnit);
                 notify->setBuffer("accessUnit", buffer);
                 notify->post();
             }
+
+            logCopyStats();
         }
 
-        mEncoder->releaseOutputBuffer(bufferIndex);
+        if (!borrowed) {
+            mEncoder->releaseOutputBuffer(bufferIndex);
+        }
 
         if (flags & MediaCodec::BUFFER_FLAG_EOS) {
             break;
@@ -650,6 +721,131 @@ status_t Converter::doMoreWork() {
     return err;
 }
 
+// Hands out the encoder's output buffer itself unless that would leave the
+// encoder with no buffer to write into, in which case the data is copied.
+sp<ABuffer> Converter::wrapOutputBuffer(
+        size_t bufferIndex, size_t offset, size_t size, bool *borrowed) {
+    const sp<ABuffer> &outputBuffer = mEncoderOutputBuffers.itemAt(bufferIndex);
+
+    ++mNumOutputFrames;
+
+    if (mNumBorrowedOutputBuffers + 1 >= mEncoderOutputBuffers.size()) {
+        sp<ABuffer> buffer = new ABuffer(size);
+        memcpy(buffer->data(), outputBuffer->base() + offset, size);
+
+        mNumOutputBytesCopied += size;
+
+        *borrowed = false;
+        return buffer;
+    }
+
+    sp<ABuffer> buffer = new ABuffer(outputBuffer->base() + offset, size);
+
+    sp<AMessage> msg = new AMessage(kWhatReleaseOutputBuffer, id());
+    msg->setSize("bufferIndex", bufferIndex);
+
+    buffer->meta()->setObject("releaser", new OutputBufferReleaser(msg));
+
+    ++mNumBorrowedOutputBuffers;
+    ++mNumOutputFramesBorrowed;
+
+    *borrowed = true;
+    return buffer;
+}
+
+// Returns the size of the leading part of "data" up to and including its
+// first coded slice NAL unit, parameter sets and SEI preceding the slice
+// stay with it.
+static size_t GetSliceSize(
+        const uint8_t *data, size_t size, bool *firstSliceOfPicture) {
+    *firstSliceOfPicture = false;
+
+    bool sawSlice = false;
+    for (size_t i = 0; i + 3 < size; ++i) {
+        if (data[i] != 0x00 || data[i + 1] != 0x00 || data[i + 2] != 0x01) {
+            continue;
+        }
+
+        if (sawSlice) {
+            return (data[i - 1] == 0x00) ? i - 1 : i;
+        }
+
+        unsigned nalType = data[i + 3] & 0x1f;
+        if (nalType >= 1 && nalType <= 5) {
+            sawSlice = true;
+
+            // first_mb_in_slice leads the slice header, ue(v) codes 0 as
+            // a single "1" bit.
+            *firstSliceOfPicture = (i + 4 < size) && (data[i + 4] & 0x80);
+        }
+
+        i += 2;
+    }
+
+    return size;
+}
+
+void Converter::notifySlices(const sp<ABuffer> &accessUnit) {
+    int64_t timeUs;
+    CHECK(accessUnit->meta()->findInt64("timeUs", &timeUs));
+
+    // The encoder may already deliver a single slice per output buffer,
+    // otherwise the frame is split up here. Only then do we know which
+    // slice is the last one.
+    bool wholePicture = false;
+
+    size_t offset = 0;
+    while (offset < accessUnit->size()) {
+        bool firstSlice;
+        size_t sliceSize = GetSliceSize(
+                accessUnit->data() + offset,
+                accessUnit->size() - offset,
+                &firstSlice);
+
+        if (offset == 0) {
+            wholePicture = firstSlice && sliceSize < accessUnit->size();
+        }
+
+        sp<ABuffer> slice =
+            new ABuffer(accessUnit->data() + offset, sliceSize);
+
+        slice->meta()->setInt64("timeUs", timeUs);
+        slice->meta()->setInt32("firstSlice", firstSlice);
+        slice->meta()->setInt32(
+                "lastSlice",
+                wholePicture && offset + sliceSize == accessUnit->size());
+
+        // Keeps the memory referenced by the slice alive.
+        slice->meta()->setBuffer("accessUnit", accessUnit);
+
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("what", kWhatAccessUnit);
+        notify->setBuffer("accessUnit", slice);
+        notify->post();
+
+        offset += sliceSize;
+    }
+}
+
+void Converter::logCopyStats() {
+    if (mNumOutputFrames < kStatsIntervalFrames) {
+        return;
+    }
+
+    ALOGI("[%s] bytes copied per frame: %lld input, %lld output, "
+          "%d of %d frames forwarded without a copy",
+          mIsVideo ? "video" : "audio",
+          mNumInputBytesCopied / mNumOutputFrames,
+          mNumOutputBytesCopied / mNumOutputFrames,
+          mNumOutputFramesBorrowed,
+          mNumOutputFrames);
+
+    mNumOutputFrames = 0;
+    mNumOutputFramesBorrowed = 0;
+    mNumInputBytesCopied = 0ll;
+    mNumOutputBytesCopied = 0ll;
+}
+
 void Converter::requestIDRFrame() {
     (new AMessage(kWhatRequestIDRFrame, id()))->post();
 }
@@ -51,6 +51,12 @@ struct Converter : public AHandler {
 
     void requestIDRFrame();
 
+    // The configured video bitrate, media.wfd.video-bitrate or 5 Mbit/sec.
+    static int32_t GetVideoBitrate();
+
+    // In slice mode, kWhatAccessUnit video buffers hold a single slice
+    // and carry "firstSlice", set for the first slice of a picture, and
+    // "lastSlice", set if the slice is known to complete it.
     enum {
         kWhatAccessUnit,
         kWhatEOS,
@@ -63,6 +69,7 @@ struct Converter : public AHandler {
         kWhatShutdown,
         kWhatMediaPullerNotify,
         kWhatEncoderActivity,
+        kWhatReleaseOutputBuffer,
     };
 
     void shutdownAsync();
@@ -72,6 +79,11 @@ protected:
     virtual void onMessageReceived(const sp<AMessage> &msg);
 
 private:
+    struct OutputBufferReleaser;
+
+    // How often the copy statistics are logged, in output frames.
+    static const int32_t kStatsIntervalFrames = 300;
+
     status_t mInitCheck;
     sp<AMessage> mNotify;
     sp<ALooper> mCodecLooper;
@@ -81,6 +93,11 @@ private:
     sp<AMessage> mOutputFormat;
     bool mNeedToManuallyPrependSPSPPS;
 
+    // Number of slices per frame the encoder is asked for ("num-slices" in
+    // the input format), with more than one each slice is emitted as soon
+    // as it is available.
+    int32_t mNumSlices;
+
     sp<MediaCodec> mEncoder;
     sp<AMessage> mEncoderActivityNotify;
 
@@ -89,6 +106,16 @@ private:
 
     List<size_t> mAvailEncoderInputIndices;
 
+    // Encoder output buffers currently lent to our observer as the data
+    // of kWhatAccessUnit buffers, they are returned to the encoder once
+    // the last reference to that access unit goes away.
+    size_t mNumBorrowedOutputBuffers;
+
+    int32_t mNumOutputFrames;
+    int32_t mNumOutputFramesBorrowed;
+    int64_t mNumInputBytesCopied;
+    int64_t mNumOutputBytesCopied;
+
     List<sp<ABuffer> > mInputBufferQueue;
 
     bool mDoMoreWorkPending;
@@ -109,6 +136,15 @@ private:
 
     void notifyError(status_t err);
 
+    sp<ABuffer> wrapOutputBuffer(
+            size_t bufferIndex, size_t offset, size_t size, bool *borrowed);
+
+    void logCopyStats();
+
+    // Notifies the observer of each slice of the encoded video data in
+    // "accessUnit" separately, see kWhatAccessUnit.
+    void notifySlices(const sp<ABuffer> &accessUnit);
+
     // Packetizes raw PCM audio data available in mInputBufferQueue
     // into a format suitable for transport stream inclusion and
     // notifies the observer.
@@ -0,0 +1,253 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PCMKernels"
+#include <utils/Log.h>
+
+#include "PCMKernels.h"
+
+#include <cutils/properties.h>
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled regardless of the baseline instruction set and
+// only used if the CPU turns out to support it.
+#if (defined(__i386__) || defined(__x86_64__)) \
+        && (defined(__clang__) || __GNUC__ >= 5)
+#define HAVE_AVX2_KERNELS       1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS       1
+#include <arm_neon.h>
+#endif
+
+namespace android {
+
+static void SwapCopy16Scalar(void *dst, const void *src, size_t numSamples) {
+    const uint16_t *in = (const uint16_t *)src;
+    uint16_t *out = (uint16_t *)dst;
+
+    for (size_t i = 0; i < numSamples; ++i) {
+        out[i] = htons(in[i]);
+    }
+}
+
+static bool IsSilenceScalar(const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    const uint8_t *end = ptr + size;
+    while (ptr < end) {
+        if (*ptr != 0) {
+            return false;
+        }
+        ++ptr;
+    }
+
+    return true;
+}
+
+static const PCMKernels kScalarKernels = {
+    "scalar", SwapCopy16Scalar, IsSilenceScalar
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if defined(__SSE2__)
+
+static void SwapCopy16SSE2(void *dst, const void *src, size_t numSamples) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+
+    size_t i = 0;
+    for (; i + 8 <= numSamples; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&in[2 * i]);
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i *)&out[2 * i], x);
+    }
+
+    SwapCopy16Scalar(&out[2 * i], &in[2 * i], numSamples - i);
+}
+
+static bool IsSilenceSSE2(const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        __m128i x = _mm_or_si128(
+                _mm_or_si128(
+                    _mm_loadu_si128((const __m128i *)&ptr[i]),
+                    _mm_loadu_si128((const __m128i *)&ptr[i + 16])),
+                _mm_or_si128(
+                    _mm_loadu_si128((const __m128i *)&ptr[i + 32]),
+                    _mm_loadu_si128((const __m128i *)&ptr[i + 48])));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xffff) {
+            return false;
+        }
+    }
+
+    return IsSilenceScalar(&ptr[i], size - i);
+}
+
+static const PCMKernels kSSE2Kernels = {
+    "sse2", SwapCopy16SSE2, IsSilenceSSE2
+};
+
+#endif  // __SSE2__
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_AVX2_KERNELS
+
+__attribute__((target("avx2")))
+static void SwapCopy16AVX2(void *dst, const void *src, size_t numSamples) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+
+    const __m256i kSwapBytes = _mm256_setr_epi8(
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+            1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+
+    size_t i = 0;
+    for (; i + 16 <= numSamples; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&in[2 * i]);
+        x = _mm256_shuffle_epi8(x, kSwapBytes);
+        _mm256_storeu_si256((__m256i *)&out[2 * i], x);
+    }
+
+    SwapCopy16Scalar(&out[2 * i], &in[2 * i], numSamples - i);
+}
+
+__attribute__((target("avx2")))
+static bool IsSilenceAVX2(const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) {
+        __m256i x = _mm256_or_si256(
+                _mm256_or_si256(
+                    _mm256_loadu_si256((const __m256i *)&ptr[i]),
+                    _mm256_loadu_si256((const __m256i *)&ptr[i + 32])),
+                _mm256_or_si256(
+                    _mm256_loadu_si256((const __m256i *)&ptr[i + 64]),
+                    _mm256_loadu_si256((const __m256i *)&ptr[i + 96])));
+
+        if (!_mm256_testz_si256(x, x)) {
+            return false;
+        }
+    }
+
+    return IsSilenceScalar(&ptr[i], size - i);
+}
+
+static const PCMKernels kAVX2Kernels = {
+    "avx2", SwapCopy16AVX2, IsSilenceAVX2
+};
+
+#endif  // HAVE_AVX2_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////
+
+#if HAVE_NEON_KERNELS
+
+static void SwapCopy16NEON(void *dst, const void *src, size_t numSamples) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = (uint8_t *)dst;
+
+    size_t i = 0;
+    for (; i + 8 <= numSamples; i += 8) {
+        vst1q_u8(&out[2 * i], vrev16q_u8(vld1q_u8(&in[2 * i])));
+    }
+
+    SwapCopy16Scalar(&out[2 * i], &in[2 * i], numSamples - i);
+}
+
+static bool IsSilenceNEON(const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        uint8x16_t x = vorrq_u8(
+                vorrq_u8(vld1q_u8(&ptr[i]), vld1q_u8(&ptr[i + 16])),
+                vorrq_u8(vld1q_u8(&ptr[i + 32]), vld1q_u8(&ptr[i + 48])));
+
+        uint8x8_t y = vorr_u8(vget_low_u8(x), vget_high_u8(x));
+
+        if (vget_lane_u64(vreinterpret_u64_u8(y), 0) != 0) {
+            return false;
+        }
+    }
+
+    return IsSilenceScalar(&ptr[i], size - i);
+}
+
+static const PCMKernels kNEONKernels = {
+    "neon", SwapCopy16NEON, IsSilenceNEON
+};
+
+#endif  // HAVE_NEON_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////
+
+static pthread_once_t gSelectOnce = PTHREAD_ONCE_INIT;
+static const PCMKernels *gKernels = &kScalarKernels;
+
+static void SelectPCMKernels() {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.pcm-kernels", val, NULL)
+            && !strcasecmp("scalar", val)) {
+        ALOGI("using scalar PCM kernels as requested");
+        return;
+    }
+
+#if defined(__SSE2__)
+    gKernels = &kSSE2Kernels;
+#endif
+
+#if HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gKernels = &kAVX2Kernels;
+    }
+#endif
+
+#if HAVE_NEON_KERNELS
+    gKernels = &kNEONKernels;
+#endif
+
+    ALOGI("using %s PCM kernels", gKernels->mName);
+}
+
+const PCMKernels &GetPCMKernels() {
+    pthread_once(&gSelectOnce, SelectPCMKernels);
+
+    return *gKernels;
+}
+
+const PCMKernels &GetScalarPCMKernels() {
+    return kScalarKernels;
+}
+
+}  // namespace android
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PCM_KERNELS_H_
+
+#define PCM_KERNELS_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+namespace android {
+
+// Inner loops of the LPCM audio path. The best implementation the CPU
+// supports is picked the first time GetPCMKernels() is called, setting
+// media.wfd.pcm-kernels to "scalar" disables the vectorized ones.
+struct PCMKernels {
+    const char *mName;
+
+    // Copies "numSamples" 16-bit samples from "src" to "dst", converting
+    // them from host to network byte order. The buffers must not overlap
+    // unless they are identical.
+    void (*mSwapCopy16)(void *dst, const void *src, size_t numSamples);
+
+    // Returns true iff all "size" bytes at "data" are zero.
+    bool (*mIsSilence)(const void *data, size_t size);
+};
+
+const PCMKernels &GetPCMKernels();
+
+// The portable implementation, for reference and benchmarking.
+const PCMKernels &GetScalarPCMKernels();
+
+}  // namespace android
+
+#endif  // PCM_KERNELS_H_
@@ -48,6 +48,8 @@
 #include <media/stagefright/SurfaceMediaSource.h>
 #include <media/stagefright/Utils.h>
 
+#include <cutils/properties.h>
+
 #include <OMX_IVCommon.h>
 
 namespace android {
@@ -79,9 +81,23 @@ struct WifiDisplaySource::PlaybackSession::Track : public AHandler {
     void queueAccessUnit(const sp<ABuffer> &accessUnit);
     sp<ABuffer> dequeueAccessUnit();
 
+    // Access units may reference the encoder's output buffers, these
+    // must be gone by the time the encoder shuts down.
+    void flushQueuedBuffers();
+
     bool hasOutputBuffer(int64_t *timeUs) const;
     void queueOutputBuffer(const sp<ABuffer> &accessUnit);
-    sp<ABuffer> dequeueOutputBuffer();
+
+    // Also accounts for how long the access unit was held back.
+    sp<ABuffer> dequeueOutputBuffer(int64_t nowUs);
+
+    // When the access unit at the head of the queue was queued.
+    int64_t outputBufferQueuedUs() const;
+
+    // Interleaving delay incurred by the access units dequeued since
+    // the last call.
+    void getInterleaveStats(
+            size_t *numAccessUnits, int64_t *avgDelayUs, int64_t *maxDelayUs);
 
 #if SUSPEND_VIDEO_IF_IDLE
     bool isSuspended() const;
@@ -115,6 +131,10 @@ private:
     List<sp<ABuffer> > mQueuedOutputBuffers;
     int64_t mLastOutputBufferQueuedTimeUs;
 
+    size_t mNumDequeuedOutputBuffers;
+    int64_t mTotalInterleaveDelayUs;
+    int64_t mMaxInterleaveDelayUs;
+
     static bool IsAudioFormat(const sp<AMessage> &format);
 
     DISALLOW_EVIL_CONSTRUCTORS(Track);
@@ -134,7 +154,10 @@ WifiDisplaySource::PlaybackSession::Track::Track(
       mStarted(false),
       mPacketizerTrackIndex(-1),
       mIsAudio(IsAudioFormat(mConverter->getOutputFormat())),
-      mLastOutputBufferQueuedTimeUs(-1ll) {
+      mLastOutputBufferQueuedTimeUs(-1ll),
+      mNumDequeuedOutputBuffers(0),
+      mTotalInterleaveDelayUs(0ll),
+      mMaxInterleaveDelayUs(0ll) {
 }
 
 WifiDisplaySource::PlaybackSession::Track::~Track() {
@@ -248,6 +271,11 @@ sp<ABuffer> WifiDisplaySource::PlaybackSession::Track::dequeueAccessUnit() {
     return accessUnit;
 }
 
+void WifiDisplaySource::PlaybackSession::Track::flushQueuedBuffers() {
+    mQueuedAccessUnits.clear();
+    mQueuedOutputBuffers.clear();
+}
+
 void WifiDisplaySource::PlaybackSession::Track::setRepeaterSource(
         const sp<RepeaterSource> &source) {
     mRepeaterSource = source;
@@ -282,19 +310,52 @@ bool WifiDisplaySource::PlaybackSession::Track::hasOutputBuffer(
 
 void WifiDisplaySource::PlaybackSession::Track::queueOutputBuffer(
         const sp<ABuffer> &accessUnit) {
-    mQueuedOutputBuffers.push_back(accessUnit);
     mLastOutputBufferQueuedTimeUs = ALooper::GetNowUs();
+
+    accessUnit->meta()->setInt64("queuedUs", mLastOutputBufferQueuedTimeUs);
+    mQueuedOutputBuffers.push_back(accessUnit);
 }
 
-sp<ABuffer> WifiDisplaySource::PlaybackSession::Track::dequeueOutputBuffer() {
+sp<ABuffer> WifiDisplaySource::PlaybackSession::Track::dequeueOutputBuffer(
+        int64_t nowUs) {
     CHECK(!mQueuedOutputBuffers.empty());
 
+    int64_t delayUs = nowUs - outputBufferQueuedUs();
+
+    ++mNumDequeuedOutputBuffers;
+    mTotalInterleaveDelayUs += delayUs;
+    if (delayUs > mMaxInterleaveDelayUs) {
+        mMaxInterleaveDelayUs = delayUs;
+    }
+
     sp<ABuffer> outputBuffer = *mQueuedOutputBuffers.begin();
     mQueuedOutputBuffers.erase(mQueuedOutputBuffers.begin());
 
     return outputBuffer;
 }
 
+int64_t WifiDisplaySource::PlaybackSession::Track::outputBufferQueuedUs() const {
+    CHECK(!mQueuedOutputBuffers.empty());
+
+    int64_t queuedUs;
+    CHECK((*mQueuedOutputBuffers.begin())->meta()->findInt64(
+                "queuedUs", &queuedUs));
+
+    return queuedUs;
+}
+
+void WifiDisplaySource::PlaybackSession::Track::getInterleaveStats(
+        size_t *numAccessUnits, int64_t *avgDelayUs, int64_t *maxDelayUs) {
+    *numAccessUnits = mNumDequeuedOutputBuffers;
+    *avgDelayUs = mNumDequeuedOutputBuffers > 0
+        ? mTotalInterleaveDelayUs / mNumDequeuedOutputBuffers : 0ll;
+    *maxDelayUs = mMaxInterleaveDelayUs;
+
+    mNumDequeuedOutputBuffers = 0;
+    mTotalInterleaveDelayUs = 0ll;
+    mMaxInterleaveDelayUs = 0ll;
+}
+
 #if SUSPEND_VIDEO_IF_IDLE
 bool WifiDisplaySource::PlaybackSession::Track::isSuspended() const {
     if (!mQueuedOutputBuffers.empty()) {
@@ -315,12 +376,37 @@ bool WifiDisplaySource::PlaybackSession::Track::isSuspended() const {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// True iff the H.264 access unit's first coded slice has a nal_ref_idc of 0,
+// i.e. no other frame is predicted from it. Never true for IDR frames.
+static bool IsNonReferenceFrame(const sp<ABuffer> &accessUnit) {
+    const uint8_t *data = accessUnit->data();
+    size_t size = accessUnit->size();
+
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while (getNextNALUnit(&data, &size, &nalStart, &nalSize, true) == OK) {
+        CHECK_GT(nalSize, 0u);
+
+        unsigned nalType = nalStart[0] & 0x1f;
+
+        if (nalType >= 1 && nalType <= 5) {
+            return (nalStart[0] & 0x60) == 0;
+        }
+    }
+
+    return false;
+}
+
 WifiDisplaySource::PlaybackSession::PlaybackSession(
         const sp<ANetworkSession> &netSession,
         const sp<AMessage> &notify,
         const in_addr &interfaceAddr,
         const sp<IHDCP> &hdcp)
     : mNetSession(netSession),
+      mNextSinkID(kPrimarySinkID),
+      mMulticastPort(kDefaultMulticastPort),
+      mGroupSenderStarted(false),
+      mGroupLastCPUTimeUs(0),
       mNotify(notify),
       mInterfaceAddr(interfaceAddr),
       mHDCP(hdcp),
@@ -328,21 +414,125 @@ WifiDisplaySource::PlaybackSession::PlaybackSession(
       mLastLifesignUs(),
       mVideoTrackIndex(-1),
       mPrevTimeUs(-1ll),
-      mAllTracksHavePacketizerIndex(false) {
+      mAllTracksHavePacketizerIndex(false),
+      mMaxInterleaveSkewUs(kDefaultMaxInterleaveSkewUs),
+      mDrainDeadlineGeneration(0),
+      mDrainDeadlineUs(-1ll),
+      mLastStatsUs(-1ll),
+      mGOPCacheSize(0),
+      mGOPCacheValid(false),
+      mSessionEstablishedUs(-1ll),
+      mSentFirstVideoFrame(false),
+      mIDRRequestedUs(-1ll),
+      mNumVideoBytesSent(0ll),
+      mLastNumFramesEmitted(0ll),
+      mLastNumFramesSkipped(0ll),
+      mVideoWidth(0),
+      mVideoHeight(0),
+      mVideoFramesPerSecond(0),
+      mNumVideoSlices(1),
+      mVideoFrameTimeUs(-1ll),
+      mVideoFrameFirstSentUs(-1ll),
+      mVideoFrameLastSentUs(-1ll),
+      mNumLatencyFrames(0ll),
+      mTotalFirstByteLatencyUs(0ll),
+      mTotalLastByteLatencyUs(0ll),
+      mCongested(false),
+      mNumVideoFramesDropped(0ll),
+      mTotalBitrate(0),
+      mPacketizeCPUTimeUs(0ll) {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.max-interleave-skew-ms", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val) {
+            mMaxInterleaveSkewUs = x * 1000ll;
+        }
+    }
+
+    // Sends each slice of a frame as soon as the encoder produced it,
+    // instead of waiting for the whole frame.
+    if (property_get("media.wfd.video-slices", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 1) {
+            if (mHDCP != NULL) {
+                // Every PES packet carries its own encryption counters.
+                ALOGW("slice mode is not supported with HDCP");
+            } else {
+                mNumVideoSlices = x;
+            }
+        }
+    }
+
+    // "addr[:port]", sinks using UDP transport then share one RTP stream
+    // sent to that group instead of getting a copy each.
+    if (property_get("media.wfd.multicast-group", val, NULL)) {
+        bool valid = true;
+        unsigned long port = kDefaultMulticastPort;
+
+        char *colonPos = strchr(val, ':');
+        if (colonPos != NULL) {
+            *colonPos = '\0';
+
+            char *end;
+            port = strtoul(colonPos + 1, &end, 10);
+
+            valid = *end == '\0' && end > colonPos + 1
+                && port > 0 && port < 65535;
+        }
+
+        if (!valid || !ANetworkSession::IsMulticastAddress(val)) {
+            ALOGW("ignoring malformed media.wfd.multicast-group");
+        } else if (mHDCP != NULL) {
+            // Every sink negotiates its own session key.
+            ALOGW("multicast is not supported with HDCP");
+        } else {
+            mMulticastGroup = val;
+            mMulticastPort = port;
+        }
+    }
 }
 
 status_t WifiDisplaySource::PlaybackSession::init(
         const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
         Sender::TransportMode transportMode,
-        bool usePCMAudio) {
+        bool usePCMAudio,
+        VideoFormats::ResolutionType videoResolutionType,
+        size_t videoResolutionIndex) {
+    size_t width, height, framesPerSecond;
+    bool interlaced;
+    CHECK(VideoFormats::GetConfiguration(
+                videoResolutionType,
+                videoResolutionIndex,
+                &width,
+                &height,
+                &framesPerSecond,
+                &interlaced));
+
+    // The encoder only produces progressive frames.
+    CHECK(!interlaced);
+
+    mVideoWidth = width;
+    mVideoHeight = height;
+    mVideoFramesPerSecond = framesPerSecond;
+
     status_t err = setupPacketizer(usePCMAudio);
 
     if (err != OK) {
         return err;
     }
 
-    sp<AMessage> notify = new AMessage(kWhatSenderNotify, id());
-    mSender = new Sender(mNetSession, notify);
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        sp<AMessage> format = mTracks.valueAt(i)->converter()->getOutputFormat();
+
+        int32_t bitrate;
+        if (format->findInt32("bitrate", &bitrate)) {
+            mTotalBitrate += bitrate;
+        }
+    }
 
     mSenderLooper = new ALooper;
     mSenderLooper->setName("sender_looper");
@@ -352,14 +542,27 @@ status_t WifiDisplaySource::PlaybackSession::init(
             false /* canCallJava */,
             PRIORITY_AUDIO);
 
-    mSenderLooper->registerHandler(mSender);
+    if (!mMulticastGroup.empty()) {
+        err = setupGroupSender();
+
+        if (err != OK) {
+            ALOGW("failed to set up the multicast group sender (%d), "
+                  "sinks will be served by unicast",
+                  err);
 
-    err = mSender->init(clientIP, clientRtp, clientRtcp, transportMode);
+            mMulticastGroup.clear();
+        }
+    }
+
+    int32_t sinkID;
+    err = addSink(clientIP, clientRtp, clientRtcp, transportMode, &sinkID);
 
     if (err != OK) {
         return err;
     }
 
+    CHECK_EQ(sinkID, (int32_t)kPrimarySinkID);
+
     updateLiveness();
 
     return OK;
@@ -368,8 +571,139 @@ status_t WifiDisplaySource::PlaybackSession::init(
 WifiDisplaySource::PlaybackSession::~PlaybackSession() {
 }
 
-int32_t WifiDisplaySource::PlaybackSession::getRTPPort() const {
-    return mSender->getRTPPort();
+status_t WifiDisplaySource::PlaybackSession::setupGroupSender() {
+    sp<AMessage> notify = new AMessage(kWhatSenderNotify, id());
+    notify->setInt32("sinkID", kGroupSenderID);
+
+    sp<Sender> sender = new Sender(mNetSession, notify);
+    mSenderLooper->registerHandler(sender);
+
+    status_t err = sender->init(
+            mMulticastGroup.c_str(),
+            mMulticastPort,
+            -1 /* clientRtcp */,
+            Sender::TRANSPORT_UDP);
+
+    if (err == OK) {
+        err = sender->setMulticastInterface(mInterfaceAddr);
+    }
+
+    if (err != OK) {
+        mSenderLooper->unregisterHandler(sender->id());
+        return err;
+    }
+
+    if (mTotalBitrate > 0) {
+        sender->setBitrate(mTotalBitrate);
+    }
+
+    mGroupSender = sender;
+    mGroupLastCPUTimeUs = sender->getCPUTimeUs();
+
+    ALOGI("sending RTP to multicast group %s:%d",
+          mMulticastGroup.c_str(), mMulticastPort);
+
+    return OK;
+}
+
+status_t WifiDisplaySource::PlaybackSession::addSink(
+        const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
+        Sender::TransportMode transportMode,
+        int32_t *sinkID) {
+    if (mSenderLooper == NULL) {
+        return INVALID_OPERATION;
+    }
+
+    sp<AMessage> notify = new AMessage(kWhatSenderNotify, id());
+    notify->setInt32("sinkID", mNextSinkID);
+
+    sp<Sender> sender = new Sender(mNetSession, notify);
+    mSenderLooper->registerHandler(sender);
+
+    status_t err = sender->init(clientIP, clientRtp, clientRtcp, transportMode);
+
+    if (err != OK) {
+        mSenderLooper->unregisterHandler(sender->id());
+        return err;
+    }
+
+    bool multicast =
+        mGroupSender != NULL && transportMode == Sender::TRANSPORT_UDP;
+
+    if (multicast) {
+        sender->setMulticastGroupSender(mGroupSender);
+    } else if (mTotalBitrate > 0) {
+        sender->setBitrate(mTotalBitrate);
+    }
+
+    SinkInfo info;
+    info.mSender = sender;
+    info.mStarted = false;
+    info.mMulticast = multicast;
+    info.mLastCPUTimeUs = sender->getCPUTimeUs();
+    info.mReplaying = false;
+    info.mReplayQueueSize = 0;
+
+    *sinkID = mNextSinkID++;
+    mSinks.add(*sinkID, info);
+
+    ALOGI("sink %d (%s) added%s, %d sinks in total",
+          *sinkID, clientIP, multicast ? " to the multicast group" : "",
+          mSinks.size());
+
+    return OK;
+}
+
+void WifiDisplaySource::PlaybackSession::startSink(int32_t sinkID) {
+    // XXX Give the dongle a second to bind its sockets.
+    sp<AMessage> msg = new AMessage(kWhatFinishPlay, id());
+    msg->setInt32("sinkID", sinkID);
+    msg->post(1000000ll);
+}
+
+void WifiDisplaySource::PlaybackSession::removeSink(int32_t sinkID) {
+    CHECK_NE(sinkID, (int32_t)kPrimarySinkID);
+
+    ssize_t index = mSinks.indexOfKey(sinkID);
+    if (index < 0) {
+        return;
+    }
+
+    mSenderLooper->unregisterHandler(mSinks.valueAt(index).mSender->id());
+    mSinks.removeItemsAt(index);
+
+    ALOGI("sink %d removed, %d sinks left", sinkID, mSinks.size());
+}
+
+int32_t WifiDisplaySource::PlaybackSession::getRTPPort(int32_t sinkID) const {
+    return mSinks.valueFor(sinkID).mSender->getRTPPort();
+}
+
+status_t WifiDisplaySource::PlaybackSession::addRedundantPath(
+        int32_t sinkID, int32_t clientRtp) {
+    const SinkInfo &info = mSinks.valueFor(sinkID);
+    CHECK(!info.mStarted);
+
+    return info.mSender->addRedundantPath(clientRtp);
+}
+
+int32_t WifiDisplaySource::PlaybackSession::getRedundantRTPPort(
+        int32_t sinkID) const {
+    return mSinks.valueFor(sinkID).mSender->getRedundantRTPPort();
+}
+
+bool WifiDisplaySource::PlaybackSession::getMulticastGroup(
+        int32_t sinkID, AString *groupAddr, int32_t *groupPort) const {
+    ssize_t index = mSinks.indexOfKey(sinkID);
+
+    if (index < 0 || !mSinks.valueAt(index).mMulticast) {
+        return false;
+    }
+
+    *groupAddr = mMulticastGroup;
+    *groupPort = mMulticastPort;
+
+    return true;
 }
 
 int64_t WifiDisplaySource::PlaybackSession::getLastLifesignUs() const {
@@ -387,22 +721,44 @@ status_t WifiDisplaySource::PlaybackSession::play() {
 }
 
 status_t WifiDisplaySource::PlaybackSession::finishPlay() {
-    // XXX Give the dongle a second to bind its sockets.
-    (new AMessage(kWhatFinishPlay, id()))->post(1000000ll);
+    startSink(kPrimarySinkID);
     return OK;
 }
 
-status_t WifiDisplaySource::PlaybackSession::onFinishPlay() {
-    return mSender->finishInit();
+status_t WifiDisplaySource::PlaybackSession::onFinishPlay(int32_t sinkID) {
+    ssize_t index = mSinks.indexOfKey(sinkID);
+    if (index < 0) {
+        // Removed in the meantime.
+        return OK;
+    }
+
+    return mSinks.valueAt(index).mSender->finishInit();
 }
 
-status_t WifiDisplaySource::PlaybackSession::onFinishPlay2() {
-    mSender->scheduleSendSR();
+status_t WifiDisplaySource::PlaybackSession::onFinishPlay2(int32_t sinkID) {
+    SinkInfo *info = &mSinks.editValueFor(sinkID);
+    info->mSender->scheduleSendSR();
+    info->mStarted = true;
+
+    if (info->mMulticast) {
+        mGroupSenderStarted = true;
+    }
+
+    if (sinkID != kPrimarySinkID) {
+        // The encoder is running already, the new sink needs an IDR frame
+        // to start decoding.
+        ALOGI("sink %d joined", sinkID);
+
+        requestIDRFrame(sinkID);
+        return OK;
+    }
 
     for (size_t i = 0; i < mTracks.size(); ++i) {
         CHECK_EQ((status_t)OK, mTracks.editValueAt(i)->start());
     }
 
+    mSessionEstablishedUs = ALooper::GetNowUs();
+
     sp<AMessage> notify = mNotify->dup();
     notify->setInt32("what", kWhatSessionEstablished);
     notify->post();
@@ -419,7 +775,11 @@ status_t WifiDisplaySource::PlaybackSession::pause() {
 void WifiDisplaySource::PlaybackSession::destroyAsync() {
     ALOGI("destroyAsync");
 
+    // Access units still on their way to us are dropped from now on.
+    mWeAreDead = true;
+
     for (size_t i = 0; i < mTracks.size(); ++i) {
+        mTracks.valueAt(i)->flushQueuedBuffers();
         mTracks.valueAt(i)->stopAsync();
     }
 }
@@ -517,10 +877,38 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
             int32_t what;
             CHECK(msg->findInt32("what", &what));
 
+            int32_t sinkID;
+            CHECK(msg->findInt32("sinkID", &sinkID));
+
+            if (sinkID == kGroupSenderID) {
+                // Nobody calls finishInit() on it, all it can report is
+                // that its socket died, which affects every multicast sink.
+                if (mGroupSender != NULL && what == Sender::kWhatSessionDead) {
+                    notifySessionDead();
+                }
+                break;
+            }
+
+            if (mSinks.indexOfKey(sinkID) < 0) {
+                // Removed in the meantime.
+                break;
+            }
+
             if (what == Sender::kWhatInitDone) {
-                onFinishPlay2();
+                onFinishPlay2(sinkID);
             } else if (what == Sender::kWhatSessionDead) {
-                notifySessionDead();
+                if (sinkID == kPrimarySinkID) {
+                    notifySessionDead();
+                    break;
+                }
+
+                // Only this sink is affected, the others keep going.
+                removeSink(sinkID);
+
+                sp<AMessage> notify = mNotify->dup();
+                notify->setInt32("what", kWhatSinkDead);
+                notify->setInt32("sinkID", sinkID);
+                notify->post();
             } else {
                 TRESPASS();
             }
@@ -530,7 +918,10 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
 
         case kWhatFinishPlay:
         {
-            onFinishPlay();
+            int32_t sinkID;
+            CHECK(msg->findInt32("sinkID", &sinkID));
+
+            onFinishPlay(sinkID);
             break;
         }
 
@@ -555,11 +946,26 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
                     break;
                 }
 
-                mSenderLooper->unregisterHandler(mSender->id());
-                mSender.clear();
+                for (size_t i = 0; i < mSinks.size(); ++i) {
+                    mSenderLooper->unregisterHandler(
+                            mSinks.valueAt(i).mSender->id());
+                }
+                mSinks.clear();
+
+                if (mGroupSender != NULL) {
+                    mSenderLooper->unregisterHandler(mGroupSender->id());
+                    mGroupSender.clear();
+                    mGroupSenderStarted = false;
+                }
+
                 mSenderLooper.clear();
 
                 mPacketizer.clear();
+                mRepeaterSource.clear();
+
+                mGOPCache.clear();
+                mGOPCacheSize = 0;
+                mGOPCacheValid = false;
 
                 sp<AMessage> notify = mNotify->dup();
                 notify->setInt32("what", kWhatSessionDestroyed);
@@ -590,6 +996,32 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
             break;
         }
 
+        case kWhatDrainDeadline:
+        {
+            int32_t generation;
+            CHECK(msg->findInt32("generation", &generation));
+
+            if (generation != mDrainDeadlineGeneration || mWeAreDead) {
+                break;
+            }
+
+            mDrainDeadlineUs = -1ll;
+
+            if (mAllTracksHavePacketizerIndex) {
+                drainAccessUnits();
+            }
+            break;
+        }
+
+        case kWhatReplayGOPCache:
+        {
+            int32_t sinkID;
+            CHECK(msg->findInt32("sinkID", &sinkID));
+
+            onReplayGOPCache(sinkID);
+            break;
+        }
+
         default:
             TRESPASS();
     }
@@ -641,6 +1073,11 @@ status_t WifiDisplaySource::PlaybackSession::addSource(
 
     if (isVideo) {
         format->setInt32("store-metadata-in-buffers", true);
+        format->setInt32("frame-rate", mVideoFramesPerSecond);
+
+        if (mNumVideoSlices > 1) {
+            format->setInt32("num-slices", mNumVideoSlices);
+        }
 
         format->setInt32(
                 "color-format", OMX_COLOR_FormatAndroidOpaque);
@@ -698,7 +1135,23 @@ status_t WifiDisplaySource::PlaybackSession::addVideoSource() {
 
 #if 1
     sp<RepeaterSource> videoSource =
-        new RepeaterSource(source, 30.0 /* rateHz */);
+        new RepeaterSource(source, mVideoFramesPerSecond /* rateHz */);
+
+    // Lets a static screen cost (almost) nothing to encode and send.
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.video-min-rate-hz", val, NULL)) {
+        char *end;
+        double minRateHz = strtod(val, &end);
+
+        if (*end == '\0' && end > val && minRateHz >= 0.0) {
+            ALOGI("variable frame rate, refreshing at least at %.2f Hz",
+                  minRateHz);
+
+            videoSource->setVariableFrameRate(minRateHz);
+        }
+    }
+
+    mRepeaterSource = videoSource;
 #endif
 
 #if 1
@@ -747,22 +1200,32 @@ sp<ISurfaceTexture> WifiDisplaySource::PlaybackSession::getSurfaceTexture() {
 }
 
 int32_t WifiDisplaySource::PlaybackSession::width() const {
-#if USE_1080P
-    return 1920;
-#else
-    return 1280;
-#endif
+    return mVideoWidth;
 }
 
 int32_t WifiDisplaySource::PlaybackSession::height() const {
-#if USE_1080P
-    return 1080;
-#else
-    return 720;
-#endif
+    return mVideoHeight;
 }
 
-void WifiDisplaySource::PlaybackSession::requestIDRFrame() {
+void WifiDisplaySource::PlaybackSession::requestIDRFrame(int32_t sinkID) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    // Tide the sink over until the encoder delivers the new IDR frame.
+    size_t numBytes = replayGOPCache(sinkID);
+
+    if (numBytes > 0) {
+        ALOGI("IDR requested by sink %d, replaying %d bytes from the GOP "
+              "cache", sinkID, numBytes);
+
+        if (sinkID != kPrimarySinkID) {
+            // That's all it needs, a fresh IDR frame would cost every
+            // other sink bandwidth for nothing.
+            return;
+        }
+    }
+
+    mIDRRequestedUs = nowUs;
+
     for (size_t i = 0; i < mTracks.size(); ++i) {
         const sp<Track> &track = mTracks.valueAt(i);
 
@@ -797,10 +1260,34 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
     uint64_t inputCTR;
     uint8_t HDCP_private_data[16];
 
+    // In slice mode all slices of a frame share a single PES packet.
+    // Unless it is known to be the frame's last slice, Sender can't mark
+    // where the frame ends.
+    bool continuesFrame = false;
+    bool endsFrame = !track->isAudio();
+
+    int32_t firstSlice;
+    if (!track->isAudio()
+            && accessUnit->meta()->findInt32("firstSlice", &firstSlice)) {
+        int64_t frameTimeUs;
+        CHECK(accessUnit->meta()->findInt64("timeUs", &frameTimeUs));
+
+        continuesFrame = !firstSlice && frameTimeUs == mVideoFrameTimeUs;
+
+        flags |= continuesFrame
+            ? TSPacketizer::CONTINUE_PES_PACKET
+            : TSPacketizer::UNBOUNDED_PES_PACKET;
+
+        int32_t lastSlice;
+        endsFrame = accessUnit->meta()->findInt32("lastSlice", &lastSlice)
+            && lastSlice;
+    }
+
+    // Must be determined before the data is encrypted below.
+    bool isIDR = !track->isAudio() && !continuesFrame && IsIDR(accessUnit);
+
     bool manuallyPrependSPSPPS =
-        !track->isAudio()
-        && track->converter()->needToManuallyPrependSPSPPS()
-        && IsIDR(accessUnit);
+        isIDR && track->converter()->needToManuallyPrependSPSPPS();
 
     if (mHDCP != NULL && !track->isAudio()) {
         isHDCPEncrypted = true;
@@ -894,7 +1381,9 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
     }
 
     int64_t timeUs = ALooper::GetNowUs();
-    if (mPrevTimeUs < 0ll || mPrevTimeUs + 100000ll <= timeUs) {
+    if (mPrevTimeUs < 0ll || mPrevTimeUs + 100000ll <= timeUs || isIDR) {
+        // IDR frames always carry PAT/PMT, so that a GOP replayed from the
+        // cache is decodable by itself.
         flags |= TSPacketizer::EMIT_PCR;
         flags |= TSPacketizer::EMIT_PAT_AND_PMT;
 
@@ -907,6 +1396,18 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
             !isHDCPEncrypted ? 0 : sizeof(HDCP_private_data),
             track->isAudio() ? 2 : 0 /* numStuffingBytes */);
 
+    if (isIDR) {
+        (*packets)->meta()->setInt32("isIDR", true);
+    }
+
+    if (continuesFrame) {
+        (*packets)->meta()->setInt32("continuesFrame", true);
+    }
+
+    if (endsFrame) {
+        (*packets)->meta()->setInt32("endsFrame", true);
+    }
+
     return OK;
 }
 
@@ -946,13 +1447,22 @@ void WifiDisplaySource::PlaybackSession::drainAccessUnits() {
             mTracks.valueFor(1)->countQueuedOutputBuffers(),
             mTracks.valueFor(0)->countQueuedOutputBuffers());
 
-    while (drainAccessUnit()) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    while (drainAccessUnit(nowUs)) {
     }
+
+    updateCongestion();
+    logStats(nowUs);
 }
 
-bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
+// Emits the earliest access unit across all tracks. As long as some live
+// track has nothing queued it might still produce an earlier one, so we
+// hold back, but never for longer than mMaxInterleaveSkewUs.
+bool WifiDisplaySource::PlaybackSession::drainAccessUnit(int64_t nowUs) {
     ssize_t minTrackIndex = -1;
     int64_t minTimeUs = -1ll;
+    bool waitingForTrack = false;
 
     for (size_t i = 0; i < mTracks.size(); ++i) {
         const sp<Track> &track = mTracks.valueAt(i);
@@ -969,13 +1479,13 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
             // We still consider this track "live", so it should keep
             // delivering output data whose time stamps we'll have to
             // consider for proper interleaving.
-            return false;
+            waitingForTrack = true;
         }
 #else
         else {
             // We need access units available on all tracks to be able to
             // dequeue the earliest one.
-            return false;
+            waitingForTrack = true;
         }
 #endif
     }
@@ -985,11 +1495,35 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
     }
 
     const sp<Track> &track = mTracks.valueFor(minTrackIndex);
-    sp<ABuffer> accessUnit = track->dequeueOutputBuffer();
+
+    if (waitingForTrack) {
+        int64_t deadlineUs =
+            track->outputBufferQueuedUs() + mMaxInterleaveSkewUs;
+
+        if (nowUs < deadlineUs) {
+            scheduleDrainDeadline(deadlineUs);
+            return false;
+        }
+    }
+
+    sp<ABuffer> accessUnit = track->dequeueOutputBuffer(nowUs);
+
+    bool isNonReference = (ssize_t)minTrackIndex == mVideoTrackIndex
+        && IsNonReferenceFrame(accessUnit);
+
+    if (mCongested && isNonReference) {
+        // No other frame depends on it, so the sink won't miss it much.
+        ++mNumVideoFramesDropped;
+        return true;
+    }
+
+    int64_t startCPUTimeUs = Sender::GetThreadCPUTimeUs();
 
     sp<ABuffer> packets;
     status_t err = packetizeAccessUnit(minTrackIndex, accessUnit, &packets);
 
+    mPacketizeCPUTimeUs += Sender::GetThreadCPUTimeUs() - startCPUTimeUs;
+
     if (err != OK) {
         notifySessionDead();
         return false;
@@ -997,8 +1531,56 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
 
     if ((ssize_t)minTrackIndex == mVideoTrackIndex) {
         packets->meta()->setInt32("isVideo", 1);
+        mNumVideoBytesSent += packets->size();
+
+        if (isNonReference) {
+            // Lets the network session shed it before anything else.
+            packets->meta()->setInt32("droppable", 1);
+        }
+
+        int32_t isIDR;
+        if (!packets->meta()->findInt32("isIDR", &isIDR)) {
+            isIDR = false;
+        }
+
+        int32_t continuesFrame;
+        if (!packets->meta()->findInt32("continuesFrame", &continuesFrame)) {
+            continuesFrame = false;
+        }
+
+        updateFrameLatency(minTimeUs, !continuesFrame);
+
+        if (!mSentFirstVideoFrame) {
+            mSentFirstVideoFrame = true;
+
+            ALOGI("time to first frame %lld ms",
+                  (ALooper::GetNowUs() - mSessionEstablishedUs) / 1000ll);
+        }
+
+        if (isIDR && mIDRRequestedUs >= 0ll) {
+            ALOGI("fresh IDR frame sent %lld ms after it was requested",
+                  (ALooper::GetNowUs() - mIDRRequestedUs) / 1000ll);
+
+            mIDRRequestedUs = -1ll;
+        }
+
+        packets->meta()->setInt64("timeUs", minTimeUs);
+        addToGOPCache(packets, isIDR);
+    }
+
+    // Every sender does its own RTP framing, the packetized data itself is
+    // shared. The multicast sinks' stream is framed and sent only once.
+    if (mGroupSenderStarted) {
+        mGroupSender->queuePackets(minTimeUs, packets);
+    }
+
+    for (size_t i = 0; i < mSinks.size(); ++i) {
+        SinkInfo *info = &mSinks.editValueAt(i);
+
+        if (info->mStarted && !info->mMulticast) {
+            queueToSink(info, minTimeUs, packets);
+        }
     }
-    mSender->queuePackets(minTimeUs, packets);
 
 #if 0
     if (minTrackIndex == mVideoTrackIndex) {
@@ -1014,5 +1596,343 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
     return true;
 }
 
+// The sender's backlog is the backpressure signal. While it is too large
+// non-reference video frames are discarded here, audio and reference
+// frames are always sent so the picture never freezes. All sinks share
+// one stream, so the slowest of them decides.
+void WifiDisplaySource::PlaybackSession::updateCongestion() {
+    if (mVideoTrackIndex < 0 || mTracks.indexOfKey(mVideoTrackIndex) < 0) {
+        return;
+    }
+
+    int64_t backlogUs = 0ll;
+    for (size_t i = 0; i < mSinks.size(); ++i) {
+        const SinkInfo &info = mSinks.valueAt(i);
+
+        if (!info.mStarted) {
+            continue;
+        }
+
+        int64_t sinkBacklogUs;
+        uint32_t numDropped;
+        info.mSender->getQueueStats(&sinkBacklogUs, &numDropped);
+
+        if (sinkBacklogUs > backlogUs) {
+            backlogUs = sinkBacklogUs;
+        }
+    }
+
+    if (mGroupSenderStarted) {
+        int64_t groupBacklogUs;
+        uint32_t numDropped;
+        mGroupSender->getQueueStats(&groupBacklogUs, &numDropped);
+
+        if (groupBacklogUs > backlogUs) {
+            backlogUs = groupBacklogUs;
+        }
+    }
+
+    bool congested = mCongested
+        ? backlogUs > kResumeSenderBacklogUs
+        : backlogUs > kMaxSenderBacklogUs;
+
+    if (congested == mCongested) {
+        return;
+    }
+
+    if (congested) {
+        ALOGW("sender is %lld ms behind, dropping non-reference video "
+              "frames", backlogUs / 1000ll);
+    } else {
+        ALOGI("sender caught up, %lld video frames dropped so far",
+              mNumVideoFramesDropped);
+    }
+
+    mCongested = congested;
+}
+
+// Latency is measured from capture to handing the data to the sender, for
+// both the first and the last byte of a frame. The latter is only known
+// once the next frame starts.
+void WifiDisplaySource::PlaybackSession::updateFrameLatency(
+        int64_t timeUs, bool startsFrame) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (startsFrame) {
+        if (mVideoFrameTimeUs >= 0ll) {
+            ++mNumLatencyFrames;
+            mTotalFirstByteLatencyUs +=
+                mVideoFrameFirstSentUs - mVideoFrameTimeUs;
+            mTotalLastByteLatencyUs +=
+                mVideoFrameLastSentUs - mVideoFrameTimeUs;
+        }
+
+        mVideoFrameTimeUs = timeUs;
+        mVideoFrameFirstSentUs = nowUs;
+    }
+
+    mVideoFrameLastSentUs = nowUs;
+}
+
+void WifiDisplaySource::PlaybackSession::addToGOPCache(
+        const sp<ABuffer> &packets, bool isIDR) {
+    if (isIDR) {
+        mGOPCache.clear();
+        mGOPCacheSize = 0;
+        mGOPCacheValid = true;
+    }
+
+    if (!mGOPCacheValid) {
+        return;
+    }
+
+    if (mGOPCacheSize + packets->size() > kMaxGOPCacheSize) {
+        ALOGW("GOP too large to cache, waiting for the next IDR frame");
+
+        mGOPCache.clear();
+        mGOPCacheSize = 0;
+        mGOPCacheValid = false;
+        return;
+    }
+
+    // Sender copies the data into its RTP packets, we can hold on to it.
+    mGOPCache.push_back(packets);
+    mGOPCacheSize += packets->size();
+}
+
+size_t WifiDisplaySource::PlaybackSession::replayGOPCache(int32_t sinkID) {
+    ssize_t index = mSinks.indexOfKey(sinkID);
+
+    if (!mGOPCacheValid || index < 0 || !mSinks.valueAt(index).mStarted) {
+        return 0;
+    }
+
+    if (mSinks.valueAt(index).mMulticast) {
+        // Replaying to the group would hit every other multicast sink too.
+        return 0;
+    }
+
+    SinkInfo *info = &mSinks.editValueAt(index);
+
+    if (info->mReplaying) {
+        // Didn't help the last time around, it'll need a fresh IDR frame.
+        return 0;
+    }
+
+    // Handing it all to the sender at once would overflow its send queue
+    // and congest every other sink, it is fed in step with the backlog.
+    info->mReplaying = true;
+    info->mReplayQueue = mGOPCache;
+    info->mReplayQueueSize = mGOPCacheSize;
+
+    onReplayGOPCache(sinkID);
+
+    return mGOPCacheSize;
+}
+
+void WifiDisplaySource::PlaybackSession::onReplayGOPCache(int32_t sinkID) {
+    ssize_t index = mSinks.indexOfKey(sinkID);
+
+    if (index < 0 || !mSinks.valueAt(index).mReplaying) {
+        // Removed or abandoned in the meantime.
+        return;
+    }
+
+    SinkInfo *info = &mSinks.editValueAt(index);
+
+    while (!info->mReplayQueue.empty()) {
+        int64_t backlogUs;
+        uint32_t numDropped;
+        info->mSender->getQueueStats(&backlogUs, &numDropped);
+
+        if (backlogUs > kResumeSenderBacklogUs) {
+            sp<AMessage> msg = new AMessage(kWhatReplayGOPCache, id());
+            msg->setInt32("sinkID", sinkID);
+            msg->post(kReplayIntervalUs);
+            return;
+        }
+
+        const sp<ABuffer> &packets = *info->mReplayQueue.begin();
+
+        int64_t timeUs;
+        CHECK(packets->meta()->findInt64("timeUs", &timeUs));
+
+        info->mSender->queuePackets(timeUs, packets);
+
+        info->mReplayQueueSize -= packets->size();
+        info->mReplayQueue.erase(info->mReplayQueue.begin());
+    }
+
+    ALOGI("GOP cache replayed to sink %d", sinkID);
+
+    info->mReplaying = false;
+}
+
+void WifiDisplaySource::PlaybackSession::queueToSink(
+        SinkInfo *info, int64_t timeUs, const sp<ABuffer> &packets) {
+    if (!info->mReplaying) {
+        info->mSender->queuePackets(timeUs, packets);
+        return;
+    }
+
+    if (info->mReplayQueueSize + packets->size() > kMaxGOPCacheSize) {
+        // The sink can't keep up with the replay, give up on it and let
+        // the encoder provide a new starting point instead.
+        ALOGW("GOP cache replay falling behind, requesting an IDR frame");
+
+        info->mReplaying = false;
+        info->mReplayQueue.clear();
+        info->mReplayQueueSize = 0;
+
+        mIDRRequestedUs = ALooper::GetNowUs();
+
+        for (size_t i = 0; i < mTracks.size(); ++i) {
+            mTracks.valueAt(i)->requestIDRFrame();
+        }
+
+        info->mSender->queuePackets(timeUs, packets);
+        return;
+    }
+
+    // Must not overtake the replayed data.
+    packets->meta()->setInt64("timeUs", timeUs);
+    info->mReplayQueue.push_back(packets);
+    info->mReplayQueueSize += packets->size();
+}
+
+void WifiDisplaySource::PlaybackSession::scheduleDrainDeadline(
+        int64_t deadlineUs) {
+    if (mDrainDeadlineUs >= 0ll && mDrainDeadlineUs <= deadlineUs) {
+        // We'll be woken up early enough already.
+        return;
+    }
+
+    mDrainDeadlineUs = deadlineUs;
+
+    sp<AMessage> msg = new AMessage(kWhatDrainDeadline, id());
+    msg->setInt32("generation", ++mDrainDeadlineGeneration);
+    msg->post(deadlineUs - ALooper::GetNowUs());
+}
+
+void WifiDisplaySource::PlaybackSession::logStats(int64_t nowUs) {
+    if (mLastStatsUs < 0ll) {
+        mLastStatsUs = nowUs;
+        return;
+    }
+
+    if (nowUs < mLastStatsUs + kStatsIntervalUs) {
+        return;
+    }
+
+    int64_t intervalUs = nowUs - mLastStatsUs;
+    mLastStatsUs = nowUs;
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        const sp<Track> &track = mTracks.valueAt(i);
+
+        size_t numAccessUnits;
+        int64_t avgDelayUs, maxDelayUs;
+        track->getInterleaveStats(&numAccessUnits, &avgDelayUs, &maxDelayUs);
+
+        ALOGI("[%s] %d access units, interleaving delay avg %lld us, "
+              "max %lld us",
+              track->isAudio() ? "audio" : "video",
+              numAccessUnits,
+              avgDelayUs,
+              maxDelayUs);
+    }
+
+    for (size_t i = 0; i < mSinks.size(); ++i) {
+        SinkInfo *info = &mSinks.editValueAt(i);
+
+        int64_t backlogUs;
+        uint32_t numDatagramsDropped;
+        info->mSender->getQueueStats(&backlogUs, &numDatagramsDropped);
+
+        uint32_t cpuTimeUs = info->mSender->getCPUTimeUs();
+        uint32_t deltaCPUTimeUs = cpuTimeUs - info->mLastCPUTimeUs;
+        info->mLastCPUTimeUs = cpuTimeUs;
+
+        ALOGI("[sender %d] backlog %lld us, %u RTP packets dropped in total, "
+              "cpu %.1f%%",
+              mSinks.keyAt(i),
+              backlogUs,
+              numDatagramsDropped,
+              deltaCPUTimeUs * 100.0 / intervalUs);
+    }
+
+    if (mGroupSender != NULL) {
+        int64_t backlogUs;
+        uint32_t numDatagramsDropped;
+        mGroupSender->getQueueStats(&backlogUs, &numDatagramsDropped);
+
+        uint32_t cpuTimeUs = mGroupSender->getCPUTimeUs();
+        uint32_t deltaCPUTimeUs = cpuTimeUs - mGroupLastCPUTimeUs;
+        mGroupLastCPUTimeUs = cpuTimeUs;
+
+        ALOGI("[sender %s:%d] backlog %lld us, %u RTP packets dropped in "
+              "total, cpu %.1f%%",
+              mMulticastGroup.c_str(),
+              mMulticastPort,
+              backlogUs,
+              numDatagramsDropped,
+              deltaCPUTimeUs * 100.0 / intervalUs);
+    }
+
+    ALOGI("[packetizer] %d sinks, cpu %.1f%%, "
+          "%lld video frames dropped in total",
+          mSinks.size(),
+          mPacketizeCPUTimeUs * 100.0 / intervalUs,
+          mNumVideoFramesDropped);
+
+    mPacketizeCPUTimeUs = 0ll;
+
+    if (mNumLatencyFrames > 0) {
+        ALOGI("[video] %lld frames (%s mode), latency to first byte avg "
+              "%lld us, to last byte avg %lld us",
+              mNumLatencyFrames,
+              mNumVideoSlices > 1 ? "slice" : "frame",
+              mTotalFirstByteLatencyUs / mNumLatencyFrames,
+              mTotalLastByteLatencyUs / mNumLatencyFrames);
+
+        mNumLatencyFrames = 0ll;
+        mTotalFirstByteLatencyUs = 0ll;
+        mTotalLastByteLatencyUs = 0ll;
+    }
+
+    if (mRepeaterSource == NULL) {
+        return;
+    }
+
+    int64_t numFramesEmitted, numFramesSkipped;
+    mRepeaterSource->getStats(&numFramesEmitted, &numFramesSkipped);
+
+    int64_t emitted = numFramesEmitted - mLastNumFramesEmitted;
+    int64_t skipped = numFramesSkipped - mLastNumFramesSkipped;
+
+    mLastNumFramesEmitted = numFramesEmitted;
+    mLastNumFramesSkipped = numFramesSkipped;
+
+    // Skipped frames would have cost about as much as the ones we sent.
+    int64_t bytesSaved =
+        emitted > 0 ? (mNumVideoBytesSent * skipped) / emitted : 0ll;
+
+    ALOGI("[video] %lld frames emitted, %lld skipped, ~%lld kbit/s saved",
+          emitted,
+          skipped,
+          (bytesSaved * 8ll * 1000ll) / kStatsIntervalUs);
+
+    int64_t avgJitterUs, maxJitterUs, numOverruns;
+    mRepeaterSource->getTimingStats(&avgJitterUs, &maxJitterUs, &numOverruns);
+
+    ALOGI("[video] frame timing jitter avg %lld us, max %lld us, "
+          "%lld deadlines missed",
+          avgJitterUs,
+          maxJitterUs,
+          numOverruns);
+
+    mNumVideoBytesSent = 0ll;
+}
+
 }  // namespace android
 
@@ -29,6 +29,7 @@ struct IHDCP;
 struct ISurfaceTexture;
 struct MediaPuller;
 struct MediaSource;
+struct RepeaterSource;
 struct TSPacketizer;
 
 // Encapsulates the state of an RTP/RTCP session in the context of wifi
@@ -43,11 +44,38 @@ struct WifiDisplaySource::PlaybackSession : public AHandler {
     status_t init(
             const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
             Sender::TransportMode transportMode,
-            bool usePCMAudio);
+            bool usePCMAudio,
+            VideoFormats::ResolutionType videoResolutionType,
+            size_t videoResolutionIndex);
 
     void destroyAsync();
 
-    int32_t getRTPPort() const;
+    // The sink the session was set up for. Others may join its stream
+    // later on, they share capture, encoder and packetizer with it and
+    // only get a Sender, i.e. their own RTP/RTCP transport.
+    enum {
+        kPrimarySinkID = 0,
+    };
+
+    status_t addSink(
+            const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
+            Sender::TransportMode transportMode,
+            int32_t *sinkID);
+
+    void startSink(int32_t sinkID);
+    void removeSink(int32_t sinkID);
+
+    int32_t getRTPPort(int32_t sinkID = kPrimarySinkID) const;
+
+    // See Sender::addRedundantPath(), for a sink that was added but not
+    // started yet.
+    status_t addRedundantPath(int32_t sinkID, int32_t clientRtp);
+    int32_t getRedundantRTPPort(int32_t sinkID) const;
+
+    // True iff the sink receives its RTP stream through the multicast
+    // group (see media.wfd.multicast-group) rather than by unicast.
+    bool getMulticastGroup(
+            int32_t sinkID, AString *groupAddr, int32_t *groupPort) const;
 
     int64_t getLastLifesignUs() const;
     void updateLiveness();
@@ -60,13 +88,14 @@ struct WifiDisplaySource::PlaybackSession : public AHandler {
     int32_t width() const;
     int32_t height() const;
 
-    void requestIDRFrame();
+    void requestIDRFrame(int32_t sinkID = kPrimarySinkID);
 
     enum {
         kWhatSessionDead,
         kWhatBinaryData,
         kWhatSessionEstablished,
         kWhatSessionDestroyed,
+        kWhatSinkDead,
     };
 
 protected:
@@ -84,10 +113,71 @@ private:
         kWhatUpdateSurface,
         kWhatFinishPlay,
         kWhatPacketize,
+        kWhatDrainDeadline,
+        kWhatReplayGOPCache,
+    };
+
+    // Longest an access unit is held back waiting for the other tracks
+    // to catch up, unless media.wfd.max-interleave-skew-ms says otherwise.
+    static const int64_t kDefaultMaxInterleaveSkewUs = 20000ll;
+
+    // How often the interleaving delay and frame rate statistics are logged.
+    static const int64_t kStatsIntervalUs = 10000000ll;
+
+    // Upper bound on the packetized video kept since the most recent IDR
+    // frame, the cache is abandoned until the next one if it grows larger.
+    // Well below ANetworkSession::kMaxOutDatagramsSize, and a replay is
+    // paced anyway, see onReplayGOPCache().
+    static const size_t kMaxGOPCacheSize = 512 * 1024;
+
+    // How often a replay checks whether the sink's sender has room for
+    // more of the GOP cache.
+    static const int64_t kReplayIntervalUs = 10000ll;
+
+    static const int32_t kDefaultMulticastPort = 5004;
+
+    // Identifies the group sender's notifications.
+    enum {
+        kGroupSenderID = -1,
+    };
+
+    // Once the sender is this far behind, video is thinned out until its
+    // backlog is back below kResumeSenderBacklogUs.
+    static const int64_t kMaxSenderBacklogUs = 150000ll;
+    static const int64_t kResumeSenderBacklogUs = 50000ll;
+
+    struct SinkInfo {
+        sp<Sender> mSender;
+        bool mStarted;
+
+        // Its RTP stream goes out through mGroupSender.
+        bool mMulticast;
+
+        // Sender::getCPUTimeUs() as of the last stats.
+        uint32_t mLastCPUTimeUs;
+
+        // While the GOP cache is replayed to the sink, the live stream is
+        // held back behind it, both are fed to mSender only as fast as
+        // its backlog drains.
+        bool mReplaying;
+        List<sp<ABuffer> > mReplayQueue;
+        size_t mReplayQueueSize;
     };
 
     sp<ANetworkSession> mNetSession;
-    sp<Sender> mSender;
+
+    // All senders run on mSenderLooper.
+    KeyedVector<int32_t, SinkInfo> mSinks;
+    int32_t mNextSinkID;
+
+    // Sends the stream once to the multicast group for all sinks using
+    // UDP transport, started along with the first of them.
+    AString mMulticastGroup;
+    int32_t mMulticastPort;
+    sp<Sender> mGroupSender;
+    bool mGroupSenderStarted;
+    uint32_t mGroupLastCPUTimeUs;
+
     sp<ALooper> mSenderLooper;
     sp<AMessage> mNotify;
     in_addr mInterfaceAddr;
@@ -106,7 +196,56 @@ private:
 
     bool mAllTracksHavePacketizerIndex;
 
+    int64_t mMaxInterleaveSkewUs;
+    int32_t mDrainDeadlineGeneration;
+    int64_t mDrainDeadlineUs;
+    int64_t mLastStatsUs;
+
+    sp<RepeaterSource> mRepeaterSource;
+
+    // Video packetized since (and including) the most recent IDR frame,
+    // replayed on an IDR request so the sink doesn't have to wait for
+    // the encoder to produce a fresh one.
+    List<sp<ABuffer> > mGOPCache;
+    size_t mGOPCacheSize;
+    bool mGOPCacheValid;
+
+    int64_t mSessionEstablishedUs;
+    bool mSentFirstVideoFrame;
+    int64_t mIDRRequestedUs;
+    int64_t mNumVideoBytesSent;
+    int64_t mLastNumFramesEmitted;
+    int64_t mLastNumFramesSkipped;
+
+    // The video format negotiated in M3/M4, set up by init().
+    int32_t mVideoWidth;
+    int32_t mVideoHeight;
+    int32_t mVideoFramesPerSecond;
+
+    // Slices per video frame, see media.wfd.video-slices.
+    int32_t mNumVideoSlices;
+
+    // Capture time of the video frame currently being sent and when its
+    // first and most recent data went out.
+    int64_t mVideoFrameTimeUs;
+    int64_t mVideoFrameFirstSentUs;
+    int64_t mVideoFrameLastSentUs;
+
+    int64_t mNumLatencyFrames;
+    int64_t mTotalFirstByteLatencyUs;
+    int64_t mTotalLastByteLatencyUs;
+
+    bool mCongested;
+    int64_t mNumVideoFramesDropped;
+
+    int32_t mTotalBitrate;
+
+    // CPU time spent packetizing since the last stats, paid once no matter
+    // how many sinks there are.
+    int64_t mPacketizeCPUTimeUs;
+
     status_t setupPacketizer(bool usePCMAudio);
+    status_t setupGroupSender();
 
     status_t addSource(
             bool isVideo,
@@ -121,8 +260,8 @@ private:
     ssize_t appendTSData(
             const void *data, size_t size, bool timeDiscontinuity, bool flush);
 
-    status_t onFinishPlay();
-    status_t onFinishPlay2();
+    status_t onFinishPlay(int32_t sinkID);
+    status_t onFinishPlay2(int32_t sinkID);
 
     bool allTracksHavePacketizerIndex();
 
@@ -137,7 +276,19 @@ private:
     void drainAccessUnits();
 
     // Returns true iff an access unit was successfully drained.
-    bool drainAccessUnit();
+    bool drainAccessUnit(int64_t nowUs);
+
+    void scheduleDrainDeadline(int64_t deadlineUs);
+
+    void updateFrameLatency(int64_t timeUs, bool startsFrame);
+    void updateCongestion();
+
+    void addToGOPCache(const sp<ABuffer> &packets, bool isIDR);
+    size_t replayGOPCache(int32_t sinkID);
+    void onReplayGOPCache(int32_t sinkID);
+    void queueToSink(
+            SinkInfo *info, int64_t timeUs, const sp<ABuffer> &packets);
+    void logStats(int64_t nowUs);
 
     DISALLOW_EVIL_CONSTRUCTORS(PlaybackSession);
 };
@@ -4,23 +4,44 @@
 
 #include "RepeaterSource.h"
 
+#include "AClock.h"
+
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/MediaBuffer.h>
 #include <media/stagefright/MetaData.h>
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
 namespace android {
 
 RepeaterSource::RepeaterSource(const sp<MediaSource> &source, double rateHz)
     : mStarted(false),
       mSource(source),
       mRateHz(rateHz),
+      mClock(AClock::GetDefault()),
       mBuffer(NULL),
       mResult(OK),
       mLastBufferUpdateUs(-1ll),
       mStartTimeUs(-1ll),
-      mFrameCount(0) {
+      mFrameCount(0),
+      mVariableFrameRate(false),
+      mMinRateHz(0.0),
+      mBufferGeneration(0),
+      mLastEmittedGeneration(-1),
+      mLastEmittedTimeUs(-1ll),
+      mForceEmit(false),
+      mNumFramesEmitted(0ll),
+      mNumFramesSkipped(0ll),
+      mTimerFd(-1),
+      mWakeupFd(-1),
+      mNumJitterSamples(0ll),
+      mTotalJitterUs(0ll),
+      mMaxJitterUs(0ll),
+      mNumOverruns(0ll) {
 }
 
 RepeaterSource::~RepeaterSource() {
@@ -30,9 +51,30 @@ RepeaterSource::~RepeaterSource() {
 status_t RepeaterSource::start(MetaData *params) {
     CHECK(!mStarted);
 
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (mTimerFd < 0) {
+        return -errno;
+    }
+
+    mWakeupFd = eventfd(0, EFD_NONBLOCK);
+    if (mWakeupFd < 0) {
+        status_t err = -errno;
+
+        close(mTimerFd);
+        mTimerFd = -1;
+
+        return err;
+    }
+
     status_t err = mSource->start(params);
 
     if (err != OK) {
+        close(mWakeupFd);
+        mWakeupFd = -1;
+
+        close(mTimerFd);
+        mTimerFd = -1;
+
         return err;
     }
 
@@ -40,6 +82,10 @@ status_t RepeaterSource::start(MetaData *params) {
     mResult = OK;
     mStartTimeUs = -1ll;
     mFrameCount = 0;
+    mBufferGeneration = 0;
+    mLastEmittedGeneration = -1;
+    mLastEmittedTimeUs = -1ll;
+    mForceEmit = false;
 
     mLooper = new ALooper;
     mLooper->setName("repeater_looper");
@@ -75,6 +121,16 @@ status_t RepeaterSource::stop() {
 
     status_t err = mSource->stop();
 
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        close(mWakeupFd);
+        mWakeupFd = -1;
+
+        close(mTimerFd);
+        mTimerFd = -1;
+    }
+
     ALOGV("stopped");
 
     mStarted = false;
@@ -103,20 +159,47 @@ status_t RepeaterSource::read(
             }
 
             ALOGV("now resuming.");
-            mStartTimeUs = ALooper::GetNowUs();
+            mStartTimeUs = mClock->nowUs();
             bufferTimeUs = mStartTimeUs;
         } else {
             bufferTimeUs = mStartTimeUs + (mFrameCount * 1000000ll) / mRateHz;
 
-            int64_t nowUs = ALooper::GetNowUs();
-            int64_t delayUs = bufferTimeUs - nowUs;
+            int64_t nowUs = mClock->nowUs();
+            int64_t periodUs = 1000000ll / mRateHz;
+
+            if (nowUs >= bufferTimeUs + periodUs) {
+                // We fell behind by at least a whole frame, rather than
+                // catching up with a burst of frames we skip the deadlines
+                // we missed.
+                int32_t numMissed = (nowUs - bufferTimeUs) / periodUs;
+
+                mFrameCount += numMissed;
+                bufferTimeUs =
+                    mStartTimeUs + (mFrameCount * 1000000ll) / mRateHz;
+
+                Mutex::Autolock autoLock(mLock);
+                mNumOverruns += numMissed;
+            }
 
-            if (delayUs > 0ll) {
-                usleep(delayUs);
+            if (waitUntil(bufferTimeUs)) {
+                int64_t jitterUs = mClock->nowUs() - bufferTimeUs;
+
+                Mutex::Autolock autoLock(mLock);
+                ++mNumJitterSamples;
+                mTotalJitterUs += jitterUs;
+                if (jitterUs > mMaxJitterUs) {
+                    mMaxJitterUs = jitterUs;
+                }
+            } else {
+                // Woken up early, send this frame right away. It still
+                // takes the place of the one due at "bufferTimeUs", so the
+                // frame grid is not affected.
+                bufferTimeUs = mClock->nowUs();
             }
         }
 
         bool stale = false;
+        bool skipped = false;
 
         {
             Mutex::Autolock autoLock(mLock);
@@ -126,20 +209,40 @@ status_t RepeaterSource::read(
             }
 
 #if SUSPEND_VIDEO_IF_IDLE
-            int64_t nowUs = ALooper::GetNowUs();
-            if (nowUs - mLastBufferUpdateUs > 1000000ll) {
+            int64_t nowUs = mClock->nowUs();
+            if (!mVariableFrameRate
+                    && nowUs - mLastBufferUpdateUs > 1000000ll) {
                 mLastBufferUpdateUs = -1ll;
                 stale = true;
             } else
 #endif
-            {
+            if (mVariableFrameRate
+                    && !mForceEmit
+                    && mBufferGeneration == mLastEmittedGeneration
+                    && (mMinRateHz <= 0.0
+                        || bufferTimeUs - mLastEmittedTimeUs
+                                < 1000000ll / mMinRateHz)) {
+                // Nothing changed on screen, keep the encoder idle.
+                ++mFrameCount;
+                ++mNumFramesSkipped;
+                skipped = true;
+            } else {
                 mBuffer->add_ref();
                 *buffer = mBuffer;
                 (*buffer)->meta_data()->setInt64(kKeyTime, bufferTimeUs);
                 ++mFrameCount;
+
+                mLastEmittedGeneration = mBufferGeneration;
+                mLastEmittedTimeUs = bufferTimeUs;
+                mForceEmit = false;
+                ++mNumFramesEmitted;
             }
         }
 
+        if (skipped) {
+            continue;
+        }
+
         if (!stale) {
             break;
         }
@@ -152,6 +255,49 @@ status_t RepeaterSource::read(
     return OK;
 }
 
+bool RepeaterSource::waitUntil(int64_t deadlineUs) {
+    if (!mClock->isSystemClock()) {
+        return mClock->waitUntil(deadlineUs, mWakeupFd);
+    }
+
+    // ALooper::GetNowUs() is based on CLOCK_MONOTONIC as well.
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadlineUs / 1000000ll;
+    spec.it_value.tv_nsec = (deadlineUs % 1000000ll) * 1000ll;
+
+    CHECK_EQ(timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, NULL), 0);
+
+    struct pollfd fds[2];
+    fds[0].fd = mTimerFd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = mWakeupFd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    int res;
+    do {
+        res = poll(fds, 2, -1);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0) {
+        ALOGE("poll failed (%s)", strerror(errno));
+        return true;
+    }
+
+    uint64_t count;
+
+    if (fds[1].revents & POLLIN) {
+        read(mWakeupFd, &count, sizeof(count));
+        return false;
+    }
+
+    read(mTimerFd, &count, sizeof(count));
+
+    return true;
+}
+
 void RepeaterSource::postRead() {
     (new AMessage(kWhatRead, mReflector->id()))->post();
 }
@@ -172,7 +318,8 @@ void RepeaterSource::onMessageReceived(const sp<AMessage> &msg) {
             }
             mBuffer = buffer;
             mResult = err;
-            mLastBufferUpdateUs = ALooper::GetNowUs();
+            mLastBufferUpdateUs = mClock->nowUs();
+            ++mBufferGeneration;
 
             mCondition.broadcast();
 
@@ -191,9 +338,49 @@ void RepeaterSource::wakeUp() {
     ALOGV("wakeUp");
     Mutex::Autolock autoLock(mLock);
     if (mLastBufferUpdateUs < 0ll && mBuffer != NULL) {
-        mLastBufferUpdateUs = ALooper::GetNowUs();
+        mLastBufferUpdateUs = mClock->nowUs();
         mCondition.broadcast();
     }
+
+    // An IDR frame was requested or we're being stopped, either way the
+    // next frame must not be skipped or wait for its deadline.
+    mForceEmit = true;
+
+    if (mWakeupFd >= 0) {
+        uint64_t one = 1;
+        write(mWakeupFd, &one, sizeof(one));
+    }
+}
+
+void RepeaterSource::setVariableFrameRate(double minRateHz) {
+    CHECK(!mStarted);
+    CHECK_GE(minRateHz, 0.0);
+
+    mVariableFrameRate = true;
+    mMinRateHz = minRateHz;
+}
+
+void RepeaterSource::getStats(
+        int64_t *numFramesEmitted, int64_t *numFramesSkipped) {
+    Mutex::Autolock autoLock(mLock);
+
+    *numFramesEmitted = mNumFramesEmitted;
+    *numFramesSkipped = mNumFramesSkipped;
+}
+
+void RepeaterSource::getTimingStats(
+        int64_t *avgJitterUs, int64_t *maxJitterUs, int64_t *numOverruns) {
+    Mutex::Autolock autoLock(mLock);
+
+    *avgJitterUs =
+        mNumJitterSamples > 0 ? mTotalJitterUs / mNumJitterSamples : 0ll;
+    *maxJitterUs = mMaxJitterUs;
+    *numOverruns = mNumOverruns;
+
+    mNumJitterSamples = 0ll;
+    mTotalJitterUs = 0ll;
+    mMaxJitterUs = 0ll;
+    mNumOverruns = 0ll;
 }
 
 }  // namespace android
@@ -10,8 +10,11 @@
 
 namespace android {
 
+struct AClock;
+
 // This MediaSource delivers frames at a constant rate by repeating buffers
-// if necessary.
+// if necessary. Frames are paced by a timerfd armed with absolute deadlines
+// on the nominal frame grid, so processing time doesn't make them drift.
 struct RepeaterSource : public MediaSource {
     RepeaterSource(const sp<MediaSource> &source, double rateHz);
 
@@ -28,6 +31,19 @@ struct RepeaterSource : public MediaSource {
     // send updates in a while, this is its wakeup call.
     void wakeUp();
 
+    // Only emit a frame if SurfaceFlinger delivered a new buffer since the
+    // last one, but at least "minRateHz" frames per second. A "minRateHz"
+    // of 0 disables the refresh, frames are then only repeated after a
+    // wakeUp(). Must be called before start().
+    void setVariableFrameRate(double minRateHz);
+
+    void getStats(int64_t *numFramesEmitted, int64_t *numFramesSkipped);
+
+    // How late frames were emitted relative to their deadline since the
+    // last call, and how many deadlines were missed entirely.
+    void getTimingStats(
+            int64_t *avgJitterUs, int64_t *maxJitterUs, int64_t *numOverruns);
+
 protected:
     virtual ~RepeaterSource();
 
@@ -43,6 +59,7 @@ private:
 
     sp<MediaSource> mSource;
     double mRateHz;
+    sp<AClock> mClock;
 
     sp<ALooper> mLooper;
     sp<AHandlerReflector<RepeaterSource> > mReflector;
@@ -54,6 +71,32 @@ private:
     int64_t mStartTimeUs;
     int32_t mFrameCount;
 
+    bool mVariableFrameRate;
+    double mMinRateHz;
+
+    // Counts the buffers read from mSource.
+    int32_t mBufferGeneration;
+    int32_t mLastEmittedGeneration;
+    int64_t mLastEmittedTimeUs;
+    bool mForceEmit;
+
+    int64_t mNumFramesEmitted;
+    int64_t mNumFramesSkipped;
+
+    // read() waits on mTimerFd for the next deadline, wakeUp() pulls it
+    // out early through mWakeupFd. Other than the system clock, mClock
+    // does the waiting itself.
+    int mTimerFd;
+    int mWakeupFd;
+
+    int64_t mNumJitterSamples;
+    int64_t mTotalJitterUs;
+    int64_t mMaxJitterUs;
+    int64_t mNumOverruns;
+
+    // Returns false if interrupted by wakeUp() before "deadlineUs".
+    bool waitUntil(int64_t deadlineUs);
+
     void postRead();
 
     DISALLOW_EVIL_CONSTRUCTORS(RepeaterSource);
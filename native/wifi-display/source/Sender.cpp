@@ -20,9 +20,11 @@
 
 #include "Sender.h"
 
+#include "AClock.h"
 #include "ANetworkSession.h"
 #include "TimeSeries.h"
 
+#include <cutils/atomic.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
@@ -30,6 +32,8 @@
 #include <media/stagefright/MediaErrors.h>
 #include <media/stagefright/Utils.h>
 
+#include <time.h>
+
 namespace android {
 
 static size_t kMaxRTPPacketSize = 1500;
@@ -40,12 +44,15 @@ Sender::Sender(
         const sp<AMessage> &notify)
     : mNetSession(netSession),
       mNotify(notify),
+      mClock(AClock::GetDefault()),
       mTransportMode(TRANSPORT_UDP),
       mRTPChannel(0),
       mRTCPChannel(0),
       mRTPPort(0),
       mRTPSessionID(0),
       mRTCPSessionID(0),
+      mRedundantRTPPort(0),
+      mRedundantSessionID(0),
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
       mRTPRetransmissionSessionID(0),
       mRTCPRetransmissionSessionID(0),
@@ -65,7 +72,10 @@ Sender::Sender(
       mNumRTPSent(0),
       mNumRTPOctetsSent(0),
       mNumSRsSent(0),
-      mSendSRPending(false)
+      mSendSRPending(false),
+      mBitrate(0),
+      mNumBytesQueued(0),
+      mCPUTimeUs(0)
 #if ENABLE_RETRANSMISSION
       ,mHistoryLength(0)
 #endif
@@ -93,6 +103,10 @@ Sender::~Sender() {
     }
 #endif
 
+    if (mRedundantSessionID != 0) {
+        mNetSession->destroySession(mRedundantSessionID);
+    }
+
     if (mRTCPSessionID != 0) {
         mNetSession->destroySession(mRTCPSessionID);
     }
@@ -249,6 +263,53 @@ status_t Sender::init(
     return OK;
 }
 
+status_t Sender::setMulticastInterface(const struct in_addr &interfaceAddr) {
+    CHECK_EQ((int)mTransportMode, (int)TRANSPORT_UDP);
+
+    return mNetSession->setMulticastSendOptions(
+            mRTPSessionID, interfaceAddr, kMulticastTTL, true /* loopback */);
+}
+
+void Sender::setMulticastGroupSender(const sp<Sender> &groupSender) {
+    mGroupSender = groupSender;
+}
+
+status_t Sender::addRedundantPath(int32_t clientRtp) {
+    if (mTransportMode != TRANSPORT_UDP || mGroupSender != NULL) {
+        return INVALID_OPERATION;
+    }
+
+    sp<AMessage> notify = new AMessage(kWhatRedundantRTPNotify, id());
+
+    int32_t port = mRTPPort + kRedundantPortOffset;
+
+    int32_t sessionID;
+    status_t err = mNetSession->createUDPSession(
+            port, mClientIP.c_str(), clientRtp, notify, &sessionID);
+
+    if (err != OK) {
+        ALOGI("failed to create redundant RTP socket on port %d", port);
+        return err;
+    }
+
+    mRedundantRTPPort = port;
+    mRedundantSessionID = sessionID;
+
+    if (mBitrate > 0) {
+        mNetSession->tuneSocketBuffers(
+                sessionID, mBitrate, kSocketBufferLatencyUs);
+    }
+
+    ALOGI("duplicating RTP from port %d to %s:%d",
+          port, mClientIP.c_str(), clientRtp);
+
+    return OK;
+}
+
+int32_t Sender::getRedundantRTPPort() const {
+    return mRedundantRTPPort;
+}
+
 status_t Sender::finishInit() {
     if (mTransportMode != TRANSPORT_TCP) {
         notifyInitDone();
@@ -284,8 +345,30 @@ int32_t Sender::getRTPPort() const {
     return mRTPPort;
 }
 
+void Sender::setBitrate(int32_t bitrate) {
+    mBitrate = bitrate;
+
+    if (mTransportMode != TRANSPORT_UDP || mRTPSessionID == 0) {
+        return;
+    }
+
+    status_t err = mNetSession->tuneSocketBuffers(
+            mRTPSessionID, bitrate, kSocketBufferLatencyUs);
+
+    if (err == OK && mRedundantSessionID != 0) {
+        err = mNetSession->tuneSocketBuffers(
+                mRedundantSessionID, bitrate, kSocketBufferLatencyUs);
+    }
+
+    if (err != OK) {
+        ALOGW("failed to size RTP socket buffers (%d)", err);
+    }
+}
+
 void Sender::queuePackets(
         int64_t timeUs, const sp<ABuffer> &tsPackets) {
+    int64_t startCPUTimeUs = GetThreadCPUTimeUs();
+
     const size_t numTSPackets = tsPackets->size() / 188;
 
     const size_t numRTPPackets =
@@ -297,14 +380,27 @@ void Sender::queuePackets(
 
     udpPackets->meta()->setInt64("timeUs", timeUs);
 
+    int32_t droppable;
+    if (tsPackets->meta()->findInt32("droppable", &droppable)) {
+        udpPackets->meta()->setInt32("droppable", droppable);
+    }
+
+    // The marker bit goes on the last packet of a video frame, so the sink
+    // knows it's complete even if the PES packet's length is unbounded.
+    int32_t endsFrame;
+    if (!tsPackets->meta()->findInt32("endsFrame", &endsFrame)) {
+        endsFrame = false;
+    }
+
     size_t dstOffset = 0;
     for (size_t i = 0; i < numTSPackets; ++i) {
         if ((i % kMaxNumTSPacketsPerRTPPacket) == 0) {
-            static const bool kMarkerBit = false;
+            bool markerBit = endsFrame
+                && i / kMaxNumTSPacketsPerRTPPacket == numRTPPackets - 1;
 
             uint8_t *rtp = udpPackets->data() + dstOffset;
             rtp[0] = 0x80;
-            rtp[1] = 33 | (kMarkerBit ? (1 << 7) : 0);  // M-bit
+            rtp[1] = 33 | (markerBit ? (1 << 7) : 0);  // M-bit
             rtp[2] = (mRTPSeqNo >> 8) & 0xff;
             rtp[3] = mRTPSeqNo & 0xff;
             rtp[4] = 0x00;  // rtp time to be filled in later.
@@ -330,6 +426,8 @@ void Sender::queuePackets(
 
     udpPackets->setRange(0, dstOffset);
 
+    android_atomic_add(udpPackets->size(), &mNumBytesQueued);
+
     sp<AMessage> msg = new AMessage(kWhatDrainQueue, id());
     msg->setBuffer("udpPackets", udpPackets);
     msg->post();
@@ -339,12 +437,16 @@ void Sender::queuePackets(
         fwrite(tsPackets->data(), 1, tsPackets->size(), mLogFile);
     }
 #endif
+
+    android_atomic_add(
+            (int32_t)(GetThreadCPUTimeUs() - startCPUTimeUs), &mCPUTimeUs);
 }
 
 void Sender::onMessageReceived(const sp<AMessage> &msg) {
     switch (msg->what()) {
         case kWhatRTPNotify:
         case kWhatRTCPNotify:
+        case kWhatRedundantRTPNotify:
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
         case kWhatRTPRetransmissionNotify:
         case kWhatRTCPRetransmissionNotify:
@@ -369,6 +471,7 @@ void Sender::onMessageReceived(const sp<AMessage> &msg) {
                     CHECK(msg->findString("detail", &detail));
 
                     if ((msg->what() == kWhatRTPNotify
+                            || msg->what() == kWhatRedundantRTPNotify
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
                             || msg->what() == kWhatRTPRetransmissionNotify
 #endif
@@ -388,6 +491,14 @@ void Sender::onMessageReceived(const sp<AMessage> &msg) {
 
                     mNetSession->destroySession(sessionID);
 
+                    if (sessionID == mRedundantSessionID) {
+                        ALOGW("lost the redundant path, sending on the "
+                              "primary one only");
+
+                        mRedundantSessionID = 0;
+                        break;
+                    }
+
                     if (sessionID == mRTPSessionID) {
                         mRTPSessionID = 0;
                     } else if (sessionID == mRTCPSessionID) {
@@ -427,11 +538,16 @@ void Sender::onMessageReceived(const sp<AMessage> &msg) {
 
                 case ANetworkSession::kWhatConnected:
                 {
-                    CHECK_EQ(mTransportMode, TRANSPORT_TCP);
-
                     int32_t sessionID;
                     CHECK(msg->findInt32("sessionID", &sessionID));
 
+                    if (mTransportMode != TRANSPORT_TCP) {
+                        // A UDP session whose client hostname needed
+                        // resolving, nothing to wait for here.
+                        ALOGI("session %d now connected.", sessionID);
+                        break;
+                    }
+
                     if (sessionID == mRTPSessionID) {
                         CHECK(!mRTPConnected);
                         mRTPConnected = true;
@@ -488,12 +604,19 @@ void Sender::scheduleSendSR() {
     }
 
     mSendSRPending = true;
-    (new AMessage(kWhatSendSR, id()))->post(kSendSRIntervalUs);
+    mClock->post(new AMessage(kWhatSendSR, id()), kSendSRIntervalUs);
 }
 
 void Sender::addSR(const sp<ABuffer> &buffer) {
     uint8_t *data = buffer->data() + buffer->size();
 
+    // The sender's info describes the stream the client actually receives.
+    const Sender *stream = (mGroupSender != NULL) ? mGroupSender.get() : this;
+    uint64_t lastNTPTime = stream->mLastNTPTime;
+    uint32_t lastRTPTime = stream->mLastRTPTime;
+    uint32_t numRTPSent = stream->mNumRTPSent;
+    uint32_t numRTPOctetsSent = stream->mNumRTPOctetsSent;
+
     // TODO: Use macros/utility functions to clean up all the bitshifts below.
 
     data[0] = 0x80 | 0;
@@ -505,29 +628,29 @@ void Sender::addSR(const sp<ABuffer> &buffer) {
     data[6] = (kSourceID >> 8) & 0xff;
     data[7] = kSourceID & 0xff;
 
-    data[8] = mLastNTPTime >> (64 - 8);
-    data[9] = (mLastNTPTime >> (64 - 16)) & 0xff;
-    data[10] = (mLastNTPTime >> (64 - 24)) & 0xff;
-    data[11] = (mLastNTPTime >> 32) & 0xff;
-    data[12] = (mLastNTPTime >> 24) & 0xff;
-    data[13] = (mLastNTPTime >> 16) & 0xff;
-    data[14] = (mLastNTPTime >> 8) & 0xff;
-    data[15] = mLastNTPTime & 0xff;
-
-    data[16] = (mLastRTPTime >> 24) & 0xff;
-    data[17] = (mLastRTPTime >> 16) & 0xff;
-    data[18] = (mLastRTPTime >> 8) & 0xff;
-    data[19] = mLastRTPTime & 0xff;
-
-    data[20] = mNumRTPSent >> 24;
-    data[21] = (mNumRTPSent >> 16) & 0xff;
-    data[22] = (mNumRTPSent >> 8) & 0xff;
-    data[23] = mNumRTPSent & 0xff;
-
-    data[24] = mNumRTPOctetsSent >> 24;
-    data[25] = (mNumRTPOctetsSent >> 16) & 0xff;
-    data[26] = (mNumRTPOctetsSent >> 8) & 0xff;
-    data[27] = mNumRTPOctetsSent & 0xff;
+    data[8] = lastNTPTime >> (64 - 8);
+    data[9] = (lastNTPTime >> (64 - 16)) & 0xff;
+    data[10] = (lastNTPTime >> (64 - 24)) & 0xff;
+    data[11] = (lastNTPTime >> 32) & 0xff;
+    data[12] = (lastNTPTime >> 24) & 0xff;
+    data[13] = (lastNTPTime >> 16) & 0xff;
+    data[14] = (lastNTPTime >> 8) & 0xff;
+    data[15] = lastNTPTime & 0xff;
+
+    data[16] = (lastRTPTime >> 24) & 0xff;
+    data[17] = (lastRTPTime >> 16) & 0xff;
+    data[18] = (lastRTPTime >> 8) & 0xff;
+    data[19] = lastRTPTime & 0xff;
+
+    data[20] = numRTPSent >> 24;
+    data[21] = (numRTPSent >> 16) & 0xff;
+    data[22] = (numRTPSent >> 8) & 0xff;
+    data[23] = numRTPSent & 0xff;
+
+    data[24] = numRTPOctetsSent >> 24;
+    data[25] = (numRTPOctetsSent >> 16) & 0xff;
+    data[26] = (numRTPOctetsSent >> 8) & 0xff;
+    data[27] = numRTPOctetsSent & 0xff;
 
     buffer->setRange(buffer->offset(), buffer->size() + 28);
 }
@@ -581,13 +704,11 @@ void Sender::addSDES(const sp<ABuffer> &buffer) {
 }
 
 // static
-uint64_t Sender::GetNowNTP() {
-    uint64_t nowUs = ALooper::GetNowUs();
+uint64_t Sender::GetNTPTime(int64_t timeUs) {
+    uint64_t ntpUs = timeUs + ((70ll * 365 + 17) * 24) * 60 * 60 * 1000000ll;
 
-    nowUs += ((70ll * 365 + 17) * 24) * 60 * 60 * 1000000ll;
-
-    uint64_t hi = nowUs / 1000000ll;
-    uint64_t lo = ((1ll << 32) * (nowUs % 1000000ll)) / 1000000ll;
+    uint64_t hi = ntpUs / 1000000ll;
+    uint64_t lo = ((1ll << 32) * (ntpUs % 1000000ll)) / 1000000ll;
 
     return (hi << 32) | lo;
 }
@@ -624,13 +745,18 @@ status_t Sender::parseTSFB(
         return ERROR_MALFORMED;
     }
 
+    // Multicast packets are repaired from the group's history, but only
+    // toward the client that asked.
+    const List<sp<ABuffer> > &history =
+        (mGroupSender != NULL) ? mGroupSender->mHistory : mHistory;
+
     for (size_t i = 12; i < size; i += 4) {
         uint16_t seqNo = U16_AT(&data[i]);
         uint16_t blp = U16_AT(&data[i + 2]);
 
-        List<sp<ABuffer> >::iterator it = mHistory.begin();
+        List<sp<ABuffer> >::const_iterator it = history.begin();
         bool foundSeqNo = false;
-        while (it != mHistory.end()) {
+        while (it != history.end()) {
             const sp<ABuffer> &buffer = *it;
 
             uint16_t bufferSeqNo = buffer->int32Data() & 0xffff;
@@ -764,8 +890,56 @@ status_t Sender::parseRTCP(
 }
 
 status_t Sender::sendPacket(
-        int32_t sessionID, const void *data, size_t size) {
-    return mNetSession->sendRequest(sessionID, data, size);
+        int32_t sessionID, const void *data, size_t size, bool droppable) {
+    return mNetSession->sendRequest(sessionID, data, size, droppable);
+}
+
+void Sender::getQueueStats(int64_t *backlogUs, uint32_t *numDropped) const {
+    size_t numBytes = mNumBytesQueued;
+
+    *numDropped = 0;
+
+    size_t numBytesQueued;
+    if (mTransportMode == TRANSPORT_UDP
+            && mNetSession->getSendQueueStats(
+                mRTPSessionID, &numBytesQueued, numDropped) == OK) {
+        numBytes += numBytesQueued;
+    }
+
+    *backlogUs = (mBitrate > 0) ? numBytes * 8000000ll / mBitrate : 0ll;
+}
+
+void Sender::getQueueSizes(
+        size_t *numBytesPending,
+        size_t *numBytesUnsent,
+        size_t *historyLength) const {
+    *numBytesPending = mNumBytesQueued;
+
+    *numBytesUnsent = 0;
+
+    uint32_t numDropped;
+    if (mTransportMode == TRANSPORT_UDP) {
+        mNetSession->getSendQueueStats(
+                mRTPSessionID, numBytesUnsent, &numDropped);
+    }
+
+#if ENABLE_RETRANSMISSION
+    *historyLength = mHistoryLength;
+#else
+    *historyLength = 0;
+#endif
+}
+
+uint32_t Sender::getCPUTimeUs() const {
+    return mCPUTimeUs;
+}
+
+// static
+int64_t Sender::GetThreadCPUTimeUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
 }
 
 void Sender::notifyInitDone() {
@@ -784,6 +958,14 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
     static const size_t kFullRTPPacketSize =
         12 + 188 * kMaxNumTSPacketsPerRTPPacket;
 
+    int64_t startCPUTimeUs = GetThreadCPUTimeUs();
+
+    // The network session sheds these first should its queue fill up.
+    int32_t droppable;
+    if (!udpPackets->meta()->findInt32("droppable", &droppable)) {
+        droppable = false;
+    }
+
     size_t srcOffset = 0;
     while (srcOffset < udpPackets->size()) {
         uint8_t *rtp = udpPackets->data() + srcOffset;
@@ -793,8 +975,8 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
             rtpPacketSize = kFullRTPPacketSize;
         }
 
-        int64_t nowUs = ALooper::GetNowUs();
-        mLastNTPTime = GetNowNTP();
+        int64_t nowUs = mClock->nowUs();
+        mLastNTPTime = GetNTPTime(nowUs);
 
         // 90kHz time scale
         uint32_t rtpTime = (nowUs * 9ll) / 100ll;
@@ -820,11 +1002,16 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
             notify->setBuffer("data", data);
             notify->post();
         } else {
-            sendPacket(mRTPSessionID, rtp, rtpPacketSize);
+            sendPacket(mRTPSessionID, rtp, rtpPacketSize, droppable);
+
+            if (mRedundantSessionID != 0) {
+                sendPacket(
+                        mRedundantSessionID, rtp, rtpPacketSize, droppable);
+            }
 
 #if TRACK_BANDWIDTH
             mTotalBytesSent += rtpPacketSize->size();
-            int64_t delayUs = ALooper::GetNowUs() - mFirstPacketTimeUs;
+            int64_t delayUs = mClock->nowUs() - mFirstPacketTimeUs;
 
             if (delayUs > 0ll) {
                 ALOGI("approx. net bandwidth used: %.2f Mbit/sec",
@@ -840,11 +1027,16 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
         srcOffset += rtpPacketSize;
     }
 
+    android_atomic_add(-(int32_t)udpPackets->size(), &mNumBytesQueued);
+
+    android_atomic_add(
+            (int32_t)(GetThreadCPUTimeUs() - startCPUTimeUs), &mCPUTimeUs);
+
 #if 0
     int64_t timeUs;
     CHECK(udpPackets->meta()->findInt64("timeUs", &timeUs));
 
-    ALOGI("dTimeUs = %lld us", ALooper::GetNowUs() - timeUs);
+    ALOGI("dTimeUs = %lld us", mClock->nowUs() - timeUs);
 #endif
 }
 
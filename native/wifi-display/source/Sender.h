@@ -20,6 +20,8 @@
 
 #include <media/stagefright/foundation/AHandler.h>
 
+#include <netinet/in.h>
+
 namespace android {
 
 #define LOG_TRANSPORT_STREAM            0
@@ -35,6 +37,7 @@ namespace android {
 #define RETRANSMISSION_ACCORDING_TO_RFC_XXXX    0
 
 struct ABuffer;
+struct AClock;
 struct ANetworkSession;
 
 struct Sender : public AHandler {
@@ -59,9 +62,53 @@ struct Sender : public AHandler {
 
     int32_t getRTPPort() const;
 
+    // Sizes the RTP socket's buffers for a stream of the given bitrate,
+    // only applies to UDP transport.
+    void setBitrate(int32_t bitrate);
+
+    // For a sender init()ed with a multicast group as its client, sends
+    // the RTP stream out through the given interface.
+    status_t setMulticastInterface(const struct in_addr &interfaceAddr);
+
+    // The RTP stream reaches this sender's client through "groupSender"
+    // (on the same looper) instead, nothing is to be queued here. This one
+    // only carries RTCP and retransmits what the client NACKs from the
+    // group sender's history by unicast.
+    void setMulticastGroupSender(const sp<Sender> &groupSender);
+
+    // Duplicates the RTP stream onto a second socket sending to the
+    // client's "clientRtp" port, so a packet is only lost if it's lost on
+    // both paths. UDP transport only, to be called before finishInit().
+    // Trouble on this path is logged, the primary one carries on alone.
+    status_t addRedundantPath(int32_t clientRtp);
+    int32_t getRedundantRTPPort() const;
+
     void queuePackets(int64_t timeUs, const sp<ABuffer> &tsPackets);
     void scheduleSendSR();
 
+    // "backlogUs" is how long it takes to send the data queued up but not
+    // yet written to the RTP socket at the configured bitrate (0 if there
+    // is none), "numDropped" the number of RTP packets that were discarded
+    // because the network session's send queue was full. May be called
+    // from any thread.
+    void getQueueStats(int64_t *backlogUs, uint32_t *numDropped) const;
+
+    // The sizes behind the backlog for long-running monitoring: bytes
+    // passed to queuePackets() not yet drained, bytes waiting in the
+    // network session's send queue and packets kept for retransmission.
+    // May be called from any thread, the latter is only approximate then.
+    void getQueueSizes(
+            size_t *numBytesPending,
+            size_t *numBytesUnsent,
+            size_t *historyLength) const;
+
+    // CPU time spent framing and sending this sender's RTP packets, on
+    // whichever thread did the work. Wraps around, only the difference
+    // between two calls is meaningful. May be called from any thread.
+    uint32_t getCPUTimeUs() const;
+
+    static int64_t GetThreadCPUTimeUs();
+
 protected:
     virtual ~Sender();
     virtual void onMessageReceived(const sp<AMessage> &msg);
@@ -72,6 +119,7 @@ private:
         kWhatSendSR,
         kWhatRTPNotify,
         kWhatRTCPNotify,
+        kWhatRedundantRTPNotify,
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
         kWhatRTPRetransmissionNotify,
         kWhatRTCPRetransmissionNotify,
@@ -80,15 +128,22 @@ private:
 
     static const int64_t kSendSRIntervalUs = 10000000ll;
 
+    // Worth of outgoing traffic the RTP socket should be able to buffer.
+    static const int64_t kSocketBufferLatencyUs = 200000ll;
+
     static const uint32_t kSourceID = 0xdeadbeef;
+    static const int32_t kMulticastTTL = 1;
     static const size_t kMaxHistoryLength = 128;
 
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
     static const size_t kRetransmissionPortOffset = 120;
 #endif
 
+    static const int32_t kRedundantPortOffset = 100;
+
     sp<ANetworkSession> mNetSession;
     sp<AMessage> mNotify;
+    sp<AClock> mClock;
 
     TransportMode mTransportMode;
     AString mClientIP;
@@ -102,6 +157,9 @@ private:
     int32_t mRTPSessionID;
     int32_t mRTCPSessionID;
 
+    int32_t mRedundantRTPPort;
+    int32_t mRedundantSessionID;
+
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
     int32_t mRTPRetransmissionSessionID;
     int32_t mRTCPRetransmissionSessionID;
@@ -128,6 +186,16 @@ private:
 
     bool mSendSRPending;
 
+    int32_t mBitrate;
+
+    sp<Sender> mGroupSender;
+
+    // Bytes passed to queuePackets() that onDrainQueue() hasn't handed
+    // to the network session yet.
+    volatile int32_t mNumBytesQueued;
+
+    volatile int32_t mCPUTimeUs;
+
 #if ENABLE_RETRANSMISSION
     List<sp<ABuffer> > mHistory;
     size_t mHistoryLength;
@@ -145,7 +213,7 @@ private:
     void onSendSR();
     void addSR(const sp<ABuffer> &buffer);
     void addSDES(const sp<ABuffer> &buffer);
-    static uint64_t GetNowNTP();
+    static uint64_t GetNTPTime(int64_t timeUs);
 
 #if ENABLE_RETRANSMISSION
     status_t parseTSFB(const uint8_t *data, size_t size);
@@ -154,7 +222,9 @@ private:
 
     status_t parseRTCP(const sp<ABuffer> &buffer);
 
-    status_t sendPacket(int32_t sessionID, const void *data, size_t size);
+    status_t sendPacket(
+            int32_t sessionID, const void *data, size_t size,
+            bool droppable = false);
 
     void notifyInitDone();
     void notifySessionDead();
@@ -428,6 +428,7 @@ status_t TSPacketizer::packetize(
     const sp<Track> &track = mTracks.itemAt(trackIndex);
 
     if (track->isH264() && (flags & PREPEND_SPS_PPS_TO_IDR_FRAMES)
+            && !(flags & CONTINUE_PES_PACKET)
             && IsIDR(accessUnit)) {
         // prepend codec specific data, i.e. SPS and PPS.
         accessUnit = track->prependCSD(accessUnit);
@@ -477,7 +478,10 @@ status_t TSPacketizer::packetize(
     }
 
     size_t numTSPackets;
-    if (PES_packet_length <= 178) {
+    if (flags & CONTINUE_PES_PACKET) {
+        CHECK(track->isVideo());
+        numTSPackets = (accessUnit->size() + 183) / 184;
+    } else if (PES_packet_length <= 178) {
         numTSPackets = 1;
     } else {
         numTSPackets = 1 + ((PES_packet_length - 178) + 183) / 184;
@@ -708,82 +712,96 @@ status_t TSPacketizer::packetize(
         packetDataStart += 188;
     }
 
-    uint64_t PTS = (timeUs * 9ll) / 100ll;
+    size_t offset = 0;
 
-    bool padding = (PES_packet_length < (188 - 10));
+    if (!(flags & CONTINUE_PES_PACKET)) {
+        uint64_t PTS = (timeUs * 9ll) / 100ll;
 
-    if (PES_packet_length >= 65536) {
-        // This really should only happen for video.
-        CHECK(track->isVideo());
+        bool padding = (PES_packet_length < (188 - 10));
 
-        // It's valid to set this to 0 for video according to the specs.
-        PES_packet_length = 0;
-    }
+        if (PES_packet_length >= 65536) {
+            // This really should only happen for video.
+            CHECK(track->isVideo());
 
-    uint8_t *ptr = packetDataStart;
-    *ptr++ = 0x47;
-    *ptr++ = 0x40 | (track->PID() >> 8);
-    *ptr++ = track->PID() & 0xff;
-    *ptr++ = (padding ? 0x30 : 0x10) | track->incrementContinuityCounter();
-
-    if (padding) {
-        size_t paddingSize = 188 - 10 - PES_packet_length;
-        *ptr++ = paddingSize - 1;
-        if (paddingSize >= 2) {
-            *ptr++ = 0x00;
-            memset(ptr, 0xff, paddingSize - 2);
-            ptr += paddingSize - 2;
+            // It's valid to set this to 0 for video according to the specs.
+            PES_packet_length = 0;
         }
-    }
 
-    *ptr++ = 0x00;
-    *ptr++ = 0x00;
-    *ptr++ = 0x01;
-    *ptr++ = track->streamID();
-    *ptr++ = PES_packet_length >> 8;
-    *ptr++ = PES_packet_length & 0xff;
-    *ptr++ = 0x84;
-    *ptr++ = (PES_private_data_len > 0) ? 0x81 : 0x80;
+        uint8_t *ptr = packetDataStart;
+        *ptr++ = 0x47;
+        *ptr++ = 0x40 | (track->PID() >> 8);
+        *ptr++ = track->PID() & 0xff;
+        *ptr++ = (padding ? 0x30 : 0x10)
+                    | track->incrementContinuityCounter();
 
-    size_t headerLength = 0x05 + numStuffingBytes;
-    if (PES_private_data_len > 0) {
-        headerLength += 1 + PES_private_data_len;
-    }
+        if (padding) {
+            size_t paddingSize = 188 - 10 - PES_packet_length;
+            *ptr++ = paddingSize - 1;
+            if (paddingSize >= 2) {
+                *ptr++ = 0x00;
+                memset(ptr, 0xff, paddingSize - 2);
+                ptr += paddingSize - 2;
+            }
+        }
 
-    *ptr++ = headerLength;
+        if (flags & UNBOUNDED_PES_PACKET) {
+            // Only now that the padding is sized based on the actual
+            // payload.
+            CHECK(track->isVideo());
+            PES_packet_length = 0;
+        }
 
-    *ptr++ = 0x20 | (((PTS >> 30) & 7) << 1) | 1;
-    *ptr++ = (PTS >> 22) & 0xff;
-    *ptr++ = (((PTS >> 15) & 0x7f) << 1) | 1;
-    *ptr++ = (PTS >> 7) & 0xff;
-    *ptr++ = ((PTS & 0x7f) << 1) | 1;
+        *ptr++ = 0x00;
+        *ptr++ = 0x00;
+        *ptr++ = 0x01;
+        *ptr++ = track->streamID();
+        *ptr++ = PES_packet_length >> 8;
+        *ptr++ = PES_packet_length & 0xff;
+        *ptr++ = 0x84;
+        *ptr++ = (PES_private_data_len > 0) ? 0x81 : 0x80;
+
+        size_t headerLength = 0x05 + numStuffingBytes;
+        if (PES_private_data_len > 0) {
+            headerLength += 1 + PES_private_data_len;
+        }
 
-    if (PES_private_data_len > 0) {
-        *ptr++ = 0x8e;  // PES_private_data_flag, reserved.
-        memcpy(ptr, PES_private_data, PES_private_data_len);
-        ptr += PES_private_data_len;
-    }
+        *ptr++ = headerLength;
 
-    for (size_t i = 0; i < numStuffingBytes; ++i) {
-        *ptr++ = 0xff;
-    }
+        *ptr++ = 0x20 | (((PTS >> 30) & 7) << 1) | 1;
+        *ptr++ = (PTS >> 22) & 0xff;
+        *ptr++ = (((PTS >> 15) & 0x7f) << 1) | 1;
+        *ptr++ = (PTS >> 7) & 0xff;
+        *ptr++ = ((PTS & 0x7f) << 1) | 1;
 
-    // 18 bytes of TS/PES header leave 188 - 18 = 170 bytes for the payload
+        if (PES_private_data_len > 0) {
+            *ptr++ = 0x8e;  // PES_private_data_flag, reserved.
+            memcpy(ptr, PES_private_data, PES_private_data_len);
+            ptr += PES_private_data_len;
+        }
 
-    size_t sizeLeft = packetDataStart + 188 - ptr;
-    size_t copy = accessUnit->size();
-    if (copy > sizeLeft) {
-        copy = sizeLeft;
-    }
+        for (size_t i = 0; i < numStuffingBytes; ++i) {
+            *ptr++ = 0xff;
+        }
+
+        // 18 bytes of TS/PES header leave 188 - 18 = 170 bytes for the
+        // payload
+
+        size_t sizeLeft = packetDataStart + 188 - ptr;
+        size_t copy = accessUnit->size();
+        if (copy > sizeLeft) {
+            copy = sizeLeft;
+        }
+
+        memcpy(ptr, accessUnit->data(), copy);
+        ptr += copy;
+        CHECK_EQ(sizeLeft, copy);
+        memset(ptr, 0xff, sizeLeft - copy);
 
-    memcpy(ptr, accessUnit->data(), copy);
-    ptr += copy;
-    CHECK_EQ(sizeLeft, copy);
-    memset(ptr, 0xff, sizeLeft - copy);
+        packetDataStart += 188;
 
-    packetDataStart += 188;
+        offset = copy;
+    }
 
-    size_t offset = copy;
     while (offset < accessUnit->size()) {
         bool padding = (accessUnit->size() - offset) < (188 - 4);
 
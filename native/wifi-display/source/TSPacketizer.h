@@ -42,6 +42,13 @@ struct TSPacketizer : public RefBase {
         EMIT_PCR                        = 2,
         IS_ENCRYPTED                    = 4,
         PREPEND_SPS_PPS_TO_IDR_FRAMES   = 8,
+        // Video only, leaves the PES packet's length unspecified so that
+        // it can be extended by subsequent CONTINUE_PES_PACKET calls.
+        UNBOUNDED_PES_PACKET            = 16,
+        // Appends the access unit's data to the PES packet most recently
+        // started on this track instead of starting a new one, no PES
+        // header (and hence no timestamp or private data) is emitted.
+        CONTINUE_PES_PACKET             = 32,
     };
     status_t packetize(
             size_t trackIndex, const sp<ABuffer> &accessUnit,
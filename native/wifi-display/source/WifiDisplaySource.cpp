@@ -18,6 +18,8 @@
 #define LOG_TAG "WifiDisplaySource"
 #include <utils/Log.h>
 #include "WifiDisplaySource.h"
+#include "AudioFormats.h"
+#include "Converter.h"
 #include "PlaybackSession.h"
 #include "Parameters.h"
 #include "ParsedMessage.h"
@@ -49,48 +51,82 @@ WifiDisplaySource::WifiDisplaySource(
       mSessionID(0),
       mStopReplyID(0),
       mChosenRTPPort(-1),
+      mChosenVideoResolutionType(VideoFormats::RESOLUTION_CEA),
+      mChosenVideoResolutionIndex(0),
+      mChosenVideoProfile(VideoFormats::PROFILE_CBP),
+      mChosenVideoLevel(VideoFormats::LEVEL_31),
       mUsingPCMAudio(false),
       mClientSessionID(0),
+      mMaxSinks(1),
+      mRedundantRTP(false),
       mReaperPending(false),
       mNextCSeq(1),
       mUsingHDCP(false),
       mIsHDCP2_0(false),
       mHDCPPort(0),
       mHDCPInitializationComplete(false),
-      mSetupTriggerDeferred(false)
-	  /* mPlaybackSessionEstablished(false) {  
-		if (path != NULL) {  
-			mMediaPath.setTo(path);  
-		}  
-  
-		mSupportedSourceVideoFormats.disableAll();  
-  
-		mSupportedSourceVideoFormats.setNativeResolution(  
-				VideoFormats::RESOLUTION_CEA, 5);  // 1280x720 p30  
-  
-		// Enable all resolutions up to 1280x720p30  
-		mSupportedSourceVideoFormats.enableResolutionUpto(  
-				VideoFormats::RESOLUTION_CEA, 5,  
-				VideoFormats::PROFILE_CHP,  // Constrained High Profile  
-				VideoFormats::LEVEL_32);    // Level 3.2  
-}  
-*/ {}
+      mSetupTriggerDeferred(false) {
+    // The largest resolution we are willing to encode, anything the sink
+    // supports that costs no more to encode is fair game.
+#if USE_1080P
+    const size_t kMaxResolutionIndex = 7;  // 1920x1080p30
+    const VideoFormats::LevelType kMaxLevel = VideoFormats::LEVEL_40;
+#else
+    const size_t kMaxResolutionIndex = 5;  // 1280x720p30
+    const VideoFormats::LevelType kMaxLevel = VideoFormats::LEVEL_32;
+#endif
+
+    uint32_t maxMacroblocksPerSec = VideoFormats::GetMacroblocksPerSec(
+            VideoFormats::RESOLUTION_CEA, kMaxResolutionIndex);
+
+    mSupportedSourceVideoFormats.setNativeResolution(
+            VideoFormats::RESOLUTION_CEA, kMaxResolutionIndex);
+
+    mSupportedSourceVideoFormats.addCodec(
+            VideoFormats::PROFILE_CBP, kMaxLevel, maxMacroblocksPerSec);
+
+    mSupportedSourceVideoFormats.addCodec(
+            VideoFormats::PROFILE_CHP, kMaxLevel, maxMacroblocksPerSec);
+
+    mChosenVideoResolutionIndex = kMaxResolutionIndex;
+    mChosenVideoProfile = VideoFormats::PROFILE_CHP;
+    mChosenVideoLevel = kMaxLevel;
+
+    // Sinks connecting while a stream is running may join it, sharing its
+    // capture, encoder and packetizer instead of getting their own.
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.max-sinks", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            mMaxSinks = x;
+        }
+    }
+
+    // Sends the stream twice, to the "redundant_port" a sink asked for in
+    // its SETUP request as well, so bursts of loss on one path are hidden.
+    if (property_get("media.wfd.redundant-rtp", val, NULL)
+            && (!strcasecmp("true", val) || !strcmp("1", val))) {
+        mRedundantRTP = true;
+    }
+}
 
 WifiDisplaySource::~WifiDisplaySource() {
 }
 
-//SourceͨRemoteDisplay.cppĹ캯עWifidisplaỵ߳ANetworkSessionʼͨõ
-//ݹܵҿʼ仯Source˽ͨmSource->start(iface)ʼRTSPӲSink˴
+//Source端通过RemoteDisplay.cpp的构造函数注册了Wifidisplay处理线程，并且ANetworkSession初始化了通信所用的
+//数据管道并且开始监听数据流变化后，Source端将通过函数mSource->start(iface)开始建立RTSP连接并且向Sink端传递数据流
 status_t WifiDisplaySource::start(const char *iface) {
-    CHECK_EQ(mState, INITIALIZED);   //Ƿʼ
+    CHECK_EQ(mState, INITIALIZED);   //检查是否初始化
 
 	
-	//onMessageReceived֧нƥ䣬msg->setString(iface,iface)ڴϢЯַ˿Ϣ
-    sp<AMessage> msg = new AMessage(kWhatStart, id()); //յkWhatStartϢ
-	// id()ALooperRosterעhandlerIDֵ onMessageReceived()
+	//用于在onMessageReceived处理分支中进行匹配，msg->setString(“iface”,iface)用于在传递消息过程中携带网络地址端口信息
+    sp<AMessage> msg = new AMessage(kWhatStart, id()); //接收到kWhatStart消息种类后，
+	// id()返回ALooperRoster注册的handlerID值， 进行onMessageReceived()处理
     msg->setString("iface", iface);
 
-	//msg->postAndAwaitResponseڷӦ
+	//msg->postAndAwaitResponse用于返回相应结果
     sp<AMessage> response;
     status_t err = msg->postAndAwaitResponse(&response);
 
@@ -127,10 +163,10 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
         case kWhatStart:
         {
             uint32_t replyID;
-			//WifiDisplaySource::startеmsg->postAndAwaitResponseȡӦpostAndAwaitResponseӦʶ
+			//从WifiDisplaySource::start中的msg->postAndAwaitResponse获取对应于postAndAwaitResponse函数的响应标识
             CHECK(msg->senderAwaitsResponse(&replyID));
 
-			//ȡiface
+			//获取iface
             AString iface;
             CHECK(msg->findString("iface", &iface));
 
@@ -141,7 +177,7 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
             unsigned long port;
 
             if (colonPos >= 0) {
-				// port ʼλ
+				// port 的起始位置
                 const char *s = iface.c_str() + colonPos + 1;
 
                 char *end;
@@ -150,20 +186,20 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
                 if (end == s || *end != '\0' || port > 65535) {
                     err = -EINVAL;
                 } else {
-					// ȡport ʣΪip
+					// 取得port 剩余为ip
                     iface.erase(colonPos, iface.size() - colonPos);
                 }
             } else {
                 port = kWifiDisplayDefaultPort;
             }
 
-            if (err == OK) {
-				//IPַתΪ32λIPַ 
+            if (err == OK) {、
+				//将IP地址转化为32位的网络序列IP地址 
                 if (inet_aton(iface.c_str(), &mInterfaceAddr) != 0) {
-					///ʶΪ kWhatRTSPNotifyϢΪ  
+					///建立标识为 kWhatRTSPNotify的消息作为参数传递  
                     sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id()); 
 
-					//RTSP,ӦSession
+					//创建RTSP服务端,返回相应的Session编号
                     err = mNetSession->createRTSPServer(
                             mInterfaceAddr, port, notify, &mSessionID);
                 } else {
@@ -172,7 +208,7 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
             }
 
             if (err == OK) {
-				//ɹȴͻ
+				//创建成功，等待客户端连接
                 mState = AWAITING_CLIENT_CONNECTION;
             }
 
@@ -207,7 +243,11 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
 
                     mNetSession->destroySession(sessionID);
 
-                    if (sessionID == mClientSessionID) {
+                    ssize_t index = mExtraSinks.indexOfKey(sessionID);
+                    if (index >= 0) {
+                        // The other sinks aren't affected.
+                        removeExtraSink(index);
+                    } else if (sessionID == mClientSessionID) {
                         mClientSessionID = 0;
 
                         mClient->onDisplayError(
@@ -221,7 +261,16 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
                     int32_t sessionID;
                     CHECK(msg->findInt32("sessionID", &sessionID));
 
-                    if (mClientSessionID > 0) {   // mClientSessionIDʼΪ0
+                    if (mClientSessionID > 0) {   // mClientSessionID初始为0
+                        // The stream is only encrypted for the first
+                        // client's HDCP session.
+                        if (mClientInfo.mPlaybackSession != NULL
+                                && !mUsingHDCP
+                                && mExtraSinks.size() + 1 < mMaxSinks) {
+                            onExtraSinkConnected(sessionID, msg);
+                            break;
+                        }
+
                         ALOGW("A client tried to connect, but we already "
                               "have one.");
 
@@ -229,13 +278,13 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
                         break;
                     }
 
-                    CHECK_EQ(mState, AWAITING_CLIENT_CONNECTION); //״̬
+                    CHECK_EQ(mState, AWAITING_CLIENT_CONNECTION); //检查状态
 
-                    CHECK(msg->findString("client-ip", &mClientInfo.mRemoteIP));//clientSessionϢ  
+                    CHECK(msg->findString("client-ip", &mClientInfo.mRemoteIP));//接收clientSession传来的信息  
                     CHECK(msg->findString("server-ip", &mClientInfo.mLocalIP));
 
                     if (mClientInfo.mRemoteIP == mClientInfo.mLocalIP) {
-						//ڰȫǲɱַ 
+						//出于安全考虑不接收由本地网络地址发来的连接 
                         // Disallow connections from the local interface
                         // for security reasons.
                         mNetSession->destroySession(sessionID);
@@ -260,9 +309,21 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
 
                 case ANetworkSession::kWhatData:
                 {
-                    status_t err = onReceiveClientData(msg); //Ϣ
+                    status_t err = onReceiveClientData(msg); //调用消息处理函数
 
                     if (err != OK) {
+                        int32_t sessionID;
+                        CHECK(msg->findInt32("sessionID", &sessionID));
+
+                        ssize_t index = mExtraSinks.indexOfKey(sessionID);
+                        if (index >= 0) {
+                            ALOGW("Dropping sink on session %d.", sessionID);
+
+                            mNetSession->destroySession(sessionID);
+                            removeExtraSink(index);
+                            break;
+                        }
+
                         mClient->onDisplayError(
                                 IRemoteDisplayClient::kDisplayErrorUnknown);
                     }
@@ -284,6 +345,12 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
             if (mState >= AWAITING_CLIENT_PLAY) {
                 // We have a session, i.e. a previous SETUP succeeded.
 
+                for (size_t i = 0; i < mExtraSinks.size(); ++i) {
+                    if (mExtraSinks.valueAt(i).mSinkID >= 0) {
+                        sendM5(mExtraSinks.keyAt(i), true /* requestShutdown */);
+                    }
+                }
+
                 status_t err = sendM5(
                         mClientSessionID, true /* requestShutdown */);
 
@@ -307,6 +374,18 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
         {
             mReaperPending = false;
 
+            int64_t nowUs = ALooper::GetNowUs();
+            for (ssize_t i = mExtraSinks.size() - 1; i >= 0; --i) {
+                if (mExtraSinks.valueAt(i).mLastLifesignUs
+                        + kPlaybackSessionTimeoutUs < nowUs) {
+                    ALOGI("sink on session %d timed out, reaping.",
+                          mExtraSinks.keyAt(i));
+
+                    mNetSession->destroySession(mExtraSinks.keyAt(i));
+                    removeExtraSink(i);
+                }
+            }
+
             if (mClientSessionID == 0
                     || mClientInfo.mPlaybackSession == NULL) {
                 break;
@@ -356,6 +435,19 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
                 }
             } else if (what == PlaybackSession::kWhatSessionDestroyed) {
                 disconnectClient2();
+            } else if (what == PlaybackSession::kWhatSinkDead) {
+                int32_t sinkID;
+                CHECK(msg->findInt32("sinkID", &sinkID));
+
+                for (size_t i = 0; i < mExtraSinks.size(); ++i) {
+                    if (mExtraSinks.valueAt(i).mSinkID == sinkID) {
+                        ALOGI("sink %d is gone.", sinkID);
+
+                        mNetSession->destroySession(mExtraSinks.keyAt(i));
+                        removeExtraSink(i);
+                        break;
+                    }
+                }
             } else {
                 CHECK_EQ(what, (status_t)PlaybackSession::kWhatBinaryData);
 
@@ -391,7 +483,8 @@ void WifiDisplaySource::onMessageReceived(const sp<AMessage> &msg) {
             int32_t sessionID;
             CHECK(msg->findInt32("sessionID", &sessionID));
 
-            if (mClientSessionID != sessionID) {
+            if (mClientSessionID != sessionID
+                    && mExtraSinks.indexOfKey(sessionID) < 0) {
                 // Obsolete event, client is already gone.
                 break;
             }
@@ -479,7 +572,7 @@ void WifiDisplaySource::registerResponseHandler(
 
 status_t WifiDisplaySource::sendM1(int32_t sessionID) {
     AString request = "OPTIONS * RTSP/1.0\r\n";
-    AppendCommonResponse(&request, mNextCSeq);//ӻϢʱ䡢Ϣ
+    AppendCommonResponse(&request, mNextCSeq);//添加基本消息，如时间、消息序号
 
     request.append(
             "Require: org.wfa.wfd1.0\r\n"
@@ -488,7 +581,7 @@ status_t WifiDisplaySource::sendM1(int32_t sessionID) {
     status_t err =
         mNetSession->sendRequest(sessionID, request.c_str(), request.size());
 
-	//ANetworkSessionݵȴthreadLoop
+	//向ANetworkSession发送数据等待threadLoop处理
     if (err != OK) {
         return err;
     }
@@ -496,8 +589,8 @@ status_t WifiDisplaySource::sendM1(int32_t sessionID) {
     registerResponseHandler(
             sessionID, mNextCSeq, &WifiDisplaySource::onReceiveM1Response);
 	
-	//ʹúָ뷵״̬Ϣ
-    ++mNextCSeq; //Ϣűʶ  
+	//使用函数指针返回状态信息
+    ++mNextCSeq; //消息序号标识递增  
 
     return OK;
 }
@@ -549,7 +642,16 @@ status_t WifiDisplaySource::sendM4(int32_t sessionID) {
     //   max-hres (none or 2 byte)
     //   max-vres (none or 2 byte)
 
-    CHECK_EQ(sessionID, mClientSessionID);
+    AString localIP = mClientInfo.mLocalIP;
+    int32_t rtpPort = mChosenRTPPort;
+
+    ssize_t index = mExtraSinks.indexOfKey(sessionID);
+    if (index >= 0) {
+        localIP = mExtraSinks.valueAt(index).mLocalIP;
+        rtpPort = mExtraSinks.valueAt(index).mChosenRTPPort;
+    } else {
+        CHECK_EQ(sessionID, mClientSessionID);
+    }
 
     AString transportString = "UDP";
 
@@ -560,28 +662,24 @@ status_t WifiDisplaySource::sendM4(int32_t sessionID) {
         transportString = "TCP";
     }
 
-    // For 720p60:
-    //   use "30 00 02 02 00000040 00000000 00000000 00 0000 0000 00 none none\r\n"
-    // For 720p30:
-    //   use "28 00 02 02 00000020 00000000 00000000 00 0000 0000 00 none none\r\n"
-    // For 720p24:
-    //   use "78 00 02 02 00008000 00000000 00000000 00 0000 0000 00 none none\r\n"
-    // For 1080p30:
-    //   use "38 00 02 02 00000080 00000000 00000000 00 0000 0000 00 none none\r\n"
+    // e.g. for 720p30 with CHP at level 3.2:
+    //   "28 00 02 02 00000020 00000000 00000000 00 0000 0000 00 none none"
+    AString videoFormatSpec = VideoFormats::GetFormatSpecFor(
+            mChosenVideoResolutionType,
+            mChosenVideoResolutionIndex,
+            mChosenVideoProfile,
+            mChosenVideoLevel);
+
     AString body = StringPrintf(
-        "wfd_video_formats: "
-#if USE_1080P
-        "38 00 02 02 00000080 00000000 00000000 00 0000 0000 00 none none\r\n"
-#else
-        "28 00 02 02 00000020 00000000 00000000 00 0000 0000 00 none none\r\n"
-#endif
+        "wfd_video_formats: %s\r\n"
         "wfd_audio_codecs: %s\r\n"
         "wfd_presentation_URL: rtsp://%s/wfd1.0/streamid=0 none\r\n"
         "wfd_client_rtp_ports: RTP/AVP/%s;unicast %d 0 mode=play\r\n",
+        videoFormatSpec.c_str(),
         (mUsingPCMAudio
             ? "LPCM 00000002 00" // 2 ch PCM 48kHz
             : "AAC 00000001 00"),  // 2 ch AAC 48kHz
-        mClientInfo.mLocalIP.c_str(), transportString.c_str(), mChosenRTPPort);
+        localIP.c_str(), transportString.c_str(), rtpPort);
 
     AString request = "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
     AppendCommonResponse(&request, mNextCSeq);
@@ -644,9 +742,16 @@ status_t WifiDisplaySource::sendM16(int32_t sessionID) {
     AString request = "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
     AppendCommonResponse(&request, mNextCSeq);
 
-    CHECK_EQ(sessionID, mClientSessionID);
-    request.append(
-            StringPrintf("Session: %d\r\n", mClientInfo.mPlaybackSessionID));
+    int32_t playbackSessionID = mClientInfo.mPlaybackSessionID;
+
+    ssize_t index = mExtraSinks.indexOfKey(sessionID);
+    if (index >= 0) {
+        playbackSessionID = mExtraSinks.valueAt(index).mPlaybackSessionID;
+    } else {
+        CHECK_EQ(sessionID, mClientSessionID);
+    }
+
+    request.append(StringPrintf("Session: %d\r\n", playbackSessionID));
     request.append("\r\n");  // Empty body
 
     status_t err =
@@ -678,35 +783,10 @@ status_t WifiDisplaySource::onReceiveM1Response(
     return OK;
 }
 
-// sink_audio_list := ("LPCM"|"AAC"|"AC3" HEXDIGIT*8 HEXDIGIT*2)
-//                       (", " sink_audio_list)*
-static void GetAudioModes(const char *s, const char *prefix, uint32_t *modes) {
-    *modes = 0;
-
-    size_t prefixLen = strlen(prefix);
-
-    while (*s != '0') {
-        if (!strncmp(s, prefix, prefixLen) && s[prefixLen] == ' ') {
-            unsigned latency;
-            if (sscanf(&s[prefixLen + 1], "%08x %02x", modes, &latency) != 2) {
-                *modes = 0;
-            }
-
-            return;
-        }
-
-        char *commaPos = strchr(s, ',');
-        if (commaPos != NULL) {
-            s = commaPos + 1;
-
-            while (isspace(*s)) {
-                ++s;
-            }
-        } else {
-            break;
-        }
-    }
-}
+// Resolutions that would leave fewer bits per pixel than this at the
+// configured video bitrate are not considered, the link could carry them
+// but the picture would suffer more than the extra resolution gains.
+static const double kMinVideoBitsPerPixel = 0.1;
 
 status_t WifiDisplaySource::onReceiveM3Response(
         int32_t sessionID, const sp<ParsedMessage> &msg) {
@@ -744,8 +824,44 @@ status_t WifiDisplaySource::onReceiveM3Response(
         return ERROR_MALFORMED;
     }
 
+    ssize_t extraSinkIndex = mExtraSinks.indexOfKey(sessionID);
+    if (extraSinkIndex >= 0) {
+        // The stream is running already, all that's left to decide is
+        // whether the sink can play it.
+        if (!supportsChosenFormats(params)) {
+            ALOGE("Sink doesn't support the running stream's formats.");
+            return ERROR_UNSUPPORTED;
+        }
+
+        mExtraSinks.editValueAt(extraSinkIndex).mChosenRTPPort = port0;
+
+        return sendM4(sessionID);
+    }
+
     mChosenRTPPort = port0;
 
+    VideoFormats sinkVideoFormats;
+    if (!params->findParameter("wfd_video_formats", &value)) {
+        ALOGW("Sink doesn't report its wfd_video_formats.");
+    } else if (!sinkVideoFormats.parseFormatSpec(value.c_str())) {
+        ALOGW("Sink reports malformed wfd_video_formats (%s)", value.c_str());
+    } else {
+        uint64_t maxPixelsPerSec =
+            Converter::GetVideoBitrate() / kMinVideoBitsPerPixel;
+
+        if (!VideoFormats::PickBestFormat(
+                    sinkVideoFormats,
+                    mSupportedSourceVideoFormats,
+                    maxPixelsPerSec,
+                    &mChosenVideoResolutionType,
+                    &mChosenVideoResolutionIndex,
+                    &mChosenVideoProfile,
+                    &mChosenVideoLevel)) {
+            ALOGE("Sink doesn't support a video format we do.");
+            return ERROR_UNSUPPORTED;
+        }
+    }
+
     if (!params->findParameter("wfd_audio_codecs", &value)) {
         ALOGE("Sink doesn't report its choice of wfd_audio_codecs.");
         return ERROR_MALFORMED;
@@ -756,14 +872,18 @@ status_t WifiDisplaySource::onReceiveM3Response(
         return ERROR_UNSUPPORTED;
     }
 
-    uint32_t modes;
-    GetAudioModes(value.c_str(), "AAC", &modes);
-
-    bool supportsAAC = (modes & 1) != 0;  // AAC 2ch 48kHz
+    AudioFormats sinkAudioFormats;
+    if (!sinkAudioFormats.parseFormatSpec(value.c_str())) {
+        return ERROR_MALFORMED;
+    }
 
-    GetAudioModes(value.c_str(), "LPCM", &modes);
+    bool supportsAAC =
+        (sinkAudioFormats.getModes(AudioFormats::CODEC_AAC)
+            & AudioFormats::kModeStereo) != 0;
 
-    bool supportsPCM = (modes & 2) != 0;  // LPCM 2ch 48kHz
+    bool supportsPCM =
+        (sinkAudioFormats.getModes(AudioFormats::CODEC_LPCM)
+            & AudioFormats::kModeLPCM48000Stereo) != 0;
 
     char val[PROPERTY_VALUE_MAX];
     if (supportsPCM
@@ -860,6 +980,19 @@ status_t WifiDisplaySource::onReceiveM16Response(
         int32_t sessionID, const sp<ParsedMessage> &msg) {
     // If only the response was required to include a "Session:" header...
 
+    ssize_t index = mExtraSinks.indexOfKey(sessionID);
+    if (index >= 0) {
+        ExtraSinkInfo *info = &mExtraSinks.editValueAt(index);
+
+        if (info->mSinkID >= 0) {
+            info->mLastLifesignUs = ALooper::GetNowUs();
+
+            scheduleKeepAlive(sessionID);
+        }
+
+        return OK;
+    }
+
     CHECK_EQ(sessionID, mClientSessionID);
 
     if (mClientInfo.mPlaybackSession != NULL) {
@@ -871,6 +1004,81 @@ status_t WifiDisplaySource::onReceiveM16Response(
     return OK;
 }
 
+void WifiDisplaySource::onExtraSinkConnected(
+        int32_t sessionID, const sp<AMessage> &msg) {
+    ExtraSinkInfo info;
+    CHECK(msg->findString("client-ip", &info.mRemoteIP));
+    CHECK(msg->findString("server-ip", &info.mLocalIP));
+
+    if (info.mRemoteIP == info.mLocalIP) {
+        // Disallow connections from the local interface
+        // for security reasons.
+        mNetSession->destroySession(sessionID);
+        return;
+    }
+
+    info.mChosenRTPPort = -1;
+    info.mPlaybackSessionID = -1;
+    info.mSinkID = -1;
+    info.mStarted = false;
+
+    // Reaped like any other sink unless it completes its setup in time.
+    info.mLastLifesignUs = ALooper::GetNowUs();
+
+    if (sendM1(sessionID) != OK) {
+        mNetSession->destroySession(sessionID);
+        return;
+    }
+
+    mExtraSinks.add(sessionID, info);
+
+    ALOGI("Another client (%d) connected, %d sinks now.",
+          sessionID, mExtraSinks.size() + 1);
+}
+
+// Whether a sink that joins a running stream is able to play it, i.e.
+// supports the video mode and audio codec negotiated with the first client.
+bool WifiDisplaySource::supportsChosenFormats(
+        const sp<Parameters> &params) const {
+    AString value;
+    VideoFormats sinkVideoFormats;
+    if (!params->findParameter("wfd_video_formats", &value)
+            || !sinkVideoFormats.parseFormatSpec(value.c_str())) {
+        return false;
+    }
+
+    bool supportsVideo = false;
+    for (size_t i = 0; i < sinkVideoFormats.countCodecs(); ++i) {
+        const VideoFormats::H264Codec &codec = sinkVideoFormats.codecAt(i);
+
+        if (codec.mProfile == mChosenVideoProfile
+                && codec.mLevel >= mChosenVideoLevel
+                && (codec.mResolutions[mChosenVideoResolutionType]
+                        & (1ul << mChosenVideoResolutionIndex))) {
+            supportsVideo = true;
+            break;
+        }
+    }
+
+    if (!supportsVideo) {
+        return false;
+    }
+
+    AudioFormats sinkAudioFormats;
+    if (!params->findParameter("wfd_audio_codecs", &value)
+            || !sinkAudioFormats.parseFormatSpec(value.c_str())) {
+        return false;
+    }
+
+    if (mUsingPCMAudio) {
+        return (sinkAudioFormats.getModes(AudioFormats::CODEC_LPCM)
+                    & AudioFormats::kModeLPCM48000Stereo) != 0;
+    }
+
+    return (sinkAudioFormats.getModes(AudioFormats::CODEC_AAC)
+                & AudioFormats::kModeStereo) != 0;
+}
+
 void WifiDisplaySource::scheduleReaper() {
     if (mReaperPending) {
         return;
@@ -892,13 +1100,13 @@ void WifiDisplaySource::scheduleKeepAlive(int32_t sessionID) {
 
 status_t WifiDisplaySource::onReceiveClientData(const sp<AMessage> &msg) {
     int32_t sessionID;
-    CHECK(msg->findInt32("sessionID", &sessionID)); //÷ϢsessionID
+    CHECK(msg->findInt32("sessionID", &sessionID)); //获得发送消息的sessionID
 
     sp<RefBase> obj;
-    CHECK(msg->findObject("data", &obj)); //÷Ϣobject
+    CHECK(msg->findObject("data", &obj)); //获得发送信息的object对象
 
     sp<ParsedMessage> data =
-        static_cast<ParsedMessage *>(obj.get()); //objectȡ  
+        static_cast<ParsedMessage *>(obj.get()); //根据object对象获取解析后的数据  
 
     ALOGV("session %d received '%s'",
           sessionID, data->debugString().c_str());
@@ -908,19 +1116,19 @@ status_t WifiDisplaySource::onReceiveClientData(const sp<AMessage> &msg) {
     data->getRequestField(0, &method);
 
     int32_t cseq;
-    if (!data->findInt32("cseq", &cseq)) {  //ȡsendʱϢ 
+    if (!data->findInt32("cseq", &cseq)) {  //获取send时加入的消息序号 
         sendErrorResponse(sessionID, "400 Bad Request", -1 /* cseq */);
         return ERROR_MALFORMED;
     }
 
-    if (method.startsWith("RTSP/")) {  //Ϣ"RTSP/"ͷ 
+    if (method.startsWith("RTSP/")) {  //如果消息以"RTSP/"开头 
         // This is a response.
 
         ResponseID id;
         id.mSessionID = sessionID;
         id.mCSeq = cseq;
 
-		// ResponseIDȡעʱmResponseHandlersKeyedVector<ResponseID, HandleRTSPResponseFunc>ݽṹеλ  
+		//根据 ResponseID获取注册时的mResponseHandlers在KeyedVector<ResponseID, HandleRTSPResponseFunc>这个数据结构中的位置  
         ssize_t index = mResponseHandlers.indexOfKey(id);
 
         if (index < 0) {
@@ -928,11 +1136,11 @@ status_t WifiDisplaySource::onReceiveClientData(const sp<AMessage> &msg) {
             return ERROR_MALFORMED;
         }
 
-        HandleRTSPResponseFunc func = mResponseHandlers.valueAt(index);//λûȡעĻظ
+        HandleRTSPResponseFunc func = mResponseHandlers.valueAt(index);//根据位置获取注册的回复函数
         mResponseHandlers.removeItemsAt(index);
 
-        status_t err = (this->*func)(sessionID, data); //亯ָ  
-         //жϻظǷдϢ  
+        status_t err = (this->*func)(sessionID, data); //填充函数指针  
+         //判断回复中是否有错误信息  
 
         if (err != OK) {
             ALOGW("Response handler for session %d, cseq %d returned "
@@ -947,11 +1155,15 @@ status_t WifiDisplaySource::onReceiveClientData(const sp<AMessage> &msg) {
 
     AString version;
     data->getRequestField(2, &version);
-    if (!(version == AString("RTSP/1.0"))) {  //жRTSPЭ汾Ƿȷ 
+    if (!(version == AString("RTSP/1.0"))) {  //判断RTSP协议版本是否正确 
         sendErrorResponse(sessionID, "505 RTSP Version not supported", cseq);
         return ERROR_UNSUPPORTED;
     }
 
+    if (mExtraSinks.indexOfKey(sessionID) >= 0) {
+        return onExtraSinkRequest(sessionID, cseq, method, data);
+    }
+
     status_t err;
     if (method == "OPTIONS") {
         err = onOptionsRequest(sessionID, cseq, data);
@@ -984,7 +1196,7 @@ status_t WifiDisplaySource::onOptionsRequest(
     sp<PlaybackSession> playbackSession =
         findPlaybackSession(data, &playbackSessionID);
 
-    if (playbackSession != NULL) {
+    if (playbackSession != NULL && sessionID == mClientSessionID) {
         playbackSession->updateLiveness();
     }
 
@@ -1010,8 +1222,15 @@ status_t WifiDisplaySource::onSetupRequest(
         int32_t sessionID,
         int32_t cseq,
         const sp<ParsedMessage> &data) {
-    CHECK_EQ(sessionID, mClientSessionID);
-    if (mClientInfo.mPlaybackSessionID != -1) {
+    ssize_t extraSinkIndex = mExtraSinks.indexOfKey(sessionID);
+
+    if (extraSinkIndex < 0) {
+        CHECK_EQ(sessionID, mClientSessionID);
+    }
+
+    if ((extraSinkIndex >= 0
+                ? mExtraSinks.valueAt(extraSinkIndex).mPlaybackSessionID
+                : mClientInfo.mPlaybackSessionID) != -1) {
         // We only support a single playback session per client.
         // This is due to the reversed keep-alive design in the wfd specs...
         sendErrorResponse(sessionID, "400 Bad Request", cseq);
@@ -1027,6 +1246,7 @@ status_t WifiDisplaySource::onSetupRequest(
     Sender::TransportMode transportMode = Sender::TRANSPORT_UDP;
 
     int clientRtp, clientRtcp;
+    int32_t clientRedundantRtp = -1;
     if (transport.startsWith("RTP/AVP/TCP;")) {
         AString interleaved;
         if (ParsedMessage::GetAttribute(
@@ -1078,6 +1298,13 @@ status_t WifiDisplaySource::onSetupRequest(
             sendErrorResponse(sessionID, "400 Bad Request", cseq);
             return ERROR_MALFORMED;
         }
+
+        if (mRedundantRTP
+                && ParsedMessage::GetInt32Attribute(
+                    transport.c_str(), "redundant_port", &clientRedundantRtp)
+                && (clientRedundantRtp <= 0 || clientRedundantRtp > 65535)) {
+            clientRedundantRtp = -1;
+        }
 #if 1
     // The older LG dongles doesn't specify client_port=xxx apparently.
     } else if (transport == "RTP/AVP/UDP;unicast") {
@@ -1089,18 +1316,6 @@ status_t WifiDisplaySource::onSetupRequest(
         return ERROR_UNSUPPORTED;
     }
 
-    int32_t playbackSessionID = makeUniquePlaybackSessionID();
-
-    sp<AMessage> notify = new AMessage(kWhatPlaybackSessionNotify, id());
-    notify->setInt32("playbackSessionID", playbackSessionID);
-    notify->setInt32("sessionID", sessionID);
-
-    sp<PlaybackSession> playbackSession =
-        new PlaybackSession(
-                mNetSession, notify, mInterfaceAddr, mHDCP);
-
-    looper()->registerHandler(playbackSession);
-
     AString uri;
     data->getRequestField(1, &uri);
 
@@ -1114,16 +1329,51 @@ status_t WifiDisplaySource::onSetupRequest(
         return ERROR_MALFORMED;
     }
 
-    status_t err = playbackSession->init(
-            mClientInfo.mRemoteIP.c_str(),
-            clientRtp,
-            clientRtcp,
-            transportMode,
-            mUsingPCMAudio);
+    int32_t playbackSessionID = makeUniquePlaybackSessionID();
 
-    if (err != OK) {
-        looper()->unregisterHandler(playbackSession->id());
-        playbackSession.clear();
+    sp<PlaybackSession> playbackSession;
+    int32_t sinkID = PlaybackSession::kPrimarySinkID;
+
+    status_t err;
+    if (extraSinkIndex >= 0) {
+        // Interleaved data is only ever routed to the first client.
+        if (transportMode == Sender::TRANSPORT_TCP_INTERLEAVED) {
+            sendErrorResponse(sessionID, "461 Unsupported Transport", cseq);
+            return ERROR_UNSUPPORTED;
+        }
+
+        playbackSession = mClientInfo.mPlaybackSession;
+
+        err = playbackSession->addSink(
+                mExtraSinks.valueAt(extraSinkIndex).mRemoteIP.c_str(),
+                clientRtp,
+                clientRtcp,
+                transportMode,
+                &sinkID);
+    } else {
+        sp<AMessage> notify = new AMessage(kWhatPlaybackSessionNotify, id());
+        notify->setInt32("playbackSessionID", playbackSessionID);
+        notify->setInt32("sessionID", sessionID);
+
+        playbackSession =
+            new PlaybackSession(
+                    mNetSession, notify, mInterfaceAddr, mHDCP);
+
+        looper()->registerHandler(playbackSession);
+
+        err = playbackSession->init(
+                mClientInfo.mRemoteIP.c_str(),
+                clientRtp,
+                clientRtcp,
+                transportMode,
+                mUsingPCMAudio,
+                mChosenVideoResolutionType,
+                mChosenVideoResolutionIndex);
+
+        if (err != OK) {
+            looper()->unregisterHandler(playbackSession->id());
+            playbackSession.clear();
+        }
     }
 
     switch (err) {
@@ -1137,8 +1387,26 @@ status_t WifiDisplaySource::onSetupRequest(
             return err;
     }
 
-    mClientInfo.mPlaybackSessionID = playbackSessionID;
-    mClientInfo.mPlaybackSession = playbackSession;
+    if (extraSinkIndex >= 0) {
+        ExtraSinkInfo *info = &mExtraSinks.editValueAt(extraSinkIndex);
+        info->mPlaybackSessionID = playbackSessionID;
+        info->mSinkID = sinkID;
+        info->mStarted = false;
+    } else {
+        mClientInfo.mPlaybackSessionID = playbackSessionID;
+        mClientInfo.mPlaybackSession = playbackSession;
+    }
+
+    int32_t serverRedundantRtp = -1;
+    if (clientRedundantRtp > 0) {
+        err = playbackSession->addRedundantPath(sinkID, clientRedundantRtp);
+
+        if (err == OK) {
+            serverRedundantRtp = playbackSession->getRedundantRTPPort(sinkID);
+        } else {
+            ALOGW("failed to set up the redundant path (%d)", err);
+        }
+    }
 
     AString response = "RTSP/1.0 200 OK\r\n";
     AppendCommonResponse(&response, cseq, playbackSessionID);
@@ -1149,28 +1417,61 @@ status_t WifiDisplaySource::onSetupRequest(
                     "Transport: RTP/AVP/TCP;interleaved=%d-%d;",
                     clientRtp, clientRtcp));
     } else {
-        int32_t serverRtp = playbackSession->getRTPPort();
+        int32_t serverRtp = playbackSession->getRTPPort(sinkID);
 
         AString transportString = "UDP";
         if (transportMode == Sender::TRANSPORT_TCP) {
             transportString = "TCP";
         }
 
-        if (clientRtcp >= 0) {
+        AString groupAddr;
+        int32_t groupPort;
+        if (playbackSession->getMulticastGroup(
+                    sinkID, &groupAddr, &groupPort)) {
+            // The stream arrives from the group, RTCP and retransmissions
+            // keep using the unicast ports.
+            response.append(
+                    StringPrintf(
+                        "Transport: RTP/AVP/UDP;multicast;destination=%s;"
+                        "port=%d;",
+                        groupAddr.c_str(),
+                        groupPort));
+
+            if (clientRtcp >= 0) {
+                response.append(
+                        StringPrintf(
+                            "client_port=%d-%d;server_port=%d-%d",
+                            clientRtp, clientRtcp, serverRtp, serverRtp + 1));
+            } else {
+                response.append(
+                        StringPrintf(
+                            "client_port=%d;server_port=%d",
+                            clientRtp, serverRtp));
+            }
+        } else if (clientRtcp >= 0) {
             response.append(
                     StringPrintf(
                         "Transport: RTP/AVP/%s;unicast;client_port=%d-%d;"
-                        "server_port=%d-%d\r\n",
+                        "server_port=%d-%d",
                         transportString.c_str(),
                         clientRtp, clientRtcp, serverRtp, serverRtp + 1));
         } else {
             response.append(
                     StringPrintf(
                         "Transport: RTP/AVP/%s;unicast;client_port=%d;"
-                        "server_port=%d\r\n",
+                        "server_port=%d",
                         transportString.c_str(),
                         clientRtp, serverRtp));
         }
+
+        if (serverRedundantRtp > 0) {
+            response.append(
+                    StringPrintf(
+                        ";redundant_port=%d-%d",
+                        clientRedundantRtp, serverRedundantRtp));
+        }
+
+        response.append("\r\n");
     }
 
     response.append("\r\n");
@@ -1181,6 +1482,11 @@ status_t WifiDisplaySource::onSetupRequest(
         return err;
     }
 
+    if (extraSinkIndex >= 0) {
+        scheduleKeepAlive(sessionID);
+        return OK;
+    }
+
     mState = AWAITING_CLIENT_PLAY;
 
     scheduleReaper();
@@ -1438,6 +1744,87 @@ sp<WifiDisplaySource::PlaybackSession> WifiDisplaySource::findPlaybackSession(
     return mClientInfo.mPlaybackSession;
 }
 
+// Requests from sinks that joined the first client's stream only ever
+// affect their own Sender, never the shared playback session.
+status_t WifiDisplaySource::onExtraSinkRequest(
+        int32_t sessionID,
+        int32_t cseq,
+        const AString &method,
+        const sp<ParsedMessage> &data) {
+    if (method == "OPTIONS") {
+        return onOptionsRequest(sessionID, cseq, data);
+    } else if (method == "SETUP") {
+        return onSetupRequest(sessionID, cseq, data);
+    } else if (!(method == "PLAY")
+            && !(method == "PAUSE")
+            && !(method == "TEARDOWN")
+            && !(method == "GET_PARAMETER")
+            && !(method == "SET_PARAMETER")) {
+        sendErrorResponse(sessionID, "405 Method Not Allowed", cseq);
+        return ERROR_UNSUPPORTED;
+    }
+
+    ExtraSinkInfo *info = &mExtraSinks.editValueFor(sessionID);
+
+    int32_t playbackSessionID;
+    if (!data->findInt32("session", &playbackSessionID)) {
+        // XXX the older dongles do not always include a "Session:" header.
+        playbackSessionID = info->mPlaybackSessionID;
+    }
+
+    const sp<PlaybackSession> &playbackSession = mClientInfo.mPlaybackSession;
+
+    if (info->mSinkID < 0
+            || playbackSessionID != info->mPlaybackSessionID
+            || playbackSession == NULL) {
+        sendErrorResponse(sessionID, "454 Session Not Found", cseq);
+        return ERROR_MALFORMED;
+    }
+
+    info->mLastLifesignUs = ALooper::GetNowUs();
+
+    AString response = "RTSP/1.0 200 OK\r\n";
+    AppendCommonResponse(&response, cseq, playbackSessionID);
+
+    if (method == "PLAY") {
+        ALOGI("Received PLAY request from sink %d.", info->mSinkID);
+
+        if (info->mStarted) {
+            // Already streaming, starting its sender again would break it.
+            ALOGW("sink %d is playing already", info->mSinkID);
+        } else {
+            playbackSession->startSink(info->mSinkID);
+            info->mStarted = true;
+        }
+
+        response.append("Range: npt=now-\r\n");
+    } else if (method == "TEARDOWN") {
+        ALOGI("Received TEARDOWN request from sink %d.", info->mSinkID);
+
+        playbackSession->removeSink(info->mSinkID);
+        info->mSinkID = -1;
+        info->mStarted = false;
+        response.append("Connection: close\r\n");
+    } else if (method == "SET_PARAMETER"
+            && strstr(data->getContent(), "wfd_idr_request\r\n")) {
+        playbackSession->requestIDRFrame(info->mSinkID);
+    }
+
+    response.append("\r\n");
+
+    return mNetSession->sendRequest(sessionID, response.c_str());
+}
+
+void WifiDisplaySource::removeExtraSink(size_t index) {
+    const ExtraSinkInfo &info = mExtraSinks.valueAt(index);
+
+    if (info.mSinkID >= 0 && mClientInfo.mPlaybackSession != NULL) {
+        mClientInfo.mPlaybackSession->removeSink(info.mSinkID);
+    }
+
+    mExtraSinks.removeItemsAt(index);
+}
+
 void WifiDisplaySource::disconnectClientAsync() {
     ALOGV("disconnectClient");
 
@@ -1460,6 +1847,11 @@ void WifiDisplaySource::disconnectClient2() {
         mClientInfo.mPlaybackSession.clear();
     }
 
+    for (size_t i = 0; i < mExtraSinks.size(); ++i) {
+        mNetSession->destroySession(mExtraSinks.keyAt(i));
+    }
+    mExtraSinks.clear();
+
     if (mClientSessionID != 0) {
         mNetSession->destroySession(mClientSessionID);
         mClientSessionID = 0;
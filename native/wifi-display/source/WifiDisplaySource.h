@@ -19,6 +19,7 @@
 #define WIFI_DISPLAY_SOURCE_H_
 
 #include "ANetworkSession.h"
+#include "VideoFormats.h"
 
 #include <media/stagefright/foundation/AHandler.h>
 
@@ -30,6 +31,7 @@ namespace android {
 
 struct IHDCP;
 struct IRemoteDisplayClient;
+struct Parameters;
 struct ParsedMessage;
 
 // Represents the RTSP server acting as a wifi display source.
@@ -39,7 +41,7 @@ struct WifiDisplaySource : public AHandler {
 
     WifiDisplaySource(
             const sp<ANetworkSession> &netSession,
-            const sp<IRemoteDisplayClient> &client);     //Ựеó
+            const sp<IRemoteDisplayClient> &client);     //从网络会话中得出
 
     status_t start(const char *iface);
     status_t stop();
@@ -113,6 +115,12 @@ private:
 
     int32_t mChosenRTPPort;  // extracted from "wfd_client_rtp_ports"
 
+    VideoFormats mSupportedSourceVideoFormats;
+    VideoFormats::ResolutionType mChosenVideoResolutionType;
+    size_t mChosenVideoResolutionIndex;
+    VideoFormats::ProfileType mChosenVideoProfile;
+    VideoFormats::LevelType mChosenVideoLevel;
+
     bool mUsingPCMAudio;
     int32_t mClientSessionID;
 
@@ -125,6 +133,25 @@ private:
     };
     ClientInfo mClientInfo;
 
+    // Further sinks joining the first client's playback session, keyed by
+    // their RTSP session ID. They get the stream negotiated with the first
+    // client or nothing, see media.wfd.max-sinks.
+    struct ExtraSinkInfo {
+        AString mRemoteIP;
+        AString mLocalIP;
+        int32_t mChosenRTPPort;
+        int32_t mPlaybackSessionID;
+        int32_t mSinkID;  // -1 unless it is set up
+        bool mStarted;    // PLAY was received for mSinkID
+        int64_t mLastLifesignUs;
+    };
+    KeyedVector<int32_t, ExtraSinkInfo> mExtraSinks;
+    size_t mMaxSinks;
+
+    // Whether sinks asking for a redundant copy of the stream get one,
+    // see media.wfd.redundant-rtp.
+    bool mRedundantRTP;
+
     bool mReaperPending;
 
     int32_t mNextCSeq;
@@ -165,6 +192,18 @@ private:
     status_t onReceiveM16Response(
             int32_t sessionID, const sp<ParsedMessage> &msg);
 
+    void onExtraSinkConnected(int32_t sessionID, const sp<AMessage> &msg);
+
+    bool supportsChosenFormats(const sp<Parameters> &params) const;
+
+    status_t onExtraSinkRequest(
+            int32_t sessionID,
+            int32_t cseq,
+            const AString &method,
+            const sp<ParsedMessage> &data);
+
+    void removeExtraSink(size_t index);
+
     void registerResponseHandler(
             int32_t sessionID, int32_t cseq, HandleRTSPResponseFunc func);
 
@@ -234,6 +234,16 @@ void TestHandler::onMessageReceived(const sp<AMessage> &msg) {
                     break;
                 }
 
+                case ANetworkSession::kWhatConnected:
+                {
+                    int64_t connectLatencyUs;
+                    CHECK(msg->findInt64(
+                                "connectLatencyUs", &connectLatencyUs));
+
+                    printf("connected after %lld us\n", connectLatencyUs);
+                    break;
+                }
+
                 default:
                     TRESPASS();
             }
@@ -24,7 +24,8 @@ static void usage(const char *me) {
             "           %s -c host[:port]\tconnect to wifi source\n"
             "               -u uri        \tconnect to an rtsp uri\n"
             "               -l ip[:port] \tlisten on the specified port "
-            "(create a sink)\n",
+            "(create a sink)\n"
+            "               -t threads    \tnumber of network threads\n",
             me);
 }
 
@@ -188,10 +189,12 @@ int main(int argc, char **argv) {
     AString listenOnAddr;
     int32_t listenOnPort = -1;
 
+    int32_t numNetworkThreads = 1;
+
     int res;
 
 	//解析参数
-    while ((res = getopt(argc, argv, "hc:l:u:")) >= 0) {
+    while ((res = getopt(argc, argv, "hc:l:u:t:")) >= 0) {
         switch (res) {
     	
 		//建立连接，设置默认端口        
@@ -246,6 +249,19 @@ int main(int argc, char **argv) {
                 break;
             }
 
+            case 't':
+            {
+                char *end;
+                numNetworkThreads = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || end == optarg || numNetworkThreads < 1
+                        || numNetworkThreads > ANetworkSession::kMaxNumThreads) {
+                    fprintf(stderr, "Illegal number of threads specified.\n");
+                    exit(1);
+                }
+                break;
+            }
+
             case '?':
             case 'h':
             default:
@@ -280,7 +296,7 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    sp<ANetworkSession> session = new ANetworkSession;
+    sp<ANetworkSession> session = new ANetworkSession(numNetworkThreads);
     session->start();
 
 	//strong pointer，而wp则是weak pointer的意思